@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""
+Connect storm benchmark.
+
+Client processes open connections as fast as they can, every connection
+sends CONNECT right away. Reported rate is the number of connections
+acknowledged by CONNACK per second, measured from the first connect until
+the last CONNACK.
+
+Start the broker first, e.g. `./mqttserver -p 1883`, then run:
+
+    python3 bench/connect_storm.py -p 1883 --connections 10000
+
+Both the broker and the benchmark need a file descriptor limit above the
+number of connections.
+"""
+import argparse
+import multiprocessing
+import os
+import resource
+import selectors
+import socket
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from mqtt import connect_packet  # noqa: E402
+
+CONNACK_SIZE = 4
+
+
+def storm(port, index, count, start, results):
+    start.wait()
+    selector = selectors.DefaultSelector()
+    sockets = []
+    failed = 0
+
+    for i in range(count):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        try:
+            sock.connect(("127.0.0.1", port))
+            sock.sendall(connect_packet("storm-%03d-%07d" % (index, i)))
+        except OSError:
+            sock.close()
+            failed += 1
+            continue
+        sock.setblocking(False)
+        selector.register(sock, selectors.EVENT_READ, bytearray())
+        sockets.append(sock)
+
+    acknowledged = 0
+    pending = len(sockets)
+    while pending:
+        events = selector.select(timeout=10)
+        if not events:
+            break
+        for key, _ in events:
+            try:
+                data = key.fileobj.recv(CONNACK_SIZE)
+            except OSError:
+                data = b""
+            key.data.extend(data)
+            if not data or len(key.data) >= CONNACK_SIZE:
+                if len(key.data) >= CONNACK_SIZE and key.data[0] == 0x20:
+                    acknowledged += 1
+                else:
+                    failed += 1
+                selector.unregister(key.fileobj)
+                pending -= 1
+
+    results.put((acknowledged, failed, time.monotonic()))
+    for sock in sockets:
+        sock.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-p", "--port", type=int, default=1883)
+    parser.add_argument("--connections", type=int, default=10000)
+    parser.add_argument("--processes", type=int, default=4)
+    args = parser.parse_args()
+
+    _, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    # fail early instead of waiting for clients that never connect
+    socket.create_connection(("127.0.0.1", args.port)).close()
+
+    per_process = args.connections // args.processes
+    start = multiprocessing.Event()
+    results = multiprocessing.Queue()
+    processes = [
+        multiprocessing.Process(
+            target=storm, args=(args.port, i, per_process, start, results))
+        for i in range(args.processes)
+    ]
+    for process in processes:
+        process.start()
+
+    began = time.monotonic()
+    start.set()
+    stats = [results.get() for _ in processes]
+    for process in processes:
+        process.join()
+
+    acknowledged = sum(count for count, _, _ in stats)
+    failed = sum(count for _, count, _ in stats)
+    elapsed = max(finished for _, _, finished in stats) - began
+    print("%d connections acknowledged, %d failed in %.3f s: %.0f conn/s" % (
+        acknowledged, failed, elapsed, acknowledged / elapsed))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+Fan-in/fan-out throughput benchmark.
+
+Every publisher process publishes QoS 0 messages to its own topic, every
+subscriber process is subscribed to `bench/+` and therefore receives messages
+of all publishers. Reported throughput is the number of messages delivered to
+subscribers per second.
+
+Start the broker first, e.g. `./mqttserver -p 1883 -t 4`, then run:
+
+    python3 bench/fanout.py -p 1883 --publishers 4 --subscribers 4
+"""
+import argparse
+import multiprocessing
+import os
+import socket
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from mqtt import Client, publish_packet  # noqa: E402
+
+IDLE_TIMEOUT = 2  # seconds
+PINGREQ = b"\xc0\x00"
+
+
+def subscriber(port, index, expected, size, ready, start, results):
+    client = Client(port, "bench-sub-%d" % index)
+    client.subscribe(["bench/+"])
+    ready.release()
+    start.wait()
+    # all delivered frames have the same size, count bytes instead of parsing
+    frame_size = len(publish_packet("bench/0", b"x" * size))
+    received = len(client.buffer)
+    last = time.monotonic()
+    # QoS 0 messages may be dropped for slow subscribers, stop when idle
+    client.sock.settimeout(IDLE_TIMEOUT)
+    while received < expected * frame_size:
+        try:
+            data = client.sock.recv(1 << 20)
+        except socket.timeout:
+            break
+        if not data:
+            break
+        received += len(data)
+        last = time.monotonic()
+    results.put((received // frame_size, last))
+    client.close()
+
+
+def publisher(port, index, count, size, ready, start):
+    client = Client(port, "bench-pub-%d" % index)
+    frame = publish_packet("bench/%d" % (index % 10), b"x" * size)
+    batch = frame * 64
+    ready.release()
+    start.wait()
+    # every batch is followed by PINGREQ, waiting for PINGRESP keeps the
+    # publishers from flooding the broker faster than it routes messages
+    for _ in range(count // 64):
+        client.send(batch + PINGREQ)
+        client.read()
+    client.send(frame * (count % 64) + PINGREQ)
+    client.read()
+    client.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-p", "--port", type=int, default=1883)
+    parser.add_argument("--publishers", type=int, default=4,
+                        help="at most 10, topics must have the same length")
+    parser.add_argument("--subscribers", type=int, default=4)
+    parser.add_argument("--messages", type=int, default=50000,
+                        help="messages sent by every publisher")
+    parser.add_argument("--size", type=int, default=64, help="payload size")
+    args = parser.parse_args()
+
+    # fail early instead of waiting for clients that never become ready
+    socket.create_connection(("127.0.0.1", args.port)).close()
+
+    expected = args.publishers * args.messages
+    ready = multiprocessing.Semaphore(0)
+    start = multiprocessing.Event()
+    results = multiprocessing.Queue()
+
+    processes = [
+        multiprocessing.Process(
+            target=subscriber,
+            args=(args.port, i, expected, args.size, ready, start,
+                  results))
+        for i in range(args.subscribers)
+    ]
+    processes += [
+        multiprocessing.Process(
+            target=publisher,
+            args=(args.port, i, args.messages, args.size, ready, start))
+        for i in range(args.publishers)
+    ]
+    for process in processes:
+        process.start()
+    for _ in processes:
+        ready.acquire()
+
+    began = time.monotonic()
+    start.set()
+    stats = [results.get() for _ in range(args.subscribers)]
+    for process in processes:
+        process.join()
+
+    delivered = sum(count for count, _ in stats)
+    elapsed = max(last for _, last in stats) - began
+    print("%d publishers, %d subscribers, %d byte payload" % (
+        args.publishers, args.subscribers, args.size))
+    print("delivered %d of %d messages in %.3f s: %.0f msg/s" % (
+        delivered, expected * args.subscribers, elapsed, delivered / elapsed))
+
+if __name__ == "__main__":
+    main()
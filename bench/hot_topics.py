@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+Skewed topic distribution benchmark, for the publish-topic match cache.
+
+Subscribers hold many wildcard and exact subscriptions over topics of the
+form `fleet/rR/dDDDD/sS`. Publishers publish to topics drawn from a Zipf
+distribution, so a small set of hot topics gets most of the messages.
+Reported throughput is the number of messages published (and routed by the
+broker) per second.
+
+Start the broker first, e.g. `./mqttserver -p 1883`, then run:
+
+    python3 bench/hot_topics.py -p 1883
+
+Compare with the cache disabled (`./mqttserver -p 1883 -c 0`).
+"""
+import argparse
+import bisect
+import itertools
+import multiprocessing
+import os
+import random
+import socket
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from mqtt import Client, publish_packet  # noqa: E402
+
+IDLE_TIMEOUT = 2  # seconds
+PINGREQ = b"\xc0\x00"
+BATCH = 64
+REGIONS = 10
+SENSORS = 10
+
+
+def topic_name(index):
+    device, sensor = divmod(index, SENSORS)
+    region = device % REGIONS
+    return "fleet/r%d/d%04d/s%d" % (region, device, sensor)
+
+
+def filters(index, count, topics):
+    """
+    Mix of exact filters, `+` filters and `#` filters of one subscriber.
+    """
+    rng = random.Random(index)
+    result = []
+    for i in range(count):
+        device, sensor = divmod(rng.randrange(topics), SENSORS)
+        kind = i % 4
+        if kind == 0:
+            result.append(topic_name(device * SENSORS + sensor))
+        elif kind == 1:
+            result.append("fleet/+/d%04d/s%d" % (device, sensor))
+        elif kind == 2:
+            result.append("fleet/r%d/+/s%d" % (device % REGIONS, sensor))
+        else:
+            result.append("fleet/r%d/d%04d/#" % (device % REGIONS, device))
+    return result
+
+
+def subscriber(port, index, count, topics, ready, start, results):
+    client = Client(port, "hot-sub-%d" % index)
+    wanted = filters(index, count, topics)
+    for i in range(0, len(wanted), 100):
+        client.subscribe(wanted[i:i + 100])
+    ready.release()
+    start.wait()
+    # all topics have the same length, count bytes instead of parsing
+    frame_size = len(publish_packet(topic_name(0), b"x" * 16))
+    received = len(client.buffer)
+    client.sock.settimeout(IDLE_TIMEOUT)
+    while True:
+        try:
+            data = client.sock.recv(1 << 20)
+        except socket.timeout:
+            break
+        if not data:
+            break
+        received += len(data)
+    results.put(received // frame_size)
+    client.close()
+
+
+def publisher(port, index, count, topics, skew, ready, start, results):
+    client = Client(port, "hot-pub-%d" % index)
+    # Zipf distribution over topics, hot topics are spread over the space
+    weights = [1 / (rank + 1) ** skew for rank in range(topics)]
+    cumulative = list(itertools.accumulate(weights))
+    order = list(range(topics))
+    random.Random(index).shuffle(order)
+    rng = random.Random(1000 + index)
+    batches = []
+    for _ in range(64):
+        frames = b""
+        for _ in range(BATCH):
+            rank = bisect.bisect(cumulative, rng.random() * cumulative[-1])
+            frames += publish_packet(topic_name(order[rank]), b"x" * 16)
+        batches.append(frames + PINGREQ)
+    ready.release()
+    start.wait()
+    began = time.monotonic()
+    # every batch is followed by PINGREQ, waiting for PINGRESP keeps the
+    # publishers from flooding the broker faster than it routes messages
+    for i in range(count // BATCH):
+        client.send(batches[i % len(batches)])
+        client.read()
+    results.put(time.monotonic() - began)
+    client.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-p", "--port", type=int, default=1883)
+    parser.add_argument("--publishers", type=int, default=1)
+    parser.add_argument("--subscribers", type=int, default=1)
+    parser.add_argument("--filters", type=int, default=4000,
+                        help="subscriptions of every subscriber")
+    parser.add_argument("--topics", type=int, default=1000,
+                        help="number of distinct published topics")
+    parser.add_argument("--skew", type=float, default=1.2,
+                        help="Zipf exponent of topic popularity")
+    parser.add_argument("--messages", type=int, default=1000000,
+                        help="messages sent by every publisher")
+    args = parser.parse_args()
+
+    # fail early instead of waiting for clients that never become ready
+    socket.create_connection(("127.0.0.1", args.port)).close()
+
+    ready = multiprocessing.Semaphore(0)
+    start = multiprocessing.Event()
+    delivered = multiprocessing.Queue()
+    durations = multiprocessing.Queue()
+
+    processes = [
+        multiprocessing.Process(
+            target=subscriber,
+            args=(args.port, i, args.filters, args.topics, ready, start,
+                  delivered))
+        for i in range(args.subscribers)
+    ]
+    processes += [
+        multiprocessing.Process(
+            target=publisher,
+            args=(args.port, i, args.messages, args.topics, args.skew, ready,
+                  start, durations))
+        for i in range(args.publishers)
+    ]
+    for process in processes:
+        process.start()
+    for _ in processes:
+        ready.acquire()
+
+    start.set()
+    elapsed = max(durations.get() for _ in range(args.publishers))
+    received = sum(delivered.get() for _ in range(args.subscribers))
+    for process in processes:
+        process.join()
+
+    published = args.publishers * (args.messages // BATCH * BATCH)
+    print("%d publishers, %d subscribers x %d filters, %d topics, skew %.2f"
+          % (args.publishers, args.subscribers, args.filters, args.topics,
+             args.skew))
+    print("published %d messages in %.3f s: %.0f msg/s, %d delivered" % (
+        published, elapsed, published / elapsed, received))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+"""
+Minimal raw-socket MQTT 3.1.1 client used by the benchmarks.
+
+Only the parts of the protocol needed for driving the broker under load are
+implemented, so the benchmarks have no dependencies besides Python 3.
+"""
+import socket
+import struct
+
+
+def encode_length(length):
+    out = bytearray()
+    while True:
+        byte = length % 128
+        length //= 128
+        if length:
+            byte |= 0x80
+        out.append(byte)
+        if not length:
+            return bytes(out)
+
+
+def packet(header, body):
+    return bytes([header]) + encode_length(len(body)) + body
+
+
+def string(value):
+    if isinstance(value, str):
+        value = value.encode()
+    return struct.pack("!H", len(value)) + value
+
+
+def connect_packet(client_id, keep_alive=60, clean_session=True):
+    flags = 0x02 if clean_session else 0x00
+    body = string("MQTT") + bytes([4, flags]) + struct.pack("!H", keep_alive)
+    return packet(0x10, body + string(client_id))
+
+
+def subscribe_packet(packet_id, topics, qos=0):
+    body = struct.pack("!H", packet_id)
+    for topic in topics:
+        body += string(topic) + bytes([qos])
+    return packet(0x82, body)
+
+
+def publish_packet(topic, payload, qos=0, packet_id=0, retain=False):
+    header = 0x30 | (qos << 1) | (1 if retain else 0)
+    body = string(topic)
+    if qos:
+        body += struct.pack("!H", packet_id)
+    return packet(header, body + payload)
+
+
+class Client:
+    """
+    Blocking MQTT client reading whole packets from the socket.
+    """
+    def __init__(self, port, client_id, keep_alive=60, clean_session=True):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.buffer = bytearray()
+        self.sock.sendall(connect_packet(client_id, keep_alive, clean_session))
+        header, _ = self.read()
+        assert header >> 4 == 2, "CONNACK expected"
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def subscribe(self, topics, qos=0):
+        self.send(subscribe_packet(1, topics, qos))
+        header, _ = self.read()
+        assert header >> 4 == 9, "SUBACK expected"
+
+    def _fill(self, size):
+        while len(self.buffer) < size:
+            data = self.sock.recv(1 << 16)
+            if not data:
+                raise ConnectionError("connection closed by broker")
+            self.buffer += data
+
+    def read(self):
+        """
+        Reads one packet, returns its first byte and body.
+        """
+        self._fill(2)
+        length, multiplier, pos = 0, 1, 1
+        while True:
+            self._fill(pos + 1)
+            byte = self.buffer[pos]
+            length += (byte & 0x7f) * multiplier
+            multiplier *= 128
+            pos += 1
+            if not byte & 0x80:
+                break
+        self._fill(pos + length)
+        header, body = self.buffer[0], bytes(self.buffer[pos:pos + length])
+        del self.buffer[:pos + length]
+        return header, body
+
+    def close(self):
+        self.sock.close()
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""
+Throughput benchmark of QoS 0, 1 and 2 delivery.
+
+For every QoS level, one publisher process publishes messages with that QoS
+to one subscriber process subscribed with the same QoS. Both of them complete
+the acknowledgement flow of every message (PUBACK, or PUBREC, PUBREL and
+PUBCOMP). Publisher is at most CREDITS batches ahead of the subscriber, so
+messages waiting for the subscriber's inflight window are not dropped.
+Reported throughput is the number of messages delivered to the subscriber
+per second.
+
+Start the broker first, e.g. `./mqttserver -p 1883`, then run:
+
+    python3 bench/qos.py -p 1883 --messages 50000
+"""
+import argparse
+import multiprocessing
+import os
+import socket
+import struct
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from mqtt import Client, packet, publish_packet  # noqa: E402
+
+IDLE_TIMEOUT = 2  # seconds
+BATCH = 64  # messages published before waiting for their acknowledgements
+CREDITS = 8  # batches published and not received by subscriber yet
+PINGREQ = b"\xc0\x00"
+
+
+def ack_packet(header, packet_id):
+    return packet(header, struct.pack("!H", packet_id))
+
+
+def subscriber(port, qos, expected, credits, ready, start, results):
+    client = Client(port, "bench-qos-sub")
+    client.subscribe(["bench/qos"], qos)
+    client.sock.settimeout(IDLE_TIMEOUT)
+    ready.release()
+    start.wait()
+
+    received = 0
+    last = time.monotonic()
+    acks = []
+    while received < expected:
+        # acknowledgements are sent once all received packets are processed
+        if acks and len(client.buffer) < 2:
+            client.send(b"".join(acks))
+            acks = []
+        try:
+            header, body = client.read()
+        except socket.timeout:
+            break
+        kind = header >> 4
+        if kind == 3:
+            received += 1
+            if received % BATCH == 0:
+                credits.release()
+            last = time.monotonic()
+            if qos:
+                topic_size = struct.unpack("!H", body[:2])[0]
+                packet_id = struct.unpack(
+                    "!H", body[2 + topic_size:4 + topic_size])[0]
+                acks.append(ack_packet(0x40 if qos == 1 else 0x50, packet_id))
+        elif kind == 6:
+            acks.append(ack_packet(0x70, struct.unpack("!H", body)[0]))
+    if acks:
+        client.send(b"".join(acks))
+    # last PUBCOMPs are sent after last message, wait for nothing else
+    results.put((received, last))
+    client.close()
+
+
+def publisher(port, qos, count, size, credits, ready, start):
+    client = Client(port, "bench-qos-pub")
+    payload = b"x" * size
+    ready.release()
+    start.wait()
+
+    sent = 0
+    while sent < count:
+        batch = min(BATCH, count - sent)
+        credits.acquire()
+        frames = [
+            publish_packet("bench/qos", payload, qos, (sent + i) % 65535 + 1)
+            for i in range(batch)
+        ]
+        if qos == 0:
+            client.send(b"".join(frames) + PINGREQ)
+            client.read()
+        else:
+            client.send(b"".join(frames))
+            releases = []
+            for _ in range(batch):
+                header, body = client.read()
+                if header >> 4 == 5:
+                    releases.append(ack_packet(0x62, struct.unpack("!H", body)[0]))
+            if releases:
+                client.send(b"".join(releases))
+                for _ in releases:
+                    client.read()
+        sent += batch
+    client.close()
+
+
+def run(port, qos, count, size):
+    credits = multiprocessing.Semaphore(CREDITS)
+    ready = multiprocessing.Semaphore(0)
+    start = multiprocessing.Event()
+    results = multiprocessing.Queue()
+
+    processes = [
+        multiprocessing.Process(
+            target=subscriber,
+            args=(port, qos, count, credits, ready, start, results)),
+        multiprocessing.Process(
+            target=publisher,
+            args=(port, qos, count, size, credits, ready, start)),
+    ]
+    for process in processes:
+        process.start()
+    for _ in processes:
+        ready.acquire()
+
+    began = time.monotonic()
+    start.set()
+    received, last = results.get()
+    for process in processes:
+        process.join()
+    return received, last - began
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-p", "--port", type=int, default=1883)
+    parser.add_argument("--messages", type=int, default=50000,
+                        help="messages published at every QoS level")
+    parser.add_argument("--size", type=int, default=64, help="payload size")
+    parser.add_argument("--qos", type=int, nargs="+", default=[0, 1, 2],
+                        choices=[0, 1, 2])
+    args = parser.parse_args()
+
+    # fail early instead of waiting for clients that never become ready
+    socket.create_connection(("127.0.0.1", args.port)).close()
+
+    print("%d messages, %d byte payload" % (args.messages, args.size))
+    for qos in args.qos:
+        received, elapsed = run(args.port, qos, args.messages, args.size)
+        print("QoS %d: delivered %d messages in %.3f s: %.0f msg/s" % (
+            qos, received, elapsed, received / elapsed))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,148 @@
+/**
+ * Session store recovery benchmark.
+ *
+ * Appends persistent sessions (one subscription each) with one waiting QoS 1
+ * message per session to a store file, closes it, and measures how long it
+ * takes to open the file again and restore all sessions, as the broker does
+ * on startup.
+ *
+ * Build and run:
+ *
+ *     make bench/session_store && ./bench/session_store [sessions] [file]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "session_store.h"
+
+#define DEFAULT_SESSIONS 1000000
+#define DEFAULT_PATH "bench_sessions.db"
+
+typedef struct {
+	size_t sessions;
+	size_t messages;
+	size_t bytes;
+} restored_t;
+
+static double
+now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+count_restored(
+	void *arg, const session_record_t *session,
+	const session_record_t **messages, size_t message_count
+) {
+	restored_t *restored = arg;
+	restored->sessions++;
+	restored->messages += message_count;
+	restored->bytes += session_record_body_size(session);
+	for (size_t i = 0; i < message_count; i++) {
+		restored->bytes += session_record_body_size(messages[i]);
+	}
+}
+
+/**
+ * Session record body with one QoS 1 subscription and no received packet IDs.
+ */
+static size_t
+build_snapshot(char *body, const char *filter) {
+	uint32_t topic_count = 1;
+	uint32_t received_count = 0;
+	uint16_t filter_len = strlen(filter);
+	char *index = body;
+
+	memcpy(index, &topic_count, sizeof(uint32_t));
+	index += sizeof(uint32_t);
+	memcpy(index, &received_count, sizeof(uint32_t));
+	index += sizeof(uint32_t);
+	memcpy(index, &filter_len, sizeof(uint16_t));
+	index += sizeof(uint16_t);
+	*index++ = 1;
+	memcpy(index, filter, filter_len);
+	return index + filter_len - body;
+}
+
+/**
+ * PUBLISH control packet with QoS 1 and 64 bytes of payload.
+ */
+static size_t
+build_publish(char *packet, const char *topic) {
+	uint16_t topic_len = strlen(topic);
+	size_t remaining = 2 + topic_len + 2 + 64;
+
+	packet[0] = 0x32;
+	packet[1] = remaining;
+	packet[2] = topic_len >> 8;
+	packet[3] = topic_len & 0xFF;
+	memcpy(packet + 4, topic, topic_len);
+	memset(packet + 4 + topic_len, 0, 2);
+	memset(packet + 6 + topic_len, 'x', 64);
+	return 2 + remaining;
+}
+
+int
+main(int argc, char **argv) {
+	size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_SESSIONS;
+	const char *path = argc > 2 ? argv[2] : DEFAULT_PATH;
+	char client_id[32], topic[64], body[128], packet[160];
+	restored_t restored = { 0 };
+	session_store_t store;
+
+	unlink(path);
+	session_store_init(&store);
+	if (session_store_open(&store, path, count_restored, &restored) == -1)
+		err(1, "cannot open %s", path);
+
+	double started = now_seconds();
+	for (size_t i = 0; i < count; i++) {
+		int id_len = snprintf(client_id, sizeof(client_id), "client-%zu", i);
+		snprintf(topic, sizeof(topic), "bench/%zu/#", i % 1000);
+		size_t body_size = build_snapshot(body, topic);
+
+		session_store_add(&store, client_id, id_len);
+		session_record_t session = { .type = SESSION_RECORD_SESSION };
+		session_store_append(&store, &session, client_id, id_len, body, body_size);
+
+		snprintf(topic, sizeof(topic), "bench/%zu/value", i % 1000);
+		size_t packet_size = build_publish(packet, topic);
+		session_record_t message = { .type = SESSION_RECORD_MESSAGE, .qos = 1 };
+		session_store_append(
+			&store, &message, client_id, id_len, packet, packet_size
+		);
+	}
+	double appended = now_seconds() - started;
+	size_t file_size = store.end;
+	uint64_t compactions = store.stats.compactions;
+	session_store_free(&store);
+
+	printf(
+		"appended %zu sessions in %.3f s (%.0f records/s), %.1f MiB, "
+		"%llu compactions\n",
+		count, appended, 2 * count / appended, file_size / 1048576.0,
+		(unsigned long long) compactions
+	);
+
+	session_store_init(&store);
+	started = now_seconds();
+	if (session_store_open(&store, path, count_restored, &restored) == -1)
+		err(1, "cannot open %s", path);
+	double recovered = now_seconds() - started;
+
+	printf(
+		"restored %zu sessions, %zu messages (%.1f MiB of records) in "
+		"%.3f s (%.0f sessions/s)\n",
+		restored.sessions, restored.messages, restored.bytes / 1048576.0,
+		recovered, restored.sessions / recovered
+	);
+
+	session_store_free(&store);
+	unlink(path);
+	return restored.sessions == count ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+/**
+ * Topic scanning microbenchmark.
+ *
+ * Compares single-pass `topic_scan` (scalar, SSE2 and AVX2 variants) with the
+ * previous way of checking topics: per-character wildcard check of topic
+ * name or topic filter, followed by splitting into levels with `memchr`.
+ * Previous code did not validate UTF-8 at all, `topic_scan` does.
+ *
+ * Build and run:
+ *
+ *     make bench/topic_scan && ./bench/topic_scan [iterations]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "topic_scan.h"
+
+#define TOPIC_COUNT 256
+#define MAX_LEVELS 64
+
+typedef int (*scan_fn)(const char *topic, size_t topic_len, topic_scan_t *scan);
+
+typedef struct {
+	const char *name;
+	char *topics[TOPIC_COUNT];
+	size_t lengths[TOPIC_COUNT];
+	size_t bytes;
+} workload_t;
+
+static volatile size_t sink;
+
+/**
+ * Previous topic name check of PUBLISH.
+ */
+static int
+reference_topic_name(const char *topic, size_t topic_len) {
+	if (topic_len == 0)
+		return 0;
+
+	for (size_t i = 0; i < topic_len; i++) {
+		switch (topic[i]) {
+		case '+':
+		case '#':
+		case '$':
+		case '\0':
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Previous topic filter check of SUBSCRIBE.
+ */
+static int
+reference_topic_filter(const char *topic, size_t topic_len) {
+	if (topic_len == 0)
+		return 0;
+
+	for (size_t i = 0; i < topic_len; i++) {
+		if (topic[i] != '+' && topic[i] != '#')
+			continue;
+		if (i > 0 && topic[i - 1] != '/')
+			return 0;
+		if (topic[i] == '+' && i + 1 < topic_len && topic[i + 1] != '/')
+			return 0;
+		if (topic[i] == '#' && i + 1 != topic_len)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Previous level splitting of subscription tree.
+ *
+ * \returns Number of levels, their offsets are stored in `offsets`.
+ */
+static size_t
+reference_levels(const char *topic, size_t topic_len, uint32_t *offsets) {
+	const char *level = topic;
+	const char *topic_end = topic + topic_len;
+	const char *separator;
+	size_t level_count = 0;
+
+	for (;;) {
+		separator = memchr(level, '/', topic_end - level);
+		if (level_count < MAX_LEVELS)
+			offsets[level_count] = level - topic;
+		level_count++;
+		if (!separator)
+			return level_count;
+		level = separator + 1;
+	}
+}
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(
+	const char *name, const workload_t *workload, long iterations,
+	double elapsed
+) {
+	double topics = (double) iterations * TOPIC_COUNT;
+	printf(
+		"  %-22s %8.1f ns/topic %8.0f MB/s\n", name,
+		elapsed * 1e9 / topics,
+		(double) iterations * workload->bytes / elapsed / 1e6
+	);
+}
+
+static void
+bench_reference(const workload_t *workload, long iterations, int filters) {
+	uint32_t offsets[MAX_LEVELS];
+	size_t total = 0;
+
+	double began = now();
+	for (long n = 0; n < iterations; n++) {
+		for (size_t i = 0; i < TOPIC_COUNT; i++) {
+			const char *topic = workload->topics[i];
+			size_t topic_len = workload->lengths[i];
+			int valid = filters
+				? reference_topic_filter(topic, topic_len)
+				: reference_topic_name(topic, topic_len);
+			total += valid + reference_levels(topic, topic_len, offsets);
+		}
+	}
+	report("previous (memchr)", workload, iterations, now() - began);
+	sink = total;
+}
+
+static void
+bench_scan(
+	const workload_t *workload, long iterations, const char *name, scan_fn fn
+) {
+	topic_scan_t scan;
+	size_t total = 0;
+
+	topic_scan_init(&scan);
+	double began = now();
+	for (long n = 0; n < iterations; n++) {
+		for (size_t i = 0; i < TOPIC_COUNT; i++) {
+			int result = fn(workload->topics[i], workload->lengths[i], &scan);
+			total += result + topic_scan_level_count(&scan) + scan.wildcard_count;
+		}
+	}
+	report(name, workload, iterations, now() - began);
+	topic_scan_free(&scan);
+	sink = total;
+}
+
+/**
+ * Checks that scan found the same levels as the previous splitting.
+ */
+static void
+verify(const workload_t *workload, scan_fn fn, const char *name) {
+	uint32_t offsets[MAX_LEVELS];
+	topic_scan_t scan;
+
+	topic_scan_init(&scan);
+	for (size_t i = 0; i < TOPIC_COUNT; i++) {
+		const char *topic = workload->topics[i];
+		size_t topic_len = workload->lengths[i];
+		size_t level_count = reference_levels(topic, topic_len, offsets);
+
+		if (fn(topic, topic_len, &scan) == -1)
+			errx(1, "%s: %s rejected topic %zu", workload->name, name, i);
+		if (topic_scan_level_count(&scan) != level_count)
+			errx(1, "%s: %s level count differs", workload->name, name);
+		for (size_t j = 0; j < level_count && j < MAX_LEVELS; j++) {
+			size_t level_len;
+			if (topic_scan_level(&scan, topic_len, j, &level_len) != offsets[j])
+				errx(1, "%s: %s level offset differs", workload->name, name);
+		}
+	}
+	topic_scan_free(&scan);
+}
+
+/**
+ * Generates topics of given number of levels, level names are drawn from
+ * given words.
+ */
+static void
+generate(
+	workload_t *workload, const char *name, const char **words,
+	size_t word_count, size_t levels, int filters
+) {
+	unsigned seed = 1;
+
+	workload->name = name;
+	workload->bytes = 0;
+	for (size_t i = 0; i < TOPIC_COUNT; i++) {
+		char topic[1024];
+		size_t topic_len = 0;
+
+		for (size_t level = 0; level < levels; level++) {
+			seed = seed * 1103515245 + 12345;
+			const char *word = words[(seed >> 16) % word_count];
+			if (filters && level == levels / 2)
+				word = "+";
+			if (filters && level == levels - 1)
+				word = "#";
+			if (level > 0)
+				topic[topic_len++] = '/';
+			topic_len += sprintf(topic + topic_len, "%s", word);
+		}
+
+		workload->topics[i] = malloc(topic_len);
+		if (!workload->topics[i])
+			err(1, "generate malloc topic");
+		memcpy(workload->topics[i], topic, topic_len);
+		workload->lengths[i] = topic_len;
+		workload->bytes += topic_len;
+	}
+}
+
+static void
+run(workload_t *workload, long iterations, int filters) {
+	printf(
+		"%s: %d topics, %.1f bytes on average\n", workload->name, TOPIC_COUNT,
+		(double) workload->bytes / TOPIC_COUNT
+	);
+
+	verify(workload, topic_scan_scalar, "scalar");
+	bench_reference(workload, iterations, filters);
+	bench_scan(workload, iterations, "topic_scan (scalar)", topic_scan_scalar);
+#if TOPIC_SCAN_SIMD
+	verify(workload, topic_scan_sse2, "sse2");
+	bench_scan(workload, iterations, "topic_scan (sse2)", topic_scan_sse2);
+	if (__builtin_cpu_supports("avx2")) {
+		verify(workload, topic_scan_avx2, "avx2");
+		bench_scan(workload, iterations, "topic_scan (avx2)", topic_scan_avx2);
+	}
+#endif
+
+	for (size_t i = 0; i < TOPIC_COUNT; i++) {
+		free(workload->topics[i]);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	long iterations = argc > 1 ? atol(argv[1]) : 20000;
+	const char *ascii[] = {
+		"sensors", "building", "floor", "temperature", "humidity", "r1",
+		"device0042", "status", "telemetry", "v2", "home", "kitchen"
+	};
+	const char *utf8[] = {
+		"sensors", "b\xc3\xa1sico", "\xe6\xb8\xa9\xe5\xba\xa6", "floor",
+		"\xc5\xbe\xc3\xa1rovka", "\xf0\x9f\x8c\xa1", "status", "kitchen"
+	};
+	workload_t workload;
+
+	generate(&workload, "short names", ascii, 12, 3, 0);
+	run(&workload, iterations, 0);
+	generate(&workload, "long names", ascii, 12, 12, 0);
+	run(&workload, iterations, 0);
+	generate(&workload, "UTF-8 names", utf8, 8, 8, 0);
+	run(&workload, iterations, 0);
+	generate(&workload, "filters", ascii, 12, 6, 1);
+	run(&workload, iterations, 1);
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * Write-ahead log group commit benchmark.
+ *
+ * Logs QoS 1 PUBLISH packets with 64 bytes of payload and commits them in
+ * batches of growing size. Batch of one message is the baseline, it syncs the
+ * log after every message. Messages are acknowledged (their frames freed)
+ * after commit, so the log is truncated as in the broker.
+ *
+ * Build and run:
+ *
+ *     make bench/wal && ./bench/wal [messages] [directory]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "wal.h"
+
+#define DEFAULT_MESSAGES 20000
+#define DEFAULT_DIR "bench_wal"
+
+static const size_t batch_sizes[] = { 1, 8, 64, 512 };
+
+static double
+now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * PUBLISH control packet with QoS 1 and 64 bytes of payload.
+ */
+static frame_t *
+build_publish(const char *topic, uint16_t packet_id) {
+	uint16_t topic_len = strlen(topic);
+	size_t remaining = 2 + topic_len + 2 + 64;
+	frame_t *frame = frame_create(2 + remaining);
+	char *packet = frame->data;
+
+	packet[0] = 0x32;
+	packet[1] = remaining;
+	packet[2] = topic_len >> 8;
+	packet[3] = topic_len & 0xFF;
+	memcpy(packet + 4, topic, topic_len);
+	packet[4 + topic_len] = packet_id >> 8;
+	packet[5 + topic_len] = packet_id & 0xFF;
+	memset(packet + 6 + topic_len, 'x', 64);
+	frame->qos = 1;
+	return frame;
+}
+
+int
+main(int argc, char **argv) {
+	size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_MESSAGES;
+	const char *dir = argc > 2 ? argv[2] : DEFAULT_DIR;
+	frame_t *batch[512];
+	char topic[64];
+	double baseline = 0;
+
+	for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(size_t); b++) {
+		size_t batch_size = batch_sizes[b];
+		wal_t wal;
+
+		wal_init(&wal);
+		if (wal_open(&wal, dir, 0, 0) == -1)
+			err(1, "cannot open write-ahead log in %s", dir);
+
+		double started = now_seconds();
+		for (size_t i = 0; i < count; i += batch_size) {
+			size_t n = count - i < batch_size ? count - i : batch_size;
+			for (size_t j = 0; j < n; j++) {
+				snprintf(topic, sizeof(topic), "bench/%zu/value", (i + j) % 1000);
+				batch[j] = build_publish(topic, (i + j) % 65535 + 1);
+				wal_append(&wal, batch[j]);
+			}
+			if (wal_commit(&wal) == -1)
+				err(1, "write-ahead log commit");
+			for (size_t j = 0; j < n; j++) {
+				frame_release(batch[j]);
+			}
+			wal_truncate(&wal, (uint64_t) (now_seconds() * 1000));
+		}
+		double elapsed = now_seconds() - started;
+		double rate = count / elapsed;
+		if (batch_size == 1)
+			baseline = rate;
+
+		wal_stats_t *stats = &wal.stats;
+		printf(
+			"batch %3zu: %zu messages in %.3f s (%.0f msgs/s, %.1fx), "
+			"%llu commits, %.0f us average commit, %llu us max\n",
+			batch_size, count, elapsed, rate, rate / baseline,
+			(unsigned long long) stats->commits,
+			stats->commits ? (double) stats->latency_sum / stats->commits : 0.0,
+			(unsigned long long) stats->latency_max
+		);
+		wal_free(&wal);
+	}
+
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,110 @@
+#include "client_table.h"
+#include "structs.h"
+
+uint32_t
+client_id_hash(const char *client_id, size_t client_id_len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < client_id_len; i++) {
+		hash ^= (uint8_t) client_id[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void
+client_table_init(client_table_t *table) {
+	table->bucket_count = CLIENT_TABLE_INITIAL_BUCKETS;
+	table->count = 0;
+	table->buckets = calloc(table->bucket_count, sizeof(struct connection *));
+	if (!table->buckets)
+		err(1, "client table init calloc buckets");
+}
+
+void
+client_table_free(client_table_t *table) {
+	free(table->buckets);
+	table->buckets = NULL;
+	table->bucket_count = 0;
+	table->count = 0;
+}
+
+/**
+ * Doubles number of buckets and rehashes connections.
+ */
+static void
+client_table_expand(client_table_t *table) {
+	size_t bucket_count = table->bucket_count * 2;
+	struct connection **buckets =
+		calloc(bucket_count, sizeof(struct connection *));
+	if (!buckets)
+		err(1, "client table expand calloc buckets");
+
+	struct connection *next;
+	for (size_t i = 0; i < table->bucket_count; i++) {
+		for (struct connection *conn = table->buckets[i]; conn; conn = next) {
+			next = conn->next_client;
+			size_t index = conn->client_id_hash & (bucket_count - 1);
+			conn->next_client = buckets[index];
+			buckets[index] = conn;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->bucket_count = bucket_count;
+}
+
+struct connection *
+client_table_find(
+	client_table_t *table, const char *client_id, size_t client_id_len
+) {
+	uint32_t hash = client_id_hash(client_id, client_id_len);
+	size_t index = hash & (table->bucket_count - 1);
+
+	for (
+		struct connection *conn = table->buckets[index];
+		conn != NULL;
+		conn = conn->next_client
+	) {
+		if (conn->client_id_hash == hash
+			&& conn->cliend_id_length == client_id_len
+			&& memcmp(conn->client_id, client_id, client_id_len) == 0
+		) {
+			return conn;
+		}
+	}
+
+	return NULL;
+}
+
+void
+client_table_insert(client_table_t *table, struct connection *conn) {
+	if (table->count >= table->bucket_count)
+		client_table_expand(table);
+
+	conn->client_id_hash = client_id_hash(
+		conn->client_id, conn->cliend_id_length
+	);
+	size_t index = conn->client_id_hash & (table->bucket_count - 1);
+	conn->next_client = table->buckets[index];
+	table->buckets[index] = conn;
+	table->count++;
+}
+
+void
+client_table_remove(client_table_t *table, struct connection *conn) {
+	size_t index = conn->client_id_hash & (table->bucket_count - 1);
+
+	for (
+		struct connection **link = &table->buckets[index];
+		*link != NULL;
+		link = &(*link)->next_client
+	) {
+		if (*link == conn) {
+			*link = conn->next_client;
+			conn->next_client = NULL;
+			table->count--;
+			return;
+		}
+	}
+}
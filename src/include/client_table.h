@@ -0,0 +1,64 @@
+#ifndef FEMTO_MQTT_CLIENT_TABLE_H
+#define FEMTO_MQTT_CLIENT_TABLE_H
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <err.h>
+
+/**
+ * Initial number of buckets of client table.
+ */
+#define CLIENT_TABLE_INITIAL_BUCKETS 64
+
+struct connection;
+
+/**
+ * Hash table of connected clients keyed by client ID. Connections are chained
+ * in buckets through their `next_client` pointer, so insertion and removal
+ * do not allocate.
+ */
+struct client_table {
+	struct connection **buckets;
+	size_t bucket_count; // power of two
+	size_t count; // number of connections in table
+};
+
+typedef struct client_table client_table_t;
+
+/**
+ * FNV-1a hash of client ID, also used to find worker owning its session.
+ */
+uint32_t
+client_id_hash(const char *client_id, size_t client_id_len);
+
+void
+client_table_init(client_table_t *table);
+
+void
+client_table_free(client_table_t *table);
+
+/**
+ * Finds connection with given client ID.
+ *
+ * \param client_id Client ID, not necessarily null-terminated.
+ * \param client_id_len Length of client ID.
+ *
+ * \returns Connection or NULL, if no connected client has the ID.
+ */
+struct connection *
+client_table_find(
+	client_table_t *table, const char *client_id, size_t client_id_len
+);
+
+/**
+ * Inserts connection with client ID set. Client ID has to be unique in the
+ * table.
+ */
+void
+client_table_insert(client_table_t *table, struct connection *conn);
+
+void
+client_table_remove(client_table_t *table, struct connection *conn);
+
+#endif
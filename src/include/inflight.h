@@ -0,0 +1,148 @@
+#ifndef FEMTO_MQTT_INFLIGHT_H
+#define FEMTO_MQTT_INFLIGHT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <err.h>
+#include "out_queue.h"
+
+/**
+ * Maximum number of unacknowledged QoS 1 and 2 messages sent to one
+ * connection, at most 32 (slots are tracked in 32-bit bitmap).
+ */
+#define INFLIGHT_WINDOW 16
+
+/**
+ * Time after which unacknowledged messages are sent again, in milliseconds.
+ */
+#define INFLIGHT_RETRY_INTERVAL 20000
+
+/**
+ * Maximum number of messages waiting for free slot of inflight window.
+ */
+#define INFLIGHT_PENDING_MAX 1024
+
+/**
+ * Generations of packet IDs, every slot of window has one ID per generation.
+ */
+#define INFLIGHT_GENERATIONS (65535 / INFLIGHT_WINDOW)
+
+/**
+ * Message sent with QoS above 0, waiting for acknowledgement. Message itself
+ * is shared by all its subscribers, only reference to its payload is kept.
+ *
+ * QoS 2 message is released once PUBREC is received, its slot is kept until
+ * PUBCOMP, PUBREL is sent again instead of the message.
+ */
+typedef struct {
+	frame_t *payload; // slice of PUBLISH frame (parent), NULL if released
+	uint16_t packet_id; // 0 if message waits for free slot
+	uint8_t qos; // QoS message is sent with
+	uint8_t released; // PUBREC was received, PUBREL is sent
+} inflight_msg_t;
+
+/**
+ * Window of messages sent to connection and not acknowledged yet, with queue
+ * of messages waiting for free slot.
+ *
+ * Packet ID is allocated together with slot of the window, from bitmap of
+ * used slots. Low bits of the ID are index of the slot, so acknowledgement
+ * finds its message directly. High bits are generation, which advances with
+ * every allocation, so IDs are not reused right away.
+ */
+struct inflight {
+	inflight_msg_t *slots; // INFLIGHT_WINDOW slots, allocated on first use
+	uint32_t used; // bitmap of used slots
+	uint16_t generation; // generation of next packet ID
+
+	inflight_msg_t *pending; // ring buffer of messages waiting for a slot
+	size_t pending_capacity; // allocated entries, power of two
+	size_t pending_head; // index of first waiting message
+	size_t pending_count; // number of waiting messages
+};
+
+typedef struct inflight inflight_t;
+
+void
+inflight_init(inflight_t *inflight);
+
+/**
+ * Frees window and waiting messages, their references are released.
+ */
+void
+inflight_free(inflight_t *inflight);
+
+/**
+ * Puts message into free slot of the window and allocates its packet ID.
+ *
+ * \param payload Payload slice, the window takes over caller's reference.
+ *
+ * \returns Message in the window, NULL if the window is full (reference is
+ * 			kept by caller).
+ */
+inflight_msg_t *
+inflight_add(inflight_t *inflight, frame_t *payload, uint8_t qos);
+
+/**
+ * Puts message of restored session into the slot of its packet ID, so that
+ * the client's acknowledgement finds it.
+ *
+ * \param payload Payload slice, the window takes over caller's reference.
+ * 				  NULL for released QoS 2 message.
+ *
+ * \returns 0 on success, -1 if the slot is taken (reference is kept by
+ * 			caller).
+ */
+int
+inflight_restore(
+	inflight_t *inflight, frame_t *payload, uint8_t qos, uint16_t packet_id,
+	int released
+);
+
+/**
+ * Finds message in the window by its packet ID.
+ *
+ * \returns Message, NULL if no message with the ID is in flight.
+ */
+inflight_msg_t *
+inflight_find(inflight_t *inflight, uint16_t packet_id);
+
+/**
+ * Removes acknowledged message from the window, its reference is released.
+ */
+void
+inflight_remove(inflight_t *inflight, inflight_msg_t *msg);
+
+/**
+ * Releases payload of QoS 2 message received by the client (PUBREC), only
+ * its packet ID is kept until PUBCOMP.
+ */
+void
+inflight_release(inflight_t *inflight, inflight_msg_t *msg);
+
+/**
+ * \returns Number of messages in the window.
+ */
+int
+inflight_count(inflight_t *inflight);
+
+/**
+ * Appends message to the queue of messages waiting for a slot.
+ *
+ * \param payload Payload slice, the queue takes over caller's reference.
+ *
+ * \returns 0 on success, -1 if the queue is full (reference is kept by
+ * 			caller).
+ */
+int
+inflight_push_pending(inflight_t *inflight, frame_t *payload, uint8_t qos);
+
+/**
+ * Moves waiting messages into free slots of the window.
+ *
+ * \param moved Set to bitmap of slots messages were moved into.
+ */
+void
+inflight_fill(inflight_t *inflight, uint32_t *moved);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef FEMTO_MQTT_INTERN_TABLE_H
+#define FEMTO_MQTT_INTERN_TABLE_H
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <err.h>
+
+/**
+ * Initial number of entries (and buckets) of intern table.
+ */
+#define INTERN_TABLE_INITIAL_SIZE 64
+
+/**
+ * ID of topic level that is not interned. No level has this ID.
+ */
+#define INTERN_NONE 0
+
+/**
+ * Interned topic level. Entries are stored in one array indexed by level ID,
+ * unused entries are linked in free list through `next`.
+ */
+typedef struct {
+	char *level; // topic level, null-terminated (NULL if entry is unused)
+	uint32_t level_len;
+	uint32_t hash; // hash of the level
+	uint32_t refcount; // number of holders of the ID
+	uint32_t next; // next entry in the same bucket or in free list
+} intern_entry_t;
+
+/**
+ * Symbol table of topic levels. Every distinct topic level used by
+ * subscriptions is stored once and gets compact integer ID, so topic
+ * filters and published topics can be compared level by level as integers.
+ * Entries are reference counted, ID of level nobody uses is reused.
+ */
+struct intern_table {
+	intern_entry_t *entries; // indexed by ID, entry 0 is never used
+	uint32_t capacity; // allocated entries, power of two
+	uint32_t count; // number of interned levels
+	uint32_t free_list; // first unused entry, INTERN_NONE if none
+	uint32_t *buckets; // hash table of IDs, one bucket per entry
+};
+
+typedef struct intern_table intern_table_t;
+
+/**
+ * FNV-1a hash of topic level.
+ */
+uint32_t
+hash_level(const char *level, size_t level_len);
+
+void
+intern_table_init(intern_table_t *table);
+
+void
+intern_table_free(intern_table_t *table);
+
+/**
+ * Finds ID of topic level.
+ *
+ * \param level Topic level, not necessarily null-terminated.
+ * \param level_len Length of topic level.
+ * \param hash Hash of topic level, see `hash_level`.
+ *
+ * \returns ID of the level, INTERN_NONE if it is not interned.
+ */
+uint32_t
+intern_find(
+	intern_table_t *table, const char *level, size_t level_len, uint32_t hash
+);
+
+/**
+ * Interns topic level, if it is not interned yet, and takes reference to its
+ * ID.
+ *
+ * \returns ID of the level.
+ */
+uint32_t
+intern_acquire(intern_table_t *table, const char *level, size_t level_len);
+
+/**
+ * Releases reference to ID of topic level, level is removed from the table
+ * when the last reference is released.
+ */
+void
+intern_release(intern_table_t *table, uint32_t id);
+
+/**
+ * \returns Interned topic level (null-terminated) of given ID.
+ */
+const char *
+intern_level(intern_table_t *table, uint32_t id);
+
+#endif
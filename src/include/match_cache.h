@@ -0,0 +1,113 @@
+#ifndef FEMTO_MQTT_MATCH_CACHE_H
+#define FEMTO_MQTT_MATCH_CACHE_H
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <err.h>
+
+/**
+ * Default number of published topics whose subscribers are cached.
+ */
+#define MATCH_CACHE_SIZE 1024
+
+/**
+ * No entry, used as null index in buckets and LRU list.
+ */
+#define MATCH_CACHE_NONE 0
+
+struct topic;
+
+/**
+ * Cached subscribers of one published topic. Entries are linked in hash
+ * table buckets and in LRU list by their indices.
+ */
+typedef struct {
+	char *topic; // published topic, not null-terminated
+	size_t topic_len;
+	uint32_t hash; // hash of the topic
+	uint64_t epoch; // subscription epoch the subscribers were found in
+	struct topic **matches; // matching subscriptions
+	size_t match_count;
+	uint32_t next; // next entry in the same bucket
+	uint32_t lru_prev; // more recently used entry
+	uint32_t lru_next; // less recently used entry
+} match_cache_entry_t;
+
+/**
+ * Counters of match cache, for tuning of its size.
+ */
+typedef struct {
+	uint64_t hits;
+	uint64_t misses; // including stale entries
+	uint64_t stale; // entries found, but resolved in older epoch
+	uint64_t evictions; // least recently used entries replaced
+} match_cache_stats_t;
+
+/**
+ * Bounded LRU cache from published topic to its matching subscriptions, so
+ * subscription tree is not walked again for hot topics.
+ *
+ * Every change of subscription tree bumps its epoch, entries resolved in
+ * older epoch are stale, they are refreshed on next lookup. Pointers to
+ * subscriptions in stale entries may dangle, they are never used.
+ */
+struct match_cache {
+	match_cache_entry_t *entries; // indexed from 1, allocated on first use
+	uint32_t *buckets; // hash table of entry indices
+	size_t bucket_count; // power of two
+	size_t capacity; // maximum number of entries, 0 disables the cache
+	size_t count; // entries in use
+	uint32_t lru_head; // most recently used entry
+	uint32_t lru_tail; // least recently used entry
+	match_cache_stats_t stats;
+};
+
+typedef struct match_cache match_cache_t;
+
+/**
+ * Initializes empty cache. Memory is allocated on first store, so capacity
+ * can be changed until the cache is used.
+ *
+ * \param capacity Maximum number of cached topics, 0 disables the cache.
+ */
+void
+match_cache_init(match_cache_t *cache, size_t capacity);
+
+void
+match_cache_free(match_cache_t *cache);
+
+/**
+ * Finds subscriptions matching published topic.
+ *
+ * \param hash Hash of the topic, see `hash_level`.
+ * \param epoch Current epoch of subscription tree.
+ *
+ * \returns Entry with matches, NULL if the topic is not cached or its entry
+ * 			is stale.
+ */
+match_cache_entry_t *
+match_cache_lookup(
+	match_cache_t *cache, const char *topic, size_t topic_len, uint32_t hash,
+	uint64_t epoch
+);
+
+/**
+ * Caches subscriptions matching published topic, the least recently used
+ * entry is evicted if the cache is full. Matches are copied.
+ *
+ * \returns Entry with copy of matches.
+ */
+match_cache_entry_t *
+match_cache_store(
+	match_cache_t *cache, const char *topic, size_t topic_len, uint32_t hash,
+	uint64_t epoch, struct topic **matches, size_t match_count
+);
+
+/**
+ * Logs hit ratio and eviction count of the cache.
+ */
+void
+match_cache_log_stats(match_cache_t *cache);
+
+#endif
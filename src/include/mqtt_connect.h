@@ -4,27 +4,64 @@
 #include "mqtt_utils.h"
 #include <ctype.h>
 
+/**
+ * Fields of CONNECT variable header and client ID, parsed before the packet is
+ * routed and read.
+ */
+typedef struct {
+	uint8_t flags; // connect flags
+	uint16_t keep_alive; // seconds
+	char *client_id; // points into the packet, not null-terminated
+	uint16_t client_id_len;
+} connect_header_t;
+
+/**
+ * Parses connect flags, keep alive and client ID of CONNECT. Protocol name,
+ * level and flags are checked by `read_connect_message`.
+ * 
+ * \returns Zero if success, -1 if CONNECT is shorter than its fields and
+ * 			connection has to be deleted.
+ */
+int
+parse_connect_header(
+	conn_t *conn, char *incoming_message, connect_header_t *header
+);
+
+/**
+ * Finds worker CONNECT has to be processed by, the one owning session of the
+ * client (see `session_home_worker`).
+ * 
+ * \returns Worker the connection has to be handed over to, NULL if CONNECT
+ * 			is processed by this one.
+ */
+struct worker *
+route_connect_message(conns_t *conns, connect_header_t *header);
+
 /**
  * Read, parse incoming CONNECT MQTT control packet.
  * 
  * Errors: 1 - invalid protocol name. 2 - invalid protocol level.
- * 3 - invalid client name.
+ * 3 - invalid client name. 4 - reserved connect flag is set.
  * 
  * \param conns Connections linked list.
  * \param conn Connection struct of connectee.
  * \param incoming_message MQTT variable header and payload in byte form.
+ * \param header Fields parsed by `parse_connect_header`.
  * 
  * \returns Zero if success or error code.
  */
 int
-read_connect_message(conns_t *conns, conn_t *conn, char* incoming_message);
+read_connect_message(
+	conns_t *conns, conn_t *conn, char* incoming_message,
+	connect_header_t *header
+);
 
 /**
  * Creates CONNACK MQTT control packet based on provided code.
  * 
- * \returns CONNACK MQTT control packet in bytes form.
+ * \returns CONNACK MQTT control packet frame.
  */
-char *
-create_connect_response(conn_t *conn, conns_t *conns, int code, int *failed);
+frame_t *
+create_connect_response(conn_t *conn, int code, int *failed);
 
 #endif
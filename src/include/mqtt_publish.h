@@ -5,33 +5,137 @@
 
 /**
  * Struct used for wrapping information about publishing a message.
+ * 
+ * Neither topic nor message (payload) is copied, they point into incoming
+ * PUBLISH control packet of the publisher, which stays in receive buffer
+ * while the packet is processed.
  */
 typedef struct {
-    char *topic;
-    char *message;
+    char *topic; // view into incoming message, not null-terminated
+    const topic_scan_t *levels; // scan of the topic, NULL if not scanned
+    char *message; // view into incoming message, not null-terminated
     uint32_t message_size; // size in bytes
     uint16_t topic_size; // size in bytes
+    uint8_t retain; // RETAIN flag of incoming PUBLISH
+    uint8_t qos; // QoS level of incoming PUBLISH
+    uint16_t packet_id; // packet ID of incoming PUBLISH, QoS above 0 only
 } publish_t;
 
 /**
  * Read, parse incoming PUBLISH MQTT control packet.
  * 
- * \returns publish_t struct containing publish info.
+ * \param publish Filled with publish info, views into incoming message.
+ * 
+ * \returns 0 on success, -1 if control packet is malformed.
  */
-publish_t *
-read_publish_message(conn_t *conn, char *incoming_message);
+int
+read_publish_message(conn_t *conn, char *incoming_message, publish_t *publish);
 
 /**
- * Finds out which clients are subscribet to given topic in published message
- * and sends them the message.
+ * Creates acknowledgement of PUBLISH MQTT control packet with QoS above 0, or
+ * of one of the acknowledgements.
+ * 
+ * \param type PUBACK, PUBREC, PUBREL or PUBCOMP.
+ * 
+ * \returns Acknowledgement MQTT control packet frame.
+ */
+frame_t *
+create_publish_ack(ctrl_packet_t type, uint16_t packet_id);
+
+/**
+ * Creates slice of PUBLISH frame encoded by `create_publish_message` with its
+ * payload only. Slice is what QoS 1 subscribers keep in their inflight window,
+ * header with their own packet ID is encoded whenever it is sent.
+ * 
+ * \returns Payload slice, holding reference to the message.
+ */
+frame_t *
+create_publish_slice(frame_t *message);
+
+/**
+ * Sends message with QoS above 0 to the client. Message gets packet ID from
+ * client's inflight window, when the window is full, it waits for a free slot.
+ * 
+ * \param payload Payload slice, caller keeps its reference.
+ * 
+ * \returns 0 on success, -1 if too many messages wait for the client (message
+ * 			is dropped).
+ */
+int
+queue_inflight_message(
+	conns_t *conns, conn_t *conn, frame_t *payload, uint8_t qos
+);
+
+/**
+ * Read, parse incoming PUBACK, PUBREC or PUBCOMP MQTT control packet. After
+ * PUBREC, PUBREL is sent. Message acknowledged by PUBACK or PUBCOMP is removed
+ * from inflight window and messages waiting for the window are sent.
+ * 
+ * \returns 0 on success, -1 if control packet is malformed.
+ */
+int
+read_publish_ack(conns_t *conns, conn_t *conn, char *incoming_message);
+
+/**
+ * Read, parse incoming PUBREL MQTT control packet. Packet ID of QoS 2 message
+ * is released, so next message with the same ID is a new one.
  * 
- * Message size, its contents, status and type are set accordingly.
+ * \param packet_id Set to released packet ID, to be sent in PUBCOMP.
+ * 
+ * \returns 0 on success, -1 if control packet is malformed.
+ */
+int
+read_pubrel_message(conn_t *conn, char *incoming_message, uint16_t *packet_id);
+
+/**
+ * Sends all messages in inflight window of the client again, with DUP flag
+ * (PUBREL for released QoS 2 messages).
+ */
+void
+resend_inflight_messages(conns_t *conns, conn_t *conn);
+
+/**
+ * Sends messages of resumed session: messages in flight again (see
+ * `resend_inflight_messages`), then messages waiting for free slots.
+ */
+void
+resume_inflight_messages(conns_t *conns, conn_t *conn);
+
+/**
+ * Delivers PUBLISH frame encoded by `create_publish_message` to local
+ * subscribers, like `deliver_publish` does. Topic is found in the frame.
+ *
+ * \returns Number of clients the message was queued for.
+ */
+int
+deliver_published_frame(conns_t *conns, frame_t *frame);
+
+/**
+ * Queues PUBLISH frame for all clients of given connections subscribed to the
+ * topic. Each client gets the message at most once, even if more of its
+ * topics match.
+ * 
+ * \param conns Connections linked list.
+ * \param publish Information about publish.
+ * \param frame Encoded PUBLISH frame. If it points to NULL, frame is encoded
+ * 				from publish when first subscriber is found, caller has to
+ * 				release it.
+ * 
+ * \returns Number of clients message was queued for.
+ */
+int
+deliver_publish(conns_t *conns, publish_t *publish, frame_t **frame);
+
+/**
+ * Finds out which clients are subscribet to given topic in published message
+ * and queues the message for them. When more worker threads run, message is
+ * forwarded to them as well.
  * 
  * \param sender_conn Connection to the sender (publisher).
  * \param conns Connections linked list.
  * \param publish Information about publish.
  * 
- * \returns 1, if message is published to publisher as well, 0 otherwise.
+ * \returns Number of local clients message was queued for.
  */
 int
 send_published_message(conn_t *sender_conn, conns_t *conns, publish_t *publish);
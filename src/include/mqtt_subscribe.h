@@ -4,12 +4,13 @@
 #include "mqtt_utils.h"
 
 /**
- * Read, parse incoming (UN)SUBSCRIBE MQTT control packet.
+ * Read, parse incoming (UN)SUBSCRIBE MQTT control packet. Topics are inserted
+ * into (removed from) client's topic list and subscription tree.
  * 
  * \returns Number of topics found.
  */
 int
-read_un_subscribe_message(conn_t *conn, char *incoming_message);
+read_un_subscribe_message(conns_t *conns, conn_t *conn, char *incoming_message);
 
 /**
  * Create response to (UN)SUBSCRIBE MQTT control packet.
@@ -17,11 +18,20 @@ read_un_subscribe_message(conn_t *conn, char *incoming_message);
  * \param topics_inserted_code How many topics were inserted, or error code, if
  * number is negative.
  * 
- * \returns (UN)SUBACK MQTT control packet, in bytes.
+ * \returns (UN)SUBACK MQTT control packet frame.
  */
-char *
+frame_t *
 create_un_subscribe_response(
     conn_t *conn, conns_t *conns, int topics_inserted_code
 );
 
+/**
+ * Queues retained messages matching topic filters of last SUBSCRIBE MQTT
+ * control packet, with RETAIN flag set.
+ *
+ * \param topic_counter Number of topic filters of the packet.
+ */
+void
+send_retained_messages(conns_t *conns, conn_t *conn, int topic_counter);
+
 #endif
@@ -4,13 +4,65 @@
 #include "structs.h"
 
 /**
- * Checks if client IDs were already used by other connected clients.
+ * Closes connection socket and removes connection from connections linked
+ * list and client table. Connection memory is freed at the end of event loop
+ * iteration.
+ *
+ * \returns Next connection in connections linked list.
+ */
+struct connection *
+clear_one_connection(struct connection *conn, struct connections *conns);
+
+/**
+ * Initialize connections linked list.
+ */
+void
+conns_init(struct connections *conns);
+
+/**
+ * \returns Monotonic time (ms) client is disconnected at, unless it sends
+ * 			a control packet before.
+ */
+uint64_t
+keep_alive_deadline(struct connection *conn);
+
+/**
+ * Inserts connection into list of connections with outgoing message waiting
+ * to be written. Connection already present in the list is not inserted again.
+ */
+void
+schedule_write(struct connections *conns, struct connection *conn);
+
+/**
+ * Appends frame to outgoing queue of connection and schedules the connection
+ * for writing. Queue takes over caller's reference to the frame. Connection
+ * whose queue reaches its high watermark gets congested.
  * 
- * NOTE: Run this BEFORE inserting newly connected client into connections 
- * linked list, otherwise it will match itself.
+ * \returns 0 if success, -1 if outgoing queue is full (reference is
+ * 			released).
  */
 int
-check_for_client_id_repeated(struct connections *conns, char* client_id);
+queue_frame(struct connections *conns, struct connection *conn, frame_t *frame);
+
+/**
+ * Updates totals of frames and bytes waiting in outgoing queues of the worker
+ * (see `STATS_QUEUE_MESSAGES`) after outgoing queue of connection changed.
+ * 
+ * \param count Frames in the queue before the change.
+ * \param bytes Bytes in the queue before the change.
+ */
+void
+account_out_queue(
+	struct connections *conns, struct connection *conn, size_t count,
+	size_t bytes
+);
+
+/**
+ * Ends congestion of connection, once its outgoing queue was written down to
+ * low watermark.
+ */
+void
+check_congestion_end(struct connections *conns, struct connection *conn);
 
 /**
  * Convert variable length integer to C integer.
@@ -24,8 +76,12 @@ from_val_len_to_uint(char *buffer);
  * Convert C integer to variable length integer.
  * 
  * Use in remaining length field in MQTT control packet fixed header.
+ *
+ * \param output Buffer for encoded value, at least 4 bytes.
+ *
+ * \returns Number of bytes written.
  */
-char *
-from_uint_to_val_len(int val, size_t *len);
+size_t
+from_uint_to_val_len(int val, char *output);
 
 #endif
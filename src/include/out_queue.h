@@ -0,0 +1,200 @@
+#ifndef FEMTO_MQTT_OUT_QUEUE_H
+#define FEMTO_MQTT_OUT_QUEUE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <err.h>
+#include "pool.h"
+
+/**
+ * Initial capacity of outgoing queue. Queue grows by doubling as needed.
+ */
+#define OUT_QUEUE_INITIAL_SIZE 4
+
+/**
+ * Maximum number of frames waiting in outgoing queue of one connection.
+ */
+#define OUT_QUEUE_MAX_SIZE 1024
+
+/**
+ * Default high watermarks of outgoing queue, in bytes and frames.
+ */
+#define OUT_QUEUE_HIGH_BYTES (1024 * 1024)
+#define OUT_QUEUE_HIGH_FRAMES 768
+
+/**
+ * Default low watermarks of outgoing queue, in bytes and frames.
+ */
+#define OUT_QUEUE_LOW_BYTES (256 * 1024)
+#define OUT_QUEUE_LOW_FRAMES 256
+
+/**
+ * Outgoing MQTT control packet in bytes form, ready to be written to socket.
+ * 
+ * Frame is reference counted, so one frame (e.g. published message) can be
+ * shared by outgoing queues of many connections. Every queue holds one
+ * reference, frame is freed when the last reference is released.
+ * 
+ * Frames handed over to other worker threads are marked as shared, only their
+ * reference count is updated atomically.
+ * 
+ * Slice frame has no data of its own, it points into its parent frame (e.g.
+ * payload of PUBLISH, which is sent after per-connection header) and holds a
+ * reference to it.
+ *
+ * PUBLISH frame logged in write-ahead log points to its segment, which is
+ * kept until all its frames are freed.
+ */
+struct frame {
+	size_t refcount; // number of holders of the frame
+	int shared; // frame is referenced from more threads
+	uint8_t qos; // QoS of PUBLISH, which itself is encoded with QoS 0
+	size_t size; // size of data in bytes
+	char *data; // whole control packet, including fixed header
+	struct frame *parent; // frame data points into, NULL if data is own
+	struct wal_segment *segment; // write-ahead log segment, NULL if not logged
+};
+
+typedef struct frame frame_t;
+
+/**
+ * Bounded FIFO queue of outgoing frames of one connection, implemented as
+ * ring buffer. Head frame may be already partially written.
+ */
+struct out_queue {
+	frame_t **frames; // ring buffer of frames
+	size_t capacity; // allocated entries, power of two
+	size_t head; // index of first frame in queue
+	size_t count; // number of frames in queue
+	size_t offset; // bytes of head frame already written
+	size_t bytes; // size of all frames in queue
+	/* frames at head handed to writes in flight, they are not dropped */
+	size_t locked;
+};
+
+typedef struct out_queue out_queue_t;
+
+/**
+ * High and low watermarks of outgoing queue. Queue is over its high
+ * watermark once either its size or frame count reaches it, and under its
+ * low watermark when both are at most the low ones. Head frame does not
+ * count to the size, so one message bigger than the watermark does not get
+ * the queue over it.
+ */
+typedef struct {
+	size_t high_bytes;
+	size_t high_frames;
+	size_t low_bytes;
+	size_t low_frames;
+} out_watermarks_t;
+
+/**
+ * Allocates frame with data buffer of given size from buffer pools. Caller
+ * holds the only reference.
+ */
+frame_t *
+frame_create(size_t size);
+
+/**
+ * Creates frame pointing into data of parent frame, which is referenced
+ * until the slice is released. Caller holds the only reference.
+ */
+frame_t *
+frame_slice(frame_t *parent, size_t offset, size_t size);
+
+/**
+ * Acquires new reference to frame.
+ * 
+ * \returns The same frame.
+ */
+frame_t *
+frame_ref(frame_t *frame);
+
+/**
+ * Releases reference to frame, frame is freed with the last one.
+ */
+void
+frame_release(frame_t *frame);
+
+void
+out_queue_init(out_queue_t *queue);
+
+/**
+ * Frees queue and all frames still waiting in it.
+ */
+void
+out_queue_free(out_queue_t *queue);
+
+/**
+ * Appends frame to the end of queue. Queue takes over caller's reference.
+ * 
+ * \returns 0 if success, -1 if queue is full (frame is not inserted).
+ */
+int
+out_queue_push(out_queue_t *queue, frame_t *frame);
+
+/**
+ * \returns Number of frames that can be pushed before the queue is full.
+ */
+size_t
+out_queue_room(out_queue_t *queue);
+
+/**
+ * \returns First frame in queue, NULL if queue is empty.
+ */
+frame_t *
+out_queue_peek(out_queue_t *queue);
+
+/**
+ * Removes first frame from queue and releases its reference.
+ */
+void
+out_queue_pop(out_queue_t *queue);
+
+/**
+ * \returns Non-zero if queue reached its high watermark.
+ */
+int
+out_queue_over(out_queue_t *queue, const out_watermarks_t *watermarks);
+
+/**
+ * \returns Non-zero if queue drained to its low watermark.
+ */
+int
+out_queue_under(out_queue_t *queue, const out_watermarks_t *watermarks);
+
+/**
+ * Removes the oldest frame matching predicate from queue and releases its
+ * reference. Partially written frame and locked frames are never removed.
+ *
+ * \returns 1 if a frame was removed, 0 if none matched.
+ */
+int
+out_queue_drop_first(out_queue_t *queue, int (*match)(const frame_t *frame));
+
+/**
+ * Fills iovec array with frames from the start of queue, so they can be
+ * written with one `writev` call. Already written part of the first frame is
+ * skipped.
+ * 
+ * \param iov Array of at least `max_iov` entries.
+ * 
+ * \returns Number of iovec entries filled.
+ */
+int
+out_queue_gather(out_queue_t *queue, struct iovec *iov, int max_iov);
+
+/**
+ * Marks bytes at the start of queue as written. Fully written frames are
+ * removed from queue, offset into partially written frame is kept. Empty
+ * frames following the written bytes are removed too.
+ *
+ * \returns Number of control packets written whole, payload slices are not
+ * 			counted.
+ */
+size_t
+out_queue_consume(out_queue_t *queue, size_t bytes);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef FEMTO_MQTT_PACKET_ID_SET_H
+#define FEMTO_MQTT_PACKET_ID_SET_H
+
+#include <stdint.h>
+#include <string.h>
+#include "pool.h"
+
+/**
+ * Initial number of entries of packet ID set (64 bytes, the smallest pool
+ * buffer).
+ */
+#define PACKET_ID_SET_INITIAL_CAPACITY 32
+
+/**
+ * Maximum number of packet IDs in the set.
+ */
+#define PACKET_ID_SET_MAX 1024
+
+/**
+ * Set of packet IDs, open-addressed table with linear probing. Packet ID 0 is
+ * never used, so it marks empty entry. Clients usually allocate packet IDs
+ * sequentially, so IDs are placed by their low bits. Table is allocated on
+ * first insertion and is at most half full.
+ */
+struct packet_id_set {
+	uint16_t *ids;
+	uint32_t capacity; // power of two, 0 if not allocated
+	uint32_t count; // number of IDs in set
+};
+
+typedef struct packet_id_set packet_id_set_t;
+
+void
+packet_id_set_init(packet_id_set_t *set);
+
+void
+packet_id_set_free(packet_id_set_t *set);
+
+/**
+ * \returns Non-zero if set contains the packet ID.
+ */
+int
+packet_id_set_contains(packet_id_set_t *set, uint16_t packet_id);
+
+/**
+ * Inserts packet ID, which is not in the set yet.
+ *
+ * \param packet_id Non-zero packet ID.
+ *
+ * \returns 0 on success, -1 if the set is full.
+ */
+int
+packet_id_set_insert(packet_id_set_t *set, uint16_t packet_id);
+
+/**
+ * Removes packet ID, does nothing if it is not in the set.
+ */
+void
+packet_id_set_remove(packet_id_set_t *set, uint16_t packet_id);
+
+#endif
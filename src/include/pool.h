@@ -0,0 +1,125 @@
+#ifndef FEMTO_MQTT_POOL_H
+#define FEMTO_MQTT_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <err.h>
+
+/**
+ * Size of memory chunk slab pools get from the system at once.
+ */
+#define POOL_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Size of chunk backed by huge pages.
+ */
+#define POOL_HUGE_CHUNK_SIZE (2 * 1024 * 1024)
+
+/**
+ * Smallest buffer size class is 1 << BUFFER_MIN_SHIFT bytes (64 B), every
+ * next class doubles it, largest is 64 KiB. Larger buffers are allocated
+ * from the system directly.
+ */
+#define BUFFER_MIN_SHIFT 6
+#define BUFFER_CLASS_COUNT 11
+
+/**
+ * Allocation counters of one pool, for tuning of chunk sizes and size
+ * classes.
+ */
+typedef struct {
+	uint64_t allocs; // objects handed out
+	uint64_t frees; // objects returned
+	uint64_t system_allocs; // chunks (or large buffers) got from the system
+} pool_stats_t;
+
+/**
+ * Chunk of memory slab pool carves its objects from. Chunks are returned to
+ * the system only when pools are freed at exit.
+ */
+struct pool_chunk {
+	struct pool_chunk *next;
+	size_t size; // size of the chunk, including this header
+	int huge; // chunk is mapped, not allocated by malloc
+};
+
+typedef struct pool_chunk pool_chunk_t;
+
+/**
+ * Pool of fixed-size objects. Free objects are linked in free list through
+ * their first bytes, allocation and free are O(1) and do not touch the system
+ * allocator, until free list is empty.
+ */
+typedef struct {
+	size_t object_size; // multiple of 16 bytes
+	void *free_list;
+	pool_chunk_t *chunks;
+	pool_stats_t stats;
+} slab_t;
+
+/**
+ * Pools of one thread: slabs of connections and subscriptions and size
+ * classes of buffers (packet bodies, outgoing frames). Every thread uses its
+ * own pools, so no locking is needed. Memory allocated by one thread and freed
+ * by another one (frames shared among workers) simply moves into pools of the
+ * other thread.
+ */
+struct pools {
+	slab_t connections;
+	slab_t topics;
+	slab_t buffers[BUFFER_CLASS_COUNT];
+	pool_stats_t large_buffers; // buffers over the largest size class
+	struct pools *next; // registry of pools of all threads
+};
+
+typedef struct pools pools_t;
+
+/**
+ * If enabled, chunks are mapped with huge pages (transparent huge pages are
+ * requested when explicit ones are not available). Has to be set before any
+ * pool is used.
+ */
+void
+pools_use_huge_pages(int enable);
+
+/**
+ * \returns Pools of calling thread, created on first use.
+ */
+pools_t *
+pools_local(void);
+
+/**
+ * Frees pools of all threads, including their chunks. Called once at exit,
+ * after all threads finished and memory from pools is not used any more.
+ */
+void
+pools_free_all(void);
+
+/**
+ * Logs allocation counters of pools, summed over all threads.
+ */
+void
+pools_log_stats(void);
+
+void *
+slab_alloc(slab_t *slab);
+
+void
+slab_free(slab_t *slab, void *object);
+
+/**
+ * Allocates buffer from pool of the smallest size class it fits in. Buffer
+ * is not zeroed.
+ */
+void *
+buffer_alloc(size_t size);
+
+/**
+ * Returns buffer allocated by `buffer_alloc` to pool of calling thread. NULL
+ * is ignored.
+ */
+void
+buffer_free(void *buffer);
+
+#endif
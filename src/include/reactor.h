@@ -0,0 +1,66 @@
+#ifndef FEMTO_MQTT_REACTOR_H
+#define FEMTO_MQTT_REACTOR_H
+
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+/**
+ * Maximum number of ready events returned by one `reactor_wait` call.
+ */
+#define REACTOR_MAX_EVENTS 256
+
+typedef struct epoll_event event_t;
+
+/**
+ * Readiness source of the event loop. Wraps epoll instance and the array
+ * ready events are returned in.
+ *
+ * All file descriptors are registered edge-triggered, so every ready event has
+ * to be handled until EAGAIN (or EOF), otherwise no new event will come.
+ */
+typedef struct {
+	int epoll_fd;
+	event_t *events; // ready events, filled by reactor_wait
+	int max_events; // size of the events array
+} reactor_t;
+
+void
+reactor_init(reactor_t *reactor);
+
+void
+reactor_free(reactor_t *reactor);
+
+/**
+ * Registers file descriptor in reactor, edge-triggered.
+ *
+ * \param data Pointer returned with every event for this fd. NULL is reserved
+ * 			   for listening socket.
+ * \param events Epoll events mask (EPOLLET is added automatically).
+ *
+ * \returns Zero if success, -1 with errno set otherwise.
+ */
+int
+reactor_add(reactor_t *reactor, int fd, void *data, uint32_t events);
+
+/**
+ * Unregisters file descriptor, which stays open.
+ */
+void
+reactor_remove(reactor_t *reactor, int fd);
+
+/**
+ * Waits for ready file descriptors.
+ *
+ * \param timeout Timeout in milliseconds, -1 to block indefinitely.
+ *
+ * \returns Number of ready events in `reactor->events`. Zero on timeout or
+ * 			when interrupted by signal.
+ */
+int
+reactor_wait(reactor_t *reactor, int timeout);
+
+#endif
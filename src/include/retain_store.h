@@ -0,0 +1,120 @@
+#ifndef FEMTO_MQTT_RETAIN_STORE_H
+#define FEMTO_MQTT_RETAIN_STORE_H
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <err.h>
+#include "out_queue.h"
+#include "topic_scan.h"
+
+/**
+ * Default limit of memory used by retained messages, in bytes.
+ */
+#define RETAIN_STORE_MEMORY (64 * 1024 * 1024)
+
+/**
+ * Initial number of buckets in children hash table of retained store node.
+ */
+#define RETAIN_NODE_INITIAL_BUCKETS 4
+
+/**
+ * Node of retained message trie. Every node represents one topic level, path
+ * from root to the node is a topic name.
+ */
+struct retain_node {
+	char *level; // topic level, not null-terminated
+	size_t level_len;
+	uint32_t hash; // hash of the level, see `hash_level`
+	struct retain_node *parent;
+	struct retain_node *next_sibling; // next node in the same bucket
+
+	struct retain_node **buckets; // hash table of children
+	size_t bucket_count; // number of buckets, power of two
+	size_t child_count; // number of children in hash table
+
+	frame_t *frame; // retained PUBLISH (RETAIN flag set), NULL if none
+};
+
+typedef struct retain_node retain_node_t;
+
+/**
+ * Counters of retained store, logged when broker exits.
+ */
+typedef struct {
+	uint64_t stored; // messages retained, including replacements
+	uint64_t removed; // messages removed by empty retained PUBLISH
+	uint64_t rejected; // messages not retained due to memory limit
+	uint64_t matched; // retained messages matched by new subscriptions
+} retain_store_stats_t;
+
+/**
+ * Retained messages of one worker thread, indexed by topic in a trie, so
+ * topic filters with wildcards visit only matching branches.
+ *
+ * Messages are kept as encoded PUBLISH frames with RETAIN flag, delivering
+ * them to new subscriber only queues new references. When more worker
+ * threads run, every one of them keeps its own store, frames are shared.
+ */
+struct retain_store {
+	retain_node_t *root;
+	size_t count; // number of retained messages
+	size_t memory; // bytes of retained frames and trie nodes
+	size_t memory_limit; // 0 disables retained messages
+	frame_t **matches; // frames found by last retain_store_match
+	size_t matches_capacity; // allocated entries of matches
+	retain_store_stats_t stats;
+};
+
+typedef struct retain_store retain_store_t;
+
+/**
+ * \param memory_limit Maximum memory used by retained messages, 0 disables
+ * 					   them.
+ */
+void
+retain_store_init(retain_store_t *store, size_t memory_limit);
+
+/**
+ * Frees the store, references to retained frames are released.
+ */
+void
+retain_store_free(retain_store_t *store);
+
+/**
+ * Replaces retained message of topic.
+ *
+ * \param levels Scan of the topic.
+ * \param frame PUBLISH frame with RETAIN flag, the store acquires a reference
+ * 				to it. NULL removes retained message of the topic.
+ *
+ * \returns 0 on success, -1 if the message does not fit into memory limit
+ * 			(previous message of the topic is kept).
+ */
+int
+retain_store_set(
+	retain_store_t *store, const char *topic, size_t topic_len,
+	const topic_scan_t *levels, frame_t *frame
+);
+
+/**
+ * Finds retained messages whose topic matches topic filter.
+ *
+ * \param levels Scan of the topic filter.
+ * \param frames Set to array of matching frames, valid until next call.
+ *
+ * \returns Number of matching frames.
+ */
+size_t
+retain_store_match(
+	retain_store_t *store, const char *filter, size_t filter_len,
+	const topic_scan_t *levels, frame_t ***frames
+);
+
+/**
+ * Logs number and memory of retained messages and store counters.
+ */
+void
+retain_store_log_stats(retain_store_t *store);
+
+#endif
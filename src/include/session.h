@@ -0,0 +1,98 @@
+#ifndef FEMTO_MQTT_SESSION_H
+#define FEMTO_MQTT_SESSION_H
+
+#include "mqtt_utils.h"
+#include "session_store.h"
+
+struct worker;
+
+/**
+ * Finds worker owning session of the client. Every session belongs to one
+ * worker chosen by hash of client ID, its subscriptions are in subscription
+ * tree of that worker only. Every connection is handed over to that worker,
+ * also with clean session, so that client ID is connected at most once
+ * (MQTT-3.1.4-2) and takeover finds the previous connection.
+ *
+ * \returns Worker CONNECT has to be processed by, NULL if by this one.
+ */
+struct worker *
+session_home_worker(
+	conns_t *conns, const char *client_id, size_t client_id_len
+);
+
+/**
+ * Sets up session of connecting client, with client ID set. Clean session
+ * discards existing session of the client. Otherwise existing session is
+ * resumed (subscriptions, messages in flight and waiting, received QoS 2
+ * packet IDs are moved to the connection and `session_present` is set), or a
+ * new persistent session is started. Connection is inserted into client
+ * table.
+ *
+ * Messages of resumed session are sent by `resume_inflight_messages`, once
+ * CONNACK is queued.
+ */
+void
+session_open(conns_t *conns, conn_t *conn, int clean_session);
+
+/**
+ * Moves session of persistent connection being cleared to offline session,
+ * which takes its place in client table. Session is written to session
+ * store, with messages in flight and waiting.
+ */
+void
+session_detach(conns_t *conns, conn_t *conn);
+
+/**
+ * Writes snapshot of subscriptions of persistent connection to session
+ * store, after they changed.
+ */
+void
+session_save(conns_t *conns, conn_t *conn);
+
+/**
+ * Queues message with QoS above 0 for offline session and writes it to
+ * session store.
+ *
+ * \param payload Payload slice, caller keeps its reference.
+ *
+ * \returns 0 on success, -1 if too many messages wait for the client (message
+ * 			is dropped).
+ */
+int
+session_deliver(conns_t *conns, conn_t *session, frame_t *payload, uint8_t qos);
+
+/**
+ * Rebuilds offline session from session store records, in connections of the
+ * worker owning it. Called for every session restored by
+ * `session_store_open`, before worker threads are started.
+ *
+ * \param arg Array of all workers.
+ */
+void
+session_restore(
+	void *arg, const session_record_t *record,
+	const session_record_t **messages, size_t message_count
+);
+
+/**
+ * Indexes messages restored into offline sessions from session store, before
+ * write-ahead log is replayed. Store keeps messages of offline sessions, so
+ * log of crashed broker has them too. Replayed message equal to a restored
+ * one is not queued for the session again.
+ */
+void
+sessions_replay_begin(conns_t *conns);
+
+/**
+ * Frees index of restored messages, once write-ahead log is replayed.
+ */
+void
+sessions_replay_end(conns_t *conns);
+
+/**
+ * Frees all offline sessions of connections, they stay in session store.
+ */
+void
+sessions_free(conns_t *conns);
+
+#endif
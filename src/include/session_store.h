@@ -0,0 +1,201 @@
+#ifndef FEMTO_MQTT_SESSION_STORE_H
+#define FEMTO_MQTT_SESSION_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+/**
+ * Initial number of buckets of session registry and of recovery index.
+ */
+#define SESSION_STORE_INITIAL_BUCKETS 1024
+
+/**
+ * Store file is compacted once it is at least this big and twice as big as
+ * after last compaction.
+ */
+#define SESSION_STORE_COMPACT_MIN (4 * 1024 * 1024)
+
+/**
+ * Store file grows by at least this many bytes.
+ */
+#define SESSION_STORE_GROWTH (1024 * 1024)
+
+/**
+ * Types of records in session store file.
+ */
+enum session_record_type {
+	SESSION_RECORD_SESSION = 1, // subscriptions and received QoS 2 packet IDs
+	SESSION_RECORD_MESSAGE, // message waiting for the client
+	SESSION_RECORD_RESUME, // client reconnected, its messages were taken
+	SESSION_RECORD_DELETE // session was discarded
+};
+
+/**
+ * Header of record in session store file. Client ID follows the header, then
+ * body of the record, records are aligned to 8 bytes.
+ *
+ * Body of session record is made of subscription count (uint32_t), received
+ * packet ID count (uint32_t), subscriptions (16-bit size, QoS byte, topic
+ * filter) and packet IDs (uint16_t). Body of message record is encoded
+ * PUBLISH control packet, empty for QoS 2 message released by the client.
+ */
+typedef struct {
+	uint32_t size; // size of the record without padding, 0 marks end
+	uint32_t checksum; // FNV-1a of the record after this field
+	uint8_t type; // see enum session_record_type
+	uint8_t qos; // QoS the message is sent with
+	uint8_t released; // QoS 2 message received by the client (PUBREC)
+	uint8_t reserved;
+	uint16_t packet_id; // packet ID of message in flight, 0 if waiting
+	uint16_t client_id_length;
+} session_record_t;
+
+/**
+ * Client ID of session record.
+ */
+#define session_record_client_id(record) ((const char *) ((record) + 1))
+
+/**
+ * Body of session record.
+ */
+#define session_record_body(record) \
+	(session_record_client_id(record) + (record)->client_id_length)
+
+/**
+ * Size of body of session record.
+ */
+#define session_record_body_size(record) \
+	((record)->size - sizeof(session_record_t) - (record)->client_id_length)
+
+/**
+ * Client ID of session with persistent session (clean session 0).
+ */
+struct session_id {
+	struct session_id *next; // next ID in the same bucket
+	uint32_t hash;
+	uint16_t length;
+	char id[];
+};
+
+/**
+ * Counters of session store, logged when broker exits.
+ */
+typedef struct {
+	uint64_t records; // records appended
+	uint64_t bytes; // bytes of appended records
+	uint64_t compactions; // compactions completed
+	uint64_t restored; // sessions restored from the file
+} session_store_stats_t;
+
+/**
+ * Persistent sessions shared by all worker threads.
+ *
+ * Registry of client IDs with session is kept in memory, so any worker can
+ * find out whether CONNECT has to be handled by the worker owning the
+ * session. When the store has a file, session changes are appended to it as
+ * records: session snapshot when its client disconnects, messages queued for
+ * disconnected client, resumption and discarding of the session. The file is
+ * memory-mapped, appending a record is a copy into the mapping.
+ *
+ * File is compacted by a background thread, which replays it (the same way
+ * as sessions are restored on startup) and writes only records of live
+ * sessions into a new file. Records appended in the meantime are copied after
+ * them, then the new file replaces the old one.
+ */
+struct session_store {
+	pthread_mutex_t lock; // all fields are accessed under the lock
+
+	struct session_id **buckets; // registry of client IDs
+	size_t bucket_count; // power of two
+	size_t count; // number of client IDs in registry
+
+	char *path; // store file, NULL if sessions are kept in memory only
+	int fd;
+	char *map; // mapping of the whole file
+	size_t map_size; // size of the file and its mapping
+	size_t end; // end of records
+	size_t compacted_size; // end of records after last compaction
+
+	pthread_t compactor; // background compaction thread
+	int compactor_started; // thread was started and not joined yet
+	int compacting; // compaction is running
+
+	session_store_stats_t stats;
+};
+
+typedef struct session_store session_store_t;
+
+/**
+ * Callback receiving session restored from store file, with all its
+ * messages. Records point into mapping of the file, they are valid only
+ * during the call.
+ */
+typedef void (*session_restore_t)(
+	void *arg, const session_record_t *session,
+	const session_record_t **messages, size_t message_count
+);
+
+/**
+ * Initializes store with empty registry, sessions are kept in memory only.
+ */
+void
+session_store_init(session_store_t *store);
+
+/**
+ * Opens store file, creates it if it does not exist. Sessions in the file
+ * are restored, their client IDs are inserted into registry.
+ *
+ * \param restore Called for every restored session.
+ *
+ * \returns 0 on success, -1 if the file cannot be opened (errno is set).
+ */
+int
+session_store_open(
+	session_store_t *store, const char *path, session_restore_t restore,
+	void *arg
+);
+
+/**
+ * Waits for compaction, syncs and closes the file and frees the registry. No
+ * other thread may use the store anymore.
+ */
+void
+session_store_free(session_store_t *store);
+
+/**
+ * Inserts client ID into registry, nothing is written until the client
+ * disconnects.
+ */
+void
+session_store_add(
+	session_store_t *store, const char *client_id, size_t client_id_len
+);
+
+/**
+ * Removes client ID from registry and appends delete record.
+ */
+void
+session_store_remove(
+	session_store_t *store, const char *client_id, size_t client_id_len
+);
+
+/**
+ * Appends record to store file, does nothing if store has no file.
+ *
+ * \param record Header with type, QoS, released flag and packet ID set, size,
+ * 				 checksum and client ID length are filled in.
+ * \param body Body of the record, may be NULL if its size is 0.
+ */
+void
+session_store_append(
+	session_store_t *store, session_record_t *record, const char *client_id,
+	size_t client_id_len, const char *body, size_t body_size
+);
+
+void
+session_store_log_stats(session_store_t *store);
+
+#endif
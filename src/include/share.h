@@ -0,0 +1,140 @@
+#ifndef FEMTO_MQTT_SHARE_H
+#define FEMTO_MQTT_SHARE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <err.h>
+#include "topic_list.h"
+
+/**
+ * Groups of registry spread across at most this many workers (bits of
+ * worker mask).
+ */
+#define SHARE_MAX_WORKERS 64
+
+/**
+ * Initial number of buckets of registry hash table, it grows by doubling.
+ */
+#define SHARE_REGISTRY_INITIAL_BUCKETS 64
+
+/**
+ * Group of shared subscriptions of one worker with the same name and topic
+ * filter. Group is linked into subscription tree node of the filter by its
+ * entry (without owner), so published message matches the group once and
+ * one member is selected to receive it.
+ */
+struct share_group {
+	topic_t entry; // linked into tree node, its topic is the filter
+	char *name; // share name, null-terminated
+	size_t name_len;
+	topic_t **members; // subscriptions of the group, in no particular order
+	size_t member_count;
+	size_t member_capacity;
+	uint64_t cursor; // position of round robin, state of random choice
+	struct share_entry *shared; // entry of registry, NULL with one worker
+};
+
+typedef struct share_group share_group_t;
+
+/**
+ * Group known to registry, shared by its groups in all workers.
+ */
+struct share_entry {
+	struct share_entry *next; // next entry in the same bucket
+	char *key; // `$share/<group>/<filter>`, not null-terminated
+	size_t key_len;
+	uint32_t hash;
+	uint64_t workers; // mask of workers having members, read atomically
+};
+
+typedef struct share_entry share_entry_t;
+
+/**
+ * Broker-wide registry of shared groups, used when more workers run. Every
+ * worker delivers message of a group only if it is the worker selected by
+ * hash of the message among workers having members, so the message is
+ * delivered once. Registry is changed on (UN)SUBSCRIBE only, under lock.
+ */
+struct share_registry {
+	pthread_mutex_t lock;
+	share_entry_t **buckets;
+	size_t bucket_count; // power of two
+	size_t count;
+};
+
+typedef struct share_registry share_registry_t;
+
+/**
+ * Selects member of group to receive message.
+ *
+ * \param hash Hash of the message, the same for all workers.
+ *
+ * \returns Member subscription, group has at least one member.
+ */
+typedef topic_t *(*share_select_t)(share_group_t *group, uint32_t hash);
+
+/**
+ * Strategy of member selection, all of them take constant time.
+ */
+typedef struct {
+	const char *name; // name of command line option
+	share_select_t select;
+	int sticky; // hash of message is hash of its topic
+} share_strategy_t;
+
+/**
+ * \returns Strategy of given name, NULL if unknown.
+ */
+const share_strategy_t *
+share_strategy_find(const char *name);
+
+/**
+ * \returns Default strategy (round robin).
+ */
+const share_strategy_t *
+share_strategy_default(void);
+
+void
+share_registry_init(share_registry_t *registry);
+
+void
+share_registry_free(share_registry_t *registry);
+
+/**
+ * Adds worker to group of registry, entry is created if it is not present.
+ *
+ * \param key `$share/<group>/<filter>`, not null-terminated.
+ *
+ * \returns Registry entry of the group.
+ */
+share_entry_t *
+share_registry_join(
+	share_registry_t *registry, const char *key, size_t key_len, int worker_id
+);
+
+/**
+ * Removes worker from group of registry, entry is freed after last worker
+ * leaves.
+ */
+void
+share_registry_leave(
+	share_registry_t *registry, share_entry_t *entry, int worker_id
+);
+
+/**
+ * Selects member of group to receive message. When more workers have members
+ * of the group, NULL is returned unless this worker is the one to deliver.
+ *
+ * \param hash Hash of the message, the same for all workers.
+ *
+ * \returns Member subscription, NULL if another worker delivers the message.
+ */
+topic_t *
+share_group_select(
+	share_group_t *group, const share_strategy_t *strategy, int worker_id,
+	uint32_t hash
+);
+
+#endif
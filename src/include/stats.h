@@ -0,0 +1,84 @@
+#ifndef FEMTO_MQTT_STATS_H
+#define FEMTO_MQTT_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Default interval of publishing broker statistics (seconds).
+ */
+#define STATS_INTERVAL 10
+
+/**
+ * Counters and gauges of broker statistics, every one is published as
+ * retained message of its `$SYS/broker/...` topic.
+ */
+enum stats_counter {
+	STATS_MESSAGES_RECEIVED, // control packets received
+	STATS_MESSAGES_SENT, // control packets written to sockets
+	STATS_BYTES_RECEIVED, // bytes of control packets received
+	STATS_BYTES_SENT, // bytes written to sockets
+	STATS_PUBLISH_RECEIVED, // PUBLISH packets received from clients
+	STATS_PUBLISH_SENT, // messages queued for subscribers
+	STATS_PUBLISH_DROPPED, // messages dropped for subscribers
+	STATS_LOOP_ITERATIONS, // event loop iterations
+	/* gauges, kept up to date as outgoing queues change */
+	STATS_QUEUE_MESSAGES, // frames waiting in outgoing queues
+	STATS_QUEUE_BYTES, // bytes waiting in outgoing queues
+	/* gauges, set when snapshot is taken */
+	STATS_CLIENTS_CONNECTED, // connections of the worker
+	STATS_SUBSCRIPTIONS, // subscriptions, offline sessions included
+	STATS_MATCH_CACHE_HITS, // published topics found in match cache
+	STATS_MATCH_CACHE_MISSES, // published topics matched in subscription tree
+	STATS_MATCH_CACHE_EVICTIONS, // match cache entries replaced
+	STATS_COUNTERS
+};
+
+/**
+ * Statistics of one worker. Counters are incremented on hot paths by the
+ * owning worker only, without atomics. Other threads read the snapshot,
+ * which the worker copies from counters with atomic stores once per
+ * publishing interval.
+ */
+typedef struct {
+	uint64_t counters[STATS_COUNTERS];
+	uint64_t snapshot[STATS_COUNTERS];
+	uint64_t interval; // ms between snapshots, 0 if statistics are disabled
+	uint64_t next; // monotonic time (ms) of next snapshot
+} stats_t;
+
+/**
+ * Initializes statistics with all counters zero.
+ *
+ * \param interval Milliseconds between snapshots, 0 disables them.
+ * \param now Monotonic time (ms).
+ */
+void
+stats_init(stats_t *stats, uint64_t interval, uint64_t now);
+
+/**
+ * \returns Non-zero if snapshot should be taken at `now`, next one is then
+ * 			scheduled.
+ */
+int
+stats_due(stats_t *stats, uint64_t now);
+
+/**
+ * Copies counters into snapshot, may run concurrently with `stats_read`.
+ */
+void
+stats_take_snapshot(stats_t *stats);
+
+/**
+ * Adds snapshot of worker statistics to `sums`, may be called by any thread.
+ */
+void
+stats_read(stats_t *stats, uint64_t sums[STATS_COUNTERS]);
+
+/**
+ * \returns Null-terminated `$SYS/broker/...` topic of counter.
+ */
+const char *
+stats_topic(enum stats_counter counter);
+
+#endif
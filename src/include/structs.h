@@ -14,6 +14,14 @@
 #include <stdlib.h>
 #include "log.h"
 #include "topic_list.h"
+#include "share.h"
+#include "stats.h"
+#include "out_queue.h"
+#include "client_table.h"
+#include "timer_wheel.h"
+#include "retain_store.h"
+#include "inflight.h"
+#include "packet_id_set.h"
 
 /**
  * All MQTT control packet types. Values are the same as in upper 4 bits in
@@ -24,6 +32,9 @@ enum mqtt_control_packet_type {
 	MQTT_CONNACK = 2,
 	MQTT_PUBLISH = 3,
 	MQTT_PUBACK = 4,
+	MQTT_PUBREC = 5,
+	MQTT_PUBREL = 6,
+	MQTT_PUBCOMP = 7,
 	MQTT_SUBSCRIBE = 8,
 	MQTT_SUBACK = 9,
 	MQTT_UNSUBSCRIBE = 10,
@@ -41,16 +52,39 @@ enum mqtt_control_packet_type {
  */
 typedef enum mqtt_control_packet_type ctrl_packet_t;
 
+/**
+ * Highest supported QoS level. Subscriptions are granted at most this level
+ * and PUBLISH with higher one is refused.
+ */
+#define MQTT_MAX_QOS 2
+
+/**
+ * Initial size of receive buffer of connection. Buffer grows by doubling when
+ * control packet does not fit.
+ */
+#define RECEIVE_BUFFER_SIZE 4096
+
+/**
+ * What happens to QoS 0 messages for client whose outgoing queue is over its
+ * high watermark (congested client), until the queue drains to its low
+ * watermark. Messages with higher QoS wait in inflight window instead.
+ */
+enum congestion_policy {
+	CONGESTION_DROP_NEWEST, // new messages are dropped
+	CONGESTION_DROP_OLDEST, // oldest QoS 0 message in queue makes room
+	CONGESTION_DISCONNECT // client is disconnected
+};
+
 /**
  * Connection struct containing all information related to connected clients.
  * Mainly contains their in-/out-bound messages, keep alive value, topics they
- * are subscribed to, struct pollfd for `poll`, etc.
+ * are subscribed to, socket fd registered in reactor, etc.
  * 
  * Also it's an entry in connections linked list and so pointers to next and
  * previous list entry are neccessary.
  */
 struct connection {
-	// struct pollfd pfd; // for poll syscall, containing client's socked fd
+	int fd; // client's socket, registered in reactor
 
 	struct connection *next; // next entry in connections linked list
 	struct connection *prev; // previous entry in connections linked list
@@ -58,26 +92,65 @@ struct connection {
 	topics_t *topics; // subscribed topics linked list
 	char *client_id;
 	size_t cliend_id_length;
+	uint32_t client_id_hash; // hash of client_id, set by client_table_insert
+	struct connection *next_client; // next connection in client table bucket
 
-	char *message; // message in bytes form (no \0)
-	ssize_t message_size; // message size in bytes (no \0)
-	ctrl_packet_t type;
+	char *message; // incoming message, view into receive buffer (no \0)
+	ssize_t message_size; // incoming message size in bytes (no \0)
+	ctrl_packet_t type; // incoming message control packet type
+	uint8_t flags; // incoming message flags (lower 4 bits of first byte)
 	int keep_alive;
     uint16_t packet_id;
-	/* last topic in topic list before insertion of new one */
-    topic_t *last_topic_before_insert;
-	int length_left_to_read;
-	char* buffer_left_to_read;
 
-	int64_t last_seen; // last time this client sent some control packet
+	/* receive buffer, complete control packets are parsed from its start */
+	char *in_buffer;
+	size_t in_capacity; // allocated bytes of receive buffer
+	size_t in_start; // first byte not parsed yet
+	size_t in_end; // end of received bytes
+	size_t in_packet_size; // size of partially received packet, 0 if unknown
+	int remaining_length; // remaining length of last decoded fixed header
+
+	uint64_t last_seen; // monotonic time (ms) of last control packet
+	wheel_timer_t keep_alive_timer; // armed if keep alive is positive
 	uint8_t seen_connect_packet; // we can't see two connect ctrl packets
 
-	int state; // 0 - incoming, 1 - outgoing
-	int poll_list_index; // index of this connection's poll in poll list
+	uint8_t persistent; // session outlives connection (clean session 0)
+	uint8_t session_present; // CONNECT resumed existing session
+	uint8_t detached; // offline session, kept without socket
+	/* worker owning session of the client, connection is handed over to it
+	 * with CONNECT not processed yet */
+	struct worker *handoff;
+	uint8_t handoff_cancelled; // receive of io_uring was cancelled
+
+	out_queue_t out_queue; // outgoing frames waiting to be written
+	uint64_t last_publish; // id of last publish queued for this client
+	uint8_t publish_qos; // highest QoS of subscriptions matching last publish
+	uint8_t congested; // outgoing queue reached high watermark
+	uint64_t dropped; // QoS 0 messages dropped while congested
+
+	inflight_t inflight; // QoS 1 and 2 messages not acknowledged yet
+	wheel_timer_t retry_timer; // armed while messages are in flight
+	packet_id_set_t received; // QoS 2 packet IDs received, not released yet
+
+	/* next entry in list of connections with data waiting to be written */
+	struct connection *next_pending_out;
+	uint8_t pending_out; // connection is in pending out list
+	uint8_t closing; // connection was cleared, memory is freed at loop end
+	struct connection *next_closed; // next entry in closed connections list
+	/* PUBACK and PUBREC waiting for write-ahead log commit, memory is not
+	 * freed before */
+	int wal_acks;
+
+	// io_uring backend only
+	int uring_requests; // requests in flight, memory is not freed before
+	int uring_sends; // linked writev requests in flight
+	struct iovec *uring_iov; // iovecs of writev requests in flight
 };
 
 typedef struct connection conn_t;
 
+struct worker;
+
 /**
  * Connections linked list, containing all connected clients to this MQTT broker
  */
@@ -85,6 +158,41 @@ struct connections {
 	struct connection *conn_head;
 	struct connection *conn_back;
 	int count;
+
+	/* connections with outgoing message, flushed after processing events */
+	struct connection *pending_out;
+	/* cleared connections, freed at the end of event loop iteration, so
+	 * events that are still pending for them can be safely skipped */
+	struct connection *closed;
+
+	topic_tree_t topic_tree; // subscriptions of all connected clients
+	/* subscriptions of SUBSCRIBE being processed, one per its topic filter */
+	topic_t **subscribed;
+	size_t subscribed_capacity;
+	client_table_t clients; // connected clients by client ID
+	retain_store_t retained; // retained messages by topic
+	timer_wheel_t timers; // keep alive timers of connections
+	timer_wheel_t retries; // redelivery timers of connections
+	/* offline persistent sessions, linked through next and prev */
+	struct connection *sessions;
+	/* messages restored into sessions, sorted, during write-ahead log
+	 * replay only */
+	struct restored_message *restored;
+	size_t restored_count;
+	uint64_t now; // monotonic time (ms), cached once per loop iteration
+	uint64_t publish_counter; // id of last processed publish
+
+	out_watermarks_t watermarks; // of outgoing queues of all connections
+	enum congestion_policy congestion_policy;
+	uint64_t congestions; // times connections got congested
+	uint64_t dropped; // messages dropped for congested connections
+
+	/* selects member of shared subscription group to get a message */
+	const share_strategy_t *share_strategy;
+
+	stats_t stats; // published as $SYS topics
+
+	struct worker *worker; // worker thread owning these connections
 };
 
 typedef struct connections conns_t;
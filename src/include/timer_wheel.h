@@ -0,0 +1,78 @@
+#ifndef FEMTO_MQTT_TIMER_WHEEL_H
+#define FEMTO_MQTT_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+
+/**
+ * Number of slots of timer wheel, power of two.
+ */
+#define TIMER_WHEEL_SLOTS 512
+
+/**
+ * Time covered by one slot of timer wheel, in milliseconds.
+ */
+#define TIMER_WHEEL_RESOLUTION 1000
+
+/**
+ * Timer linked into timer wheel slot. Embedded into structure it belongs to.
+ */
+struct wheel_timer {
+	uint64_t expires; // tick the timer expires in
+	struct wheel_timer *next;
+	struct wheel_timer *prev; // NULL if timer is not armed
+};
+
+typedef struct wheel_timer wheel_timer_t;
+
+/**
+ * Hashed timer wheel. Timer is put into slot of its expiry tick, timers that
+ * expire more rounds of the wheel later share the slot and are skipped until
+ * their tick comes. Adding and removing timer is O(1), advancing the wheel
+ * visits only slots of elapsed ticks.
+ */
+typedef struct {
+	wheel_timer_t *slots; // slot list heads (sentinels)
+	uint64_t current; // last processed tick
+} timer_wheel_t;
+
+/**
+ * \returns Monotonic time in milliseconds. Coarse clock is used, it is cheap
+ * 			to read and precise enough for timeouts in seconds.
+ */
+uint64_t
+monotonic_ms(void);
+
+void
+timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+void
+timer_wheel_free(timer_wheel_t *wheel);
+
+/**
+ * Arms timer. Timer that is already armed is moved.
+ *
+ * \param expires Time in milliseconds, timer never expires earlier.
+ */
+void
+timer_add(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t expires);
+
+/**
+ * Disarms timer, does nothing if timer is not armed.
+ */
+void
+timer_remove(wheel_timer_t *timer);
+
+/**
+ * Advances wheel to given time and disarms all expired timers.
+ *
+ * \param now Time in milliseconds.
+ *
+ * \returns Expired timers linked by `next`.
+ */
+wheel_timer_t *
+timer_wheel_advance(timer_wheel_t *wheel, uint64_t now);
+
+#endif
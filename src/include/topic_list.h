@@ -4,19 +4,51 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <err.h>
 #include "log.h"
+#include "pool.h"
+#include "intern_table.h"
+#include "match_cache.h"
+#include "topic_scan.h"
+
+/**
+ * Initial number of buckets in children hash table of subscription tree node.
+ */
+#define TOPIC_NODE_INITIAL_BUCKETS 4
+
+/**
+ * Prefix of shared subscription topic filter, `$share/<group>/<filter>`.
+ */
+#define SHARE_PREFIX "$share/"
+#define SHARE_PREFIX_LEN 7
+
+struct connection;
+struct topic_node;
+struct share_group;
+struct share_registry;
 
 /**
  * Topic linked list entry. Contains all topic-related data.
+ *
+ * Topic is also linked into subscription tree node of its topic filter,
+ * together with subscriptions of other clients to the same filter. Shared
+ * subscription is a member of its group instead, the group is linked into
+ * the node.
  */
 struct topic {
-    char **tokenized_topic; // array of tokens of tokenized topic
-    char *topic; // topic in its string (pre-tokenization) form
-    size_t topic_len; // length of the topic string (pre-tokenization)
-    int topic_token_count; // how many tokens is topic composed of
-    int qos_code; // qos code for this topic
+    char *topic; // topic in its string form
+    size_t topic_len; // length of the topic string
+    int qos_code; // qos code for this topic (0x80 - invalid topic filter)
     struct topic *next; // next topic in topic linked list
+
+    struct connection *owner; // subscribed client
+    struct topic_node *node; // subscription tree node, NULL if not in tree
+    struct topic *node_next; // next subscription in the same tree node
+    struct topic *node_prev; // previous subscription in the same tree node
+
+    struct share_group *group; // group of shared subscription, NULL if not shared
+    size_t member_index; // index in members of the group
 };
 
 /**
@@ -34,22 +66,111 @@ struct topics {
 
 typedef struct topics topics_t;
 
+/**
+ * Node of subscription tree. Every node represents one topic level, path from
+ * root to the node is a topic filter. Subscriptions of all clients to this
+ * topic filter are linked in the node.
+ *
+ * Children are kept in hash table by ID of their interned level, wildcard
+ * levels `+` and `#` have dedicated children.
+ */
+struct topic_node {
+    uint32_t level_id; // interned topic level (INTERN_NONE for root, `+`, `#`)
+    struct topic_node *parent;
+    struct topic_node *next_sibling; // next node in the same bucket
+
+    struct topic_node **buckets; // hash table of children
+    size_t bucket_count; // number of buckets, power of two
+    size_t child_count; // number of children in hash table
+    struct topic_node *plus; // child for `+` level
+    struct topic_node *hash; // child for `#` level
+
+    struct topic *subscribers; // subscriptions to this topic filter
+};
+
+typedef struct topic_node topic_node_t;
+
+/**
+ * Broker-wide subscription tree, used for finding subscribers of published
+ * topic in time proportional to topic depth and number of matches.
+ *
+ * Topic levels of subscriptions are interned, every distinct level is stored
+ * once. Levels of published topic are translated to IDs first, matching
+ * then compares IDs only. Subscriptions matching hot topics are cached,
+ * every change of the tree bumps its epoch, which invalidates the cache.
+ */
+struct topic_tree {
+    topic_node_t *root;
+    intern_table_t levels; // topic levels used by subscriptions
+    uint64_t epoch; // bumped whenever subscription is linked or unlinked
+    size_t subscription_count; // subscriptions linked or in shared groups
+    match_cache_t cache; // matches of recently published topics
+    topic_t **matches; // subscriptions found by last topic_tree_match
+    size_t matches_capacity; // allocated entries of matches
+    uint32_t *match_levels; // level IDs of topic of last topic_tree_match
+    size_t match_levels_capacity; // allocated entries of match_levels
+    topic_scan_t scan; // levels of last scanned topic, reused between scans
+    struct share_registry *shares; // groups of all workers, NULL with one worker
+    int worker_id; // bit of the worker in shared groups of registry
+};
+
+typedef struct topic_tree topic_tree_t;
+
 void
-insert_topic(topics_t *list, char *topic_str, size_t topic_len, int qos_code);
+topic_tree_init(topic_tree_t *tree);
 
-int
-remove_topic(topics_t *list, char *topic_str, size_t topic_len);
+void
+topic_tree_free(topic_tree_t *tree);
+
+/**
+ * Finds all subscriptions whose topic filter matches published topic. Group
+ * of shared subscriptions is matched once, as entry without owner.
+ *
+ * \param tree Subscription tree.
+ * \param topic Published topic (without wildcards), not null-terminated.
+ * \param topic_len Length of published topic.
+ * \param levels Scan of the topic, NULL if it was not scanned yet.
+ *
+ * \param matches Set to array of matching subscriptions, valid until next
+ * 				  call.
+ *
+ * \returns Number of matching subscriptions.
+ */
+size_t
+topic_tree_match(
+    topic_tree_t *tree, const char *topic, size_t topic_len,
+    const topic_scan_t *levels, topic_t ***matches
+);
+
+void
+insert_topic(
+    topic_tree_t *tree, topics_t *list, struct connection *owner,
+    char *topic_str, size_t topic_len, const topic_scan_t *scan, int qos_code
+);
 
 int
-find_topic(topics_t *list, char *topic_str);
+remove_topic(
+    topic_tree_t *tree, topics_t *list, char *topic_str, size_t topic_len
+);
+
+topic_t *
+find_topic(topics_t *list, char *topic_str, size_t topic_len);
 
 topics_t *
 create_topics_list(void);
 
 void
-delete_topics_list(topics_t *list);
+delete_topics_list(topic_tree_t *tree, topics_t *list);
 
+/**
+ * Scans topic name of PUBLISH (not null-terminated).
+ *
+ * \param scan Filled with levels of the topic.
+ *
+ * \returns 1 if topic name is valid UTF-8, not empty and contains no
+ * 			wildcard nor null characters, 0 otherwise.
+ */
 int
-contains_wildcard_char(char *topic);
+is_valid_topic_name(const char *topic, size_t topic_len, topic_scan_t *scan);
 
 #endif
@@ -0,0 +1,88 @@
+#ifndef FEMTO_MQTT_TOPIC_SCAN_H
+#define FEMTO_MQTT_TOPIC_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <err.h>
+
+/**
+ * Vectorized scanning is compiled in on x86 with SSE2, AVX2 is used when CPU
+ * supports it.
+ */
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define TOPIC_SCAN_SIMD 1
+#else
+#define TOPIC_SCAN_SIMD 0
+#endif
+
+/**
+ * Result of single pass over topic name or topic filter: positions of level
+ * separators and counts of special characters. Separator array is reused by
+ * following scans.
+ */
+typedef struct {
+	uint32_t *separators; // offsets of `/` characters, ascending
+	size_t separator_count;
+	size_t capacity; // allocated entries of separators
+	uint32_t wildcard_count; // number of `+` and `#` characters
+	uint32_t dollar_count; // number of `$` characters
+} topic_scan_t;
+
+void
+topic_scan_init(topic_scan_t *scan);
+
+void
+topic_scan_free(topic_scan_t *scan);
+
+/**
+ * Scans topic in one pass: validates it is well-formed UTF-8 without null
+ * character (as MQTT requires for all strings), finds wildcard characters
+ * and offsets of topic levels. Uses the widest vector instructions CPU
+ * supports.
+ *
+ * \param topic Topic, not null-terminated.
+ * \param topic_len Length of topic in bytes.
+ * \param scan Filled with scan results.
+ *
+ * \returns 0 on success, -1 if topic is not valid UTF-8 or contains null
+ * 			character.
+ */
+int
+topic_scan(const char *topic, size_t topic_len, topic_scan_t *scan);
+
+/**
+ * The same as `topic_scan`, without vector instructions.
+ */
+int
+topic_scan_scalar(const char *topic, size_t topic_len, topic_scan_t *scan);
+
+#if TOPIC_SCAN_SIMD
+int
+topic_scan_sse2(const char *topic, size_t topic_len, topic_scan_t *scan);
+
+int
+topic_scan_avx2(const char *topic, size_t topic_len, topic_scan_t *scan);
+#endif
+
+/**
+ * \returns Number of topic levels of scanned topic.
+ */
+size_t
+topic_scan_level_count(const topic_scan_t *scan);
+
+/**
+ * Finds topic level of scanned topic.
+ *
+ * \param index Index of the level.
+ * \param level_len Set to length of the level.
+ *
+ * \returns Offset of the level in topic.
+ */
+size_t
+topic_scan_level(
+	const topic_scan_t *scan, size_t topic_len, size_t index,
+	size_t *level_len
+);
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef FEMTO_MQTT_URING_H
+#define FEMTO_MQTT_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * io_uring backend is compiled in, when kernel headers are recent enough
+ * (multishot receive, Linux 6.0) and it was not disabled by `make URING=0`.
+ */
+#if !defined(FEMTO_MQTT_NO_URING) && defined(IORING_RECV_MULTISHOT)
+#define URING_SUPPORTED 1
+#else
+#define URING_SUPPORTED 0
+#endif
+
+/**
+ * Number of submission queue entries (completion queue has twice as many).
+ */
+#define URING_ENTRIES 1024
+
+/**
+ * Number of receive buffers provided to the kernel, power of two.
+ */
+#define URING_BUFFER_COUNT 256
+
+/**
+ * Size of one receive buffer.
+ */
+#define URING_BUFFER_SIZE 4096
+
+/**
+ * Buffer group id of receive buffers.
+ */
+#define URING_BUFFER_GROUP 0
+
+typedef struct io_uring_cqe cqe_t;
+
+/**
+ * io_uring instance, with submission and completion rings mapped from kernel
+ * and ring of receive buffers provided to kernel. Completion-based
+ * alternative of reactor.
+ *
+ * Submission queue entries are only queued by `uring_get_sqe`, they are
+ * submitted together by `uring_wait`, with one system call.
+ */
+typedef struct {
+	int ring_fd;
+
+	void *sq_ring; // mapped submission queue ring
+	size_t sq_ring_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail; // tail including entries not published yet
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring; // mapped completion queue ring
+	size_t cq_ring_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	cqe_t *cqes;
+
+	struct io_uring_buf_ring *buf_ring; // receive buffers provided to kernel
+	size_t buf_ring_size;
+	unsigned buf_tail;
+	char *buffers; // memory of receive buffers
+} uring_t;
+
+/**
+ * Sets up io_uring instance and registers receive buffers.
+ *
+ * \returns 0 on success, -1 if io_uring or some of the needed features are not
+ * 			supported (errno is set).
+ */
+int
+uring_init(uring_t *uring);
+
+void
+uring_free(uring_t *uring);
+
+/**
+ * Submits queued entries and waits for at least one completion.
+ *
+ * \param timeout Timeout in milliseconds.
+ *
+ * \returns 0, also on timeout or when interrupted by signal.
+ */
+int
+uring_wait(uring_t *uring, int timeout);
+
+/**
+ * \returns Next completion or NULL, when completion queue is empty. Call
+ * 			`uring_cqe_seen` once the completion is handled.
+ */
+cqe_t *
+uring_peek_cqe(uring_t *uring);
+
+void
+uring_cqe_seen(uring_t *uring);
+
+/**
+ * \returns Non-zero, if multishot request will post more completions.
+ */
+int
+uring_cqe_more(cqe_t *cqe);
+
+/**
+ * Returns receive buffer of completion of multishot receive.
+ *
+ * \param id Set to id of the buffer, the buffer has to be returned by
+ * 			 `uring_buffer_return` afterwards.
+ *
+ * \returns Buffer with received data, NULL if completion carries no buffer.
+ */
+char *
+uring_cqe_buffer(uring_t *uring, cqe_t *cqe, unsigned *id);
+
+void
+uring_buffer_return(uring_t *uring, unsigned id);
+
+/**
+ * Queues multishot accept, one completion is posted for every accepted
+ * connection (res is the new non-blocking fd).
+ */
+void
+uring_accept_multishot(uring_t *uring, int fd, uint64_t user_data);
+
+/**
+ * Queues multishot receive into provided buffers.
+ */
+void
+uring_recv_multishot(uring_t *uring, int fd, uint64_t user_data);
+
+/**
+ * Queues multishot poll for readability.
+ */
+void
+uring_poll_multishot(uring_t *uring, int fd, uint64_t user_data);
+
+/**
+ * Queues cancellation of request with given user data, multishot request
+ * posts its last completion afterwards.
+ *
+ * \param user_data User data of completion of the cancellation itself.
+ */
+void
+uring_cancel(uring_t *uring, uint64_t target, uint64_t user_data);
+
+/**
+ * Queues writev. Iovecs have to stay valid until the request is submitted.
+ *
+ * \param link If non-zero, next queued request starts only after this one
+ * 			   completes successfully, otherwise it fails with -ECANCELED.
+ */
+void
+uring_writev(
+	uring_t *uring, int fd, struct iovec *iov, int iov_count,
+	uint64_t user_data, int link
+);
+
+#endif
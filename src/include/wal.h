@@ -0,0 +1,218 @@
+#ifndef FEMTO_MQTT_WAL_H
+#define FEMTO_MQTT_WAL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <sys/types.h>
+#include "out_queue.h"
+
+struct connection;
+
+/**
+ * Segment is sealed and a new one is started once it grows over this size.
+ */
+#define WAL_SEGMENT_SIZE (16 * 1024 * 1024)
+
+/**
+ * Initial capacity of buffer of records appended since last commit, it grows
+ * by doubling.
+ */
+#define WAL_INITIAL_BUFFER (64 * 1024)
+
+/**
+ * Active segment with all messages acknowledged is truncated at most once per
+ * this many milliseconds.
+ */
+#define WAL_TRUNCATE_INTERVAL 100
+
+/**
+ * Commit latency histogram has power of two buckets of microseconds.
+ */
+#define WAL_LATENCY_BUCKETS 32
+
+/**
+ * Header of record in segment file, encoded PUBLISH frame follows it. Records
+ * are aligned to 8 bytes.
+ */
+typedef struct {
+	uint32_t size; // size of the frame, 0 marks end
+	uint32_t checksum; // FNV-1a of QoS and the frame
+	uint8_t qos; // QoS of the message
+	uint8_t reserved[7];
+} wal_record_t;
+
+/**
+ * Segment file of write-ahead log. Segment is deleted once all its messages
+ * were acknowledged by all subscribers, i.e. their frames were freed.
+ */
+struct wal_segment {
+	struct wal_segment *next; // next sealed segment
+	uint64_t seq; // sequence number in file name
+	int fd;
+	size_t size; // bytes written to the file
+	/* frames of the segment not freed yet, decremented by any thread */
+	size_t live;
+};
+
+typedef struct wal_segment wal_segment_t;
+
+/**
+ * Acknowledgement of logged PUBLISH, sent once the log is synced.
+ */
+typedef struct {
+	struct connection *conn;
+	frame_t *frame;
+} wal_ack_t;
+
+/**
+ * Counters of write-ahead log, logged when broker exits.
+ */
+typedef struct {
+	uint64_t commits; // batches synced
+	uint64_t records; // messages logged
+	uint64_t bytes; // bytes written
+	uint64_t acks; // acknowledgements deferred
+	uint64_t max_batch; // most messages synced by one commit
+	uint64_t latency_sum; // us spent by writes and syncs
+	uint64_t latency_max; // us of slowest commit
+	uint64_t latency[WAL_LATENCY_BUCKETS]; // commits by log2 of latency (us)
+	uint64_t segments_removed; // segments deleted or truncated
+} wal_stats_t;
+
+/**
+ * Write-ahead log of messages with QoS above 0 accepted by one worker.
+ *
+ * Messages are appended to in-memory buffer as they are received. Their
+ * PUBACK or PUBREC waits in the log too. All messages of a batch are written
+ * and synced with one `fdatasync` (group commit), then their acknowledgements
+ * are sent. Batch is committed at the end of event loop iteration, or once
+ * commit window passes since its first message.
+ *
+ * Messages are delivered to subscribers right away. Logged frame points to
+ * its segment, segment counts frames still referenced by outgoing queues,
+ * inflight windows and sessions. Segment is deleted when its count drops to
+ * zero.
+ */
+struct wal {
+	char *dir; // directory of segments, NULL if log is disabled
+	int dir_fd;
+	int id; // worker ID, part of segment file names
+	uint32_t window; // commit window (us), 0 commits every loop iteration
+
+	wal_segment_t *active; // segment records are appended to
+	wal_segment_t *sealed; // full segments with unacknowledged messages
+	uint64_t next_seq;
+
+	char *buffer; // records appended since last commit
+	size_t buffer_size;
+	size_t buffer_capacity;
+	size_t batch_records; // messages in buffer
+	uint64_t batch_started; // monotonic time (us) of first record or ack
+
+	wal_ack_t *acks; // acknowledgements waiting for commit
+	size_t ack_count;
+	size_t ack_capacity;
+
+	uint64_t last_truncate; // monotonic time (ms) of last truncation check
+	wal_stats_t stats;
+};
+
+typedef struct wal wal_t;
+
+/**
+ * Callback receiving message replayed from segments left by previous run.
+ * Frame is logged again before the call, callee takes its own references.
+ */
+typedef void (*wal_replay_t)(void *arg, frame_t *frame);
+
+/**
+ * Initializes disabled log.
+ */
+void
+wal_init(wal_t *wal);
+
+/**
+ * Creates directory if it does not exist and starts new segment in it.
+ *
+ * \param id Worker ID, segments of workers are distinct files.
+ * \param window Commit window in microseconds.
+ *
+ * \returns 0 on success, -1 on error (errno is set).
+ */
+int
+wal_open(wal_t *wal, const char *dir, int id, uint32_t window);
+
+/**
+ * Replays messages from all other segments in the directory (left by
+ * previous run of the broker). Messages are logged again and synced, then
+ * the old segments are deleted. Has to be called before other workers open
+ * their logs.
+ *
+ * \returns Number of replayed messages, -1 on error (errno is set).
+ */
+ssize_t
+wal_recover(wal_t *wal, wal_replay_t replay, void *arg);
+
+/**
+ * Appends message to current batch and points its frame to active segment.
+ */
+void
+wal_append(wal_t *wal, frame_t *frame);
+
+/**
+ * Adds acknowledgement to current batch, it is sent after commit. Log takes
+ * over caller's reference to the frame.
+ */
+void
+wal_defer_ack(wal_t *wal, struct connection *conn, frame_t *frame);
+
+/**
+ * \returns Non-zero if batch is not empty and its commit window passed.
+ */
+int
+wal_commit_due(wal_t *wal);
+
+/**
+ * \returns Milliseconds until commit window of current batch passes, at most
+ * 			`max_wait`.
+ */
+int
+wal_wait_time(wal_t *wal, int max_wait);
+
+/**
+ * Writes and syncs current batch. Acknowledgements stay in `acks` for caller
+ * to send, `ack_count` has to be reset. Full segment is sealed.
+ *
+ * \returns 0 on success, -1 on write or sync error (errno is set).
+ */
+int
+wal_commit(wal_t *wal);
+
+/**
+ * Deletes sealed segments and truncates active one, when all their messages
+ * were acknowledged.
+ *
+ * \param now Monotonic time in milliseconds.
+ */
+void
+wal_truncate(wal_t *wal, uint64_t now);
+
+/**
+ * Releases segment reference of freed frame, may be called by any thread.
+ */
+void
+wal_segment_release(wal_segment_t *segment);
+
+void
+wal_log_stats(wal_t *wal);
+
+/**
+ * Closes the log and deletes segments of acknowledged messages. Frames of
+ * the log must not be referenced anymore.
+ */
+void
+wal_free(wal_t *wal);
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef FEMTO_MQTT_WORKER_H
+#define FEMTO_MQTT_WORKER_H
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include "structs.h"
+#include "reactor.h"
+#include "uring.h"
+#include "session_store.h"
+#include "wal.h"
+
+/**
+ * Published message or connection handed over to another worker thread.
+ */
+struct mail {
+	struct mail *next;
+	int fd; // socket of connection handed over, -1 for published message
+	/* encoded PUBLISH control packet, shared between threads, or bytes
+	 * received from connection handed over (starting with its CONNECT) */
+	frame_t *frame;
+	char *topic; // view into frame, not null-terminated
+	uint16_t topic_size;
+	uint8_t retain; // message replaces retained message of the topic
+	frame_t *retained; // frame with RETAIN flag, NULL removes retained one
+};
+
+typedef struct mail mail_t;
+
+/**
+ * Lock-free multi-producer single-consumer queue of mails. Producers push
+ * mails onto head of the stack with compare-and-swap, consumer takes all mails
+ * at once and restores their FIFO order.
+ */
+struct mailbox {
+	mail_t *head;
+};
+
+typedef struct mailbox mailbox_t;
+
+/**
+ * Event loop thread. Every worker has its own listening socket (bound with
+ * SO_REUSEPORT to the same port), reactor, connections and subscription tree.
+ * Published messages are delivered to other workers through their mailboxes.
+ */
+struct worker {
+	int id;
+	pthread_t thread;
+	int listening_fd;
+	int accept_budget; // connections accepted per event loop iteration
+	int accept_pending; // connections may wait in accept queue
+	int wake_fd; // eventfd, signalled when mails are posted to mailbox
+	int use_uring; // io_uring backend is used instead of reactor
+	reactor_t reactor;
+	uring_t uring;
+	conns_t conns;
+	mailbox_t mailbox;
+	struct worker *workers; // array of all workers
+	int worker_count;
+	session_store_t *sessions; // persistent sessions of all workers
+	wal_t wal; // write-ahead log of messages received by the worker
+};
+
+typedef struct worker worker_t;
+
+/**
+ * Initializes worker, its reactor and connections. Listening socket and
+ * wake eventfd are registered in reactor.
+ *
+ * \param workers Array of all workers, `worker` is one of them.
+ */
+void
+worker_init(
+	worker_t *worker, int id, worker_t *workers, int worker_count,
+	int listening_fd, int use_uring
+);
+
+/**
+ * Frees worker resources and mails left in its mailbox. Connections have to
+ * be cleared already.
+ */
+void
+worker_free(worker_t *worker);
+
+/**
+ * Wakes worker from waiting in reactor.
+ */
+void
+worker_wake(worker_t *worker);
+
+/**
+ * Posts published message to mailboxes of all other workers. Frame is marked
+ * as shared and every mail holds its own reference.
+ *
+ * \param topic Published topic, view into frame.
+ * \param retain Non-zero if retained message of the topic is replaced.
+ * \param retained Frame with RETAIN flag to be retained, NULL removes
+ * 				   retained message of the topic.
+ */
+void
+forward_published_frame(
+	worker_t *worker, frame_t *frame, char *topic, uint16_t topic_size,
+	int retain, frame_t *retained
+);
+
+/**
+ * Delivers all mails from worker's mailbox to local subscribers and adopts
+ * connections handed over to the worker.
+ */
+void
+process_mailbox(worker_t *worker);
+
+/**
+ * Hands connection over to worker owning session of its client, once its
+ * receive request is cancelled. Bytes received from the connection are sent
+ * along with its socket, connection is cleared without closing the socket.
+ */
+void
+hand_over_connection(worker_t *worker, conn_t *conn);
+
+/**
+ * Adds connection handed over by another worker and processes bytes received
+ * from it (implemented by event loop).
+ *
+ * \param received Bytes received from the connection, starting with CONNECT.
+ */
+void
+adopt_connection(worker_t *worker, int fd, frame_t *received);
+
+/**
+ * Delivers message replayed from write-ahead log to subscribers of all
+ * workers. Called by `wal_recover`, before worker threads are started.
+ *
+ * \param arg Array of all workers.
+ */
+void
+replay_logged_message(void *arg, frame_t *frame);
+
+/**
+ * Takes snapshot of worker statistics once per statistics interval. First
+ * worker then publishes sums of snapshots of all workers as retained
+ * `$SYS/broker/...` messages, snapshots of other workers are at most one
+ * interval old.
+ */
+void
+publish_broker_stats(worker_t *worker);
+
+#endif
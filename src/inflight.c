@@ -0,0 +1,179 @@
+#include "inflight.h"
+
+void
+inflight_init(inflight_t *inflight) {
+	inflight->slots = NULL;
+	inflight->used = 0;
+	inflight->generation = 0;
+	inflight->pending = NULL;
+	inflight->pending_capacity = 0;
+	inflight->pending_head = 0;
+	inflight->pending_count = 0;
+}
+
+void
+inflight_free(inflight_t *inflight) {
+	for (uint32_t used = inflight->used; used; used &= used - 1) {
+		inflight_msg_t *msg = &inflight->slots[__builtin_ctz(used)];
+		if (msg->payload)
+			frame_release(msg->payload);
+	}
+
+	for (size_t i = 0; i < inflight->pending_count; i++) {
+		size_t index = (inflight->pending_head + i)
+			& (inflight->pending_capacity - 1);
+		frame_release(inflight->pending[index].payload);
+	}
+
+	buffer_free(inflight->slots);
+	buffer_free(inflight->pending);
+	inflight_init(inflight);
+}
+
+inflight_msg_t *
+inflight_add(inflight_t *inflight, frame_t *payload, uint8_t qos) {
+	uint32_t free_slots = ~inflight->used
+		& (uint32_t) ((1ULL << INFLIGHT_WINDOW) - 1);
+
+	if (!free_slots)
+		return NULL;
+
+	if (!inflight->slots)
+		inflight->slots = buffer_alloc(INFLIGHT_WINDOW * sizeof(inflight_msg_t));
+
+	int slot = __builtin_ctz(free_slots);
+	inflight->used |= 1U << slot;
+
+	inflight_msg_t *msg = &inflight->slots[slot];
+	msg->payload = payload;
+	msg->qos = qos;
+	msg->released = 0;
+	msg->packet_id = inflight->generation * INFLIGHT_WINDOW + slot + 1;
+	inflight->generation = (inflight->generation + 1) % INFLIGHT_GENERATIONS;
+
+	return msg;
+}
+
+int
+inflight_restore(
+	inflight_t *inflight, frame_t *payload, uint8_t qos, uint16_t packet_id,
+	int released
+) {
+	int slot = (packet_id - 1) % INFLIGHT_WINDOW;
+	if (packet_id == 0 || (inflight->used & (1U << slot)))
+		return -1;
+
+	if (!inflight->slots)
+		inflight->slots = buffer_alloc(INFLIGHT_WINDOW * sizeof(inflight_msg_t));
+
+	inflight->used |= 1U << slot;
+	inflight_msg_t *msg = &inflight->slots[slot];
+	msg->payload = payload;
+	msg->qos = qos;
+	msg->released = released;
+	msg->packet_id = packet_id;
+
+	// next IDs are allocated after restored ones
+	uint16_t generation = (packet_id - 1) / INFLIGHT_WINDOW + 1;
+	if (generation > inflight->generation)
+		inflight->generation = generation % INFLIGHT_GENERATIONS;
+	return 0;
+}
+
+inflight_msg_t *
+inflight_find(inflight_t *inflight, uint16_t packet_id) {
+	if (packet_id == 0)
+		return NULL;
+
+	int slot = (packet_id - 1) % INFLIGHT_WINDOW;
+	if (!(inflight->used & (1U << slot)))
+		return NULL;
+
+	inflight_msg_t *msg = &inflight->slots[slot];
+	return msg->packet_id == packet_id ? msg : NULL;
+}
+
+void
+inflight_remove(inflight_t *inflight, inflight_msg_t *msg) {
+	int slot = msg - inflight->slots;
+
+	if (msg->payload)
+		frame_release(msg->payload);
+	msg->payload = NULL;
+	inflight->used &= ~(1U << slot);
+}
+
+void
+inflight_release(inflight_t *inflight, inflight_msg_t *msg) {
+	(void) inflight;
+
+	if (msg->payload)
+		frame_release(msg->payload);
+	msg->payload = NULL;
+	msg->released = 1;
+}
+
+int
+inflight_count(inflight_t *inflight) {
+	return __builtin_popcount(inflight->used);
+}
+
+/**
+ * Doubles capacity of waiting messages ring buffer, messages are moved so
+ * that head is at index zero.
+ */
+static void
+inflight_expand_pending(inflight_t *inflight) {
+	size_t capacity = inflight->pending_capacity
+		? inflight->pending_capacity * 2
+		: 4;
+
+	inflight_msg_t *pending = buffer_alloc(capacity * sizeof(inflight_msg_t));
+	for (size_t i = 0; i < inflight->pending_count; i++) {
+		pending[i] = inflight->pending[
+			(inflight->pending_head + i) & (inflight->pending_capacity - 1)
+		];
+	}
+
+	buffer_free(inflight->pending);
+	inflight->pending = pending;
+	inflight->pending_capacity = capacity;
+	inflight->pending_head = 0;
+}
+
+int
+inflight_push_pending(inflight_t *inflight, frame_t *payload, uint8_t qos) {
+	if (inflight->pending_count == inflight->pending_capacity) {
+		if (inflight->pending_capacity >= INFLIGHT_PENDING_MAX)
+			return -1;
+		inflight_expand_pending(inflight);
+	}
+
+	size_t tail = (inflight->pending_head + inflight->pending_count)
+		& (inflight->pending_capacity - 1);
+	inflight->pending[tail].payload = payload;
+	inflight->pending[tail].packet_id = 0;
+	inflight->pending[tail].qos = qos;
+	inflight->pending[tail].released = 0;
+	inflight->pending_count++;
+	return 0;
+}
+
+void
+inflight_fill(inflight_t *inflight, uint32_t *moved) {
+	*moved = 0;
+
+	while (inflight->pending_count > 0) {
+		inflight_msg_t *waiting = &inflight->pending[inflight->pending_head];
+		inflight_msg_t *msg = inflight_add(
+			inflight, waiting->payload, waiting->qos
+		);
+		if (!msg)
+			return;
+
+		*moved |= 1U << (msg - inflight->slots);
+		inflight->pending_head = (inflight->pending_head + 1)
+			& (inflight->pending_capacity - 1);
+		inflight->pending_count--;
+	}
+}
@@ -0,0 +1,167 @@
+#include "intern_table.h"
+#include "pool.h"
+
+uint32_t
+hash_level(const char *level, size_t level_len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < level_len; i++) {
+		hash ^= (uint8_t) level[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Links entries from `first` to the end of entries array into free list.
+ */
+static void
+intern_table_link_free(intern_table_t *table, uint32_t first) {
+	for (uint32_t id = table->capacity - 1; id >= first; id--) {
+		table->entries[id].next = table->free_list;
+		table->free_list = id;
+	}
+}
+
+void
+intern_table_init(intern_table_t *table) {
+	table->capacity = INTERN_TABLE_INITIAL_SIZE;
+	table->count = 0;
+	table->free_list = INTERN_NONE;
+	table->entries = calloc(table->capacity, sizeof(intern_entry_t));
+	if (!table->entries)
+		err(1, "intern table init calloc entries");
+	table->buckets = calloc(table->capacity, sizeof(uint32_t));
+	if (!table->buckets)
+		err(1, "intern table init calloc buckets");
+
+	intern_table_link_free(table, 1);
+}
+
+void
+intern_table_free(intern_table_t *table) {
+	for (uint32_t id = 1; id < table->capacity; id++) {
+		buffer_free(table->entries[id].level);
+	}
+	free(table->entries);
+	free(table->buckets);
+	table->entries = NULL;
+	table->buckets = NULL;
+	table->capacity = 0;
+	table->count = 0;
+	table->free_list = INTERN_NONE;
+}
+
+/**
+ * Doubles number of entries and buckets, interned levels are rehashed, their
+ * IDs stay the same.
+ */
+static void
+intern_table_expand(intern_table_t *table) {
+	uint32_t old_capacity = table->capacity;
+	uint32_t capacity = old_capacity * 2;
+
+	intern_entry_t *entries = realloc(
+		table->entries, capacity * sizeof(intern_entry_t)
+	);
+	if (!entries)
+		err(1, "intern table expand realloc entries");
+	memset(
+		entries + old_capacity, 0,
+		(capacity - old_capacity) * sizeof(intern_entry_t)
+	);
+
+	uint32_t *buckets = calloc(capacity, sizeof(uint32_t));
+	if (!buckets)
+		err(1, "intern table expand calloc buckets");
+
+	// all old entries are in use, table expands only when free list is empty
+	for (uint32_t id = 1; id < old_capacity; id++) {
+		uint32_t index = entries[id].hash & (capacity - 1);
+		entries[id].next = buckets[index];
+		buckets[index] = id;
+	}
+
+	free(table->buckets);
+	table->entries = entries;
+	table->buckets = buckets;
+	table->capacity = capacity;
+	intern_table_link_free(table, old_capacity);
+}
+
+uint32_t
+intern_find(
+	intern_table_t *table, const char *level, size_t level_len, uint32_t hash
+) {
+	for (
+		uint32_t id = table->buckets[hash & (table->capacity - 1)];
+		id != INTERN_NONE;
+		id = table->entries[id].next
+	) {
+		intern_entry_t *entry = &table->entries[id];
+		if (
+			entry->hash == hash &&
+			entry->level_len == level_len &&
+			memcmp(entry->level, level, level_len) == 0
+		) {
+			return id;
+		}
+	}
+
+	return INTERN_NONE;
+}
+
+uint32_t
+intern_acquire(intern_table_t *table, const char *level, size_t level_len) {
+	uint32_t hash = hash_level(level, level_len);
+	uint32_t id = intern_find(table, level, level_len, hash);
+
+	if (id != INTERN_NONE) {
+		table->entries[id].refcount++;
+		return id;
+	}
+
+	if (table->free_list == INTERN_NONE)
+		intern_table_expand(table);
+
+	id = table->free_list;
+	intern_entry_t *entry = &table->entries[id];
+	table->free_list = entry->next;
+
+	entry->level = buffer_alloc(level_len + 1);
+	memcpy(entry->level, level, level_len);
+	entry->level[level_len] = '\0';
+	entry->level_len = level_len;
+	entry->hash = hash;
+	entry->refcount = 1;
+
+	uint32_t index = hash & (table->capacity - 1);
+	entry->next = table->buckets[index];
+	table->buckets[index] = id;
+	table->count++;
+
+	return id;
+}
+
+void
+intern_release(intern_table_t *table, uint32_t id) {
+	intern_entry_t *entry = &table->entries[id];
+
+	if (--entry->refcount > 0)
+		return;
+
+	uint32_t *link = &table->buckets[entry->hash & (table->capacity - 1)];
+	while (*link != id)
+		link = &table->entries[*link].next;
+	*link = entry->next;
+
+	buffer_free(entry->level);
+	entry->level = NULL;
+	entry->next = table->free_list;
+	table->free_list = id;
+	table->count--;
+}
+
+const char *
+intern_level(intern_table_t *table, uint32_t id) {
+	return table->entries[id].level;
+}
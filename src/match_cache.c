@@ -0,0 +1,212 @@
+#include "match_cache.h"
+#include "pool.h"
+#include "log.h"
+
+void
+match_cache_init(match_cache_t *cache, size_t capacity) {
+	memset(cache, 0, sizeof(match_cache_t));
+	cache->capacity = capacity;
+}
+
+void
+match_cache_free(match_cache_t *cache) {
+	for (size_t i = 1; i <= cache->count; i++) {
+		buffer_free(cache->entries[i].topic);
+		buffer_free(cache->entries[i].matches);
+	}
+	free(cache->entries);
+	free(cache->buckets);
+	match_cache_init(cache, cache->capacity);
+}
+
+/**
+ * Allocates entries and buckets, one bucket per entry rounded up to power of
+ * two.
+ */
+static void
+match_cache_alloc(match_cache_t *cache) {
+	cache->entries = calloc(cache->capacity + 1, sizeof(match_cache_entry_t));
+	if (!cache->entries)
+		err(1, "match cache alloc calloc entries");
+
+	cache->bucket_count = 1;
+	while (cache->bucket_count < cache->capacity) {
+		cache->bucket_count *= 2;
+	}
+	cache->buckets = calloc(cache->bucket_count, sizeof(uint32_t));
+	if (!cache->buckets)
+		err(1, "match cache alloc calloc buckets");
+}
+
+static void
+match_cache_lru_unlink(match_cache_t *cache, uint32_t index) {
+	match_cache_entry_t *entry = &cache->entries[index];
+
+	if (entry->lru_prev != MATCH_CACHE_NONE)
+		cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if (entry->lru_next != MATCH_CACHE_NONE)
+		cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void
+match_cache_lru_push(match_cache_t *cache, uint32_t index) {
+	match_cache_entry_t *entry = &cache->entries[index];
+
+	entry->lru_prev = MATCH_CACHE_NONE;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head != MATCH_CACHE_NONE)
+		cache->entries[cache->lru_head].lru_prev = index;
+	else
+		cache->lru_tail = index;
+	cache->lru_head = index;
+}
+
+/**
+ * \returns Index of entry of the topic, MATCH_CACHE_NONE if not cached.
+ */
+static uint32_t
+match_cache_find(
+	match_cache_t *cache, const char *topic, size_t topic_len, uint32_t hash
+) {
+	for (
+		uint32_t index = cache->buckets[hash & (cache->bucket_count - 1)];
+		index != MATCH_CACHE_NONE;
+		index = cache->entries[index].next
+	) {
+		match_cache_entry_t *entry = &cache->entries[index];
+		if (
+			entry->hash == hash &&
+			entry->topic_len == topic_len &&
+			memcmp(entry->topic, topic, topic_len) == 0
+		) {
+			return index;
+		}
+	}
+
+	return MATCH_CACHE_NONE;
+}
+
+/**
+ * Removes least recently used entry from hash table and LRU list.
+ *
+ * \returns Index of the entry, to be reused.
+ */
+static uint32_t
+match_cache_evict(match_cache_t *cache) {
+	uint32_t index = cache->lru_tail;
+	match_cache_entry_t *entry = &cache->entries[index];
+
+	match_cache_lru_unlink(cache, index);
+
+	uint32_t *link = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+	while (*link != index)
+		link = &cache->entries[*link].next;
+	*link = entry->next;
+
+	buffer_free(entry->topic);
+	buffer_free(entry->matches);
+	entry->topic = NULL;
+	entry->matches = NULL;
+
+	cache->stats.evictions++;
+	return index;
+}
+
+match_cache_entry_t *
+match_cache_lookup(
+	match_cache_t *cache, const char *topic, size_t topic_len, uint32_t hash,
+	uint64_t epoch
+) {
+	if (!cache->entries) {
+		cache->stats.misses++;
+		return NULL;
+	}
+
+	uint32_t index = match_cache_find(cache, topic, topic_len, hash);
+	if (index == MATCH_CACHE_NONE) {
+		cache->stats.misses++;
+		return NULL;
+	}
+
+	match_cache_entry_t *entry = &cache->entries[index];
+	if (entry->epoch != epoch) {
+		cache->stats.stale++;
+		cache->stats.misses++;
+		return NULL;
+	}
+
+	if (cache->lru_head != index) {
+		match_cache_lru_unlink(cache, index);
+		match_cache_lru_push(cache, index);
+	}
+
+	cache->stats.hits++;
+	return entry;
+}
+
+match_cache_entry_t *
+match_cache_store(
+	match_cache_t *cache, const char *topic, size_t topic_len, uint32_t hash,
+	uint64_t epoch, struct topic **matches, size_t match_count
+) {
+	if (!cache->entries)
+		match_cache_alloc(cache);
+
+	match_cache_entry_t *entry;
+	uint32_t index = match_cache_find(cache, topic, topic_len, hash);
+
+	if (index != MATCH_CACHE_NONE) {
+		// stale entry is refreshed
+		entry = &cache->entries[index];
+		buffer_free(entry->matches);
+		match_cache_lru_unlink(cache, index);
+	}
+	else {
+		if (cache->count < cache->capacity)
+			index = ++cache->count;
+		else
+			index = match_cache_evict(cache);
+
+		entry = &cache->entries[index];
+		entry->topic = buffer_alloc(topic_len);
+		memcpy(entry->topic, topic, topic_len);
+		entry->topic_len = topic_len;
+		entry->hash = hash;
+
+		uint32_t *bucket = &cache->buckets[hash & (cache->bucket_count - 1)];
+		entry->next = *bucket;
+		*bucket = index;
+	}
+
+	entry->epoch = epoch;
+	entry->match_count = match_count;
+	entry->matches = NULL;
+	if (match_count > 0) {
+		entry->matches = buffer_alloc(match_count * sizeof(struct topic *));
+		memcpy(entry->matches, matches, match_count * sizeof(struct topic *));
+	}
+
+	match_cache_lru_push(cache, index);
+	return entry;
+}
+
+void
+match_cache_log_stats(match_cache_t *cache) {
+	uint64_t lookups = cache->stats.hits + cache->stats.misses;
+
+	if (lookups == 0)
+		return;
+
+	log_info(
+		"Match cache: %llu lookups, %.1f %% hits, %llu stale, %llu evictions.",
+		(unsigned long long) lookups,
+		100.0 * cache->stats.hits / lookups,
+		(unsigned long long) cache->stats.stale,
+		(unsigned long long) cache->stats.evictions
+	);
+}
@@ -1,55 +1,47 @@
 #include "mqtt_connect.h"
+#include "session.h"
 
-/**
- * Parses 16-bit BE into int keep alive value.
- */
 int
-get_keep_alive(char *index) {
-	int keep_alive = *index;
-	keep_alive <<= 8;
-	keep_alive = keep_alive | *(index + 1);
+parse_connect_header(
+	conn_t *conn, char *incoming_message, connect_header_t *header
+) {
+	uint8_t *index = (uint8_t *) incoming_message;
+
+	// protocol name, level, flags, keep alive and client ID size
+	if (conn->message_size < 12) {
+		log_error("Truncated CONNECT variable header.");
+		return -1;
+	}
 
-	return keep_alive;
-}
+	header->flags = index[7];
+	header->keep_alive = index[8] << 8 | index[9];
+	header->client_id_len = index[10] << 8 | index[11];
+	header->client_id = incoming_message + 12;
 
-/**
- * Reads length (from 16-bit BE) of client ID, allocates buffer and reads it.
- * 
- * \returns Client ID in allocated buffer.
- */
-char*
-get_client_id(char *index, uint16_t* cid_len) {
-	uint8_t *index8 = (uint8_t*) index;
-	uint16_t client_id_length = *index8;
-	index8++;
-	client_id_length <<= 8;
-	client_id_length |= *index8;
-	index8++;
-	
-	char *client_id = calloc(client_id_length + 1, 1);
-	if (!client_id)
-		err(1, "get client_id calloc client_id");
-	memcpy(client_id, index8, client_id_length);
+	if (header->client_id_len > conn->message_size - 12) {
+		log_error("Client ID exceeds CONNECT packet.");
+		return -1;
+	}
 
-	*cid_len = client_id_length;
-	return client_id;
+	return 0;
 }
 
 /**
- * \returns Allocated buffer with CONNACK message in bytes form.
+ * \param session_present Existing session of the client was resumed.
+ *
+ * \returns Allocated frame with CONNACK message in bytes form.
  */
-char *
-create_connack_message(uint8_t return_code) {
-	char *buffer = calloc(4, sizeof(char));
-	if (!buffer)
-		err(1, "create connack calloc buffer");
+frame_t *
+create_connack_message(uint8_t return_code, uint8_t session_present) {
+	frame_t *frame = frame_create(4);
+	char *buffer = frame->data;
 
 	buffer[0] = 0x02 << 4; // control packet type
 	buffer[1] = 0x02; // remaining length
-	buffer[2] = 0x00; // ack flags - session present = 0
+	buffer[2] = session_present ? 0x01 : 0x00; // ack flags
 	buffer[3] = return_code;
 
-	return buffer;
+	return frame;
 }
 
 /**
@@ -100,23 +92,41 @@ check_protocol_level(char *index) {
 		return 0;
 }
 
+struct worker *
+route_connect_message(conns_t *conns, connect_header_t *header) {
+	// empty client ID is refused by `read_connect_message`
+	if (header->client_id_len == 0)
+		return NULL;
+
+	return session_home_worker(
+		conns, header->client_id, header->client_id_len
+	);
+}
+
 /**
  * Read, parse incoming CONNECT MQTT control packet.
  * 
  * Errors: 1 - invalid protocol name. 2 - invalid protocol level.
- * 3 - invalid client name.
+ * 3 - invalid client name. 4 - reserved connect flag is set.
+ * 
+ * Client connecting without clean session gets persistent session, existing
+ * one is resumed (see `session_open`).
  * 
  * \param conns Connections linked list.
  * \param conn Connection struct of connectee.
  * \param incoming_message MQTT variable header and payload in byte form.
+ * \param header Fields parsed by `parse_connect_header`.
  * 
  * \returns Zero if success or error code.
  */
 int
-read_connect_message(conns_t *conns, conn_t *conn, char* incoming_message) {
+read_connect_message(
+	conns_t *conns, conn_t *conn, char* incoming_message,
+	connect_header_t *header
+) {
 	char *index = incoming_message;
 
-	/* variable header */
+	/* variable header, its size was checked by `parse_connect_header` */
 
 	if (!check_protocol_name(index)) {
 		log_error("Invalid protocol name in CONNECT variable header.");
@@ -128,18 +138,21 @@ read_connect_message(conns_t *conns, conn_t *conn, char* incoming_message) {
 		log_error("Invalid protocol level in CONNECT variable header.");
 		return 2;
 	}
-	index += 1;
 
-	// skip flags
-	index += 1;
+	if (header->flags & 0x01) {
+		log_error("Reserved flag set in CONNECT variable header.");
+		return 4;
+	}
 
-	conn->keep_alive = get_keep_alive(index);
-	index += 2;
+	conn->keep_alive = header->keep_alive;
 
 	/* payload */
 
-	uint16_t cid_len = 0;
-	char *client_id = get_client_id(index, &cid_len);
+	uint16_t cid_len = header->client_id_len;
+	char *client_id = calloc(cid_len + 1, 1);
+	if (!client_id)
+		err(1, "read_connect_message calloc client_id");
+	memcpy(client_id, header->client_id, cid_len);
 
 	if (strnlen(client_id, cid_len) == 0) {
 		log_warn("Found empty client ID.");
@@ -147,14 +160,22 @@ read_connect_message(conns_t *conns, conn_t *conn, char* incoming_message) {
 		return 3;
 	}
 
-	if (check_for_client_id_repeated(conns, client_id)) {
-		log_warn("Found duplicate client ID.");
-		free(client_id);
-		return 3;
+	// MQTT 3.1.1: existing client with the same client ID is disconnected
+	conn_t *previous = client_table_find(&conns->clients, client_id, cid_len);
+	if (previous && !previous->detached) {
+		log_info("Client %s took over existing session.", client_id);
+		clear_one_connection(previous, conns);
 	}
 
 	conn->client_id = client_id;
 	conn->cliend_id_length = cid_len;
+	session_open(conns, conn, header->flags & 0x02);
+
+	if (conn->keep_alive > 0) {
+		timer_add(
+			&conns->timers, &conn->keep_alive_timer, keep_alive_deadline(conn)
+		);
+	}
 
 	return 0;
 }
@@ -165,26 +186,23 @@ read_connect_message(conns_t *conns, conn_t *conn, char* incoming_message) {
  * \param failed Pointer to int to indicate, if connection should be removed or
  * 				 not.
  * 
- * \returns CONNACK MQTT control packet in bytes form.
+ * \returns CONNACK MQTT control packet frame.
  */
-char *
-create_connect_response(conn_t *conn, conns_t *conns, int code, int *failed) {
+frame_t *
+create_connect_response(conn_t *conn, int code, int *failed) {
 	if (code == 0) {
 		// CONNACK OK
-		conn->message_size = 4;
-		return create_connack_message(0x00);
+		return create_connack_message(0x00, conn->session_present);
 	}
 	else if (code == 2) {
 		// CONNACK invalid protocol version (only v3.1.1 is supported)
-		conn->message_size = 4;
 		*failed = 1;
-		return create_connack_message(0x01);
+		return create_connack_message(0x01, 0);
 	}
 	else if (code == 3) {
 		// CONNACK invalid identifier
-		conn->message_size = 4;
 		*failed = 1;
-		return create_connack_message(0x02);
+		return create_connack_message(0x02, 0);
 	}
 	else {
 		// error, just disconnect
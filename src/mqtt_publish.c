@@ -1,201 +1,673 @@
 #include "mqtt_publish.h"
+#include "session.h"
+#include "worker.h"
 
 /**
  * Read, parse incoming PUBLISH MQTT control packet.
  * 
- * \returns publish_t struct containing publish info.
+ * Neither topic nor payload is copied, publish info holds views into the
+ * incoming message. Both are binary safe, they are not null-terminated.
+ * Packet ID follows the topic only if QoS is above 0.
+ * 
+ * \param publish Filled with publish info.
+ * 
+ * \returns 0 on success, -1 if control packet is malformed.
  */
-publish_t *
-read_publish_message(conn_t *conn, char *incoming_message) {
+int
+read_publish_message(conn_t *conn, char *incoming_message, publish_t *publish) {
 	char *index = incoming_message;
-	publish_t *publish = calloc(1, sizeof(publish_t));
-	if (!publish)
-		err(1, "read publish msg calloc publish_t");
+
+	if (conn->message_size < 2)
+		return -1;
 
 	uint16_t topic_name_len = 0;
 	topic_name_len = (uint8_t)index[0] << 8;
-	topic_name_len |= index[1];
+	topic_name_len |= (uint8_t)index[1];
 
-	publish->topic = calloc(topic_name_len + 1, sizeof(char));
-	if (!publish->topic)
-		err(1, "read publish msg calloc publish->topic");
-	strncpy(publish->topic, index + 2, topic_name_len);
+	if (topic_name_len > conn->message_size - 2)
+		return -1;
 
-	uint32_t msg_len = conn->message_size - 2 - topic_name_len;
-	publish->message = calloc(msg_len + 1, sizeof(char));
-	if (!publish->message)
-		err(1, "read publish msg calloc publish->message");
-	strncpy(publish->message, index + 2 + topic_name_len, msg_len);
-
-	publish->message_size = msg_len;
+	publish->topic = index + 2;
 	publish->topic_size = topic_name_len;
+	publish->levels = NULL;
+	publish->retain = conn->flags & 0x01;
+	publish->qos = (conn->flags >> 1) & 0x03;
+	publish->packet_id = 0;
+	index += 2 + topic_name_len;
 
-	return publish;
-}
-
-/**
- * Tries to match topic that arrived in PUBLISH MQTT control packet with
- * topic struct.
- * 
- * As topic is tokenized in token struct, published topic is tokenized as well
- * (for /) and tokens are token by token compared.
- * 
- * Special tokens like #, + and $ are supported.
- * 
- * \param topic_subbed Topic struct with already tokenized topic.
- * \param topic_published Second topic in its string form, not yet tokenized.
- * 
- * \return 1 if matches, 0 otherwise
- */
-int
-topic_match(topic_t *topic_subbed, char *topic_published) {
-	if (
-		topic_published[0] == '$' && 
-		(
-			strncmp(topic_subbed->tokenized_topic[0], "#", 1) == 0 ||
-			strncmp(topic_subbed->tokenized_topic[0], "+", 1) == 0
-		)
-	) {
-		return 0;
-	}
+	size_t header_size = 2 + topic_name_len;
+	if (publish->qos > 0) {
+		if (conn->message_size - header_size < 2)
+			return -1;
 
-	int count = 0;
-	size_t token_length = 0;
-	for (
-		char *token = strtok(topic_published, "/");
-		token != NULL;
-		token = strtok(NULL, "/"), count++
-	) {
-		token_length = strlen(token);
-		if (count >= topic_subbed->topic_token_count)
-			return 0;
-		if (strncmp(topic_subbed->tokenized_topic[count], "+", 1) == 0)
-			continue;
-		else if (strncmp(
-			topic_subbed->tokenized_topic[count], token, token_length
-		) == 0) {
-			continue;
-		}
-		else if (strncmp(topic_subbed->tokenized_topic[count], "#", 1) == 0)
-			return 1;
-		else
-			return 0;
-	}
+		publish->packet_id = (uint8_t) index[0] << 8;
+		publish->packet_id |= (uint8_t) index[1];
+		if (publish->packet_id == 0)
+			return -1;
 
-	if (
-		(count == topic_subbed->topic_token_count - 1) &&
-		strncmp(topic_subbed->tokenized_topic[count], "#", 1) == 0
-	) {
-		return 1;
+		index += 2;
+		header_size += 2;
 	}
 
-	if (count != topic_subbed->topic_token_count) {
-		return 0;
-	}
+	// payload is copied only once, straight into outgoing frame
+	publish->message = index;
+	publish->message_size = conn->message_size - header_size;
 
-	return 1;
+	return 0;
 }
 
 /**
  * Creates PUBLISH MQTT control packet from publish_t struct.
  * 
- * Writes fixed header, variable header and payload. Result is saved in
- * connection struct and ready to be sent. (State is changed to 1.)
+ * Writes fixed header, variable header and payload. Frame is always encoded
+ * with QoS 0, as it is sent to QoS 0 subscribers, QoS of publish is kept in
+ * the frame for the others.
+ * 
+ * \returns PUBLISH MQTT control packet frame.
  */
-void
-create_publish_message(conn_t *conn, publish_t *publish) {
-	size_t rem_len_len_checked = 0;
-	char *rem_len = from_uint_to_val_len(
-		2 + publish->topic_size + publish->message_size, &rem_len_len_checked
+frame_t *
+create_publish_message(publish_t *publish) {
+	char rem_len[4];
+	size_t rem_len_len = from_uint_to_val_len(
+		2 + publish->topic_size + publish->message_size, rem_len
 	);
-	int rem_len_len = strnlen(rem_len, rem_len_len_checked);
-	int len = 0;
 
-	char* message = calloc(
-		1 + rem_len_len + 2 + publish->topic_size + publish->message_size,
-		sizeof(char)
+	frame_t *frame = frame_create(
+		1 + rem_len_len + 2 + publish->topic_size + publish->message_size
 	);
-	if (!message)
-		err(1, "calloc publish msg");
-	char* message_orig = message;
+	char *message = frame->data;
+	frame->qos = publish->qos;
 
 	// control packet type
 	*message = 0x30;
 	message++;
-	len++;
 
 	// remaining length
 	memcpy(message, rem_len, rem_len_len);
 	message += rem_len_len;
-	len += rem_len_len;
-	free(rem_len);
 
 	// topic (16 bit size)
 	*message = (publish->topic_size >> 8) & 0x00FF;
 	message++;
-	*message |= publish->topic_size & 0x00FF;
+	*message = publish->topic_size & 0x00FF;
 	message++;
-	len += 2;
 
 	// topic (string)
 	memcpy(message, publish->topic, publish->topic_size);
 	message += publish->topic_size;
-	len += publish->topic_size;
 
 	// message
 	memcpy(message, publish->message, publish->message_size);
-	len += publish->message_size;
 
-	// mark for export
-	conn->state = 1;
-	conn->message = message_orig;
-	conn->message_size = len;
-	conn->type = MQTT_PUBLISH;
+	return frame;
+}
+
+frame_t *
+create_publish_ack(ctrl_packet_t type, uint16_t packet_id) {
+	frame_t *frame = frame_create(4);
+	char *buffer = frame->data;
+
+	// PUBREL has the same reserved flags as SUBSCRIBE
+	buffer[0] = type << 4;
+	if (type == MQTT_PUBREL)
+		buffer[0] |= 0x02;
+	buffer[1] = 0x02;
+	buffer[2] = (packet_id >> 8) & 0x00FF;
+	buffer[3] = packet_id & 0x00FF;
+
+	return frame;
+}
+
+/**
+ * Finds topic in PUBLISH frame encoded by `create_publish_message`.
+ * 
+ * \param payload_offset Set to offset of payload in the frame.
+ * 
+ * \returns Offset of topic (its 16-bit size) in the frame.
+ */
+static size_t
+publish_topic_offset(frame_t *message, size_t *payload_offset) {
+	uint8_t *data = (uint8_t *) message->data;
+
+	// skip control packet type and remaining length
+	size_t offset = 1;
+	while (data[offset] & 0x80)
+		offset++;
+	offset++;
+
+	uint16_t topic_size = data[offset] << 8 | data[offset + 1];
+	*payload_offset = offset + 2 + topic_size;
+	return offset;
+}
+
+frame_t *
+create_publish_slice(frame_t *message) {
+	size_t payload_offset;
+	(void) publish_topic_offset(message, &payload_offset);
+	return frame_slice(
+		message, payload_offset, message->size - payload_offset
+	);
+}
+
+/**
+ * Creates header of PUBLISH MQTT control packet sent with QoS above 0. Topic
+ * and RETAIN flag are taken from the message payload is a slice of, payload
+ * itself is queued right after the header.
+ * 
+ * \param dup Message is sent again.
+ * 
+ * \returns Frame with fixed header, topic and packet ID.
+ */
+static frame_t *
+create_publish_header(inflight_msg_t *msg, int dup) {
+	frame_t *message = msg->payload->parent;
+	size_t payload_offset;
+	size_t topic_offset = publish_topic_offset(message, &payload_offset);
+	size_t topic_size = payload_offset - topic_offset;
+
+	char rem_len[4];
+	size_t rem_len_len = from_uint_to_val_len(
+		topic_size + 2 + msg->payload->size, rem_len
+	);
+
+	frame_t *frame = frame_create(1 + rem_len_len + topic_size + 2);
+	char *buffer = frame->data;
+
+	// control packet type, RETAIN flag is kept
+	*buffer = 0x30 | (message->data[0] & 0x01) | (msg->qos << 1);
+	if (dup)
+		*buffer |= 0x08;
+	buffer++;
+
+	memcpy(buffer, rem_len, rem_len_len);
+	buffer += rem_len_len;
+
+	// topic with its size, as encoded in the message
+	memcpy(buffer, message->data + topic_offset, topic_size);
+	buffer += topic_size;
+
+	*buffer = (msg->packet_id >> 8) & 0x00FF;
+	buffer++;
+	*buffer = msg->packet_id & 0x00FF;
+
+	return frame;
+}
+
+/**
+ * Queues message from inflight window. Header and payload take two entries of
+ * outgoing queue, if there is not enough room, message is left for
+ * redelivery. PUBREL is queued instead of released QoS 2 message.
+ * 
+ * \returns 0 if message was queued, -1 otherwise.
+ */
+static int
+send_inflight_message(
+	conns_t *conns, conn_t *conn, inflight_msg_t *msg, int dup
+) {
+	if (msg->released) {
+		if (out_queue_room(&conn->out_queue) < 1)
+			return -1;
+		queue_frame(conns, conn, create_publish_ack(MQTT_PUBREL, msg->packet_id));
+		return 0;
+	}
+
+	if (out_queue_room(&conn->out_queue) < 2)
+		return -1;
+
+	queue_frame(conns, conn, create_publish_header(msg, dup));
+	queue_frame(conns, conn, frame_ref(msg->payload));
+	return 0;
+}
+
+/**
+ * Arms redelivery timer of the client, unless it is armed already.
+ */
+static void
+arm_retry_timer(conns_t *conns, conn_t *conn) {
+	if (conn->retry_timer.prev)
+		return;
+
+	timer_add(
+		&conns->retries, &conn->retry_timer,
+		conns->now + INFLIGHT_RETRY_INTERVAL
+	);
+}
+
+int
+queue_inflight_message(
+	conns_t *conns, conn_t *conn, frame_t *payload, uint8_t qos
+) {
+	frame_t *ref = frame_ref(payload);
+	inflight_msg_t *msg = inflight_add(&conn->inflight, ref, qos);
+	if (!msg) {
+		if (inflight_push_pending(&conn->inflight, ref, qos) == -1) {
+			frame_release(ref);
+			return -1;
+		}
+		return 0;
+	}
+
+	(void) send_inflight_message(conns, conn, msg, 0);
+	arm_retry_timer(conns, conn);
+	return 0;
+}
+
+/**
+ * Moves messages waiting for the client into free slots of its inflight
+ * window and sends them.
+ */
+static void
+fill_inflight_window(conns_t *conns, conn_t *conn) {
+	uint32_t moved;
+	inflight_fill(&conn->inflight, &moved);
+	for (; moved; moved &= moved - 1) {
+		(void) send_inflight_message(
+			conns, conn, &conn->inflight.slots[__builtin_ctz(moved)], 0
+		);
+	}
+}
+
+/**
+ * Reads packet ID of PUBACK, PUBREC, PUBREL or PUBCOMP control packet.
+ * 
+ * \returns 0 on success, -1 if control packet is malformed.
+ */
+static int
+read_ack_packet_id(conn_t *conn, char *incoming_message, uint16_t *packet_id) {
+	if (conn->message_size != 2)
+		return -1;
+
+	*packet_id = (uint8_t) incoming_message[0] << 8;
+	*packet_id |= (uint8_t) incoming_message[1];
+	return 0;
+}
+
+/**
+ * Checks that acknowledgement is the expected next step of message's flow:
+ * PUBACK for QoS 1, PUBREC (also repeated) and PUBCOMP after it for QoS 2.
+ */
+static int
+is_expected_ack(inflight_msg_t *msg, ctrl_packet_t type) {
+	if (type == MQTT_PUBACK)
+		return msg->qos == 1;
+	if (type == MQTT_PUBREC)
+		return msg->qos == 2;
+	return msg->qos == 2 && msg->released;
+}
+
+int
+read_publish_ack(conns_t *conns, conn_t *conn, char *incoming_message) {
+	uint16_t packet_id;
+	if (read_ack_packet_id(conn, incoming_message, &packet_id) == -1)
+		return -1;
+
+	inflight_msg_t *msg = inflight_find(&conn->inflight, packet_id);
+	if (!msg || !is_expected_ack(msg, conn->type)) {
+		log_warn(
+			"Unexpected acknowledgement of packet ID %u from %s.",
+			packet_id, conn->client_id
+		);
+		return 0;
+	}
+
+	if (conn->type == MQTT_PUBREC) {
+		// message was received, only PUBREL is sent until PUBCOMP
+		inflight_release(&conn->inflight, msg);
+		(void) send_inflight_message(conns, conn, msg, 0);
+		return 0;
+	}
+	inflight_remove(&conn->inflight, msg);
+	fill_inflight_window(conns, conn);
+
+	if (inflight_count(&conn->inflight) == 0)
+		timer_remove(&conn->retry_timer);
+	return 0;
+}
+
+int
+read_pubrel_message(conn_t *conn, char *incoming_message, uint16_t *packet_id) {
+	if (read_ack_packet_id(conn, incoming_message, packet_id) == -1)
+		return -1;
+
+	packet_id_set_remove(&conn->received, *packet_id);
+	return 0;
+}
+
+void
+resend_inflight_messages(conns_t *conns, conn_t *conn) {
+	for (uint32_t used = conn->inflight.used; used; used &= used - 1) {
+		inflight_msg_t *msg = &conn->inflight.slots[__builtin_ctz(used)];
+		if (send_inflight_message(conns, conn, msg, 1) == -1)
+			return;
+	}
+}
+
+void
+resume_inflight_messages(conns_t *conns, conn_t *conn) {
+	resend_inflight_messages(conns, conn);
+	fill_inflight_window(conns, conn);
+
+	if (inflight_count(&conn->inflight) > 0)
+		arm_retry_timer(conns, conn);
+}
+
+/**
+ * \returns Non-zero if frame is PUBLISH sent with QoS 0 as a whole, which
+ * 			may be dropped for congested client.
+ */
+static int
+is_qos0_publish(const frame_t *frame) {
+	return !frame->parent
+		&& ((uint8_t) frame->data[0] & 0xF6) == (MQTT_PUBLISH << 4);
+}
+
+/**
+ * Applies congestion policy before QoS 0 message is queued for congested
+ * client. With drop oldest policy, the oldest QoS 0 message waiting in its
+ * outgoing queue is dropped to make room. Messages handed to io_uring writes
+ * are not dropped, new message waits behind them.
+ *
+ * \returns Non-zero if the message can be queued, 0 if it is dropped.
+ */
+static int
+congestion_make_room(conns_t *conns, conn_t *conn) {
+	if (conns->congestion_policy != CONGESTION_DROP_OLDEST)
+		return 0;
+
+	size_t count = conn->out_queue.count;
+	size_t bytes = conn->out_queue.bytes;
+	if (out_queue_drop_first(&conn->out_queue, is_qos0_publish)) {
+		account_out_queue(conns, conn, count, bytes);
+		conn->dropped++;
+		conns->dropped++;
+		return 1;
+	}
+
+	// whole queue is being written, the message is dropped by the next one
+	return conn->out_queue.locked == conn->out_queue.count;
+}
+
+/**
+ * Queues message for one client with given QoS. Frame is encoded and its
+ * payload slice is made on first use.
+ *
+ * \param frame Encoded PUBLISH frame, may point to NULL.
+ * \param payload Payload slice of the frame, may point to NULL.
+ *
+ * \returns 1 if the message was queued, 0 if it was dropped.
+ */
+static int
+deliver_to_client(
+	conns_t *conns, conn_t *conn, publish_t *publish, frame_t **frame,
+	frame_t **payload, uint8_t qos
+) {
+	uint64_t *counters = conns->stats.counters;
+
+	if (qos == 0 && conn->detached) {
+		counters[STATS_PUBLISH_DROPPED]++;
+		return 0;
+	}
+
+	// congested client is skipped before any frame is made for it
+	if (qos == 0 && conn->congested && !congestion_make_room(conns, conn)) {
+		conn->dropped++;
+		conns->dropped++;
+		counters[STATS_PUBLISH_DROPPED]++;
+		return 0;
+	}
+
+	if (!*frame)
+		*frame = create_publish_message(publish);
+
+	if (qos > 0) {
+		if (!*payload)
+			*payload = create_publish_slice(*frame);
+
+		if ((conn->detached
+			? session_deliver(conns, conn, *payload, qos)
+			: queue_inflight_message(conns, conn, *payload, qos)) == -1
+		) {
+			log_warn(
+				"Too many messages in flight to %s, message dropped.",
+				conn->client_id
+			);
+			counters[STATS_PUBLISH_DROPPED]++;
+			return 0;
+		}
+		counters[STATS_PUBLISH_SENT]++;
+		return 1;
+	}
+
+	if (queue_frame(conns, conn, frame_ref(*frame)) == -1) {
+		log_warn(
+			"Outgoing queue of %s is full, message dropped.",
+			conn->client_id
+		);
+		counters[STATS_PUBLISH_DROPPED]++;
+		return 0;
+	}
+	counters[STATS_PUBLISH_SENT]++;
+	return 1;
+}
+
+/**
+ * Hash of published message used to select member of shared group. It is the
+ * same in all workers, they share the frame. Sticky strategy hashes topic, so
+ * messages of a topic go to the same member.
+ */
+static uint32_t
+share_message_hash(conns_t *conns, publish_t *publish, frame_t *frame) {
+	if (conns->share_strategy->sticky)
+		return hash_level(publish->topic, publish->topic_size);
+
+	// frames are aligned, low bits of address carry no information
+	return (uint32_t) (
+		((uint64_t) (uintptr_t) frame >> 4) * 0x9E3779B97F4A7C15ULL >> 32
+	);
+}
+
+/**
+ * Queues PUBLISH frame for all clients of given connections subscribed to the
+ * topic. Each client gets the message at most once, even if more of its
+ * topics match.
+ * 
+ * Messages with QoS above 0 for offline persistent sessions wait in their
+ * inflight windows until the client connects again, QoS 0 ones are dropped.
+ * QoS 0 messages for congested clients are handled by congestion policy.
+ * 
+ * Client gets the message with the lower of published QoS and the highest QoS
+ * of its matching subscriptions. Subscriptions are walked twice in that case,
+ * first pass finds the highest QoS of every client.
+ * 
+ * Every matching group of shared subscriptions delivers the message to one
+ * of its members, selected by strategy of the connections. It is delivered
+ * independently of other subscriptions of the member.
+ * 
+ * \param conns Connections linked list.
+ * \param publish Information about publish.
+ * \param frame Encoded PUBLISH frame. If it points to NULL, frame is encoded
+ * 				from publish when first subscriber is found, caller has to
+ * 				release it.
+ * 
+ * \returns Number of clients message was queued for.
+ */
+int
+deliver_publish(conns_t *conns, publish_t *publish, frame_t **frame) {
+	int queued = 0;
+	size_t group_count = 0;
+	conn_t *conn = NULL;
+	frame_t *payload = NULL;
+
+	topic_t **matches;
+	size_t match_count = topic_tree_match(
+		&conns->topic_tree, publish->topic, publish->topic_size,
+		publish->levels, &matches
+	);
+	conns->publish_counter++;
+
+	if (publish->qos > 0) {
+		for (size_t i = 0; i < match_count; i++) {
+			conn = matches[i]->owner;
+			if (!conn)
+				continue;
+
+			if (conn->last_publish != conns->publish_counter) {
+				conn->last_publish = conns->publish_counter;
+				conn->publish_qos = 0;
+			}
+			if (matches[i]->qos_code > conn->publish_qos)
+				conn->publish_qos = matches[i]->qos_code;
+		}
+		// second pass is deduplicated by next publish id
+		conns->publish_counter++;
+	}
+
+	for (size_t i = 0; i < match_count; i++) {
+		conn = matches[i]->owner;
+		if (!conn) {
+			group_count++;
+			continue;
+		}
+
+		if (conn->last_publish == conns->publish_counter)
+			continue;
+		conn->last_publish = conns->publish_counter;
+
+		uint8_t qos = publish->qos < conn->publish_qos
+			? publish->qos
+			: conn->publish_qos;
+		queued += deliver_to_client(conns, conn, publish, frame, &payload, qos);
+	}
+
+	for (size_t i = 0; group_count > 0 && i < match_count; i++) {
+		if (matches[i]->owner)
+			continue;
+		group_count--;
+
+		// hash of other workers is taken from the same frame
+		if (!*frame)
+			*frame = create_publish_message(publish);
+		topic_t *member = share_group_select(
+			matches[i]->group, conns->share_strategy,
+			conns->topic_tree.worker_id,
+			share_message_hash(conns, publish, *frame)
+		);
+		if (!member)
+			continue;
+
+		uint8_t qos = publish->qos < member->qos_code
+			? publish->qos
+			: member->qos_code;
+		queued += deliver_to_client(
+			conns, member->owner, publish, frame, &payload, qos
+		);
+	}
+
+	if (payload)
+		frame_release(payload);
+	return queued;
+}
+
+/**
+ * Replaces retained message of published topic. Retained message is encoded
+ * once more, with RETAIN flag set, as it is sent to new subscribers. Empty
+ * payload removes retained message of the topic.
+ * 
+ * \returns Frame with RETAIN flag (caller has to release it), NULL if
+ * 			retained message was removed.
+ */
+frame_t *
+retain_published_message(
+	conn_t *sender_conn, conns_t *conns, publish_t *publish
+) {
+	frame_t *retained = NULL;
+
+	if (publish->message_size > 0) {
+		retained = create_publish_message(publish);
+		retained->data[0] |= 0x01;
+	}
+
+	if (retain_store_set(
+		&conns->retained, publish->topic, publish->topic_size,
+		publish->levels, retained
+	) == -1) {
+		log_warn(
+			"Retained store is full, message of %s not retained.",
+			sender_conn ? sender_conn->client_id : "broker"
+		);
+	}
+
+	return retained;
+}
+
+int
+deliver_published_frame(conns_t *conns, frame_t *frame) {
+	size_t payload_offset;
+	size_t topic_offset = publish_topic_offset(frame, &payload_offset);
+	publish_t publish;
+
+	memset(&publish, 0, sizeof(publish));
+	publish.topic = frame->data + topic_offset + 2;
+	publish.topic_size = payload_offset - topic_offset - 2;
+	publish.qos = frame->qos;
+
+	return deliver_publish(conns, &publish, &frame);
 }
 
 /**
  * Finds out which clients are subscribet to given topic in published message
- * and sends them the message.
+ * and queues the message for them.
  * 
- * Message size, its contents, status and type are set accordingly.
+ * Subscribers are looked up in subscription tree. PUBLISH control packet is
+ * encoded only once and its frame is shared by outgoing queues of all
+ * subscribers. When more worker threads run, the frame is forwarded to them
+ * as well, to be delivered to their clients.
  * 
- * \param sender_conn Connection to the sender (publisher).
+ * Message with QoS above 0 is appended to write-ahead log of the worker
+ * first, when the log is enabled.
+ * 
+ * \param sender_conn Connection to the sender (publisher), NULL for messages
+ * 					  of the broker.
  * \param conns Connections linked list.
  * \param publish Information about publish.
  * 
- * \returns 1, if message is published to publisher as well, 0 otherwise.
+ * \returns Number of local clients message was queued for.
  */
 int
 send_published_message(
 	conn_t *sender_conn, conns_t *conns, publish_t *publish
 ) {
-	int resend_to_sender = 0;
-
-	for (
-		conn_t *conn = conns->conn_back;
-		conn != NULL;
-		conn = conn->next
-	) {
-		for (
-			topic_t *topic = conn->topics->back;
-			topic != NULL;
-			topic = topic->next
-		) {
-			char *publish_topic_copy = calloc(
-				publish->topic_size + 1, sizeof(char)
-			);
-			strncpy(publish_topic_copy, publish->topic, publish->topic_size);
-			if (topic_match(topic, publish_topic_copy)) {
-				if (sender_conn == conn) {
-					resend_to_sender = 1;
-					free(conn->message);
-				}
-				create_publish_message(conn, publish);
-			}
-			free(publish_topic_copy);
-		}
-		
+	frame_t *frame = NULL;
+	frame_t *retained = NULL;
+
+	if (publish->qos > 0 && conns->worker && conns->worker->wal.dir) {
+		frame = create_publish_message(publish);
+		wal_append(&conns->worker->wal, frame);
+	}
+
+	int queued = deliver_publish(conns, publish, &frame);
+
+	if (publish->retain)
+		retained = retain_published_message(sender_conn, conns, publish);
+
+	if (conns->worker && conns->worker->worker_count > 1) {
+		if (!frame)
+			frame = create_publish_message(publish);
+		forward_published_frame(
+			conns->worker,
+			frame,
+			frame->data + frame->size - publish->message_size
+				- publish->topic_size,
+			publish->topic_size,
+			publish->retain,
+			retained
+		);
 	}
 
-	return resend_to_sender;
+	if (frame)
+		frame_release(frame);
+	if (retained)
+		frame_release(retained);
+
+	return queued;
 }
@@ -1,4 +1,5 @@
 #include "mqtt_subscribe.h"
+#include "mqtt_publish.h"
 
 /**
  * Parses 16-bit BE value into (UN)SUBSCRIBE control packet "packet id".
@@ -37,54 +38,103 @@ read_variable_header(conn_t *conn, char *incoming_message) {
  * Topics, first their size in 16-bit BE format, then their contents. Loops
  * as long as there should be something to read (calculated from remaining
  * length in fixed header of control packet). Based on control packet type,
- * topic is inserted (SUBSCRIBE) or removed (UNSUBSCRIBE).
+ * topic is inserted (SUBSCRIBE) or removed (UNSUBSCRIBE). Requested QoS is
+ * granted up to MQTT_MAX_QOS. Subscription to topic filter the client has
+ * already replaces the existing one, its QoS is updated.
+ * 
+ * Subscriptions of SUBSCRIBE are collected in `conns->subscribed`, in order
+ * of their topic filters, for SUBACK and retained messages.
  * 
  * \returns Number of topics read.
  */
 int
-read_payload(conn_t *conn, char *incoming_message) {
+read_payload(conns_t *conns, conn_t *conn, char *incoming_message) {
 	char *index = incoming_message;
 	int rem_len = conn->message_size;
 
 	rem_len -= 2; // for variable header
 
-	if (rem_len == 0) {
+	if (rem_len <= 0) {
 		return -1;
 	}
 
 	int length = 0;
 	int topic_counter = 0;
+	// SUBSCRIBE has QoS byte after every topic, UNSUBSCRIBE has not
+	int qos_size = conn->type == MQTT_SUBSCRIBE ? 1 : 0;
 	char *topic;
+	uint8_t qos = 0;
 	while (rem_len > 0) {
+		if (rem_len < 2) {
+			log_warn("Malformed (UN)SUBSCRIBE topic from %s.", conn->client_id);
+			return -1;
+		}
+
 		// read length
-		length = index[0];
+		length = (uint8_t) index[0];
 		length <<= 8;
-		length |= index[1];
+		length |= (uint8_t) index[1];
 		index += 2;
 		rem_len -= 2;
 
-		// read payload
-		topic = calloc(length + 1, sizeof(char));
-		if (!topic)
-			err(1, "read payload subscribe calloc topic");
-		for (int i = 0; i < length; i++) {
-			topic[i] = *index;
-			index++;
-			rem_len--;
+		// topic is a view into incoming message, copied only when inserted
+		if (length + qos_size > rem_len) {
+			log_warn("Malformed (UN)SUBSCRIBE topic from %s.", conn->client_id);
+			return -1;
 		}
+		topic = index;
+		index += length;
+		rem_len -= length;
+
+		// requested QoS, upper 6 bits are reserved
+		if (qos_size) {
+			qos = (uint8_t) index[0];
+			if (qos > 2) {
+				log_warn("Malformed SUBSCRIBE QoS from %s.", conn->client_id);
+				return -1;
+			}
+		}
+		index += qos_size;
+		rem_len -= qos_size;
 
-		//skip qos
-		index++;
-		rem_len--;
+		// topic has to be valid UTF-8, otherwise connection is closed
+		if (topic_scan(topic, length, &conns->topic_tree.scan) == -1) {
+			log_warn("Malformed (UN)SUBSCRIBE topic from %s.", conn->client_id);
+			return -1;
+		}
 
 		if (conn->type == MQTT_SUBSCRIBE) {
-			insert_topic(conn->topics, topic, length, 0x00);
-			free(topic);
+			uint8_t granted = qos > MQTT_MAX_QOS ? MQTT_MAX_QOS : qos;
+			topic_t *subscription = find_topic(conn->topics, topic, length);
+			if (subscription) {
+				// invalid topic filter stays refused
+				if (subscription->qos_code != 0x80)
+					subscription->qos_code = granted;
+			}
+			else {
+				insert_topic(
+					&conns->topic_tree, conn->topics, conn, topic, length,
+					&conns->topic_tree.scan, granted
+				);
+				subscription = conn->topics->head;
+			}
+
+			if (topic_counter == conns->subscribed_capacity) {
+				conns->subscribed_capacity = conns->subscribed_capacity
+					? conns->subscribed_capacity * 2
+					: 16;
+				conns->subscribed = realloc(
+					conns->subscribed,
+					conns->subscribed_capacity * sizeof(topic_t *)
+				);
+				if (!conns->subscribed)
+					err(1, "read payload realloc subscribed");
+			}
+			conns->subscribed[topic_counter] = subscription;
 		}
 		else {
 			// UNSUBSCRIBE control packet
-			remove_topic(conn->topics, topic, length);
-			free(topic);
+			remove_topic(&conns->topic_tree, conn->topics, topic, length);
 		}
 
 		topic_counter++;
@@ -99,13 +149,13 @@ read_payload(conn_t *conn, char *incoming_message) {
  * \returns Number of topics found.
  */
 int
-read_un_subscribe_message(conn_t *conn, char *incoming_message) {
+read_un_subscribe_message(conns_t *conns, conn_t *conn, char *incoming_message) {
 	char *index = incoming_message;
 
 	(void) read_variable_header(conn, index);
 	index += 2;
 
-	int topic_counter = read_payload(conn, index);
+	int topic_counter = read_payload(conns, conn, index);
 	return topic_counter;
 }
 
@@ -113,36 +163,25 @@ read_un_subscribe_message(conn_t *conn, char *incoming_message) {
  * Create response to SUBSCRIBE MQTT control packet.
  * 
  * Packet id is restored from connection struct. Answers to topics are inserted
- * one after another, always with QoS set to 0.
+ * one after another, with granted QoS or failure code 0x80.
  * 
- * Message size is set.
- * 
- * \returns SUBACK MQTT control packet, in bytes.
+ * \returns SUBACK MQTT control packet frame.
  */
-char *
-create_suback_message(conn_t *conn, int topic_counter) {
-	char *buffer = calloc(4 + topic_counter, sizeof(char));
-	if (!buffer)
-		err(1, "create suback calloc buffer");
-	char *buffer_orig = buffer;
-	int len = 0;
+frame_t *
+create_suback_message(conn_t *conn, conns_t *conns, int topic_counter) {
+	// get rem len in variable length format
+	char rem_len[4];
+	size_t rem_len_len = from_uint_to_val_len(2 + topic_counter, rem_len);
 
-	buffer[0] = (char) 0x90;
-	len++;
+	frame_t *frame = frame_create(1 + rem_len_len + 2 + topic_counter);
+	char *buffer = frame->data;
 
-	// get rem len in variable length format
-	size_t rem_len_len_checked = 0;
-	char *rem_len = from_uint_to_val_len(
-		2 + topic_counter, &rem_len_len_checked
-	);
-	size_t rem_len_len = strnlen(rem_len, rem_len_len_checked);
+	buffer[0] = (char) 0x90;
 
 	// write remaining length
 	for (int i = 0; i < rem_len_len; i++) {
 		buffer[1 + i] = rem_len[i];
-		len++;
 	}
-	free(rem_len);
 
 	// advance for "remaininig length" length and first byte (control id...)
 	buffer += 1 + rem_len_len;
@@ -152,24 +191,71 @@ create_suback_message(conn_t *conn, int topic_counter) {
 	buffer++;
 	*buffer = conn->packet_id & 0x00FF;
 	buffer++;
-	len += 2;
 
 	// write topic answers
-	topic_t *topic_iter = NULL;
-	if (conn->last_topic_before_insert)
-		topic_iter = conn->last_topic_before_insert->next;
-	else 
-		topic_iter = conn->topics->head;
-
 	for (int i = 0; i < topic_counter; i++) {
-		*buffer = topic_iter->qos_code;
-		topic_iter = topic_iter->next;
-		len++;
+		*buffer = conns->subscribed[i]->qos_code;
+		buffer++;
 	}
 
-	conn->message_size = len;
+	return frame;
+}
 
-	return buffer_orig;
+void
+send_retained_messages(conns_t *conns, conn_t *conn, int topic_counter) {
+	// shared subscriptions get no retained messages
+	for (int i = 0; i < topic_counter; i++) {
+		topic_t *topic_iter = conns->subscribed[i];
+		if (topic_iter->qos_code == 0x80 || topic_iter->group)
+			continue;
+
+		// topic filter repeated in the packet gets retained messages once
+		int repeated = 0;
+		for (int j = 0; j < i && !repeated; j++) {
+			repeated = conns->subscribed[j] == topic_iter;
+		}
+		if (repeated)
+			continue;
+
+		// topic filter was scanned when inserted, scan can't fail
+		(void) topic_scan(
+			topic_iter->topic, topic_iter->topic_len, &conns->topic_tree.scan
+		);
+
+		frame_t **frames;
+		size_t frame_count = retain_store_match(
+			&conns->retained, topic_iter->topic, topic_iter->topic_len,
+			&conns->topic_tree.scan, &frames
+		);
+		for (size_t frame_index = 0; frame_index < frame_count; frame_index++) {
+			frame_t *retained = frames[frame_index];
+			uint8_t qos = retained->qos < topic_iter->qos_code
+				? retained->qos
+				: topic_iter->qos_code;
+			if (qos > 0) {
+				frame_t *payload = create_publish_slice(retained);
+				int result = queue_inflight_message(conns, conn, payload, qos);
+				frame_release(payload);
+				if (result == -1) {
+					log_warn(
+						"Too many messages in flight to %s, retained messages "
+						"dropped.",
+						conn->client_id
+					);
+					return;
+				}
+				continue;
+			}
+
+			if (queue_frame(conns, conn, frame_ref(retained)) == -1) {
+				log_warn(
+					"Outgoing queue of %s is full, retained messages dropped.",
+					conn->client_id
+				);
+				return;
+			}
+		}
+	}
 }
 
 /**
@@ -177,24 +263,19 @@ create_suback_message(conn_t *conn, int topic_counter) {
  * 
  * Packet id is restored from connection struct.
  * 
- * Message size is set.
- * 
- * \returns UNSUBACK MQTT control packet, in bytes.
+ * \returns UNSUBACK MQTT control packet frame.
  */
-char *
+frame_t *
 create_unsuback_message(conn_t *conn) {
-	char* buffer = calloc(4, sizeof(char));
-	if (!buffer)
-		err(1, "create unsuback calloc buffer");
+	frame_t *frame = frame_create(4);
+	char *buffer = frame->data;
 
 	buffer[0] = (char) 0xB0;
 	buffer[1] = 0x02;
 	buffer[2] = (conn->packet_id >> 8) & 0x00FF;
 	buffer[3] = conn->packet_id & 0x00FF;
 
-	conn->message_size = 4;
-
-	return buffer;
+	return frame;
 }
 
 /**
@@ -204,9 +285,9 @@ create_unsuback_message(conn_t *conn) {
  * 
  * For UNSUBSCRIBE packet we have UNSUBACK packet.
  * 
- * \returns (UN)SUBACK MQTT control packet, in bytes.
+ * \returns (UN)SUBACK MQTT control packet frame.
  */
-char *
+frame_t *
 create_un_subscribe_response(
 	conn_t *conn, conns_t *conns, int topics_inserted_code
 ) {
@@ -215,7 +296,7 @@ create_un_subscribe_response(
 	}
 
 	if (conn->type == MQTT_SUBSCRIBE)
-		return create_suback_message(conn, topics_inserted_code);
+		return create_suback_message(conn, conns, topics_inserted_code);
 	else
 		return create_unsuback_message(conn);
 }
@@ -1,25 +1,162 @@
 #include "mqtt_utils.h"
+#include "session.h"
+
+/**
+ * Closes connection socket and removes connection from connections linked
+ * list. Closing the socket also removes it from reactor. Session of
+ * persistent connection is detached, it stays in client table until the
+ * client connects again.
+ *
+ * Socket of connection handed over to another worker is set to -1 already,
+ * it is left open.
+ *
+ * Connection memory is not freed right away, connection is moved to list of
+ * closed connections instead, as events may still be pending for it. Use
+ * `free_closed_connections` at the end of event loop iteration.
+ *
+ * \returns Next connection in connections linked list.
+ */
+struct connection *
+clear_one_connection(struct connection *conn, struct connections *conns) {
+	if (conn->fd != -1) {
+		if (shutdown(conn->fd, SHUT_RDWR) == -1) {
+			log_info("shutdown failed");
+		}
+		if (close(conn->fd) == -1) {
+			err(1, "closing fd when deleting connection");
+		}
+	}
+	struct connection *next = conn->next;
+	struct connection *prev = conn->prev;
+
+	if (prev)
+		prev->next = next;
+
+	if (next)
+		next->prev = prev;
+
+	if (conn == conns->conn_back) {
+		conns->conn_back = next;
+	}
+
+	if (conn == conns->conn_head) {
+		conns->conn_head = prev;
+	}
+
+	conns->count--;
+	if (conn->dropped > 0) {
+		log_warn(
+			"Client %s disconnected, %llu messages were dropped for it.",
+			conn->client_id, (unsigned long long) conn->dropped
+		);
+	}
+	if (conn->client_id && conn->persistent)
+		session_detach(conns, conn);
+	else if (conn->client_id)
+		client_table_remove(&conns->clients, conn);
+	timer_remove(&conn->keep_alive_timer);
+	timer_remove(&conn->retry_timer);
+	if (conn->topics)
+		delete_topics_list(&conns->topic_tree, conn->topics);
+	conn->topics = NULL;
+	conn->closing = 1;
+	conn->next_closed = conns->closed;
+	conns->closed = conn;
+	return next;
+}
+
+void
+conns_init(struct connections *conns) {
+	memset(conns, 0, sizeof(struct connections));
+	conns->count = 0;
+	conns->conn_back = NULL;
+	conns->conn_head = NULL;
+	conns->pending_out = NULL;
+	conns->closed = NULL;
+	topic_tree_init(&conns->topic_tree);
+	client_table_init(&conns->clients);
+	retain_store_init(&conns->retained, RETAIN_STORE_MEMORY);
+	conns->now = monotonic_ms();
+	stats_init(&conns->stats, STATS_INTERVAL * 1000, conns->now);
+	timer_wheel_init(&conns->timers, conns->now);
+	timer_wheel_init(&conns->retries, conns->now);
+	conns->publish_counter = 0;
+	conns->watermarks.high_bytes = OUT_QUEUE_HIGH_BYTES;
+	conns->watermarks.high_frames = OUT_QUEUE_HIGH_FRAMES;
+	conns->watermarks.low_bytes = OUT_QUEUE_LOW_BYTES;
+	conns->watermarks.low_frames = OUT_QUEUE_LOW_FRAMES;
+	conns->congestion_policy = CONGESTION_DROP_NEWEST;
+	conns->share_strategy = share_strategy_default();
+	conns->worker = NULL;
+}
+
+uint64_t
+keep_alive_deadline(struct connection *conn) {
+	// client is disconnected after one and a half of keep alive period
+	return conn->last_seen + (uint64_t) conn->keep_alive * 1500;
+}
+
+void
+schedule_write(struct connections *conns, struct connection *conn) {
+	if (conn->pending_out)
+		return;
+
+	conn->pending_out = 1;
+	conn->next_pending_out = conns->pending_out;
+	conns->pending_out = conn;
+}
 
 int
-check_for_client_id_repeated(struct connections *conns, char* client_id) {
-	for (
-		struct connection* conn = conns->conn_back;
-		conn != NULL;
-		conn = conn->next
+queue_frame(struct connections *conns, struct connection *conn, frame_t *frame) {
+	if (out_queue_push(&conn->out_queue, frame) == -1) {
+		frame_release(frame);
+		return -1;
+	}
+	conns->stats.counters[STATS_QUEUE_MESSAGES]++;
+	conns->stats.counters[STATS_QUEUE_BYTES] += frame->size;
+
+	if (!conn->congested
+		&& out_queue_over(&conn->out_queue, &conns->watermarks)
 	) {
-		if (conn->client_id &&
-			strncmp(client_id, conn->client_id, conn->cliend_id_length) == 0
-		) {
-			/** we only want to remove clients with matching client_id 
-			 * that are not already being removed
-			 */
-			return 1;
-		}
+		conn->congested = 1;
+		conns->congestions++;
+		log_warn(
+			"Client %s is not reading, outgoing queue reached %zu frames "
+			"(%zu bytes).", conn->client_id, conn->out_queue.count,
+			conn->out_queue.bytes
+		);
 	}
 
+	schedule_write(conns, conn);
 	return 0;
 }
 
+void
+account_out_queue(
+	struct connections *conns, struct connection *conn, size_t count,
+	size_t bytes
+) {
+	uint64_t *counters = conns->stats.counters;
+
+	// queue shrinks, unsigned differences wrap around to the right totals
+	counters[STATS_QUEUE_MESSAGES] += conn->out_queue.count - count;
+	counters[STATS_QUEUE_BYTES] += conn->out_queue.bytes - bytes;
+}
+
+void
+check_congestion_end(struct connections *conns, struct connection *conn) {
+	if (!conn->congested
+		|| !out_queue_under(&conn->out_queue, &conns->watermarks)
+	)
+		return;
+
+	conn->congested = 0;
+	log_info(
+		"Client %s caught up, %llu messages dropped so far.", conn->client_id,
+		(unsigned long long) conn->dropped
+	);
+}
+
 int
 from_val_len_to_uint(char *buffer) {
 	int multiplier = 1;
@@ -40,13 +177,10 @@ from_val_len_to_uint(char *buffer) {
 	return value;
 }
 
-char *
-from_uint_to_val_len(int val, size_t *len) {
+size_t
+from_uint_to_val_len(int val, char *output) {
 	char encoded_byte;
-	char *output = calloc(5, sizeof(char));
-	if (!output)
-		err(1, "uint to val len calloc output");
-	int index = 0;
+	size_t index = 0;
 
 	do {
 		encoded_byte = val % 128;
@@ -57,6 +191,5 @@ from_uint_to_val_len(int val, size_t *len) {
 		output[index++] = encoded_byte;
 	} while (val > 0);
 
-	*len = index;
-	return output;
+	return index;
 }
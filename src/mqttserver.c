@@ -3,13 +3,43 @@
 #include "mqtt_connect.h"
 #include "mqtt_subscribe.h"
 #include "mqtt_publish.h"
-#include "poll_list.h"
+#include "reactor.h"
+#include "session.h"
+#include "worker.h"
 #include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 
-#define SIZE 256
-#define POLL_WAIT_TIME 10
+#define LISTEN_BACKLOG 4096 // default, capped by net.core.somaxconn
+#define ACCEPT_BUDGET 256 // default connections accepted per iteration
+#define EVENT_WAIT_TIME 1000 // ms, upper bound for keep alive check delay
+#define WRITE_BATCH_SIZE 64 // frames written by one writev call
+#define URING_SEND_LINKS 4 // linked writev requests submitted at once
+#define URING_DRAIN_ROUNDS 10 // waits for requests in flight at exit
+
+/**
+ * Kinds of io_uring requests, stored in low bits of request user data. The
+ * rest of user data is pointer to connection, if request has one.
+ */
+enum uring_request {
+	URING_ACCEPT = 1,
+	URING_WAKE,
+	URING_RECV,
+	URING_SEND,
+	URING_CANCEL
+};
+
+#define URING_REQUEST_MASK 7
+
+/**
+ * Incoming bytes already received by io_uring, consumed by decoder.
+ */
+typedef struct {
+	char *data;
+	size_t size;
+} in_data_t;
 
 static volatile int interrupt_received = 0;
 
@@ -21,47 +51,48 @@ void
 sigaction_handler(int sig) {
 	log_warn("Interrupt received, server terminating.");
 	
-	interrupt_received = 1;
+	__atomic_store_n(&interrupt_received, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * NOTES:
- * - Fixed header is 2 to 5 bytes.
- * - Rest is up to 256 MiB.
- * - read buffer about 4 KiB
- */
-
-/**
- * Clears message size, its incoming/outgoing state and other metadata. Also
- * frees space, if requested.
- * 
- * \param should_free If non-zero, will free memory occupied by message.
+ * Clears incoming message, its size and other metadata. Message points into
+ * receive buffer, it is not freed.
  */
 void
-clear_message(struct connection *conn, int should_free) {
-	if (should_free) {
-		free(conn->message);
-	}
-
+clear_message(struct connection *conn) {
+	conn->message = NULL;
 	conn->message_size = 0;
-	conn->state = 0;
-	conn->last_topic_before_insert = NULL;
 	conn->packet_id = 0;
 }
 
 /**
- * Adds new connection into conns linked lists. Allocates memory as needed.
- * Data are set to their default values.
+ * Adds new connection into conns linked lists. Connection is allocated from
+ * slab pool of the thread. Data are set to their default values.
+ * 
+ * Nagle's algorithm is disabled on the socket, outgoing frames are already
+ * coalesced into one write per event loop iteration, and subscribers which
+ * only receive would otherwise wait for delayed ACKs.
  * 
  * \param conns Connections linked list.
  * \param fd File descriptor of socket of given connected peer, for polling.
+ * \param reactor Reactor the socket is registered in, NULL for io_uring
+ * 				  backend.
+ *
+ * \returns New connection, NULL if the socket cannot be registered in
+ * 			reactor (socket is left open).
  */
-void
-add_connection(struct connections *conns, int fd, plist_ptr plist) {
-	struct connection *new_connection = calloc(1, sizeof(struct connection));
-
-	if (!new_connection)
-		err(1, "calloc add connection");
+struct connection *
+add_connection(struct connections *conns, int fd, reactor_t *reactor) {
+	struct connection *new_connection = slab_alloc(&pools_local()->connections);
+	memset(new_connection, 0, sizeof(struct connection));
+
+	if (reactor && reactor_add(
+		reactor, fd, new_connection, EPOLLIN | EPOLLOUT | EPOLLRDHUP
+	) == -1) {
+		log_warn("Cannot register connection in reactor: %s.", strerror(errno));
+		slab_free(&pools_local()->connections, new_connection);
+		return NULL;
+	}
 
 	new_connection->next = NULL;
 	new_connection->prev = NULL;
@@ -83,48 +114,76 @@ add_connection(struct connections *conns, int fd, plist_ptr plist) {
 
 	conns->count++;
 
-	new_connection->poll_list_index = add_poll_fd(plist, fd, new_connection, POLLIN | POLLOUT);
+	new_connection->fd = fd;
+	int nodelay = 1;
+	if (setsockopt(
+		fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)
+	) == -1)
+		log_warn("Cannot disable Nagle's algorithm: %s.", strerror(errno));
+	new_connection->pending_out = 0;
+	new_connection->closing = 0;
+	out_queue_init(&new_connection->out_queue);
+	new_connection->in_buffer = NULL;
+	new_connection->in_capacity = 0;
+	new_connection->in_start = 0;
+	new_connection->in_end = 0;
+	new_connection->in_packet_size = 0;
 	new_connection->client_id = NULL;
 	new_connection->keep_alive = 0;
 	new_connection->topics = create_topics_list();
+	new_connection->last_publish = 0;
+	new_connection->publish_qos = 0;
+	inflight_init(&new_connection->inflight);
+	packet_id_set_init(&new_connection->received);
 	new_connection->packet_id = 0;
-	new_connection->last_topic_before_insert = NULL;
-	new_connection->last_seen = time(NULL);
+	new_connection->last_seen = conns->now;
 	new_connection->seen_connect_packet = 0;
-
-	clear_message(new_connection, 0);
+	new_connection->persistent = 0;
+	new_connection->session_present = 0;
+	new_connection->detached = 0;
+	new_connection->handoff = NULL;
+	new_connection->wal_acks = 0;
+	new_connection->uring_requests = 0;
+	new_connection->uring_sends = 0;
+	new_connection->uring_iov = NULL;
+
+	clear_message(new_connection);
+	return new_connection;
 }
 
-struct connection *
-clear_one_connection(struct connection *conn, struct connections *conns, poll_list_t* plist) {
-	if (shutdown(plist->poll_fds[conn->poll_list_index].fd, SHUT_RDWR) == -1) {
-		log_info("shutdown failed");
-	}
-	if (close(plist->poll_fds[conn->poll_list_index].fd) == -1) {
-		err(1, "closing fd when deleting connection");
-	}
-	struct connection *next = conn->next;
-	struct connection *prev = conn->prev;
-
-	if (prev)
-		prev->next = next;
-
-	if (next)
-		next->prev = prev;
-
-	if (conn == conns->conn_back) {
-		conns->conn_back = next;
-	}
+/**
+ * Frees all connections cleared during this event loop iteration. Connections
+ * still referenced by io_uring requests in flight are kept until the requests
+ * complete, those with acknowledgements waiting for write-ahead log commit
+ * until the commit.
+ */
+void
+free_closed_connections(struct connections *conns) {
+	struct connection *busy = NULL;
+	struct connection *next;
+	for (
+		struct connection *conn = conns->closed;
+		conn != NULL;
+		conn = next
+	) {
+		next = conn->next_closed;
+		if (conn->uring_requests > 0 || conn->wal_acks > 0) {
+			conn->next_closed = busy;
+			busy = conn;
+			continue;
+		}
 
-	if (conn == conns->conn_head) {
-		conns->conn_head = prev;
+		free(conn->uring_iov);
+		buffer_free(conn->in_buffer);
+		conns->stats.counters[STATS_QUEUE_MESSAGES] -= conn->out_queue.count;
+		conns->stats.counters[STATS_QUEUE_BYTES] -= conn->out_queue.bytes;
+		out_queue_free(&conn->out_queue);
+		inflight_free(&conn->inflight);
+		packet_id_set_free(&conn->received);
+		free(conn->client_id);
+		slab_free(&pools_local()->connections, conn);
 	}
-
-	conns->count--;
-	free(conn->client_id);
-	delete_topics_list(conn->topics);
-	free(conn);
-	return next;
+	conns->closed = busy;
 }
 
 /**
@@ -132,11 +191,13 @@ clear_one_connection(struct connection *conn, struct connections *conns, poll_li
  * listening afterwards.
  * 
  * \param portstr Port number to be used, in string form.
+ * \param reuse_port If non-zero, SO_REUSEPORT is set, so more sockets (one
+ * 					 for every worker thread) can be bound to the same port.
  * 
  * \returns File descriptor of bound socket.
  */
 int
-find_connection(char* portstr) {
+find_connection(char* portstr, int reuse_port) {
 	int sock_fd = 0;
 
 	struct addrinfo *info, *info_orig, hint;
@@ -151,7 +212,13 @@ find_connection(char* portstr) {
 
 	int bind_successful = 0;
 	for (info = info_orig; info != NULL; info = info->ai_next) {
-		sock_fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+		sock_fd = socket(
+			info->ai_family,
+			info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			info->ai_protocol
+		);
+		if (sock_fd == -1)
+			err(1, "socket");
 
 		int opt = 1;
 		if (setsockopt(
@@ -161,8 +228,13 @@ find_connection(char* portstr) {
 			err(1, "setsockopt (for main listening socket)");
 		}
 
-		if (sock_fd == -1)
-			err(1, "socket");
+		if (reuse_port && setsockopt(
+				sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)
+			) == -1
+		) {
+			err(1, "setsockopt SO_REUSEPORT (for main listening socket)");
+		}
+
 		if (!bind(sock_fd, info->ai_addr, info->ai_addrlen)) {
 			bind_successful = 1;
 			break;
@@ -178,17 +250,6 @@ find_connection(char* portstr) {
 	return sock_fd;
 }
 
-/**
- * Initialize connections linked list.
- */
-void
-conns_init(struct connections *conns) {
-	memset(conns, 0, sizeof(struct connections));
-	conns->count = 0;
-	conns->conn_back = NULL;
-	conns->conn_head = NULL;
-}
-
 /**
  * Return MQTT control packet type.
  */
@@ -200,7 +261,8 @@ get_mqtt_type(uint8_t packet_type_flags) {
 }
 
 /**
- * Checks correct flag settings for (UN)SUBSCRIBE MQTT control packets.
+ * Checks correct flag settings for (UN)SUBSCRIBE and PUBREL MQTT control
+ * packets.
  * 
  * \returns Zero if they don't match, non-zero otherwise.
  */
@@ -213,9 +275,25 @@ check_subscribe_flags(uint8_t packet_type_flags) {
 }
 
 /**
- * Checks correct flag settings for all MQTT control packets but (UN)SUBSCRIBE.
- * CONNECT control packet does not support Clean session (or rather it only
- * supports clean session set to 1).
+ * Checks correct flag settings for PUBLISH MQTT control packet. QoS may be at
+ * most MQTT_MAX_QOS, DUP flag is set only for QoS above 0.
+ * 
+ * \returns Zero if they don't match, non-zero otherwise.
+ */
+uint8_t
+check_publish_flags(uint8_t packet_type_flags) {
+	uint8_t qos = (packet_type_flags >> 1) & 0x03;
+	if (qos > MQTT_MAX_QOS)
+		return 0;
+	else if (qos == 0 && (packet_type_flags & 0x08))
+		return 0;
+	else
+		return 1;
+}
+
+/**
+ * Checks correct flag settings for all MQTT control packets but (UN)SUBSCRIBE
+ * and PUBLISH.
  * 
  * \returns Zero if they don't match, non-zero otherwise.
  */
@@ -243,316 +321,226 @@ print_msg_type(ctrl_packet_t type) {
 }
 
 /**
- * \brief Processes all data in MQTT control packet that follows after fixed
- * header.
- * 
- * For packets that don't contain any additional information besides fixed
- * header, method will set control packet type, and return.
- * 
- * If format of packet is incorrect, connection will be terminated.
- * Otherwise message and its size is appropriately set for given peer.
+ * Checks first byte of fixed header (control packet type and flags) and sets
+ * control packet type of incoming message.
  * 
  * \param conn Connection linked list entry.
- * \param fixed_header Fixed header in byte form.
- * \param fd File descriptor of client to read from.
+ * \param packet_type_flags First byte of fixed header.
  * 
- * \return -1 is delete_me flag was set and connection is scheduled for deletion, 0 otherwise.
+ * \return -1 if connection has to be deleted, 0 otherwise.
  */
 int
-process_incoming_data_from_client(struct connection *conn, char *fixed_header, int fd) {
-	if (conn->message_size == 0) {
-		/* do only on first call for given message */
-
-		char packet_type_flags = fixed_header[0];
+check_fixed_header(struct connection *conn, uint8_t packet_type_flags) {
+	conn->type = get_mqtt_type(packet_type_flags);
+	conn->flags = packet_type_flags & 0x0F;
 
-		conn->type = get_mqtt_type((uint8_t) packet_type_flags);
+	if (conn->type == MQTT_DISCONNECT) {
+		log_info("Client %s disconnecting.", conn->client_id);
+		return -1;
+	}
 
-		if (conn->type == MQTT_PINGREQ || conn->type == MQTT_DISCONNECT) {
-			// for messages with empty remaining length
-			conn->message_size = -1;
-			if (conn->type == MQTT_DISCONNECT) {
-				log_info("Client %s disconnecting.", conn->client_id);				
-				return -1;
-			}
-			return 0;
+	if (conn->type == MQTT_SUBSCRIBE || conn->type == MQTT_UNSUBSCRIBE) {
+		if (!check_subscribe_flags(packet_type_flags)) {
+			log_warn("Invalid flags for (UN)SUBSCRIBE control packet.");
+			return -1;
 		}
-
-		if (conn->type == MQTT_SUBSCRIBE || conn->type == MQTT_UNSUBSCRIBE) {
-			if (!check_subscribe_flags(packet_type_flags)) {
-				log_warn("Invalid flags for (UN)SUBSCRIBE control packet.");
-				return -1;
-			}
+	}
+	else if (conn->type == MQTT_PUBREL) {
+		if (!check_subscribe_flags(packet_type_flags)) {
+			log_warn("Invalid flags for PUBREL control packet.");
+			return -1;
 		}
-		else {
-			if (!check_zeroed_flags(packet_type_flags)) {
-				log_warn(
-					"Invalid flags for control packet (first byte of fixed header)."
-				);
-				return -1;
-			}
+	}
+	else if (conn->type == MQTT_PUBLISH) {
+		if (!check_publish_flags(packet_type_flags)) {
+			log_warn("Invalid flags for PUBLISH control packet.");
+			return -1;
 		}
-
-		conn->message_size = conn->length_left_to_read;
-		conn->buffer_left_to_read = calloc(conn->length_left_to_read, sizeof(char));
-		if (!conn->buffer_left_to_read)
-			err(1, "process incoming data calloc buffer reallocate");
 	}
-
-	/* do for all calls for given message */
-
-	int buffer_offset = conn->message_size - conn->length_left_to_read;
-	ssize_t bytes_read = read(fd, conn->buffer_left_to_read + buffer_offset, conn->length_left_to_read);
-
-	if (bytes_read == -1)
-		err(1, "read");
-
-	conn->length_left_to_read -= bytes_read;
-	
-	if (bytes_read == 0 && conn->length_left_to_read > 0) {
-		log_error("Unexpected EOF when reading message.");
-		return -1;
-	} else if (conn->length_left_to_read == 0) {
-		conn->message = conn->buffer_left_to_read;
+	else {
+		if (!check_zeroed_flags(packet_type_flags)) {
+			log_warn(
+				"Invalid flags for control packet (first byte of fixed header)."
+			);
+			return -1;
+		}
 	}
+
 	return 0;
 }
 
 /**
- * Prints all connections. For debugging purposes only.
+ * Reads from non-blocking socket, read interrupted by signal is repeated.
+ * 
+ * \returns Number of bytes read, 0 if read would block, -1 on EOF or error.
  */
-void
-print_conns(struct connections* conns, plist_ptr plist) {
-	if (conns->count == 0) {
-		log_debug("No connections were found.");
-		return;
-	}
-	log_debug("Printing connections:");
-	int i = 0, j;
-	for (
-		struct connection *conn = conns->conn_back;
-		conn != NULL;
-		conn = conn->next
-	) {
-		log_debug(".%d. fd: %p", i, conn);
-		log_debug(".%d. fd: %d", i, plist->poll_fds[conn->poll_list_index].fd);
-		log_debug(".%d. client_id: %s", i, conn->client_id);
-		log_debug(".%d. keep_alive: %d", i, conn->keep_alive);
-		log_debug(".%d. message size: %d", i, conn->message_size);
-		log_debug(".%d. topics:", i);
-		j = 0;
-		for (
-			topic_t *topic = conn->topics->back;
-			topic != NULL;
-			topic = topic->next
-		) {
-			log_debug(".%d.%d. topic: %s", i, j, topic->topic);
-			for (int k = 0; k < topic->topic_token_count; k++) {
-				log_debug(
-					".%d.%d.%d. token: %s", i, j, k, topic->tokenized_topic[k]
-				);
-			}
-			log_debug(".%d.%d. QoS code: %#04x", i, j, topic->qos_code);
-			j++;
-		}
-		i++;
-	}
+ssize_t
+read_nonblocking(int fd, char *buffer, size_t size) {
+	ssize_t bytes_read;
+
+	do {
+		bytes_read = read(fd, buffer, size);
+	} while (bytes_read == -1 && errno == EINTR);
+
+	if (bytes_read > 0)
+		return bytes_read;
+	if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	return -1;
 }
 
 /**
- * \brief Reads fixed header from socket file descriptor.
- * 
- * Remaining length is dynamically read as needed. Invalid remaining length
- * value will cause the connection to terminate.
- * 
- * \param conn Connection.
- * 
- * \returns Allocated buffer containing fixed header in bytes.
- */
-char*
-read_fixed_header(conn_t *conn, int pfd) {
-	char *buffer = calloc(6, 1);
-	if (!buffer)
-		err(1, "fixed header calloc buffer");
-	ssize_t read_bytes = 0;
-	ssize_t read_bytes_acc = 0;
-
-	// read control packet type/flags and first remaining length byte
-	read_bytes = read(pfd, buffer, 2);
-	read_bytes_acc += read_bytes;
-
-	if (read_bytes == 0) {
-		free(buffer);
-		return NULL;
-	}
+ * Decodes fixed header of control packet at start of given bytes: checks
+ * control packet type and flags and decodes remaining length.
+ *
+ * \param header_size Set to size of fixed header in bytes.
+ *
+ * \return 1 if fixed header was decoded, 0 if more bytes are needed, -1 if
+ * 		   connection has to be deleted (malformed or unexpected packet).
+ */
+int
+decode_fixed_header(
+	struct connection *conn, const char *data, size_t size,
+	size_t *header_size
+) {
+	int remaining_length = 0;
+	int multiplier = 1;
+	uint8_t byte;
+
+	if (size == 0)
+		return 0;
 
-	// read packet control type and first remaining length byte
-	while (read_bytes_acc < 2) {
-		read_bytes = read(
-			pfd, buffer + read_bytes_acc, 2 - read_bytes_acc
-		);
-		read_bytes_acc += read_bytes;
-	}
+	if (check_fixed_header(conn, (uint8_t) data[0]) == -1)
+		return -1;
+
+	for (size_t i = 1; ; i++) {
+		if (i >= size)
+			return 0;
+
+		byte = (uint8_t) data[i];
+		remaining_length += (byte & 127) * multiplier;
+
+		if ((byte & 128) == 0) {
+			*header_size = i + 1;
+			break;
+		}
 
-	// read other remaining length bytes, if needed
-	while ((buffer[read_bytes_acc - 1] & 128) != 0 && read_bytes_acc < 5) {
-		read_bytes = read(pfd, buffer + read_bytes_acc, 1);
-		read_bytes_acc += read_bytes;
+		multiplier *= 128;
+		if (multiplier > 128 * 128 * 128) {
+			log_error("Malformed remaining length.");
+			return -1;
+		}
 	}
 
-	// check if remaining len isn't too long
-	if ((buffer[read_bytes_acc - 1] & 128) != 0 && read_bytes_acc >= 5) {
-		free(buffer);
-		return NULL;
+	if (remaining_length == 0 && conn->type != MQTT_PINGREQ) {
+		log_warn("Empty control packet from %s.", conn->client_id);
+		return -1;
 	}
 
-	return buffer;
+	conn->remaining_length = remaining_length;
+	return 1;
 }
 
 /**
- * Checks for POLLIN `poll` flag in active connections.
- * 
- * If yes, message is read from socket.
- * 
- * \param conns pointer to connections structure
+ * Makes room for at least `size` received bytes at the end of receive buffer
+ * of connection. Unparsed bytes are moved to start of the buffer, buffer
+ * grows by doubling if they still do not leave enough room.
  */
 void
-check_poll_in(struct connections *conns, plist_ptr plist) {
-	if (conns->count == 0) return;
+receive_buffer_reserve(struct connection *conn, size_t size) {
+	size_t unparsed = conn->in_end - conn->in_start;
 
-	if (poll(plist->poll_fds, plist->index, POLL_WAIT_TIME) == -1) {
-		if (errno == EINTR) {
-			return;
-		}
-		err(1, "poll in check");
+	if (conn->in_start > 0) {
+		memmove(conn->in_buffer, conn->in_buffer + conn->in_start, unparsed);
+		conn->in_start = 0;
+		conn->in_end = unparsed;
 	}
 
-	int fd = 0;
-	struct connection* next;
-	for (
-		struct connection* conn = conns->conn_back;
-		conn != NULL;
-		conn = next
-	) {
-		next = conn->next;
-		if (plist->poll_fds[conn->poll_list_index].revents & POLLIN) {
-			fd = plist->poll_fds[conn->poll_list_index].fd;
-			char *fixed_header = read_fixed_header(conn, fd);
-			if (!fixed_header) {
-				next = clear_one_connection(conn, conns, plist);
-				continue;
-			}
-			conn->length_left_to_read = from_val_len_to_uint(fixed_header + 1);
-			if (process_incoming_data_from_client(conn, fixed_header, fd) == -1) {
-				next = clear_one_connection(conn, conns, plist);
-			}
-			free(fixed_header);
-		}
-	}
+	if (conn->in_capacity - unparsed >= size)
+		return;
 
-	int at_least_one_still_reading = 1;
-	while (at_least_one_still_reading) {
-		at_least_one_still_reading = 0;
-		for (
-			struct connection* conn = conns->conn_back;
-			conn != NULL;
-			conn = next
-		) {
-			next = conn->next;
-			if (conn->length_left_to_read > 0) {
-				at_least_one_still_reading = 1;
-				fd = plist->poll_fds[conn->poll_list_index].fd;
-				if (process_incoming_data_from_client(conn, "", fd) == -1) {
-					next = clear_one_connection(conn, conns, plist);
-				}
-			}
-		}
+	size_t capacity = conn->in_capacity ? conn->in_capacity : RECEIVE_BUFFER_SIZE;
+	while (capacity - unparsed < size) {
+		capacity *= 2;
 	}
+
+	char *buffer = buffer_alloc(capacity);
+	if (unparsed > 0)
+		memcpy(buffer, conn->in_buffer, unparsed);
+	buffer_free(conn->in_buffer);
+	conn->in_buffer = buffer;
+	conn->in_capacity = capacity;
 }
 
 /**
- * Polling for listening socket, waiting for new connections.
- * 
- * \param conns Connections linked list.
- * \param listening_pfd `struct pollfd` with listeinig socket fd.
+ * Marks bytes of receive buffer as parsed. When the buffer gets empty, its
+ * positions are reset and buffer grown for a large control packet is
+ * released, so that it does not stay allocated for idle connection.
  */
 void
-poll_and_accept(struct connections *conns, struct pollfd *listening_pfd, plist_ptr plist) {
-	int nfd = -1;
-	listening_pfd->events = POLLIN;
-
-	if (poll(listening_pfd, 1, POLL_WAIT_TIME) == -1) {
-		if (errno == EINTR)
-			return;
-		err(1, "poll listening pfd");
-	}
+receive_buffer_consume(struct connection *conn, size_t size) {
+	conn->in_start += size;
+	if (conn->in_start < conn->in_end)
+		return;
 
-	if (listening_pfd->revents & POLLIN) {
-		if ((nfd = accept(listening_pfd->fd, NULL, NULL)) == -1)
-			err(3, "accept");
-		add_connection(conns, nfd, plist);
+	conn->in_start = 0;
+	conn->in_end = 0;
+	if (conn->in_capacity > RECEIVE_BUFFER_SIZE) {
+		buffer_free(conn->in_buffer);
+		conn->in_buffer = NULL;
+		conn->in_capacity = 0;
 	}
 }
 
 /**
- * Checks for POLLHUP `poll` flag in active connections.
- * 
- * \param conns pointer to connections structure
+ * \returns Number of bytes receive buffer needs free for next read: rest of
+ * 			partially received control packet, but at least half of initial
+ * 			buffer size, so reads stay large.
  */
-void
-check_poll_hup(struct connections *conns, plist_ptr plist) {
-	if (poll(plist->poll_fds, plist->index, POLL_WAIT_TIME) == -1) {
-		if (errno == EINTR) {
-			return;
-		}
-		err(1, "poll hup check");
-	}
-	
-	struct connection* next;
-	for (
-		struct connection* conn = conns->conn_back;
-		conn != NULL;
-		conn = next
-	) {
-		next = conn->next;
-		if (plist->poll_fds[conn->poll_list_index].revents & (POLLHUP | POLLERR | POLLNVAL)) {
-			next = clear_one_connection(conn, conns, plist);
-		}
-	}
+size_t
+receive_buffer_wanted(struct connection *conn) {
+	size_t unparsed = conn->in_end - conn->in_start;
+	size_t wanted = RECEIVE_BUFFER_SIZE / 2;
+
+	if (conn->in_packet_size > unparsed + wanted)
+		wanted = conn->in_packet_size - unparsed;
+	return wanted;
 }
 
 /**
- * Checks for POLLOUT `poll` flag in active connections.
- * 
- * If yes, if any message is waiting to be sent (in state 1) and with non-zero
- * message length, it is written to appropriate socket.
- * 
- * \param conns pointer to connections structure
+ * Prints all connections. For debugging purposes only.
  */
 void
-check_poll_out(struct connections *conns, poll_list_t* plist) {
-	if (poll(plist->poll_fds, plist->index, POLL_WAIT_TIME) == -1) {
-		if (errno == EINTR) {
-			return;
-		}
-		err(1, "poll out check");
+print_conns(struct connections* conns) {
+	if (conns->count == 0) {
+		log_debug("No connections were found.");
+		return;
 	}
-
+	log_debug("Printing connections:");
+	int i = 0, j;
 	for (
-		struct connection* conn = conns->conn_back;
+		struct connection *conn = conns->conn_back;
 		conn != NULL;
 		conn = conn->next
 	) {
-		if (conn->state == 1 &&
-			conn->message_size > 0 &&
-			plist->poll_fds[conn->poll_list_index].revents & POLLOUT
+		log_debug(".%d. fd: %p", i, conn);
+		log_debug(".%d. fd: %d", i, conn->fd);
+		log_debug(".%d. client_id: %s", i, conn->client_id);
+		log_debug(".%d. keep_alive: %d", i, conn->keep_alive);
+		log_debug(".%d. message size: %d", i, conn->message_size);
+		log_debug(".%d. out queue: %zu", i, conn->out_queue.count);
+		log_debug(".%d. topics:", i);
+		j = 0;
+		for (
+			topic_t *topic = conn->topics->back;
+			topic != NULL;
+			topic = topic->next
 		) {
-			write(
-				plist->poll_fds[conn->poll_list_index].fd,
-				conn->message,
-				conn->message_size
-			);
-			clear_message(conn, 1);
+			log_debug(".%d.%d. topic: %s", i, j, topic->topic);
+			log_debug(".%d.%d. QoS code: %#04x", i, j, topic->qos_code);
+			j++;
 		}
+		i++;
 	}
 }
 
@@ -569,37 +557,48 @@ check_poll_out(struct connections *conns, poll_list_t* plist) {
  */
 int
 process_mqtt_message(struct connection *conn, struct connections *conns) {
-	char *incoming_message, *outgoing_message;
-	incoming_message = conn->message; // no fixed header here
-	outgoing_message = NULL;
+	char *incoming_message = conn->message; // no fixed header here
+	frame_t *outgoing_message = NULL;
 	int code = 255;
 	int topics_inserted_code = 255;
-	conn->last_seen = time(NULL);
+	connect_header_t header;
+	conn->last_seen = conns->now;
 	ctrl_packet_t conn_type = conn->type;
+	conns->stats.counters[STATS_MESSAGES_RECEIVED]++;
 
 	if (conn_type != MQTT_CONNECT && conn->seen_connect_packet == 0) {
 		return -1;
 	}
 
-	int publish_send_to_sender = 0;
 	switch (conn_type) {
 		case MQTT_CONNECT:
 			if (conn->seen_connect_packet == 1) {
 				return -1;
 			}
+			if (parse_connect_header(conn, incoming_message, &header) == -1)
+				return -1;
+			// session of the client is owned by another worker, CONNECT is
+			// processed there
+			conn->handoff = route_connect_message(conns, &header);
+			if (conn->handoff) {
+				clear_message(conn);
+				return 0;
+			}
 			conn->seen_connect_packet = 1;
-			code = read_connect_message(conns, conn, incoming_message);
+			code = read_connect_message(conns, conn, incoming_message, &header);
 			int failed = 0;
-			outgoing_message = create_connect_response(conn, conns, code, &failed);
-			if (failed)
+			outgoing_message = create_connect_response(conn, code, &failed);
+			if (failed) {
+				if (outgoing_message)
+					frame_release(outgoing_message);
 				return -1;
+			}
 			break;
 		case MQTT_DISCONNECT:
 			return -1;
 		case MQTT_SUBSCRIBE:
-			conn->last_topic_before_insert = conn->topics->head;
 			topics_inserted_code = read_un_subscribe_message(
-				conn, incoming_message
+				conns, conn, incoming_message
 			);
 			if (topics_inserted_code == -1)
 				return -1;
@@ -610,9 +609,8 @@ process_mqtt_message(struct connection *conn, struct connections *conns) {
 				return -1;
 			break;
 		case MQTT_UNSUBSCRIBE:
-			conn->last_topic_before_insert = conn->topics->head;
 			topics_inserted_code = read_un_subscribe_message(
-				conn, incoming_message
+				conns, conn, incoming_message
 			);
 			outgoing_message = create_un_subscribe_response(
 				conn, conns, topics_inserted_code
@@ -623,93 +621,843 @@ process_mqtt_message(struct connection *conn, struct connections *conns) {
 		case MQTT_PUBLISH:
 			;
 
-			publish_t *publish = read_publish_message(
-				conn, incoming_message
-			);
+			publish_t publish;
+			if (read_publish_message(conn, incoming_message, &publish) == -1) {
+				log_warn("Malformed PUBLISH from %s.", conn->client_id);
+				return -1;
+			}
 
-			if (contains_wildcard_char(publish->topic))
+			if (!is_valid_topic_name(
+				publish.topic, publish.topic_size, &conns->topic_tree.scan
+			)) {
+				log_warn("Invalid PUBLISH topic from %s.", conn->client_id);
 				return -1;
+			}
+			publish.levels = &conns->topic_tree.scan;
+			conns->stats.counters[STATS_PUBLISH_RECEIVED]++;
 
-			publish_send_to_sender = send_published_message(
-				conn, conns, publish
-			);
+			if (publish.qos == 2) {
+				outgoing_message = create_publish_ack(
+					MQTT_PUBREC, publish.packet_id
+				);
+				// QoS 2 message is delivered only once, until it is released
+				if (packet_id_set_contains(&conn->received, publish.packet_id))
+					break;
+				if (packet_id_set_insert(
+					&conn->received, publish.packet_id
+				) == -1) {
+					log_warn(
+						"Too many QoS 2 messages from %s not released.",
+						conn->client_id
+					);
+					frame_release(outgoing_message);
+					return -1;
+				}
+			}
+			else if (publish.qos == 1) {
+				outgoing_message = create_publish_ack(
+					MQTT_PUBACK, publish.packet_id
+				);
+			}
+
+			send_published_message(conn, conns, &publish);
+			break;
+		case MQTT_PUBACK:
+		case MQTT_PUBREC:
+		case MQTT_PUBCOMP:
+			if (read_publish_ack(conns, conn, incoming_message) == -1) {
+				log_warn("Malformed acknowledgement from %s.", conn->client_id);
+				return -1;
+			}
+			break;
+		case MQTT_PUBREL:
+			;
 
-			free(publish->topic);
-			free(publish->message);
-			free(publish);
+			uint16_t packet_id;
+			if (read_pubrel_message(conn, incoming_message, &packet_id) == -1) {
+				log_warn("Malformed PUBREL from %s.", conn->client_id);
+				return -1;
+			}
+			outgoing_message = create_publish_ack(MQTT_PUBCOMP, packet_id);
 			break;
 		case MQTT_PINGREQ:
-			outgoing_message = calloc(2, 1);
-			if (!outgoing_message)
-				err(1, "process mqtt msg calloc outgoing_message");
-			*outgoing_message = (char) 0xD0;
-			*(outgoing_message + 1) = 0x00;
-			conn->message_size = 2;
+			outgoing_message = frame_create(2);
+			outgoing_message->data[0] = (char) 0xD0;
+			outgoing_message->data[1] = 0x00;
 			break;
 		default:
 			log_error("Not implemented / unsupported control packet type from %s", conn->client_id);
 			return -1;
 	}
 
-	if (conn_type != MQTT_PUBLISH && conn_type != MQTT_DISCONNECT) {
-		/* PUBLISH and DISCONNECT don't have direct replies, no outgoing
-		 * message needs to be sent */
-		if (conn_type != MQTT_PINGREQ)
-			free(conn->message);
-		// no answer to sender in PUBLISH message (in QoS 0)
-		conn->message = outgoing_message;
-		conn->state = 1;
+	// PUBACK or PUBREC is sent once the message is in write-ahead log on disk
+	if (conn_type == MQTT_PUBLISH && outgoing_message && conns->worker->wal.dir) {
+		wal_defer_ack(&conns->worker->wal, conn, outgoing_message);
+		conn->wal_acks++;
+		outgoing_message = NULL;
 	}
 
-	if (conn_type == MQTT_PUBLISH && !publish_send_to_sender) {
-		// if peer is not publishing to itself, its message needs to be cleared
-		clear_message(conn, 1);
+	/* PUBLISH doesn't have direct reply in QoS 0, PUBACK, PUBREC and PUBCOMP
+	 * have none at all, no outgoing message needs to be sent */
+	if (outgoing_message && queue_frame(conns, conn, outgoing_message) == -1) {
+		log_warn("Outgoing queue of %s is full.", conn->client_id);
+		return -1;
 	}
 
+	// retained messages follow SUBACK
+	if (conn_type == MQTT_SUBSCRIBE)
+		send_retained_messages(conns, conn, topics_inserted_code);
+	// messages of resumed session follow CONNACK
+	if (conn_type == MQTT_CONNECT && conn->session_present)
+		resume_inflight_messages(conns, conn);
+	if (conn_type == MQTT_SUBSCRIBE || conn_type == MQTT_UNSUBSCRIBE)
+		session_save(conns, conn);
+
+	clear_message(conn);
 	return 0;
 }
 
 /**
- * Process MQTT control packets (messages), if any were received after last
- * check.
+ * Writes frames from outgoing queue of connection to its non-blocking socket.
+ *
+ * Frames are gathered and written together with `writev`. When socket buffer
+ * gets full, offset into partially written frame is kept in the queue and
+ * writing continues on next EPOLLOUT. EPOLLOUT stays registered
+ * edge-triggered, it is acted upon only while the queue is not empty.
+ *
+ * \returns 1 if whole queue was written, 0 if socket buffer is full, -1 on
+ * 			write error.
  */
-void
-check_and_process_mqtt_messages(struct connections *conns, plist_ptr plist) {
-	struct connection* next;
-	for (
-		struct connection* conn = conns->conn_back;
-		conn != NULL;
-		conn = next
-	) {
-		next = conn->next;
-		if (conn->message_size != 0 && conn->state == 0) {
-			if (process_mqtt_message(conn, conns) == -1) {
-				next = clear_one_connection(conn, conns, plist);
-			}
+int
+write_out_queue(struct connections *conns, struct connection *conn) {
+	out_queue_t *queue = &conn->out_queue;
+	struct iovec iov[WRITE_BATCH_SIZE];
+	int iov_count = 0;
+	size_t batch_size = 0;
+	ssize_t written = 0;
+
+	while (queue->count > 0) {
+		iov_count = out_queue_gather(queue, iov, WRITE_BATCH_SIZE);
+		batch_size = 0;
+		for (int i = 0; i < iov_count; i++) {
+			batch_size += iov[i].iov_len;
 		}
-	}
-}
 
-/**
- * Check that all MQTT clients are still alive (if their respective keep alive
- * value is positive).
- */
-void
-check_keep_alive(conns_t *conns, plist_ptr plist) {
-	conn_t *next;
-	for (
-		conn_t *conn = conns->conn_back;
+		written = writev(conn->fd, iov, iov_count);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		size_t count = queue->count;
+		size_t bytes = queue->bytes;
+		conns->stats.counters[STATS_MESSAGES_SENT] += out_queue_consume(
+			queue, written
+		);
+		account_out_queue(conns, conn, count, bytes);
+		conns->stats.counters[STATS_BYTES_SENT] += written;
+
+		// short write means socket buffer is full, EPOLLOUT will follow
+		if ((size_t) written < batch_size)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Submits outgoing queue of connection to io_uring as a chain of linked
+ * writev requests, so they are written in order. Nothing is submitted while
+ * previous chain is in flight, its completion schedules the rest of the queue.
+ *
+ * Frames stay in the queue until their writes complete.
+ */
+void
+uring_write_out_queue(uring_t *uring, struct connection *conn) {
+	if (conn->uring_sends > 0)
+		return;
+
+	if (!conn->uring_iov) {
+		conn->uring_iov = calloc(
+			WRITE_BATCH_SIZE * URING_SEND_LINKS, sizeof(struct iovec)
+		);
+		if (!conn->uring_iov)
+			err(1, "uring write calloc iov");
+	}
+
+	int iov_count = out_queue_gather(
+		&conn->out_queue, conn->uring_iov, WRITE_BATCH_SIZE * URING_SEND_LINKS
+	);
+	uint64_t user_data = (uintptr_t) conn | URING_SEND;
+
+	for (int i = 0; i < iov_count; i += WRITE_BATCH_SIZE) {
+		int count = iov_count - i < WRITE_BATCH_SIZE
+			? iov_count - i
+			: WRITE_BATCH_SIZE;
+		uring_writev(
+			uring, conn->fd, conn->uring_iov + i, count, user_data,
+			i + count < iov_count
+		);
+		conn->uring_sends++;
+		conn->uring_requests++;
+	}
+	conn->out_queue.locked = iov_count;
+}
+
+/**
+ * Syncs messages logged in write-ahead log since last commit, once commit
+ * window of the batch passed, and queues acknowledgements that waited for
+ * them. Segments of acknowledged messages are deleted.
+ *
+ * \param force Commit regardless of commit window.
+ */
+void
+commit_write_ahead_log(worker_t *worker, int force) {
+	wal_t *wal = &worker->wal;
+	struct connections *conns = &worker->conns;
+
+	if (!wal->dir)
+		return;
+
+	if ((force && (wal->batch_records > 0 || wal->ack_count > 0))
+		|| wal_commit_due(wal)
+	) {
+		// acknowledged messages must not be lost, broker cannot go on
+		if (wal_commit(wal) == -1)
+			err(1, "write-ahead log commit");
+
+		for (size_t i = 0; i < wal->ack_count; i++) {
+			struct connection *conn = wal->acks[i].conn;
+			conn->wal_acks--;
+			if (conn->closing) {
+				frame_release(wal->acks[i].frame);
+			} else if (queue_frame(conns, conn, wal->acks[i].frame) == -1) {
+				log_warn("Outgoing queue of %s is full.", conn->client_id);
+				clear_one_connection(conn, conns);
+			}
+		}
+		wal->ack_count = 0;
+	}
+
+	wal_truncate(wal, conns->now);
+}
+
+/**
+ * Writes outgoing queues of all connections in pending out list and empties
+ * the list. Connections that failed to write are cleared, congested ones too
+ * with disconnect policy.
+ *
+ * \param conns Connections linked list.
+ */
+void
+flush_pending_out(struct connections *conns) {
+	struct connection *next;
+	for (
+		struct connection *conn = conns->pending_out;
 		conn != NULL;
 		conn = next
 	) {
-		next = conn->next;
-		if (
-			conn->keep_alive != 0 &&
-			conn->last_seen + conn->keep_alive * 1.5 < time(NULL)
+		next = conn->next_pending_out;
+		conn->next_pending_out = NULL;
+		conn->pending_out = 0;
+
+		if (conn->closing)
+			continue;
+
+		if (conns->worker && conns->worker->use_uring) {
+			uring_write_out_queue(&conns->worker->uring, conn);
+		} else if (write_out_queue(conns, conn) == -1) {
+			clear_one_connection(conn, conns);
+			continue;
+		} else {
+			check_congestion_end(conns, conn);
+		}
+
+		// client which does not keep up with its messages is dropped
+		if (conn->congested
+			&& conns->congestion_policy == CONGESTION_DISCONNECT
 		) {
-			next = clear_one_connection(conn, conns, plist);
+			log_warn("Disconnecting slow client %s.", conn->client_id);
+			clear_one_connection(conn, conns);
+		}
+	}
+	conns->pending_out = NULL;
+}
+
+/**
+ * \brief Parses and processes all complete MQTT control packets in received
+ * bytes.
+ * 
+ * Control packets are processed in order they were received. Message of
+ * control packet (without fixed header) is not copied, it points into given
+ * bytes while the packet is processed. For packets without body (PINGREQ)
+ * message size is set to -1.
+ * 
+ * When the last control packet is not complete, size of the whole packet is
+ * remembered (if its fixed header is complete already), so that receive
+ * buffer can grow to fit it.
+ * 
+ * Processing stops at CONNECT of connection which is handed over to another
+ * worker, the CONNECT and everything after it stays unprocessed.
+ * 
+ * \param conn Connection the bytes were received from.
+ * \param conns Connections linked list.
+ * \param data Received bytes.
+ * \param size Number of received bytes.
+ * 
+ * \return Number of bytes of processed control packets, -1 if connection has
+ * 		   to be deleted.
+ */
+ssize_t
+process_received(
+	struct connection *conn, struct connections *conns, char *data,
+	size_t size
+) {
+	size_t offset = 0;
+	size_t header_size = 0;
+	int decoded;
+
+	conn->in_packet_size = 0;
+
+	while (offset < size && !conn->handoff) {
+		decoded = decode_fixed_header(
+			conn, data + offset, size - offset, &header_size
+		);
+		if (decoded == -1)
+			return -1;
+		if (decoded == 0)
+			break;
+
+		size_t packet_size = header_size + conn->remaining_length;
+		if (packet_size > size - offset) {
+			conn->in_packet_size = packet_size;
+			break;
+		}
+
+		if (conn->remaining_length == 0) {
+			conn->message = NULL;
+			conn->message_size = -1;
 		}
+		else {
+			conn->message = data + offset + header_size;
+			conn->message_size = conn->remaining_length;
+		}
+		conns->stats.counters[STATS_BYTES_RECEIVED] += packet_size;
+		if (process_mqtt_message(conn, conns) == -1)
+			return -1;
+		if (conn->handoff)
+			break;
+		offset += packet_size;
 	}
+
+	return offset;
+}
+
+/**
+ * Reads and processes all MQTT control packets waiting in client's socket.
+ *
+ * Bytes are read into receive buffer of connection, as many as fit, with
+ * one read, and every complete control packet in it is processed. Bytes of
+ * incomplete packet stay in the buffer until the rest arrives. Reactor is
+ * edge-triggered, so reading repeats until read returns less than it could,
+ * i.e. socket is drained. With io_uring, bytes are already received into
+ * buffer of the ring, they are parsed right there and only incomplete packet
+ * at their end is copied into receive buffer.
+ *
+ * Replies and published messages are only queued, they are written once all
+ * ready events are handled.
+ *
+ * \param conn Connection with readable socket.
+ * \param conns Connections linked list.
+ * \param in Bytes received by io_uring, NULL to read from socket.
+ *
+ * \returns -1 if connection has to be deleted, 0 otherwise.
+ */
+int
+read_from_client(
+	struct connection *conn, struct connections *conns, in_data_t *in
+) {
+	ssize_t processed;
+
+	if (in && conn->in_end == conn->in_start) {
+		processed = process_received(conn, conns, in->data, in->size);
+		if (processed == -1)
+			return -1;
+
+		in->data += processed;
+		in->size -= processed;
+		if (in->size == 0)
+			return 0;
+	}
+
+	for (;;) {
+		size_t wanted = receive_buffer_wanted(conn);
+		ssize_t bytes_read;
+
+		if (in) {
+			if (in->size == 0)
+				return 0;
+			if (wanted < in->size)
+				wanted = in->size;
+		}
+
+		receive_buffer_reserve(conn, wanted);
+		size_t room = conn->in_capacity - conn->in_end;
+
+		if (in) {
+			bytes_read = in->size;
+			memcpy(conn->in_buffer + conn->in_end, in->data, bytes_read);
+			in->data += bytes_read;
+			in->size = 0;
+		}
+		else {
+			bytes_read = read_nonblocking(
+				conn->fd, conn->in_buffer + conn->in_end, room
+			);
+			if (bytes_read <= 0)
+				return bytes_read;
+		}
+		conn->in_end += bytes_read;
+
+		processed = process_received(
+			conn, conns, conn->in_buffer + conn->in_start,
+			conn->in_end - conn->in_start
+		);
+		if (processed == -1)
+			return -1;
+		receive_buffer_consume(conn, processed);
+
+		if (!in && (size_t) bytes_read < room)
+			return 0;
+	}
+}
+
+/**
+ * Accepts pending connections on listening socket, at most `budget` of them.
+ *
+ * Listening socket is non-blocking and edge-triggered, so connections are
+ * accepted until EAGAIN. When the budget runs out first, accepting has to be
+ * resumed in next event loop iteration, as no new event will come for
+ * connections already waiting. Accepted sockets are non-blocking and
+ * close-on-exec right away.
+ *
+ * \param conns Connections linked list.
+ * \param listening_fd Listening socket fd.
+ * \param reactor Reactor new connections are registered in.
+ * \param budget Maximum number of connections accepted.
+ *
+ * \returns 1 if more connections may be pending, 0 otherwise.
+ */
+int
+accept_connections(
+	struct connections *conns, int listening_fd, reactor_t *reactor,
+	int budget
+) {
+	int nfd = -1;
+
+	while (budget > 0) {
+		nfd = accept4(listening_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (nfd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				log_warn("Too many open files, connection not accepted.");
+				return 0;
+			}
+			err(3, "accept");
+		}
+		if (!add_connection(conns, nfd, reactor))
+			close(nfd);
+		budget--;
+	}
+
+	return 1;
+}
+
+/**
+ * Dispatches one ready event returned by reactor of worker.
+ *
+ * Events of connections cleared earlier in the same event loop iteration are
+ * skipped.
+ */
+void
+handle_event(event_t *event, worker_t *worker) {
+	struct connections *conns = &worker->conns;
+	struct connection *conn = event->data.ptr;
+
+	// connections are accepted after events of existing ones are handled
+	if (!conn) {
+		worker->accept_pending = 1;
+		return;
+	}
+
+	if (event->data.ptr == &worker->mailbox) {
+		process_mailbox(worker);
+		return;
+	}
+
+	if (conn->closing)
+		return;
+
+	if (event->events & (EPOLLHUP | EPOLLERR)) {
+		clear_one_connection(conn, conns);
+		return;
+	}
+
+	if ((event->events & EPOLLOUT) && conn->out_queue.count > 0)
+		schedule_write(conns, conn);
+
+	if (event->events & (EPOLLIN | EPOLLRDHUP)) {
+		if (read_from_client(conn, conns, NULL) == -1) {
+			clear_one_connection(conn, conns);
+			return;
+		}
+	}
+
+	if (conn->handoff) {
+		reactor_remove(&worker->reactor, conn->fd);
+		hand_over_connection(worker, conn);
+	}
+}
+
+/**
+ * Queues multishot receive for connection.
+ */
+void
+uring_arm_recv(uring_t *uring, struct connection *conn) {
+	conn->uring_requests++;
+	uring_recv_multishot(uring, conn->fd, (uintptr_t) conn | URING_RECV);
+}
+
+/**
+ * Handles completion of multishot accept: registers accepted connection and
+ * queues receive for it.
+ */
+void
+handle_accept_completion(cqe_t *cqe, worker_t *worker) {
+	int res = cqe->res;
+
+	if (res >= 0) {
+		if (__atomic_load_n(&interrupt_received, __ATOMIC_RELAXED)) {
+			close(res);
+		} else {
+			struct connection *conn = add_connection(&worker->conns, res, NULL);
+			uring_arm_recv(&worker->uring, conn);
+		}
+	} else if (res == -EMFILE || res == -ENFILE) {
+		log_warn("Too many open files, connection not accepted.");
+	} else if (res != -EINTR && res != -ECONNABORTED) {
+		errx(3, "accept: %s", strerror(-res));
+	}
+
+	if (!uring_cqe_more(cqe)) {
+		uring_accept_multishot(
+			&worker->uring, worker->listening_fd, URING_ACCEPT
+		);
+	}
+}
+
+/**
+ * Handles completion of multishot receive: received bytes are decoded and
+ * processed, the same way as readable socket is in reactor.
+ *
+ * Connection to be handed over to another worker gets its receive cancelled,
+ * bytes received until its last completion are kept in receive buffer, then
+ * the connection is handed over.
+ */
+void
+handle_recv_completion(
+	cqe_t *cqe, struct connection *conn, worker_t *worker
+) {
+	uring_t *uring = &worker->uring;
+	int more = uring_cqe_more(cqe);
+	unsigned id = 0;
+	char *buffer = uring_cqe_buffer(uring, cqe, &id);
+
+	if (!more)
+		conn->uring_requests--;
+
+	if (buffer) {
+		if (!conn->closing && cqe->res > 0) {
+			in_data_t in = { buffer, cqe->res };
+			if (read_from_client(conn, &worker->conns, &in) == -1)
+				clear_one_connection(conn, &worker->conns);
+		}
+		uring_buffer_return(uring, id);
+	}
+
+	if (conn->closing)
+		return;
+
+	if (conn->handoff) {
+		if (!more) {
+			hand_over_connection(worker, conn);
+		} else if (!conn->handoff_cancelled) {
+			conn->handoff_cancelled = 1;
+			uring_cancel(uring, (uintptr_t) conn | URING_RECV, URING_CANCEL);
+		}
+		return;
+	}
+
+	// ENOBUFS only means all receive buffers were in use, receive again
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+		clear_one_connection(conn, &worker->conns);
+		return;
+	}
+
+	if (!more)
+		uring_arm_recv(uring, conn);
+}
+
+/**
+ * Handles completion of one linked writev. Written frames are removed from
+ * outgoing queue. When the whole chain completed, the rest of the queue is
+ * scheduled for writing.
+ */
+void
+handle_send_completion(
+	cqe_t *cqe, struct connection *conn, struct connections *conns
+) {
+	conn->uring_sends--;
+	conn->uring_requests--;
+
+	if (conn->closing)
+		return;
+
+	/* short write cancels the rest of the chain, it is submitted again, write
+	 * of empty frames only completes with zero */
+	if (cqe->res >= 0) {
+		size_t count = conn->out_queue.count;
+		size_t bytes = conn->out_queue.bytes;
+		conns->stats.counters[STATS_MESSAGES_SENT] += out_queue_consume(
+			&conn->out_queue, cqe->res
+		);
+		account_out_queue(conns, conn, count, bytes);
+		conns->stats.counters[STATS_BYTES_SENT] += cqe->res;
+	} else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+		clear_one_connection(conn, conns);
+		return;
+	}
+
+	if (conn->uring_sends > 0)
+		return;
+	conn->out_queue.locked = 0;
+	check_congestion_end(conns, conn);
+	if (conn->out_queue.count > 0)
+		schedule_write(conns, conn);
+}
+
+/**
+ * Handles all completions posted by io_uring of worker.
+ */
+void
+handle_completions(worker_t *worker) {
+	cqe_t *cqe;
+
+	while ((cqe = uring_peek_cqe(&worker->uring)) != NULL) {
+		uint64_t request = cqe->user_data & URING_REQUEST_MASK;
+		struct connection *conn = (struct connection *) (uintptr_t) (
+			cqe->user_data & ~(uint64_t) URING_REQUEST_MASK
+		);
+
+		switch (request) {
+		case URING_ACCEPT:
+			handle_accept_completion(cqe, worker);
+			break;
+		case URING_WAKE:
+			process_mailbox(worker);
+			if (!uring_cqe_more(cqe)) {
+				uring_poll_multishot(
+					&worker->uring, worker->wake_fd, URING_WAKE
+				);
+			}
+			break;
+		case URING_RECV:
+			handle_recv_completion(cqe, conn, worker);
+			break;
+		case URING_SEND:
+			handle_send_completion(cqe, conn, &worker->conns);
+			break;
+		case URING_CANCEL:
+			// last completion of cancelled request follows
+			break;
+		}
+
+		uring_cqe_seen(&worker->uring);
+	}
+}
+
+void
+adopt_connection(worker_t *worker, int fd, frame_t *received) {
+	struct connections *conns = &worker->conns;
+	struct connection *conn = add_connection(
+		conns, fd, worker->use_uring ? NULL : &worker->reactor
+	);
+	if (!conn) {
+		close(fd);
+		return;
+	}
+
+	in_data_t in = { received->data, received->size };
+	if (read_from_client(conn, conns, &in) == -1) {
+		clear_one_connection(conn, conns);
+		return;
+	}
+
+	if (worker->use_uring)
+		uring_arm_recv(&worker->uring, conn);
+}
+
+/**
+ * Check that MQTT clients with expired keep alive timers are still alive.
+ *
+ * Timers are not moved on every control packet, only `last_seen` is updated.
+ * Expired timer of client that was active in the meantime is armed again for
+ * its new deadline, so only expired timers are visited.
+ */
+void
+check_keep_alive(conns_t *conns) {
+	wheel_timer_t *next;
+	for (
+		wheel_timer_t *timer = timer_wheel_advance(&conns->timers, conns->now);
+		timer != NULL;
+		timer = next
+	) {
+		next = timer->next;
+		conn_t *conn = (conn_t *) (
+			(char *) timer - offsetof(conn_t, keep_alive_timer)
+		);
+
+		uint64_t deadline = keep_alive_deadline(conn);
+		if (deadline <= conns->now) {
+			log_info("Keep alive of %s expired.", conn->client_id);
+			clear_one_connection(conn, conns);
+		} else {
+			timer_add(&conns->timers, &conn->keep_alive_timer, deadline);
+		}
+	}
+}
+
+/**
+ * Sends messages in flight again to connections whose redelivery timers
+ * expired. Connection still writing earlier frames is skipped this time, as
+ * the messages may still be on their way.
+ */
+void
+check_redelivery(conns_t *conns) {
+	wheel_timer_t *next;
+	for (
+		wheel_timer_t *timer = timer_wheel_advance(&conns->retries, conns->now);
+		timer != NULL;
+		timer = next
+	) {
+		next = timer->next;
+		conn_t *conn = (conn_t *) (
+			(char *) timer - offsetof(conn_t, retry_timer)
+		);
+
+		if (inflight_count(&conn->inflight) == 0)
+			continue;
+
+		if (conn->out_queue.count == 0)
+			resend_inflight_messages(conns, conn);
+		timer_add(
+			&conns->retries, &conn->retry_timer,
+			conns->now + INFLIGHT_RETRY_INTERVAL
+		);
+	}
+}
+
+/**
+ * Runs event loop of worker until interrupt is received. All connections of
+ * the worker are cleared afterwards.
+ *
+ * \param arg Worker.
+ */
+void *
+worker_run(void *arg) {
+	worker_t *worker = arg;
+	struct connections *conns = &worker->conns;
+
+	if (worker->use_uring) {
+		uring_accept_multishot(
+			&worker->uring, worker->listening_fd, URING_ACCEPT
+		);
+		uring_poll_multishot(&worker->uring, worker->wake_fd, URING_WAKE);
+	}
+
+	for (;;) {
+		if (worker->use_uring) {
+			// queued requests are submitted by the same system call
+			uring_wait(
+				&worker->uring, wal_wait_time(&worker->wal, EVENT_WAIT_TIME)
+			);
+			if (__atomic_load_n(&interrupt_received, __ATOMIC_RELAXED)) break;
+
+			conns->now = monotonic_ms();
+			handle_completions(worker);
+		} else {
+			// do not sleep while connections are left in accept queue
+			int ready = reactor_wait(
+				&worker->reactor,
+				worker->accept_pending
+					? 0
+					: wal_wait_time(&worker->wal, EVENT_WAIT_TIME)
+			);
+			if (__atomic_load_n(&interrupt_received, __ATOMIC_RELAXED)) break;
+
+			conns->now = monotonic_ms();
+			for (int i = 0; i < ready; i++) {
+				handle_event(&worker->reactor.events[i], worker);
+			}
+
+			if (worker->accept_pending) {
+				worker->accept_pending = accept_connections(
+					conns, worker->listening_fd, &worker->reactor,
+					worker->accept_budget
+				);
+			}
+		}
+		conns->stats.counters[STATS_LOOP_ITERATIONS]++;
+		publish_broker_stats(worker);
+		// publishes of this iteration are synced together
+		commit_write_ahead_log(worker, 0);
+		flush_pending_out(conns);
+		check_keep_alive(conns);
+		check_redelivery(conns);
+
+		free_closed_connections(conns);
+		if (__atomic_load_n(&interrupt_received, __ATOMIC_RELAXED)) break;
+	}
+
+	// messages acknowledged to their publishers still reach offline sessions
+	process_mailbox(worker);
+	commit_write_ahead_log(worker, 1);
+
+	conn_t *next;
+	for (
+		conn_t *conn = conns->conn_back;
+		conn != NULL;
+		conn = next
+	) {
+		next = clear_one_connection(conn, conns);
+	}
+	sessions_free(conns);
+	free_closed_connections(conns);
+
+	// sockets were shut down, requests in flight complete shortly
+	for (int i = 0; conns->closed && i < URING_DRAIN_ROUNDS; i++) {
+		uring_wait(&worker->uring, EVENT_WAIT_TIME / URING_DRAIN_ROUNDS);
+		handle_completions(worker);
+		free_closed_connections(conns);
+	}
+
+	return NULL;
 }
 
 int
@@ -717,9 +1465,25 @@ main(int argc, char* argv[]) {
 	int opt;
 	char* portstr = calloc(6, sizeof(char));
 	strncpy(portstr, "1883", 5);
+	int thread_count = 1;
+	int use_uring = 0;
+	int backlog = LISTEN_BACKLOG;
+	int accept_budget = ACCEPT_BUDGET;
+	int match_cache_size = MATCH_CACHE_SIZE;
+	long retain_memory = RETAIN_STORE_MEMORY;
+	char *session_path = NULL;
+	char *wal_dir = NULL;
+	long commit_window = 0;
+	out_watermarks_t watermarks = {
+		OUT_QUEUE_HIGH_BYTES, OUT_QUEUE_HIGH_FRAMES,
+		OUT_QUEUE_LOW_BYTES, OUT_QUEUE_LOW_FRAMES
+	};
+	enum congestion_policy congestion_policy = CONGESTION_DROP_NEWEST;
+	const share_strategy_t *share_strategy = share_strategy_default();
+	long stats_interval = STATS_INTERVAL;
 
 	size_t opt_len = 0;
-	while ((opt = getopt(argc, argv, "-p:")) != -1) {
+	while ((opt = getopt(argc, argv, "-p:t:b:l:a:c:r:s:w:g:q:Q:o:S:i:H")) != -1) {
 		switch (opt) {
 			case 'p':
 				opt_len = strnlen(optarg, 5);
@@ -729,8 +1493,120 @@ main(int argc, char* argv[]) {
 					err(1, "main calloc portstr");
 				portstr = strncpy(portstr, optarg, opt_len);
 				break;
+			case 'b':
+				if (strcmp(optarg, "uring") == 0) {
+					use_uring = 1;
+					break;
+				}
+				if (strcmp(optarg, "epoll") == 0) {
+					use_uring = 0;
+					break;
+				}
+				printf("Unknown backend %s.\n", optarg);
+				exit(1);
+			case 'l':
+				backlog = atoi(optarg);
+				if (backlog >= 1)
+					break;
+				printf("Listen backlog must be positive.\n");
+				exit(1);
+			case 'a':
+				accept_budget = atoi(optarg);
+				if (accept_budget >= 1)
+					break;
+				printf("Accept budget must be positive.\n");
+				exit(1);
+			case 'c':
+				match_cache_size = atoi(optarg);
+				if (match_cache_size >= 0)
+					break;
+				printf("Match cache size must not be negative.\n");
+				exit(1);
+			case 'r':
+				retain_memory = atol(optarg);
+				if (retain_memory >= 0)
+					break;
+				printf("Retained memory must not be negative.\n");
+				exit(1);
+			case 's':
+				session_path = optarg;
+				break;
+			case 'w':
+				wal_dir = optarg;
+				break;
+			case 'g':
+				commit_window = atol(optarg);
+				if (commit_window >= 0 && commit_window <= UINT32_MAX)
+					break;
+				printf("Commit window must not be negative.\n");
+				exit(1);
+			case 'q':
+				if (sscanf(
+					optarg, "%zu:%zu", &watermarks.high_bytes,
+					&watermarks.low_bytes
+				) == 2 && watermarks.low_bytes < watermarks.high_bytes)
+					break;
+				printf("Byte watermarks must be <HIGH>:<LOW>, LOW < HIGH.\n");
+				exit(1);
+			case 'Q':
+				if (sscanf(
+					optarg, "%zu:%zu", &watermarks.high_frames,
+					&watermarks.low_frames
+				) == 2 && watermarks.low_frames < watermarks.high_frames
+					&& watermarks.high_frames <= OUT_QUEUE_MAX_SIZE)
+					break;
+				printf(
+					"Message watermarks must be <HIGH>:<LOW>, LOW < HIGH <= "
+					"%d.\n", OUT_QUEUE_MAX_SIZE
+				);
+				exit(1);
+			case 'o':
+				if (strcmp(optarg, "drop-newest") == 0) {
+					congestion_policy = CONGESTION_DROP_NEWEST;
+					break;
+				}
+				if (strcmp(optarg, "drop-oldest") == 0) {
+					congestion_policy = CONGESTION_DROP_OLDEST;
+					break;
+				}
+				if (strcmp(optarg, "disconnect") == 0) {
+					congestion_policy = CONGESTION_DISCONNECT;
+					break;
+				}
+				printf("Unknown congestion policy %s.\n", optarg);
+				exit(1);
+			case 'S':
+				share_strategy = share_strategy_find(optarg);
+				if (share_strategy)
+					break;
+				printf("Unknown shared subscription strategy %s.\n", optarg);
+				exit(1);
+			case 'i':
+				stats_interval = atol(optarg);
+				if (stats_interval >= 0)
+					break;
+				printf("Statistics interval must not be negative.\n");
+				exit(1);
+			case 'H':
+				pools_use_huge_pages(1);
+				break;
+			case 't':
+				thread_count = atoi(optarg);
+				if (thread_count >= 1 && thread_count <= SHARE_MAX_WORKERS)
+					break;
+				/* FALLTHROUGH */
 			default:
-				printf("Usage: ./mqttserver [-p <PORT>]\n");
+				printf(
+					"Usage: ./mqttserver [-p <PORT>] [-t <THREADS>] "
+					"[-b <epoll|uring>] [-l <BACKLOG>] [-a <ACCEPT BUDGET>] "
+					"[-c <MATCH CACHE SIZE>] [-r <RETAINED MEMORY>] "
+					"[-s <SESSION FILE>] [-w <WAL DIRECTORY>] "
+					"[-g <COMMIT WINDOW US>] [-q <HIGH BYTES>:<LOW BYTES>] "
+					"[-Q <HIGH MESSAGES>:<LOW MESSAGES>] "
+					"[-o <drop-newest|drop-oldest|disconnect>] "
+					"[-S <round-robin|least-queue|sticky>] "
+					"[-i <STATISTICS INTERVAL S>] [-H]\n"
+				);
 				exit(1);
 		}
 		
@@ -738,54 +1614,132 @@ main(int argc, char* argv[]) {
 
 	log_info("Femto MQTT broker starting.");
 
-	int nclients = SIZE;
-
 	struct sigaction sa = { 0 };
 	sa.sa_handler = &sigaction_handler;
 	sa.sa_flags = SA_RESTART;
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
-	int sock_fd = find_connection(portstr);
-	struct connections conns;
-	conns_init(&conns);
+	// writing to socket closed by peer must not terminate the server
+	struct sigaction sa_ignore = { 0 };
+	sa_ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa_ignore, NULL);
 
-	poll_list_t plist;
-	poll_list_init(&plist);
-	
-	if (listen(sock_fd, nclients) == -1)
-		err(3, "listen");
+	worker_t *workers = calloc(thread_count, sizeof(worker_t));
+	if (!workers)
+		err(1, "main calloc workers");
 
-	log_info("Listening on port %s.", portstr);
+	session_store_t sessions;
+	session_store_init(&sessions);
 
-	struct pollfd listening_pfd;
-	listening_pfd.fd = sock_fd;
-	for (;;) {
-		poll_and_accept(&conns, &listening_pfd, &plist);
-		if (interrupt_received) break;
-		check_poll_hup(&conns, &plist);
-		if (interrupt_received) break;
-		check_poll_in(&conns, &plist);
-		if (interrupt_received) break;
-		check_and_process_mqtt_messages(&conns, &plist);
-		if (interrupt_received) break;
-		check_poll_out(&conns, &plist);
-		if (interrupt_received) break;
-		check_keep_alive(&conns, &plist);
-		if (interrupt_received) break;
+	// groups of shared subscriptions spread across workers
+	share_registry_t shares;
+	if (thread_count > 1)
+		share_registry_init(&shares);
+
+	for (int i = 0; i < thread_count; i++) {
+		int sock_fd = find_connection(portstr, thread_count > 1);
+
+		if (listen(sock_fd, backlog) == -1)
+			err(3, "listen");
+
+		worker_init(&workers[i], i, workers, thread_count, sock_fd, use_uring);
+		workers[i].accept_budget = accept_budget;
+		match_cache_init(
+			&workers[i].conns.topic_tree.cache, match_cache_size
+		);
+		workers[i].conns.retained.memory_limit = retain_memory;
+		workers[i].conns.watermarks = watermarks;
+		workers[i].conns.congestion_policy = congestion_policy;
+		workers[i].conns.share_strategy = share_strategy;
+		stats_init(
+			&workers[i].conns.stats, stats_interval * 1000,
+			workers[i].conns.now
+		);
+		if (thread_count > 1) {
+			workers[i].conns.topic_tree.shares = &shares;
+			workers[i].conns.topic_tree.worker_id = i;
+		}
+		workers[i].sessions = &sessions;
 	}
 
-	conn_t *next;
-	for (
-		conn_t *conn = conns.conn_back;
-		conn != NULL;
-		conn = next
-	) {
-		next = clear_one_connection(conn, &conns, &plist);
+	// sessions are restored into workers owning them, before threads start
+	if (session_path) {
+		uint64_t started = monotonic_ms();
+		if (session_store_open(
+			&sessions, session_path, session_restore, workers
+		) == -1)
+			err(1, "cannot open session store %s", session_path);
+		log_info(
+			"Restored %zu sessions from %s in %llu ms.", sessions.count,
+			session_path, (unsigned long long) (monotonic_ms() - started)
+		);
+	}
+
+	/* messages of previous run are replayed into the restored sessions and
+	 * logged again by the first worker, before other logs are opened */
+	if (wal_dir) {
+		for (int i = 0; i < thread_count; i++) {
+			if (wal_open(&workers[i].wal, wal_dir, i, commit_window) == -1)
+				err(1, "cannot open write-ahead log in %s", wal_dir);
+			if (i > 0)
+				continue;
+
+			uint64_t started = monotonic_ms();
+			for (int j = 0; j < thread_count; j++) {
+				sessions_replay_begin(&workers[j].conns);
+			}
+			ssize_t replayed = wal_recover(
+				&workers[0].wal, replay_logged_message, workers
+			);
+			for (int j = 0; j < thread_count; j++) {
+				sessions_replay_end(&workers[j].conns);
+			}
+			if (replayed == -1)
+				err(1, "cannot replay write-ahead log in %s", wal_dir);
+			log_info(
+				"Replayed %zd messages from write-ahead log in %llu ms.",
+				replayed, (unsigned long long) (monotonic_ms() - started)
+			);
+		}
+	}
+
+	log_info("Listening on port %s (%d threads).", portstr, thread_count);
+
+	/* signals are handled by main thread only, it wakes other workers */
+	sigset_t signals, old_signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	for (int i = 1; i < thread_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))
+			errx(1, "pthread_create");
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	worker_run(&workers[0]);
+
+	for (int i = 1; i < thread_count; i++) {
+		worker_wake(&workers[i]);
+		pthread_join(workers[i].thread, NULL);
+	}
+	for (int i = 0; i < thread_count; i++) {
+		worker_free(&workers[i]);
+	}
+	// frames of one log may be freed by any worker
+	for (int i = 0; i < thread_count; i++) {
+		wal_free(&workers[i].wal);
 	}
+	session_store_log_stats(&sessions);
+	session_store_free(&sessions);
+	if (thread_count > 1)
+		share_registry_free(&shares);
 
+	free(workers);
 	free(portstr);
-	poll_list_free(&plist);
+	pools_log_stats();
+	pools_free_all();
 	log_info("Server exiting.");
 
 	return 0;
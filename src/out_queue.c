@@ -0,0 +1,229 @@
+#include "out_queue.h"
+#include "wal.h"
+
+frame_t *
+frame_create(size_t size) {
+	frame_t *frame = buffer_alloc(sizeof(frame_t) + size);
+	frame->refcount = 1;
+	frame->shared = 0;
+	frame->qos = 0;
+	frame->size = size;
+	frame->data = (char *) (frame + 1);
+	frame->parent = NULL;
+	frame->segment = NULL;
+	return frame;
+}
+
+frame_t *
+frame_slice(frame_t *parent, size_t offset, size_t size) {
+	frame_t *frame = buffer_alloc(sizeof(frame_t));
+	frame->refcount = 1;
+	frame->shared = 0;
+	frame->qos = parent->qos;
+	frame->size = size;
+	frame->data = parent->data + offset;
+	frame->parent = frame_ref(parent);
+	frame->segment = NULL;
+	return frame;
+}
+
+frame_t *
+frame_ref(frame_t *frame) {
+	if (frame->shared)
+		__atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+	else
+		frame->refcount++;
+	return frame;
+}
+
+void
+frame_release(frame_t *frame) {
+	size_t refcount;
+
+	if (frame->shared)
+		refcount = __atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL);
+	else
+		refcount = --frame->refcount;
+
+	if (refcount == 0) {
+		if (frame->parent)
+			frame_release(frame->parent);
+		if (frame->segment)
+			wal_segment_release(frame->segment);
+		buffer_free(frame);
+	}
+}
+
+void
+out_queue_init(out_queue_t *queue) {
+	queue->frames = NULL;
+	queue->capacity = 0;
+	queue->head = 0;
+	queue->count = 0;
+	queue->offset = 0;
+	queue->bytes = 0;
+	queue->locked = 0;
+}
+
+void
+out_queue_free(out_queue_t *queue) {
+	while (queue->count > 0) {
+		out_queue_pop(queue);
+	}
+	free(queue->frames);
+	out_queue_init(queue);
+}
+
+/**
+ * Doubles capacity of queue. Frames are moved so that head is at index zero.
+ */
+void
+out_queue_expand(out_queue_t *queue) {
+	size_t new_capacity = queue->capacity
+		? queue->capacity * 2
+		: OUT_QUEUE_INITIAL_SIZE;
+
+	frame_t **frames = calloc(new_capacity, sizeof(frame_t *));
+	if (!frames)
+		err(1, "out queue expand calloc frames");
+
+	for (size_t i = 0; i < queue->count; i++) {
+		frames[i] = queue->frames[(queue->head + i) & (queue->capacity - 1)];
+	}
+
+	free(queue->frames);
+	queue->frames = frames;
+	queue->capacity = new_capacity;
+	queue->head = 0;
+}
+
+int
+out_queue_push(out_queue_t *queue, frame_t *frame) {
+	if (queue->count == queue->capacity) {
+		if (queue->capacity >= OUT_QUEUE_MAX_SIZE)
+			return -1;
+		out_queue_expand(queue);
+	}
+
+	size_t tail = (queue->head + queue->count) & (queue->capacity - 1);
+	queue->frames[tail] = frame;
+	queue->count++;
+	queue->bytes += frame->size;
+	return 0;
+}
+
+size_t
+out_queue_room(out_queue_t *queue) {
+	return OUT_QUEUE_MAX_SIZE - queue->count;
+}
+
+frame_t *
+out_queue_peek(out_queue_t *queue) {
+	if (queue->count == 0)
+		return NULL;
+	return queue->frames[queue->head];
+}
+
+void
+out_queue_pop(out_queue_t *queue) {
+	if (queue->count == 0)
+		return;
+
+	frame_t *frame = queue->frames[queue->head];
+	queue->bytes -= frame->size;
+	frame_release(frame);
+	queue->frames[queue->head] = NULL;
+	queue->head = (queue->head + 1) & (queue->capacity - 1);
+	queue->count--;
+	queue->offset = 0;
+	if (queue->locked > 0)
+		queue->locked--;
+}
+
+/**
+ * \returns Size of frames waiting behind the head frame.
+ */
+static size_t
+out_queue_waiting_bytes(out_queue_t *queue) {
+	if (queue->count == 0)
+		return 0;
+	return queue->bytes - queue->frames[queue->head]->size;
+}
+
+int
+out_queue_over(out_queue_t *queue, const out_watermarks_t *watermarks) {
+	return queue->count >= watermarks->high_frames
+		|| out_queue_waiting_bytes(queue) >= watermarks->high_bytes;
+}
+
+int
+out_queue_under(out_queue_t *queue, const out_watermarks_t *watermarks) {
+	return queue->count <= watermarks->low_frames
+		&& out_queue_waiting_bytes(queue) <= watermarks->low_bytes;
+}
+
+int
+out_queue_drop_first(out_queue_t *queue, int (*match)(const frame_t *frame)) {
+	size_t first = queue->locked;
+	if (first == 0 && queue->offset > 0)
+		first = 1;
+
+	for (size_t i = first; i < queue->count; i++) {
+		size_t index = (queue->head + i) & (queue->capacity - 1);
+		frame_t *frame = queue->frames[index];
+		if (!match(frame))
+			continue;
+
+		// frames before the dropped one move by one slot, head follows them
+		for (size_t j = i; j > 0; j--) {
+			queue->frames[(queue->head + j) & (queue->capacity - 1)] =
+				queue->frames[(queue->head + j - 1) & (queue->capacity - 1)];
+		}
+		queue->frames[queue->head] = NULL;
+		queue->head = (queue->head + 1) & (queue->capacity - 1);
+		queue->count--;
+		queue->bytes -= frame->size;
+		frame_release(frame);
+		return 1;
+	}
+	return 0;
+}
+
+int
+out_queue_gather(out_queue_t *queue, struct iovec *iov, int max_iov) {
+	int iov_count = 0;
+	size_t offset = queue->offset;
+	frame_t *frame;
+
+	for (size_t i = 0; i < queue->count && iov_count < max_iov; i++) {
+		frame = queue->frames[(queue->head + i) & (queue->capacity - 1)];
+		iov[iov_count].iov_base = frame->data + offset;
+		iov[iov_count].iov_len = frame->size - offset;
+		iov_count++;
+		offset = 0;
+	}
+
+	return iov_count;
+}
+
+size_t
+out_queue_consume(out_queue_t *queue, size_t bytes) {
+	frame_t *frame;
+	size_t left;
+	size_t packets = 0;
+
+	// empty frames (payload of PUBLISH without payload) are popped as well
+	while ((frame = out_queue_peek(queue)) != NULL) {
+		left = frame->size - queue->offset;
+		if (bytes < left) {
+			queue->offset += bytes;
+			return packets;
+		}
+		bytes -= left;
+		if (!frame->parent)
+			packets++;
+		out_queue_pop(queue);
+	}
+
+	return packets;
+}
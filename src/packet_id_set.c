@@ -0,0 +1,93 @@
+#include "packet_id_set.h"
+
+void
+packet_id_set_init(packet_id_set_t *set) {
+	set->ids = NULL;
+	set->capacity = 0;
+	set->count = 0;
+}
+
+void
+packet_id_set_free(packet_id_set_t *set) {
+	buffer_free(set->ids);
+	packet_id_set_init(set);
+}
+
+/**
+ * \returns Index of entry with the packet ID, or of empty entry it would be
+ * 			inserted into.
+ */
+static uint32_t
+packet_id_set_find(packet_id_set_t *set, uint16_t packet_id) {
+	uint32_t mask = set->capacity - 1;
+	uint32_t index = packet_id & mask;
+	while (set->ids[index] != 0 && set->ids[index] != packet_id)
+		index = (index + 1) & mask;
+	return index;
+}
+
+int
+packet_id_set_contains(packet_id_set_t *set, uint16_t packet_id) {
+	if (set->count == 0)
+		return 0;
+	return set->ids[packet_id_set_find(set, packet_id)] == packet_id;
+}
+
+/**
+ * Allocates table twice as big and reinserts packet IDs.
+ */
+static void
+packet_id_set_expand(packet_id_set_t *set) {
+	uint16_t *ids = set->ids;
+	uint32_t capacity = set->capacity;
+
+	set->capacity = capacity ? capacity * 2 : PACKET_ID_SET_INITIAL_CAPACITY;
+	set->ids = buffer_alloc(set->capacity * sizeof(uint16_t));
+	memset(set->ids, 0, set->capacity * sizeof(uint16_t));
+
+	for (uint32_t i = 0; i < capacity; i++) {
+		if (ids[i])
+			set->ids[packet_id_set_find(set, ids[i])] = ids[i];
+	}
+	buffer_free(ids);
+}
+
+int
+packet_id_set_insert(packet_id_set_t *set, uint16_t packet_id) {
+	if (set->count >= PACKET_ID_SET_MAX)
+		return -1;
+
+	if ((set->count + 1) * 2 > set->capacity)
+		packet_id_set_expand(set);
+
+	set->ids[packet_id_set_find(set, packet_id)] = packet_id;
+	set->count++;
+	return 0;
+}
+
+void
+packet_id_set_remove(packet_id_set_t *set, uint16_t packet_id) {
+	if (set->count == 0)
+		return;
+
+	uint32_t mask = set->capacity - 1;
+	uint32_t hole = packet_id_set_find(set, packet_id);
+	if (set->ids[hole] != packet_id)
+		return;
+
+	// entries after the hole are shifted back, unless they would move before
+	// their own index, so no tombstones are needed
+	for (
+		uint32_t index = (hole + 1) & mask;
+		set->ids[index] != 0;
+		index = (index + 1) & mask
+	) {
+		uint32_t home = set->ids[index] & mask;
+		if (((index - home) & mask) >= ((index - hole) & mask)) {
+			set->ids[hole] = set->ids[index];
+			hole = index;
+		}
+	}
+	set->ids[hole] = 0;
+	set->count--;
+}
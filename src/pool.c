@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "pool.h"
+#include "structs.h"
+
+/**
+ * Buffers start with header holding their size class, it keeps data 16 bytes
+ * aligned.
+ */
+#define BUFFER_HEADER_SIZE 16
+
+#define POOL_CHUNK_HEADER_SIZE ((sizeof(pool_chunk_t) + 15) & ~(size_t) 15)
+
+static int huge_pages = 0;
+
+static __thread pools_t *local_pools = NULL;
+
+static pools_t *all_pools = NULL;
+static pthread_mutex_t all_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+pools_use_huge_pages(int enable) {
+	huge_pages = enable;
+}
+
+void
+slab_init(slab_t *slab, size_t object_size) {
+	memset(slab, 0, sizeof(slab_t));
+	slab->object_size = (object_size + 15) & ~(size_t) 15;
+}
+
+/**
+ * Gets chunk of memory for given slab from the system. With huge pages, chunk
+ * is mapped with explicit huge pages, if none are reserved, transparent huge
+ * pages are requested for normal mapping.
+ */
+pool_chunk_t *
+pool_chunk_create(slab_t *slab) {
+	size_t size = POOL_CHUNK_HEADER_SIZE + 4 * slab->object_size;
+	pool_chunk_t *chunk;
+
+	if (huge_pages) {
+		size = size < POOL_HUGE_CHUNK_SIZE
+			? POOL_HUGE_CHUNK_SIZE
+			: (size + POOL_HUGE_CHUNK_SIZE - 1) & ~(size_t) (POOL_HUGE_CHUNK_SIZE - 1);
+
+		chunk = mmap(
+			NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+		);
+		if (chunk == MAP_FAILED) {
+			chunk = mmap(
+				NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+			);
+			if (chunk == MAP_FAILED)
+				err(1, "pool chunk create mmap chunk");
+			madvise(chunk, size, MADV_HUGEPAGE);
+		}
+		chunk->huge = 1;
+	}
+	else {
+		if (size < POOL_CHUNK_SIZE)
+			size = POOL_CHUNK_SIZE;
+		chunk = malloc(size);
+		if (!chunk)
+			err(1, "pool chunk create malloc chunk");
+		chunk->huge = 0;
+	}
+
+	chunk->size = size;
+	return chunk;
+}
+
+/**
+ * Adds new chunk to the slab, its memory is split into objects linked into
+ * free list.
+ */
+void
+slab_grow(slab_t *slab) {
+	pool_chunk_t *chunk = pool_chunk_create(slab);
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->stats.system_allocs++;
+
+	char *start = (char *) chunk + POOL_CHUNK_HEADER_SIZE;
+	size_t count = (chunk->size - POOL_CHUNK_HEADER_SIZE) / slab->object_size;
+
+	// objects are linked from the end, so they are handed out in address order
+	for (size_t i = count; i > 0; i--) {
+		void *object = start + (i - 1) * slab->object_size;
+		*(void **) object = slab->free_list;
+		slab->free_list = object;
+	}
+}
+
+void
+slab_destroy(slab_t *slab) {
+	pool_chunk_t *next;
+
+	for (pool_chunk_t *chunk = slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		if (chunk->huge)
+			munmap(chunk, chunk->size);
+		else
+			free(chunk);
+	}
+	slab->chunks = NULL;
+	slab->free_list = NULL;
+}
+
+void *
+slab_alloc(slab_t *slab) {
+	if (!slab->free_list)
+		slab_grow(slab);
+
+	void *object = slab->free_list;
+	slab->free_list = *(void **) object;
+	slab->stats.allocs++;
+	return object;
+}
+
+void
+slab_free(slab_t *slab, void *object) {
+	*(void **) object = slab->free_list;
+	slab->free_list = object;
+	slab->stats.frees++;
+}
+
+pools_t *
+pools_local(void) {
+	if (local_pools)
+		return local_pools;
+
+	pools_t *pools = calloc(1, sizeof(pools_t));
+	if (!pools)
+		err(1, "pools local calloc pools");
+
+	slab_init(&pools->connections, sizeof(struct connection));
+	slab_init(&pools->topics, sizeof(topic_t));
+	for (int i = 0; i < BUFFER_CLASS_COUNT; i++) {
+		slab_init(&pools->buffers[i], (size_t) 1 << (BUFFER_MIN_SHIFT + i));
+	}
+
+	pthread_mutex_lock(&all_pools_lock);
+	pools->next = all_pools;
+	all_pools = pools;
+	pthread_mutex_unlock(&all_pools_lock);
+
+	local_pools = pools;
+	return pools;
+}
+
+void
+pools_free_all(void) {
+	pools_t *next;
+
+	pthread_mutex_lock(&all_pools_lock);
+	for (pools_t *pools = all_pools; pools; pools = next) {
+		next = pools->next;
+		slab_destroy(&pools->connections);
+		slab_destroy(&pools->topics);
+		for (int i = 0; i < BUFFER_CLASS_COUNT; i++) {
+			slab_destroy(&pools->buffers[i]);
+		}
+		free(pools);
+	}
+	all_pools = NULL;
+	pthread_mutex_unlock(&all_pools_lock);
+
+	local_pools = NULL;
+}
+
+/**
+ * Adds counters of one pool to the total.
+ */
+void
+pool_stats_add(pool_stats_t *total, pool_stats_t *stats) {
+	total->allocs += stats->allocs;
+	total->frees += stats->frees;
+	total->system_allocs += stats->system_allocs;
+}
+
+/**
+ * \param size Object size, lower bound for large buffers.
+ */
+void
+pool_stats_log(const char *name, size_t size, pool_stats_t *stats) {
+	if (stats->allocs == 0)
+		return;
+
+	log_info(
+		"Pool %s (%zu B): %llu allocations, %llu frees, %llu from system.",
+		name, size,
+		(unsigned long long) stats->allocs,
+		(unsigned long long) stats->frees,
+		(unsigned long long) stats->system_allocs
+	);
+}
+
+void
+pools_log_stats(void) {
+	pool_stats_t connections = { 0 };
+	pool_stats_t topics = { 0 };
+	pool_stats_t buffers[BUFFER_CLASS_COUNT] = { { 0 } };
+	pool_stats_t large_buffers = { 0 };
+
+	pthread_mutex_lock(&all_pools_lock);
+	for (pools_t *pools = all_pools; pools; pools = pools->next) {
+		pool_stats_add(&connections, &pools->connections.stats);
+		pool_stats_add(&topics, &pools->topics.stats);
+		for (int i = 0; i < BUFFER_CLASS_COUNT; i++) {
+			pool_stats_add(&buffers[i], &pools->buffers[i].stats);
+		}
+		pool_stats_add(&large_buffers, &pools->large_buffers);
+	}
+	pthread_mutex_unlock(&all_pools_lock);
+
+	pool_stats_log("connections", sizeof(struct connection), &connections);
+	pool_stats_log("topics", sizeof(topic_t), &topics);
+	for (int i = 0; i < BUFFER_CLASS_COUNT; i++) {
+		pool_stats_log(
+			"buffers", (size_t) 1 << (BUFFER_MIN_SHIFT + i), &buffers[i]
+		);
+	}
+	pool_stats_log(
+		"large buffers", (size_t) 1 << (BUFFER_MIN_SHIFT + BUFFER_CLASS_COUNT - 1),
+		&large_buffers
+	);
+}
+
+/**
+ * \returns Index of the smallest size class holding given number of bytes,
+ * 			BUFFER_CLASS_COUNT if it does not fit any.
+ */
+unsigned
+buffer_size_class(size_t size) {
+	if (size <= (size_t) 1 << BUFFER_MIN_SHIFT)
+		return 0;
+
+	unsigned bits = 64 - __builtin_clzll((unsigned long long) size - 1);
+	if (bits - BUFFER_MIN_SHIFT >= BUFFER_CLASS_COUNT)
+		return BUFFER_CLASS_COUNT;
+	return bits - BUFFER_MIN_SHIFT;
+}
+
+void *
+buffer_alloc(size_t size) {
+	pools_t *pools = pools_local();
+	unsigned size_class = buffer_size_class(size + BUFFER_HEADER_SIZE);
+	char *block;
+
+	if (size_class == BUFFER_CLASS_COUNT) {
+		block = malloc(size + BUFFER_HEADER_SIZE);
+		if (!block)
+			err(1, "buffer alloc malloc block");
+		pools->large_buffers.allocs++;
+		pools->large_buffers.system_allocs++;
+	}
+	else {
+		block = slab_alloc(&pools->buffers[size_class]);
+	}
+
+	*(unsigned *) block = size_class;
+	return block + BUFFER_HEADER_SIZE;
+}
+
+void
+buffer_free(void *buffer) {
+	if (!buffer)
+		return;
+
+	pools_t *pools = pools_local();
+	char *block = (char *) buffer - BUFFER_HEADER_SIZE;
+	unsigned size_class = *(unsigned *) block;
+
+	if (size_class == BUFFER_CLASS_COUNT) {
+		pools->large_buffers.frees++;
+		free(block);
+	}
+	else {
+		slab_free(&pools->buffers[size_class], block);
+	}
+}
@@ -0,0 +1,49 @@
+#include "reactor.h"
+
+void
+reactor_init(reactor_t *reactor) {
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd == -1)
+		err(1, "epoll_create1");
+
+	reactor->max_events = REACTOR_MAX_EVENTS;
+	reactor->events = calloc(reactor->max_events, sizeof(event_t));
+	if (!reactor->events)
+		err(1, "calloc reactor events");
+}
+
+void
+reactor_free(reactor_t *reactor) {
+	close(reactor->epoll_fd);
+	free(reactor->events);
+}
+
+int
+reactor_add(reactor_t *reactor, int fd, void *data, uint32_t events) {
+	event_t event;
+	event.events = events | EPOLLET;
+	event.data.ptr = data;
+
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void
+reactor_remove(reactor_t *reactor, int fd) {
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1)
+		err(1, "epoll_ctl del");
+}
+
+int
+reactor_wait(reactor_t *reactor, int timeout) {
+	int ready = epoll_wait(
+		reactor->epoll_fd, reactor->events, reactor->max_events, timeout
+	);
+
+	if (ready == -1) {
+		if (errno == EINTR)
+			return 0;
+		err(1, "epoll_wait");
+	}
+
+	return ready;
+}
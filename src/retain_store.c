@@ -0,0 +1,416 @@
+#include "retain_store.h"
+#include "intern_table.h"
+#include "log.h"
+
+/**
+ * \returns Memory accounted to retained frame.
+ */
+static size_t
+frame_memory(const frame_t *frame) {
+	return sizeof(frame_t) + frame->size;
+}
+
+/**
+ * Allocates new trie node, with copy of its topic level.
+ *
+ * \param parent Parent node, NULL for root.
+ */
+static retain_node_t *
+retain_node_create(
+	retain_store_t *store, retain_node_t *parent, const char *level,
+	size_t level_len, uint32_t hash
+) {
+	retain_node_t *node = calloc(1, sizeof(retain_node_t));
+	if (!node)
+		err(1, "retain node create calloc node");
+
+	if (level_len > 0) {
+		node->level = buffer_alloc(level_len);
+		memcpy(node->level, level, level_len);
+	}
+	node->level_len = level_len;
+	node->hash = hash;
+	node->parent = parent;
+
+	store->memory += sizeof(retain_node_t) + level_len;
+	return node;
+}
+
+/**
+ * Frees trie node and all its children, references to their frames are
+ * released.
+ */
+static void
+retain_node_free(retain_store_t *store, retain_node_t *node) {
+	retain_node_t *next;
+
+	for (size_t i = 0; i < node->bucket_count; i++) {
+		for (retain_node_t *child = node->buckets[i]; child; child = next) {
+			next = child->next_sibling;
+			retain_node_free(store, child);
+		}
+	}
+
+	if (node->frame) {
+		store->memory -= frame_memory(node->frame);
+		store->count--;
+		frame_release(node->frame);
+	}
+
+	store->memory -= sizeof(retain_node_t) + node->level_len;
+	store->memory -= node->bucket_count * sizeof(retain_node_t *);
+	if (node->level)
+		buffer_free(node->level);
+	free(node->buckets);
+	free(node);
+}
+
+/**
+ * Finds child of node by its topic level.
+ *
+ * \returns Child node, NULL if not present.
+ */
+static retain_node_t *
+retain_node_find_child(
+	retain_node_t *node, const char *level, size_t level_len, uint32_t hash
+) {
+	if (node->bucket_count == 0)
+		return NULL;
+
+	for (
+		retain_node_t *child = node->buckets[hash & (node->bucket_count - 1)];
+		child != NULL;
+		child = child->next_sibling
+	) {
+		if (
+			child->hash == hash &&
+			child->level_len == level_len &&
+			memcmp(child->level, level, level_len) == 0
+		) {
+			return child;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Doubles number of buckets of children hash table and rehashes children.
+ */
+static void
+retain_node_expand(retain_store_t *store, retain_node_t *node) {
+	size_t bucket_count = node->bucket_count
+		? node->bucket_count * 2
+		: RETAIN_NODE_INITIAL_BUCKETS;
+
+	retain_node_t **buckets = calloc(bucket_count, sizeof(retain_node_t *));
+	if (!buckets)
+		err(1, "retain node expand calloc buckets");
+
+	retain_node_t *next;
+	for (size_t i = 0; i < node->bucket_count; i++) {
+		for (retain_node_t *child = node->buckets[i]; child; child = next) {
+			next = child->next_sibling;
+			size_t index = child->hash & (bucket_count - 1);
+			child->next_sibling = buckets[index];
+			buckets[index] = child;
+		}
+	}
+
+	store->memory += (bucket_count - node->bucket_count)
+		* sizeof(retain_node_t *);
+	free(node->buckets);
+	node->buckets = buckets;
+	node->bucket_count = bucket_count;
+}
+
+/**
+ * Finds node of topic.
+ *
+ * \param create Missing nodes on the path are created if non-zero.
+ *
+ * \returns Node of the topic, NULL if not present and not created.
+ */
+static retain_node_t *
+retain_store_walk(
+	retain_store_t *store, const char *topic, size_t topic_len,
+	const topic_scan_t *levels, int create
+) {
+	retain_node_t *node = store->root;
+	size_t level_count = topic_scan_level_count(levels);
+
+	for (size_t i = 0; i < level_count; i++) {
+		size_t level_len;
+		const char *level = topic + topic_scan_level(
+			levels, topic_len, i, &level_len
+		);
+		uint32_t hash = hash_level(level, level_len);
+
+		retain_node_t *child = retain_node_find_child(
+			node, level, level_len, hash
+		);
+		if (!child) {
+			if (!create)
+				return NULL;
+
+			if (node->child_count >= node->bucket_count)
+				retain_node_expand(store, node);
+
+			child = retain_node_create(store, node, level, level_len, hash);
+			size_t index = hash & (node->bucket_count - 1);
+			child->next_sibling = node->buckets[index];
+			node->buckets[index] = child;
+			node->child_count++;
+		}
+		node = child;
+	}
+
+	return node;
+}
+
+/**
+ * Removes nodes without retained message and children, starting from given
+ * node up to the root.
+ */
+static void
+retain_node_prune(retain_store_t *store, retain_node_t *node) {
+	retain_node_t *parent;
+
+	while (node->parent && !node->frame && node->child_count == 0) {
+		parent = node->parent;
+
+		retain_node_t **link = &parent->buckets[
+			node->hash & (parent->bucket_count - 1)
+		];
+		while (*link != node)
+			link = &(*link)->next_sibling;
+		*link = node->next_sibling;
+		parent->child_count--;
+
+		retain_node_free(store, node);
+		node = parent;
+	}
+}
+
+void
+retain_store_init(retain_store_t *store, size_t memory_limit) {
+	memset(store, 0, sizeof(retain_store_t));
+	store->memory_limit = memory_limit;
+	store->root = retain_node_create(store, NULL, NULL, 0, 0);
+}
+
+void
+retain_store_free(retain_store_t *store) {
+	retain_node_free(store, store->root);
+	free(store->matches);
+	store->root = NULL;
+	store->matches = NULL;
+	store->matches_capacity = 0;
+}
+
+int
+retain_store_set(
+	retain_store_t *store, const char *topic, size_t topic_len,
+	const topic_scan_t *levels, frame_t *frame
+) {
+	retain_node_t *node = retain_store_walk(
+		store, topic, topic_len, levels, 0
+	);
+
+	if (!frame) {
+		if (!node || !node->frame)
+			return 0;
+
+		store->memory -= frame_memory(node->frame);
+		store->count--;
+		store->stats.removed++;
+		frame_release(node->frame);
+		node->frame = NULL;
+		retain_node_prune(store, node);
+		return 0;
+	}
+
+	if (store->memory_limit == 0)
+		return 0;
+
+	// missing nodes are estimated by their upper bound, every level a node
+	size_t needed = frame_memory(frame);
+	size_t released = node && node->frame ? frame_memory(node->frame) : 0;
+	if (!node) {
+		needed += topic_len + topic_scan_level_count(levels) * (
+			sizeof(retain_node_t) + 2 * sizeof(retain_node_t *)
+		);
+	}
+	if (store->memory - released + needed > store->memory_limit) {
+		store->stats.rejected++;
+		return -1;
+	}
+
+	if (!node)
+		node = retain_store_walk(store, topic, topic_len, levels, 1);
+
+	if (node->frame) {
+		store->memory -= frame_memory(node->frame);
+		store->count--;
+		frame_release(node->frame);
+	}
+
+	node->frame = frame_ref(frame);
+	store->memory += frame_memory(frame);
+	store->count++;
+	store->stats.stored++;
+	return 0;
+}
+
+/**
+ * Appends retained frame of node, if any, to matches of the store.
+ */
+static void
+retain_store_add_match(
+	retain_store_t *store, retain_node_t *node, size_t *count
+) {
+	if (!node->frame)
+		return;
+
+	if (*count == store->matches_capacity) {
+		store->matches_capacity = store->matches_capacity
+			? store->matches_capacity * 2
+			: 16;
+		store->matches = realloc(
+			store->matches, store->matches_capacity * sizeof(frame_t *)
+		);
+		if (!store->matches)
+			err(1, "retain store realloc matches");
+	}
+	store->matches[(*count)++] = node->frame;
+}
+
+/**
+ * \returns 1 if wildcard must not match child, which is the case of topics
+ * 			starting with `$` on the first level.
+ */
+static int
+retain_store_skip_wildcard(retain_store_t *store, retain_node_t *node) {
+	return node->parent == store->root &&
+		node->level_len > 0 && node->level[0] == '$';
+}
+
+/**
+ * Appends retained frames of node and all its descendants to matches.
+ */
+static void
+retain_store_match_subtree(
+	retain_store_t *store, retain_node_t *node, size_t *count
+) {
+	retain_store_add_match(store, node, count);
+
+	for (size_t i = 0; i < node->bucket_count; i++) {
+		for (
+			retain_node_t *child = node->buckets[i];
+			child != NULL;
+			child = child->next_sibling
+		) {
+			if (!retain_store_skip_wildcard(store, child))
+				retain_store_match_subtree(store, child, count);
+		}
+	}
+}
+
+/**
+ * Recursively matches remaining levels of topic filter against subtree.
+ *
+ * \param index Index of the first remaining level of the filter.
+ */
+static void
+retain_store_match_level(
+	retain_store_t *store, retain_node_t *node, const char *filter,
+	size_t filter_len, const topic_scan_t *levels, size_t index,
+	size_t *count
+) {
+	if (index == topic_scan_level_count(levels)) {
+		retain_store_add_match(store, node, count);
+		return;
+	}
+
+	size_t level_len;
+	const char *level = filter + topic_scan_level(
+		levels, filter_len, index, &level_len
+	);
+
+	if (level_len == 1 && level[0] == '#') {
+		// `#` matches parent level as well
+		if (node != store->root)
+			retain_store_add_match(store, node, count);
+		for (size_t i = 0; i < node->bucket_count; i++) {
+			for (
+				retain_node_t *child = node->buckets[i];
+				child != NULL;
+				child = child->next_sibling
+			) {
+				if (!retain_store_skip_wildcard(store, child))
+					retain_store_match_subtree(store, child, count);
+			}
+		}
+		return;
+	}
+
+	if (level_len == 1 && level[0] == '+') {
+		for (size_t i = 0; i < node->bucket_count; i++) {
+			for (
+				retain_node_t *child = node->buckets[i];
+				child != NULL;
+				child = child->next_sibling
+			) {
+				if (retain_store_skip_wildcard(store, child))
+					continue;
+				retain_store_match_level(
+					store, child, filter, filter_len, levels, index + 1, count
+				);
+			}
+		}
+		return;
+	}
+
+	retain_node_t *child = retain_node_find_child(
+		node, level, level_len, hash_level(level, level_len)
+	);
+	if (child) {
+		retain_store_match_level(
+			store, child, filter, filter_len, levels, index + 1, count
+		);
+	}
+}
+
+size_t
+retain_store_match(
+	retain_store_t *store, const char *filter, size_t filter_len,
+	const topic_scan_t *levels, frame_t ***frames
+) {
+	size_t count = 0;
+
+	if (store->count > 0) {
+		retain_store_match_level(
+			store, store->root, filter, filter_len, levels, 0, &count
+		);
+	}
+
+	store->stats.matched += count;
+	*frames = store->matches;
+	return count;
+}
+
+void
+retain_store_log_stats(retain_store_t *store) {
+	if (store->stats.stored == 0 && store->stats.rejected == 0)
+		return;
+
+	log_info(
+		"Retained store: %zu messages in %zu bytes, %llu stored, %llu removed, "
+		"%llu rejected, %llu matched by subscriptions.",
+		store->count, store->memory,
+		(unsigned long long) store->stats.stored,
+		(unsigned long long) store->stats.removed,
+		(unsigned long long) store->stats.rejected,
+		(unsigned long long) store->stats.matched
+	);
+}
@@ -0,0 +1,573 @@
+#include "session.h"
+#include "mqtt_publish.h"
+#include "worker.h"
+
+struct worker *
+session_home_worker(
+	conns_t *conns, const char *client_id, size_t client_id_len
+) {
+	worker_t *worker = conns->worker;
+	if (!worker || worker->worker_count == 1)
+		return NULL;
+
+	worker_t *home = &worker->workers[
+		client_id_hash(client_id, client_id_len) % worker->worker_count
+	];
+	return home == worker ? NULL : home;
+}
+
+/**
+ * Inserts offline session into list of sessions.
+ */
+static void
+session_link(conns_t *conns, conn_t *session) {
+	session->prev = NULL;
+	session->next = conns->sessions;
+	if (conns->sessions)
+		conns->sessions->prev = session;
+	conns->sessions = session;
+}
+
+static void
+session_unlink(conns_t *conns, conn_t *session) {
+	if (session->prev)
+		session->prev->next = session->next;
+	else
+		conns->sessions = session->next;
+	if (session->next)
+		session->next->prev = session->prev;
+}
+
+/**
+ * Allocates offline session, without client ID and subscriptions.
+ */
+static conn_t *
+session_create(void) {
+	conn_t *session = slab_alloc(&pools_local()->connections);
+	memset(session, 0, sizeof(conn_t));
+
+	session->fd = -1;
+	session->persistent = 1;
+	session->detached = 1;
+	inflight_init(&session->inflight);
+	packet_id_set_init(&session->received);
+	return session;
+}
+
+/**
+ * Frees offline session, it has to be removed from client table and list of
+ * sessions first.
+ */
+static void
+session_free(conns_t *conns, conn_t *session) {
+	if (session->topics)
+		delete_topics_list(&conns->topic_tree, session->topics);
+	inflight_free(&session->inflight);
+	packet_id_set_free(&session->received);
+	free(session->client_id);
+	slab_free(&pools_local()->connections, session);
+}
+
+/**
+ * Moves subscriptions from one connection to another, they stay linked in
+ * subscription tree.
+ */
+static void
+session_move_topics(conn_t *from, conn_t *to) {
+	to->topics = from->topics;
+	from->topics = NULL;
+
+	for (topic_t *topic = to->topics->back; topic != NULL; topic = topic->next) {
+		topic->owner = to;
+	}
+}
+
+/**
+ * Appends snapshot of subscriptions and received QoS 2 packet IDs to session
+ * store. Topic filters refused in SUBACK are left out.
+ */
+static void
+session_write_snapshot(session_store_t *store, conn_t *conn) {
+	uint32_t topic_count = 0;
+	uint32_t received_count = conn->received.count;
+	size_t size = 2 * sizeof(uint32_t) + received_count * sizeof(uint16_t);
+
+	for (topic_t *topic = conn->topics->back; topic != NULL; topic = topic->next) {
+		if (topic->qos_code == 0x80)
+			continue;
+		size += sizeof(uint16_t) + 1 + topic->topic_len;
+		topic_count++;
+	}
+
+	char *body = buffer_alloc(size);
+	char *index = body;
+
+	memcpy(index, &topic_count, sizeof(uint32_t));
+	index += sizeof(uint32_t);
+	memcpy(index, &received_count, sizeof(uint32_t));
+	index += sizeof(uint32_t);
+
+	for (topic_t *topic = conn->topics->back; topic != NULL; topic = topic->next) {
+		if (topic->qos_code == 0x80)
+			continue;
+
+		uint16_t topic_len = topic->topic_len;
+		memcpy(index, &topic_len, sizeof(uint16_t));
+		index += sizeof(uint16_t);
+		*index++ = topic->qos_code;
+		memcpy(index, topic->topic, topic_len);
+		index += topic_len;
+	}
+
+	for (uint32_t i = 0; i < conn->received.capacity; i++) {
+		if (conn->received.ids[i] == 0)
+			continue;
+		memcpy(index, &conn->received.ids[i], sizeof(uint16_t));
+		index += sizeof(uint16_t);
+	}
+
+	session_record_t record = { .type = SESSION_RECORD_SESSION };
+	session_store_append(
+		store, &record, conn->client_id, conn->cliend_id_length, body, size
+	);
+	buffer_free(body);
+}
+
+/**
+ * Appends message waiting for the client (in flight or for a free slot) to
+ * session store. The whole PUBLISH frame the payload is sliced from is
+ * written, only packet ID of released QoS 2 message is kept.
+ */
+static void
+session_write_message(
+	session_store_t *store, conn_t *conn, inflight_msg_t *msg
+) {
+	frame_t *message = msg->payload ? msg->payload->parent : NULL;
+	session_record_t record = {
+		.type = SESSION_RECORD_MESSAGE,
+		.qos = msg->qos,
+		.released = msg->released,
+		.packet_id = msg->packet_id
+	};
+
+	session_store_append(
+		store, &record, conn->client_id, conn->cliend_id_length,
+		message ? message->data : NULL, message ? message->size : 0
+	);
+}
+
+/**
+ * Removes offline session from session store, client table and list of
+ * sessions and frees it.
+ */
+static void
+session_discard(conns_t *conns, conn_t *session) {
+	session_store_remove(
+		conns->worker->sessions, session->client_id, session->cliend_id_length
+	);
+	client_table_remove(&conns->clients, session);
+	session_unlink(conns, session);
+	session_free(conns, session);
+}
+
+/**
+ * Moves offline session to connection of the client, session is freed.
+ */
+static void
+session_attach(conns_t *conns, conn_t *conn, conn_t *session) {
+	delete_topics_list(&conns->topic_tree, conn->topics);
+	session_move_topics(session, conn);
+
+	inflight_free(&conn->inflight);
+	conn->inflight = session->inflight;
+	inflight_init(&session->inflight);
+
+	packet_id_set_free(&conn->received);
+	conn->received = session->received;
+	packet_id_set_init(&session->received);
+
+	client_table_remove(&conns->clients, session);
+	client_table_insert(&conns->clients, conn);
+	session_unlink(conns, session);
+	session_free(conns, session);
+}
+
+void
+session_open(conns_t *conns, conn_t *conn, int clean_session) {
+	session_store_t *store = conns->worker->sessions;
+	conn_t *session = client_table_find(
+		&conns->clients, conn->client_id, conn->cliend_id_length
+	);
+
+	if (clean_session) {
+		if (session)
+			session_discard(conns, session);
+		client_table_insert(&conns->clients, conn);
+		return;
+	}
+
+	conn->persistent = 1;
+	if (session) {
+		session_attach(conns, conn, session);
+		conn->session_present = 1;
+
+		// messages are in memory of the connection from now on
+		session_record_t record = { .type = SESSION_RECORD_RESUME };
+		session_store_append(
+			store, &record, conn->client_id, conn->cliend_id_length, NULL, 0
+		);
+		return;
+	}
+
+	client_table_insert(&conns->clients, conn);
+	session_store_add(store, conn->client_id, conn->cliend_id_length);
+	if (store->path)
+		session_write_snapshot(store, conn);
+}
+
+void
+session_detach(conns_t *conns, conn_t *conn) {
+	session_store_t *store = conns->worker->sessions;
+	conn_t *session = session_create();
+
+	session->client_id = conn->client_id;
+	session->cliend_id_length = conn->cliend_id_length;
+	conn->client_id = NULL;
+	session_move_topics(conn, session);
+
+	session->inflight = conn->inflight;
+	inflight_init(&conn->inflight);
+	session->received = conn->received;
+	packet_id_set_init(&conn->received);
+
+	client_table_remove(&conns->clients, conn);
+	client_table_insert(&conns->clients, session);
+	session_link(conns, session);
+
+	// path is set before workers start, it never changes
+	if (!store->path)
+		return;
+
+	session_write_snapshot(store, session);
+
+	inflight_t *inflight = &session->inflight;
+	for (uint32_t used = inflight->used; used; used &= used - 1) {
+		session_write_message(
+			store, session, &inflight->slots[__builtin_ctz(used)]
+		);
+	}
+	for (size_t i = 0; i < inflight->pending_count; i++) {
+		session_write_message(
+			store, session,
+			&inflight->pending[
+				(inflight->pending_head + i) & (inflight->pending_capacity - 1)
+			]
+		);
+	}
+}
+
+void
+session_save(conns_t *conns, conn_t *conn) {
+	session_store_t *store = conns->worker->sessions;
+
+	if (conn->persistent && store->path)
+		session_write_snapshot(store, conn);
+}
+
+/**
+ * Message restored from session store, counted by session and content.
+ */
+struct restored_message {
+	conn_t *session;
+	frame_t *frame; // PUBLISH frame of the message
+	size_t count; // equal messages not replayed yet
+};
+
+static int
+restored_message_compare(const void *a, const void *b) {
+	const struct restored_message *first = a;
+	const struct restored_message *second = b;
+
+	if (first->session != second->session)
+		return first->session < second->session ? -1 : 1;
+	if (first->frame->size != second->frame->size)
+		return first->frame->size < second->frame->size ? -1 : 1;
+	return memcmp(first->frame->data, second->frame->data, first->frame->size);
+}
+
+/**
+ * \returns 1 if replayed message was restored into the session already and
+ * 			it was not matched before, 0 otherwise.
+ */
+static int
+session_replayed(conns_t *conns, conn_t *session, frame_t *message) {
+	struct restored_message key = { .session = session, .frame = message };
+	struct restored_message *restored = bsearch(
+		&key, conns->restored, conns->restored_count,
+		sizeof(struct restored_message), restored_message_compare
+	);
+
+	if (!restored || restored->count == 0)
+		return 0;
+	restored->count--;
+	return 1;
+}
+
+int
+session_deliver(conns_t *conns, conn_t *session, frame_t *payload, uint8_t qos) {
+	session_store_t *store = conns->worker->sessions;
+
+	if (conns->restored && session_replayed(conns, session, payload->parent))
+		return 0;
+
+	frame_t *ref = frame_ref(payload);
+
+	if (inflight_push_pending(&session->inflight, ref, qos) == -1) {
+		frame_release(ref);
+		return -1;
+	}
+
+	if (store->path) {
+		session_record_t record = { .type = SESSION_RECORD_MESSAGE, .qos = qos };
+		session_store_append(
+			store, &record, session->client_id, session->cliend_id_length,
+			payload->parent->data, payload->parent->size
+		);
+	}
+	return 0;
+}
+
+/**
+ * Restores subscriptions and received packet IDs of session from its
+ * snapshot. Snapshot is checked, as the file may be damaged.
+ */
+static void
+session_restore_snapshot(
+	conns_t *conns, conn_t *session, const session_record_t *record
+) {
+	const char *index = session_record_body(record);
+	size_t size = session_record_body_size(record);
+	uint32_t topic_count, received_count;
+
+	if (size < 2 * sizeof(uint32_t))
+		return;
+	memcpy(&topic_count, index, sizeof(uint32_t));
+	memcpy(&received_count, index + sizeof(uint32_t), sizeof(uint32_t));
+	index += 2 * sizeof(uint32_t);
+	size -= 2 * sizeof(uint32_t);
+
+	for (uint32_t i = 0; i < topic_count; i++) {
+		uint16_t topic_len;
+		if (size < sizeof(uint16_t) + 1)
+			return;
+		memcpy(&topic_len, index, sizeof(uint16_t));
+		uint8_t qos = index[sizeof(uint16_t)];
+		index += sizeof(uint16_t) + 1;
+		size -= sizeof(uint16_t) + 1;
+		if (size < topic_len)
+			return;
+
+		if (qos <= MQTT_MAX_QOS
+			&& topic_scan(index, topic_len, &conns->topic_tree.scan) != -1
+		) {
+			insert_topic(
+				&conns->topic_tree, session->topics, session, (char *) index,
+				topic_len, &conns->topic_tree.scan, qos
+			);
+		}
+		index += topic_len;
+		size -= topic_len;
+	}
+
+	for (uint32_t i = 0; i < received_count && size >= sizeof(uint16_t); i++) {
+		uint16_t packet_id;
+		memcpy(&packet_id, index, sizeof(uint16_t));
+		if (packet_id != 0)
+			(void) packet_id_set_insert(&session->received, packet_id);
+		index += sizeof(uint16_t);
+		size -= sizeof(uint16_t);
+	}
+}
+
+/**
+ * \returns Size of PUBLISH control packet at start of message record, 0 if
+ * 			it does not fit.
+ */
+static size_t
+restored_message_size(const session_record_t *record) {
+	const uint8_t *data = (const uint8_t *) session_record_body(record);
+	size_t size = session_record_body_size(record);
+	size_t remaining_length = 0;
+	size_t multiplier = 1;
+
+	for (size_t i = 1; i < size && i <= 4; i++) {
+		remaining_length += (data[i] & 127) * multiplier;
+		multiplier *= 128;
+		if (!(data[i] & 128)) {
+			size_t message_size = i + 1 + remaining_length;
+			return message_size <= size && remaining_length >= 2
+				? message_size
+				: 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Restores message of session into the slot of its packet ID, or into queue of
+ * waiting messages.
+ */
+static void
+session_restore_message(conn_t *session, const session_record_t *record) {
+	frame_t *payload = NULL;
+
+	if (record->qos == 0 || record->qos > MQTT_MAX_QOS)
+		return;
+
+	if (!record->released) {
+		size_t size = restored_message_size(record);
+		if (size == 0)
+			return;
+
+		frame_t *message = frame_create(size);
+		memcpy(message->data, session_record_body(record), size);
+		message->qos = record->qos;
+		payload = create_publish_slice(message);
+		frame_release(message);
+	}
+
+	if (record->packet_id != 0 && inflight_restore(
+		&session->inflight, payload, record->qos, record->packet_id,
+		record->released
+	) == 0)
+		return;
+
+	// PUBREL is not queued, client released the message already
+	if (!payload)
+		return;
+	if (inflight_push_pending(&session->inflight, payload, record->qos) == -1)
+		frame_release(payload);
+}
+
+void
+session_restore(
+	void *arg, const session_record_t *record,
+	const session_record_t **messages, size_t message_count
+) {
+	worker_t *workers = arg;
+	const char *client_id = session_record_client_id(record);
+	size_t client_id_len = record->client_id_length;
+	worker_t *home = &workers[
+		client_id_hash(client_id, client_id_len) % workers[0].worker_count
+	];
+	conns_t *conns = &home->conns;
+
+	conn_t *session = session_create();
+	session->client_id = calloc(client_id_len + 1, 1);
+	if (!session->client_id)
+		err(1, "session restore calloc client_id");
+	memcpy(session->client_id, client_id, client_id_len);
+	session->cliend_id_length = client_id_len;
+	session->topics = create_topics_list();
+
+	session_restore_snapshot(conns, session, record);
+	for (size_t i = 0; i < message_count; i++) {
+		session_restore_message(session, messages[i]);
+	}
+
+	client_table_insert(&conns->clients, session);
+	session_link(conns, session);
+}
+
+/**
+ * Adds message of session to index of restored messages.
+ */
+static void
+restored_message_add(
+	struct restored_message *restored, size_t *count, conn_t *session,
+	inflight_msg_t *msg
+) {
+	// released QoS 2 message has no content
+	if (!msg->payload)
+		return;
+
+	restored[*count].session = session;
+	restored[*count].frame = msg->payload->parent;
+	restored[*count].count = 1;
+	(*count)++;
+}
+
+void
+sessions_replay_begin(conns_t *conns) {
+	size_t capacity = 0;
+	for (conn_t *session = conns->sessions; session; session = session->next) {
+		capacity += __builtin_popcount(session->inflight.used)
+			+ session->inflight.pending_count;
+	}
+	if (capacity == 0)
+		return;
+
+	struct restored_message *restored = malloc(
+		capacity * sizeof(struct restored_message)
+	);
+	if (!restored)
+		err(1, "sessions_replay_begin malloc");
+
+	size_t count = 0;
+	for (conn_t *session = conns->sessions; session; session = session->next) {
+		inflight_t *inflight = &session->inflight;
+		for (uint32_t used = inflight->used; used; used &= used - 1) {
+			restored_message_add(
+				restored, &count, session,
+				&inflight->slots[__builtin_ctz(used)]
+			);
+		}
+		for (size_t i = 0; i < inflight->pending_count; i++) {
+			restored_message_add(
+				restored, &count, session,
+				&inflight->pending[
+					(inflight->pending_head + i)
+						& (inflight->pending_capacity - 1)
+				]
+			);
+		}
+	}
+	qsort(
+		restored, count, sizeof(struct restored_message),
+		restored_message_compare
+	);
+
+	// equal messages of a session are counted by one entry
+	size_t unique = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (unique > 0 && restored_message_compare(
+			&restored[unique - 1], &restored[i]
+		) == 0) {
+			restored[unique - 1].count++;
+			continue;
+		}
+		restored[unique++] = restored[i];
+	}
+
+	conns->restored = restored;
+	conns->restored_count = unique;
+}
+
+void
+sessions_replay_end(conns_t *conns) {
+	free(conns->restored);
+	conns->restored = NULL;
+	conns->restored_count = 0;
+}
+
+void
+sessions_free(conns_t *conns) {
+	conn_t *next;
+
+	for (conn_t *session = conns->sessions; session != NULL; session = next) {
+		next = session->next;
+		client_table_remove(&conns->clients, session);
+		session_free(conns, session);
+	}
+	conns->sessions = NULL;
+}
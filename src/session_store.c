@@ -0,0 +1,804 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "session_store.h"
+#include "client_table.h"
+#include "log.h"
+
+/**
+ * Store file starts with magic, records follow the header.
+ */
+#define SESSION_STORE_MAGIC "FMQSESS1"
+#define SESSION_STORE_HEADER_SIZE 16
+
+/**
+ * Size of buffer records of compacted file are written through.
+ */
+#define SESSION_STORE_WRITE_BUFFER (256 * 1024)
+
+/**
+ * Size record takes in the file, records are aligned to 8 bytes.
+ */
+#define record_span(size) (((size_t) (size) + 7) & ~(size_t) 7)
+
+/**
+ * Session found by replay of store file, with records describing its state.
+ */
+struct session_index_entry {
+	struct session_index_entry *next; // next entry in the same bucket
+	uint32_t hash;
+	const session_record_t *session; // last snapshot, NULL if none
+	const session_record_t **messages; // messages since the snapshot
+	size_t message_count;
+	size_t message_capacity;
+};
+
+typedef struct session_index_entry session_index_entry_t;
+
+/**
+ * Sessions of store file by client ID, filled by replay of the file.
+ */
+typedef struct {
+	session_index_entry_t **buckets;
+	size_t bucket_count; // power of two
+	size_t count;
+} session_index_t;
+
+/**
+ * Buffered writer of compacted store file.
+ */
+typedef struct {
+	int fd;
+	char *buffer;
+	size_t used; // bytes in buffer
+	size_t offset; // bytes written to file
+	int failed;
+} store_writer_t;
+
+/**
+ * FNV-1a hash of record bytes, its checksum.
+ */
+static uint32_t
+record_checksum(const session_record_t *record) {
+	const uint8_t *data = (const uint8_t *) &record->type;
+	size_t size = record->size - offsetof(session_record_t, type);
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * \returns Record at given offset of the mapping, NULL if there is none or it
+ * 			is not complete (torn write is where replay stops).
+ */
+static const session_record_t *
+record_at(const char *map, size_t offset, size_t limit) {
+	if (limit - offset < sizeof(session_record_t))
+		return NULL;
+
+	const session_record_t *record = (const session_record_t *) (map + offset);
+	if (record->size < sizeof(session_record_t)
+		|| record_span(record->size) > limit - offset
+		|| sizeof(session_record_t) + record->client_id_length > record->size
+		|| record->checksum != record_checksum(record)
+	)
+		return NULL;
+
+	return record;
+}
+
+static void
+session_index_init(session_index_t *index) {
+	index->bucket_count = SESSION_STORE_INITIAL_BUCKETS;
+	index->count = 0;
+	index->buckets = calloc(index->bucket_count, sizeof(session_index_entry_t *));
+	if (!index->buckets)
+		err(1, "session index init calloc buckets");
+}
+
+static void
+session_index_free(session_index_t *index) {
+	session_index_entry_t *next;
+
+	for (size_t i = 0; i < index->bucket_count; i++) {
+		for (
+			session_index_entry_t *entry = index->buckets[i];
+			entry != NULL;
+			entry = next
+		) {
+			next = entry->next;
+			free(entry->messages);
+			free(entry);
+		}
+	}
+	free(index->buckets);
+}
+
+/**
+ * Doubles number of buckets of the index and rehashes its entries.
+ */
+static void
+session_index_expand(session_index_t *index) {
+	size_t bucket_count = index->bucket_count * 2;
+	session_index_entry_t **buckets =
+		calloc(bucket_count, sizeof(session_index_entry_t *));
+	if (!buckets)
+		err(1, "session index expand calloc buckets");
+
+	session_index_entry_t *next;
+	for (size_t i = 0; i < index->bucket_count; i++) {
+		for (
+			session_index_entry_t *entry = index->buckets[i];
+			entry != NULL;
+			entry = next
+		) {
+			next = entry->next;
+			size_t bucket = entry->hash & (bucket_count - 1);
+			entry->next = buckets[bucket];
+			buckets[bucket] = entry;
+		}
+	}
+
+	free(index->buckets);
+	index->buckets = buckets;
+	index->bucket_count = bucket_count;
+}
+
+/**
+ * Finds session of client ID of the record.
+ *
+ * \param link Set to link pointing to the entry (or where it would be
+ * 			   inserted).
+ *
+ * \returns Entry or NULL.
+ */
+static session_index_entry_t *
+session_index_find(
+	session_index_t *index, const session_record_t *record, uint32_t hash,
+	session_index_entry_t ***link
+) {
+	const char *client_id = session_record_client_id(record);
+
+	for (
+		*link = &index->buckets[hash & (index->bucket_count - 1)];
+		**link != NULL;
+		*link = &(**link)->next
+	) {
+		session_index_entry_t *entry = **link;
+		const session_record_t *first = entry->session
+			? entry->session
+			: entry->messages[0];
+
+		if (entry->hash == hash
+			&& first->client_id_length == record->client_id_length
+			&& memcmp(
+				session_record_client_id(first), client_id,
+				record->client_id_length
+			) == 0
+		)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void
+session_index_add_message(
+	session_index_entry_t *entry, const session_record_t *record
+) {
+	if (entry->message_count == entry->message_capacity) {
+		size_t capacity = entry->message_capacity
+			? entry->message_capacity * 2
+			: 4;
+		const session_record_t **messages = realloc(
+			entry->messages, capacity * sizeof(session_record_t *)
+		);
+		if (!messages)
+			err(1, "session index realloc messages");
+		entry->messages = messages;
+		entry->message_capacity = capacity;
+	}
+	entry->messages[entry->message_count++] = record;
+}
+
+/**
+ * Replays records of store file into index: snapshot replaces session state
+ * and its messages, messages are appended, resumption drops them and delete
+ * record removes the whole session.
+ *
+ * \returns End of last valid record.
+ */
+static size_t
+session_index_replay(
+	session_index_t *index, const char *map, size_t offset, size_t limit
+) {
+	const session_record_t *record;
+	session_index_entry_t **link;
+
+	for (
+		;
+		(record = record_at(map, offset, limit)) != NULL;
+		offset += record_span(record->size)
+	) {
+		uint32_t hash = client_id_hash(
+			session_record_client_id(record), record->client_id_length
+		);
+		session_index_entry_t *entry = session_index_find(
+			index, record, hash, &link
+		);
+
+		if (record->type == SESSION_RECORD_DELETE) {
+			if (entry) {
+				*link = entry->next;
+				free(entry->messages);
+				free(entry);
+				index->count--;
+			}
+			continue;
+		}
+
+		if (!entry) {
+			if (record->type != SESSION_RECORD_SESSION
+				&& record->type != SESSION_RECORD_MESSAGE
+			)
+				continue;
+
+			entry = calloc(1, sizeof(session_index_entry_t));
+			if (!entry)
+				err(1, "session index calloc entry");
+			entry->hash = hash;
+			entry->next = *link;
+			*link = entry;
+			// first record identifies the entry until snapshot is found
+			if (record->type == SESSION_RECORD_MESSAGE)
+				session_index_add_message(entry, record);
+			else
+				entry->session = record;
+			if (++index->count > index->bucket_count)
+				session_index_expand(index);
+			continue;
+		}
+
+		switch (record->type) {
+		case SESSION_RECORD_SESSION:
+			entry->session = record;
+			entry->message_count = 0;
+			break;
+		case SESSION_RECORD_MESSAGE:
+			session_index_add_message(entry, record);
+			break;
+		case SESSION_RECORD_RESUME:
+			if (entry->session)
+				entry->message_count = 0;
+			break;
+		}
+	}
+
+	return offset;
+}
+
+/**
+ * Finds client ID in registry.
+ *
+ * \param link Set to link pointing to the ID (or where it would be inserted).
+ */
+static struct session_id *
+registry_find(
+	session_store_t *store, const char *client_id, size_t client_id_len,
+	uint32_t hash, struct session_id ***link
+) {
+	for (
+		*link = &store->buckets[hash & (store->bucket_count - 1)];
+		**link != NULL;
+		*link = &(**link)->next
+	) {
+		struct session_id *id = **link;
+		if (id->hash == hash
+			&& id->length == client_id_len
+			&& memcmp(id->id, client_id, client_id_len) == 0
+		)
+			return id;
+	}
+
+	return NULL;
+}
+
+/**
+ * Doubles number of buckets of registry and rehashes its IDs.
+ */
+static void
+registry_expand(session_store_t *store) {
+	size_t bucket_count = store->bucket_count * 2;
+	struct session_id **buckets = calloc(bucket_count, sizeof(struct session_id *));
+	if (!buckets)
+		err(1, "session registry expand calloc buckets");
+
+	struct session_id *next;
+	for (size_t i = 0; i < store->bucket_count; i++) {
+		for (struct session_id *id = store->buckets[i]; id != NULL; id = next) {
+			next = id->next;
+			size_t bucket = id->hash & (bucket_count - 1);
+			id->next = buckets[bucket];
+			buckets[bucket] = id;
+		}
+	}
+
+	free(store->buckets);
+	store->buckets = buckets;
+	store->bucket_count = bucket_count;
+}
+
+static void
+registry_insert(
+	session_store_t *store, const char *client_id, size_t client_id_len
+) {
+	struct session_id **link;
+	uint32_t hash = client_id_hash(client_id, client_id_len);
+
+	if (registry_find(store, client_id, client_id_len, hash, &link))
+		return;
+
+	struct session_id *id = malloc(sizeof(struct session_id) + client_id_len);
+	if (!id)
+		err(1, "session registry malloc id");
+	id->hash = hash;
+	id->length = client_id_len;
+	memcpy(id->id, client_id, client_id_len);
+	id->next = NULL;
+	*link = id;
+
+	if (++store->count > store->bucket_count)
+		registry_expand(store);
+}
+
+void
+session_store_init(session_store_t *store) {
+	memset(store, 0, sizeof(session_store_t));
+	pthread_mutex_init(&store->lock, NULL);
+	store->bucket_count = SESSION_STORE_INITIAL_BUCKETS;
+	store->buckets = calloc(store->bucket_count, sizeof(struct session_id *));
+	if (!store->buckets)
+		err(1, "session store init calloc buckets");
+	store->fd = -1;
+}
+
+/**
+ * Maps the whole store file, its size is `store->map_size`.
+ *
+ * \returns 0 on success, -1 on error (errno is set).
+ */
+static int
+session_store_map(session_store_t *store) {
+	void *map = mmap(
+		NULL, store->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0
+	);
+	if (map == MAP_FAILED)
+		return -1;
+
+	store->map = map;
+	return 0;
+}
+
+int
+session_store_open(
+	session_store_t *store, const char *path, session_restore_t restore,
+	void *arg
+) {
+	struct stat st;
+
+	store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (store->fd == -1)
+		return -1;
+
+	if (fstat(store->fd, &st) == -1)
+		goto failed;
+
+	if (st.st_size == 0) {
+		char header[SESSION_STORE_HEADER_SIZE] = SESSION_STORE_MAGIC;
+		if (pwrite(store->fd, header, sizeof(header), 0) != sizeof(header))
+			goto failed;
+		st.st_size = sizeof(header);
+	}
+
+	store->map_size = st.st_size;
+	if (store->map_size < SESSION_STORE_HEADER_SIZE
+		|| session_store_map(store) == -1
+	)
+		goto invalid;
+
+	if (memcmp(store->map, SESSION_STORE_MAGIC, strlen(SESSION_STORE_MAGIC)) != 0) {
+		munmap(store->map, store->map_size);
+		store->map = NULL;
+		goto invalid;
+	}
+
+	session_index_t index;
+	session_index_init(&index);
+	store->end = session_index_replay(
+		&index, store->map, SESSION_STORE_HEADER_SIZE, store->map_size
+	);
+	if (store->end < store->map_size) {
+		// anything after last valid record is overwritten by new ones
+		memset(store->map + store->end, 0, store->map_size - store->end);
+	}
+	store->compacted_size = store->end;
+
+	for (size_t i = 0; i < index.bucket_count; i++) {
+		for (
+			session_index_entry_t *entry = index.buckets[i];
+			entry != NULL;
+			entry = entry->next
+		) {
+			if (!entry->session)
+				continue;
+
+			registry_insert(
+				store, session_record_client_id(entry->session),
+				entry->session->client_id_length
+			);
+			restore(arg, entry->session, entry->messages, entry->message_count);
+			store->stats.restored++;
+		}
+	}
+	session_index_free(&index);
+
+	store->path = strdup(path);
+	if (!store->path)
+		err(1, "session store open strdup path");
+	return 0;
+
+invalid:
+	errno = EINVAL;
+failed:
+	;
+	int saved_errno = errno;
+	close(store->fd);
+	store->fd = -1;
+	errno = saved_errno;
+	return -1;
+}
+
+/**
+ * Waits for background compaction thread, if it was started.
+ */
+static void
+session_store_join(session_store_t *store) {
+	if (!store->compactor_started)
+		return;
+
+	pthread_join(store->compactor, NULL);
+	store->compactor_started = 0;
+}
+
+void
+session_store_free(session_store_t *store) {
+	// compaction takes the lock to finish, workers are stopped already
+	session_store_join(store);
+
+	if (store->map) {
+		if (msync(store->map, store->end, MS_SYNC) == -1)
+			log_error("Cannot sync session store: %s.", strerror(errno));
+		munmap(store->map, store->map_size);
+		// unused growth is not kept on disk
+		if (ftruncate(store->fd, store->end) == -1)
+			log_error("Cannot truncate session store: %s.", strerror(errno));
+		close(store->fd);
+	}
+	free(store->path);
+
+	struct session_id *next;
+	for (size_t i = 0; i < store->bucket_count; i++) {
+		for (struct session_id *id = store->buckets[i]; id != NULL; id = next) {
+			next = id->next;
+			free(id);
+		}
+	}
+	free(store->buckets);
+	pthread_mutex_destroy(&store->lock);
+}
+
+void
+session_store_add(
+	session_store_t *store, const char *client_id, size_t client_id_len
+) {
+	pthread_mutex_lock(&store->lock);
+	registry_insert(store, client_id, client_id_len);
+	pthread_mutex_unlock(&store->lock);
+}
+
+void
+session_store_remove(
+	session_store_t *store, const char *client_id, size_t client_id_len
+) {
+	struct session_id **link;
+	uint32_t hash = client_id_hash(client_id, client_id_len);
+
+	pthread_mutex_lock(&store->lock);
+	struct session_id *id = registry_find(
+		store, client_id, client_id_len, hash, &link
+	);
+	if (id) {
+		*link = id->next;
+		free(id);
+		store->count--;
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	session_record_t record = { .type = SESSION_RECORD_DELETE };
+	session_store_append(store, &record, client_id, client_id_len, NULL, 0);
+}
+
+static void
+writer_flush(store_writer_t *writer) {
+	size_t written = 0;
+
+	while (!writer->failed && written < writer->used) {
+		ssize_t bytes = write(
+			writer->fd, writer->buffer + written, writer->used - written
+		);
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			writer->failed = errno;
+			break;
+		}
+		written += bytes;
+	}
+
+	writer->offset += writer->used;
+	writer->used = 0;
+}
+
+static void
+writer_write(store_writer_t *writer, const void *data, size_t size) {
+	while (size > 0) {
+		size_t chunk = SESSION_STORE_WRITE_BUFFER - writer->used;
+		if (chunk > size)
+			chunk = size;
+
+		memcpy(writer->buffer + writer->used, data, chunk);
+		writer->used += chunk;
+		data = (const char *) data + chunk;
+		size -= chunk;
+
+		if (writer->used == SESSION_STORE_WRITE_BUFFER)
+			writer_flush(writer);
+	}
+}
+
+/**
+ * Compacts store file in background: records up to the end at compaction
+ * start are replayed from read-only mapping and records of live sessions are
+ * written into temporary file. Records appended in the meantime are copied
+ * under the lock, then the file replaces store file.
+ */
+static void *
+session_store_compact(void *arg) {
+	session_store_t *store = arg;
+	session_index_t index;
+	store_writer_t writer = { 0 };
+	char *tmp_path = NULL;
+	char *snapshot = MAP_FAILED;
+
+	pthread_mutex_lock(&store->lock);
+	size_t snapshot_end = store->end;
+	int fd = store->fd;
+	pthread_mutex_unlock(&store->lock);
+
+	session_index_init(&index);
+	writer.fd = -1;
+	writer.buffer = malloc(SESSION_STORE_WRITE_BUFFER);
+	tmp_path = malloc(strlen(store->path) + sizeof(".tmp"));
+	if (!writer.buffer || !tmp_path)
+		err(1, "session store compact malloc");
+	sprintf(tmp_path, "%s.tmp", store->path);
+
+	snapshot = mmap(NULL, snapshot_end, PROT_READ, MAP_SHARED, fd, 0);
+	if (snapshot == MAP_FAILED)
+		goto failed;
+	(void) session_index_replay(
+		&index, snapshot, SESSION_STORE_HEADER_SIZE, snapshot_end
+	);
+
+	writer.fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (writer.fd == -1)
+		goto failed;
+
+	char header[SESSION_STORE_HEADER_SIZE] = SESSION_STORE_MAGIC;
+	writer_write(&writer, header, sizeof(header));
+	for (size_t i = 0; i < index.bucket_count; i++) {
+		for (
+			session_index_entry_t *entry = index.buckets[i];
+			entry != NULL;
+			entry = entry->next
+		) {
+			if (!entry->session)
+				continue;
+
+			writer_write(
+				&writer, entry->session, record_span(entry->session->size)
+			);
+			for (size_t j = 0; j < entry->message_count; j++) {
+				writer_write(
+					&writer, entry->messages[j],
+					record_span(entry->messages[j]->size)
+				);
+			}
+		}
+	}
+	writer_flush(&writer);
+	// bulk of the file is synced without blocking appends
+	if (writer.failed || fdatasync(writer.fd) == -1)
+		goto failed;
+
+	size_t live_end = writer.offset;
+	pthread_mutex_lock(&store->lock);
+
+	writer_write(&writer, store->map + snapshot_end, store->end - snapshot_end);
+	writer_flush(&writer);
+
+	size_t end = writer.offset;
+	size_t map_size = end + SESSION_STORE_GROWTH;
+	char *map = MAP_FAILED;
+	if (!writer.failed
+		&& ftruncate(writer.fd, map_size) == 0
+		&& fdatasync(writer.fd) == 0
+	)
+		map = mmap(
+			NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, writer.fd, 0
+		);
+
+	if (map == MAP_FAILED || rename(tmp_path, store->path) == -1) {
+		if (map != MAP_FAILED)
+			munmap(map, map_size);
+		pthread_mutex_unlock(&store->lock);
+		goto failed;
+	}
+
+	munmap(store->map, store->map_size);
+	close(store->fd);
+	store->fd = writer.fd;
+	store->map = map;
+	store->map_size = map_size;
+	store->end = end;
+	store->compacted_size = end;
+	store->compacting = 0;
+	store->stats.compactions++;
+	pthread_mutex_unlock(&store->lock);
+
+	log_info(
+		"Session store compacted from %zu to %zu bytes.", snapshot_end,
+		live_end
+	);
+	munmap(snapshot, snapshot_end);
+	session_index_free(&index);
+	free(writer.buffer);
+	free(tmp_path);
+	return NULL;
+
+failed:
+	log_error(
+		"Session store compaction failed: %s.",
+		strerror(writer.failed ? writer.failed : errno)
+	);
+	if (writer.fd != -1) {
+		close(writer.fd);
+		unlink(tmp_path);
+	}
+	if (snapshot != MAP_FAILED)
+		munmap(snapshot, snapshot_end);
+	session_index_free(&index);
+	free(writer.buffer);
+	free(tmp_path);
+
+	pthread_mutex_lock(&store->lock);
+	store->compacting = 0;
+	// do not retry before the file doubles again
+	store->compacted_size = store->end;
+	pthread_mutex_unlock(&store->lock);
+	return NULL;
+}
+
+/**
+ * Grows store file and its mapping, so that `size` more bytes fit after end
+ * of records. Has to be called under the lock.
+ *
+ * \returns 0 on success, -1 on error (errno is set).
+ */
+static int
+session_store_grow(session_store_t *store, size_t size) {
+	size_t map_size = store->map_size;
+	while (map_size - store->end < size) {
+		map_size += map_size > SESSION_STORE_GROWTH
+			? map_size
+			: SESSION_STORE_GROWTH;
+	}
+
+	if (ftruncate(store->fd, map_size) == -1)
+		return -1;
+
+	munmap(store->map, store->map_size);
+	store->map_size = map_size;
+	if (session_store_map(store) == -1) {
+		store->map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+session_store_append(
+	session_store_t *store, session_record_t *record, const char *client_id,
+	size_t client_id_len, const char *body, size_t body_size
+) {
+	size_t size = sizeof(session_record_t) + client_id_len + body_size;
+
+	pthread_mutex_lock(&store->lock);
+	if (!store->map) {
+		pthread_mutex_unlock(&store->lock);
+		return;
+	}
+
+	if (store->map_size - store->end < record_span(size)
+		&& session_store_grow(store, record_span(size)) == -1
+	) {
+		err(1, "session store grow");
+	}
+
+	char *data = store->map + store->end;
+	record->size = size;
+	record->client_id_length = client_id_len;
+	record->reserved = 0;
+	memcpy(data, record, sizeof(session_record_t));
+	memcpy(data + sizeof(session_record_t), client_id, client_id_len);
+	if (body_size > 0)
+		memcpy(data + sizeof(session_record_t) + client_id_len, body, body_size);
+	memset(data + size, 0, record_span(size) - size);
+	((session_record_t *) data)->checksum = record_checksum(
+		(session_record_t *) data
+	);
+
+	store->end += record_span(size);
+	store->stats.records++;
+	store->stats.bytes += record_span(size);
+
+	if (!store->compacting
+		&& store->end > SESSION_STORE_COMPACT_MIN
+		&& store->end > 2 * store->compacted_size
+	) {
+		session_store_join(store);
+		store->compacting = 1;
+		if (pthread_create(
+			&store->compactor, NULL, session_store_compact, store
+		) == 0) {
+			store->compactor_started = 1;
+		}
+		else {
+			log_error("Cannot start session store compaction.");
+			store->compacting = 0;
+			store->compacted_size = store->end;
+		}
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+void
+session_store_log_stats(session_store_t *store) {
+	log_info(
+		"Session store: %zu sessions, %llu restored, %llu records "
+		"(%llu bytes) appended, %llu compactions.",
+		store->count,
+		(unsigned long long) store->stats.restored,
+		(unsigned long long) store->stats.records,
+		(unsigned long long) store->stats.bytes,
+		(unsigned long long) store->stats.compactions
+	);
+}
@@ -0,0 +1,241 @@
+#include "share.h"
+#include "structs.h"
+
+/**
+ * Picks members in turn. Clients with offline sessions are passed over while
+ * any member is connected.
+ */
+static topic_t *
+share_select_round_robin(share_group_t *group, uint32_t hash) {
+	(void) hash;
+
+	for (size_t i = 0; i < group->member_count; i++) {
+		topic_t *member = group->members[group->cursor++ % group->member_count];
+		if (!member->owner->detached)
+			return member;
+	}
+
+	return group->members[group->cursor++ % group->member_count];
+}
+
+/**
+ * \returns Messages waiting for client, in its outgoing queue and inflight
+ * 			window. Client with offline session is the most loaded.
+ */
+static size_t
+share_member_load(topic_t *member) {
+	struct connection *conn = member->owner;
+
+	if (conn->detached)
+		return SIZE_MAX;
+	return conn->out_queue.count + inflight_count(&conn->inflight);
+}
+
+/**
+ * Picks the less loaded of two random members (power of two choices), which
+ * keeps the load close to least loaded member without walking all of them.
+ */
+static topic_t *
+share_select_least_queue(share_group_t *group, uint32_t hash) {
+	(void) hash;
+
+	if (group->member_count == 1)
+		return group->members[0];
+
+	// linear congruential generator, high bits are the random ones
+	group->cursor = group->cursor * 6364136223846793005ULL
+		+ 1442695040888963407ULL;
+	uint32_t random = group->cursor >> 32;
+	size_t first = random % group->member_count;
+	size_t second = (first + 1 + (random >> 16) % (group->member_count - 1))
+		% group->member_count;
+
+	topic_t *a = group->members[first];
+	topic_t *b = group->members[second];
+	return share_member_load(b) < share_member_load(a) ? b : a;
+}
+
+/**
+ * Picks member by hash of topic, messages of one topic go to the same member
+ * as long as members of the group do not change.
+ */
+static topic_t *
+share_select_sticky(share_group_t *group, uint32_t hash) {
+	return group->members[hash % group->member_count];
+}
+
+static const share_strategy_t share_strategies[] = {
+	{ "round-robin", share_select_round_robin, 0 },
+	{ "least-queue", share_select_least_queue, 0 },
+	{ "sticky", share_select_sticky, 1 },
+};
+
+const share_strategy_t *
+share_strategy_find(const char *name) {
+	size_t count = sizeof(share_strategies) / sizeof(share_strategy_t);
+
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(share_strategies[i].name, name) == 0)
+			return &share_strategies[i];
+	}
+
+	return NULL;
+}
+
+const share_strategy_t *
+share_strategy_default(void) {
+	return &share_strategies[0];
+}
+
+void
+share_registry_init(share_registry_t *registry) {
+	pthread_mutex_init(&registry->lock, NULL);
+	registry->bucket_count = SHARE_REGISTRY_INITIAL_BUCKETS;
+	registry->buckets = calloc(registry->bucket_count, sizeof(share_entry_t *));
+	if (!registry->buckets)
+		err(1, "share registry calloc buckets");
+	registry->count = 0;
+}
+
+void
+share_registry_free(share_registry_t *registry) {
+	share_entry_t *next;
+
+	for (size_t i = 0; i < registry->bucket_count; i++) {
+		for (share_entry_t *entry = registry->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			free(entry->key);
+			free(entry);
+		}
+	}
+
+	free(registry->buckets);
+	registry->buckets = NULL;
+	registry->bucket_count = 0;
+	registry->count = 0;
+	pthread_mutex_destroy(&registry->lock);
+}
+
+/**
+ * Doubles number of buckets of registry and rehashes its entries.
+ */
+static void
+share_registry_expand(share_registry_t *registry) {
+	size_t bucket_count = registry->bucket_count * 2;
+	share_entry_t **buckets = calloc(bucket_count, sizeof(share_entry_t *));
+	if (!buckets)
+		err(1, "share registry expand calloc buckets");
+
+	share_entry_t *next;
+	for (size_t i = 0; i < registry->bucket_count; i++) {
+		for (share_entry_t *entry = registry->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			size_t index = entry->hash & (bucket_count - 1);
+			entry->next = buckets[index];
+			buckets[index] = entry;
+		}
+	}
+
+	free(registry->buckets);
+	registry->buckets = buckets;
+	registry->bucket_count = bucket_count;
+}
+
+share_entry_t *
+share_registry_join(
+	share_registry_t *registry, const char *key, size_t key_len, int worker_id
+) {
+	uint32_t hash = hash_level(key, key_len);
+	share_entry_t *entry;
+
+	pthread_mutex_lock(&registry->lock);
+
+	for (
+		entry = registry->buckets[hash & (registry->bucket_count - 1)];
+		entry != NULL;
+		entry = entry->next
+	) {
+		if (
+			entry->hash == hash && entry->key_len == key_len &&
+			memcmp(entry->key, key, key_len) == 0
+		)
+			break;
+	}
+
+	if (!entry) {
+		if (registry->count >= registry->bucket_count)
+			share_registry_expand(registry);
+
+		entry = calloc(1, sizeof(share_entry_t));
+		if (!entry)
+			err(1, "share registry calloc entry");
+		entry->key = malloc(key_len);
+		if (!entry->key)
+			err(1, "share registry malloc key");
+		memcpy(entry->key, key, key_len);
+		entry->key_len = key_len;
+		entry->hash = hash;
+
+		size_t index = hash & (registry->bucket_count - 1);
+		entry->next = registry->buckets[index];
+		registry->buckets[index] = entry;
+		registry->count++;
+	}
+
+	__atomic_or_fetch(&entry->workers, 1ULL << worker_id, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&registry->lock);
+	return entry;
+}
+
+void
+share_registry_leave(
+	share_registry_t *registry, share_entry_t *entry, int worker_id
+) {
+	pthread_mutex_lock(&registry->lock);
+
+	uint64_t workers = __atomic_and_fetch(
+		&entry->workers, ~(1ULL << worker_id), __ATOMIC_RELAXED
+	);
+
+	// entry is referenced only by groups of workers in the mask
+	if (workers == 0) {
+		share_entry_t **link = &registry->buckets[
+			entry->hash & (registry->bucket_count - 1)
+		];
+		while (*link != entry)
+			link = &(*link)->next;
+		*link = entry->next;
+		registry->count--;
+		free(entry->key);
+		free(entry);
+	}
+
+	pthread_mutex_unlock(&registry->lock);
+}
+
+topic_t *
+share_group_select(
+	share_group_t *group, const share_strategy_t *strategy, int worker_id,
+	uint32_t hash
+) {
+	if (group->shared) {
+		uint64_t workers = __atomic_load_n(
+			&group->shared->workers, __ATOMIC_RELAXED
+		);
+		uint32_t worker_count = __builtin_popcountll(workers);
+
+		if (worker_count > 1) {
+			// n-th worker of the mask delivers, n is chosen by hash
+			uint32_t n = hash % worker_count;
+			for (uint32_t i = 0; i < n; i++) {
+				workers &= workers - 1;
+			}
+			if (__builtin_ctzll(workers) != worker_id)
+				return NULL;
+			hash /= worker_count;
+		}
+	}
+
+	return strategy->select(group, hash);
+}
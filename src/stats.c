@@ -0,0 +1,57 @@
+#include "stats.h"
+
+static const char *stats_topics[STATS_COUNTERS] = {
+	[STATS_MESSAGES_RECEIVED] = "$SYS/broker/messages/received",
+	[STATS_MESSAGES_SENT] = "$SYS/broker/messages/sent",
+	[STATS_BYTES_RECEIVED] = "$SYS/broker/bytes/received",
+	[STATS_BYTES_SENT] = "$SYS/broker/bytes/sent",
+	[STATS_PUBLISH_RECEIVED] = "$SYS/broker/publish/messages/received",
+	[STATS_PUBLISH_SENT] = "$SYS/broker/publish/messages/sent",
+	[STATS_PUBLISH_DROPPED] = "$SYS/broker/publish/messages/dropped",
+	[STATS_LOOP_ITERATIONS] = "$SYS/broker/loop/iterations",
+	[STATS_CLIENTS_CONNECTED] = "$SYS/broker/clients/connected",
+	[STATS_SUBSCRIPTIONS] = "$SYS/broker/subscriptions/count",
+	[STATS_QUEUE_MESSAGES] = "$SYS/broker/queue/messages",
+	[STATS_QUEUE_BYTES] = "$SYS/broker/queue/bytes",
+	[STATS_MATCH_CACHE_HITS] = "$SYS/broker/match_cache/hits",
+	[STATS_MATCH_CACHE_MISSES] = "$SYS/broker/match_cache/misses",
+	[STATS_MATCH_CACHE_EVICTIONS] = "$SYS/broker/match_cache/evictions",
+};
+
+void
+stats_init(stats_t *stats, uint64_t interval, uint64_t now) {
+	memset(stats, 0, sizeof(stats_t));
+	stats->interval = interval;
+	stats->next = now + interval;
+}
+
+int
+stats_due(stats_t *stats, uint64_t now) {
+	if (stats->interval == 0 || now < stats->next)
+		return 0;
+
+	// missed intervals are skipped, not caught up
+	stats->next = now + stats->interval;
+	return 1;
+}
+
+void
+stats_take_snapshot(stats_t *stats) {
+	for (int i = 0; i < STATS_COUNTERS; i++) {
+		__atomic_store_n(
+			&stats->snapshot[i], stats->counters[i], __ATOMIC_RELAXED
+		);
+	}
+}
+
+void
+stats_read(stats_t *stats, uint64_t sums[STATS_COUNTERS]) {
+	for (int i = 0; i < STATS_COUNTERS; i++) {
+		sums[i] += __atomic_load_n(&stats->snapshot[i], __ATOMIC_RELAXED);
+	}
+}
+
+const char *
+stats_topic(enum stats_counter counter) {
+	return stats_topics[counter];
+}
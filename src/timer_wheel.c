@@ -0,0 +1,93 @@
+#include "timer_wheel.h"
+
+uint64_t
+monotonic_ms(void) {
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+		return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+timer_wheel_init(timer_wheel_t *wheel, uint64_t now) {
+	wheel->slots = calloc(TIMER_WHEEL_SLOTS, sizeof(wheel_timer_t));
+	if (!wheel->slots)
+		err(1, "timer wheel init calloc slots");
+
+	for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		wheel->slots[i].next = &wheel->slots[i];
+		wheel->slots[i].prev = &wheel->slots[i];
+	}
+	wheel->current = now / TIMER_WHEEL_RESOLUTION;
+}
+
+void
+timer_wheel_free(timer_wheel_t *wheel) {
+	free(wheel->slots);
+	wheel->slots = NULL;
+}
+
+void
+timer_add(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t expires) {
+	timer_remove(timer);
+
+	// round up, so timer does not expire early
+	uint64_t tick =
+		(expires + TIMER_WHEEL_RESOLUTION - 1) / TIMER_WHEEL_RESOLUTION;
+	if (tick <= wheel->current)
+		tick = wheel->current + 1;
+
+	wheel_timer_t *slot = &wheel->slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+	timer->expires = tick;
+	timer->next = slot->next;
+	timer->prev = slot;
+	slot->next->prev = timer;
+	slot->next = timer;
+}
+
+void
+timer_remove(wheel_timer_t *timer) {
+	if (!timer->prev)
+		return;
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+wheel_timer_t *
+timer_wheel_advance(timer_wheel_t *wheel, uint64_t now) {
+	uint64_t tick = now / TIMER_WHEEL_RESOLUTION;
+	wheel_timer_t *expired = NULL;
+
+	// every slot is visited at most once, even after a long pause
+	uint64_t first = wheel->current + 1;
+	if (tick >= first + TIMER_WHEEL_SLOTS)
+		first = tick - TIMER_WHEEL_SLOTS + 1;
+
+	for (uint64_t t = first; t <= tick; t++) {
+		wheel_timer_t *slot = &wheel->slots[t & (TIMER_WHEEL_SLOTS - 1)];
+		wheel_timer_t *next;
+
+		for (wheel_timer_t *timer = slot->next; timer != slot; timer = next) {
+			next = timer->next;
+			if (timer->expires > tick)
+				continue;
+
+			timer_remove(timer);
+			timer->next = expired;
+			expired = timer;
+		}
+	}
+
+	if (tick > wheel->current)
+		wheel->current = tick;
+	return expired;
+}
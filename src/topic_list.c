@@ -1,60 +1,651 @@
 #include "topic_list.h"
+#include "share.h"
 
 /**
- * Provided topic in string form is tokenized using '/' as separator. All
- * allocations are handled. Need to be freed when destroying.
- * 
- * WARNING: Method is destructive w.r.t. topic string.
- * 
- * \param topic Topic string (destructive).
- * \param count_out Pointer to integer, will return number of tokens found.
- * 
- * \returns Array of strings containing topic in tokenized form. NULL, if
- * 			client sent a wildcard character and should be disconnected.
+ * Checks topic filter from SUBSCRIBE control packet. Filter can't be empty,
+ * `+` has to occupy whole topic level and `#` has to occupy whole last topic
+ * level.
+ *
+ * \param scan Scan of the topic filter.
+ *
+ * \returns 1 if topic filter is valid, 0 otherwise.
  */
-char**
-tokenize_topic(char *topic, int *count_out) {
-	char *temp = topic;
-	int count = 1;
-	while ((temp = strstr(temp, "/"))) {
-		// count number of topics based on delimiters
-		count++;
-		temp++;
+int
+is_valid_topic_filter(
+	const char *topic, size_t topic_len, const topic_scan_t *scan
+) {
+	if (topic_len == 0)
+		return 0;
+
+	// every wildcard character has to be a whole level
+	size_t level_count = topic_scan_level_count(scan);
+	uint32_t wildcard_levels = 0;
+	for (
+		size_t i = 0;
+		i < level_count && wildcard_levels < scan->wildcard_count;
+		i++
+	) {
+		size_t level_len;
+		size_t offset = topic_scan_level(scan, topic_len, i, &level_len);
+		if (level_len != 1 || (topic[offset] != '+' && topic[offset] != '#'))
+			continue;
+		if (topic[offset] == '#' && i + 1 != level_count)
+			return 0;
+		wildcard_levels++;
+	}
+
+	return wildcard_levels == scan->wildcard_count;
+}
+
+/**
+ * Allocates new subscription tree node.
+ *
+ * \param parent Parent node, NULL for root.
+ * \param level_id Interned topic level of the node, node holds a reference
+ * 				   to it (INTERN_NONE for root and wildcard levels).
+ */
+topic_node_t *
+topic_node_create(topic_node_t *parent, uint32_t level_id) {
+	topic_node_t *node = calloc(1, sizeof(topic_node_t));
+	if (!node)
+		err(1, "topic node create calloc node");
+
+	node->level_id = level_id;
+	node->parent = parent;
+
+	return node;
+}
+
+/**
+ * Frees subscription tree node and all its children, references to their
+ * interned topic levels are released.
+ */
+void
+topic_node_free(topic_tree_t *tree, topic_node_t *node) {
+	topic_node_t *next;
+
+	if (!node)
+		return;
+
+	for (size_t i = 0; i < node->bucket_count; i++) {
+		for (topic_node_t *child = node->buckets[i]; child; child = next) {
+			next = child->next_sibling;
+			topic_node_free(tree, child);
+		}
+	}
+	topic_node_free(tree, node->plus);
+	topic_node_free(tree, node->hash);
+
+	if (node->level_id != INTERN_NONE)
+		intern_release(&tree->levels, node->level_id);
+	free(node->buckets);
+	free(node);
+}
+
+/**
+ * Finds child of node by ID of its topic level.
+ *
+ * \returns Child node, NULL if not present.
+ */
+topic_node_t *
+topic_node_find_child(topic_node_t *node, uint32_t level_id) {
+	if (node->bucket_count == 0)
+		return NULL;
+
+	for (
+		topic_node_t *child = node->buckets[level_id & (node->bucket_count - 1)];
+		child != NULL;
+		child = child->next_sibling
+	) {
+		if (child->level_id == level_id)
+			return child;
+	}
+
+	return NULL;
+}
+
+/**
+ * Doubles number of buckets of children hash table and rehashes children.
+ * Level IDs are dense, so they are used as hashes directly.
+ */
+void
+topic_node_expand(topic_node_t *node) {
+	size_t bucket_count = node->bucket_count
+		? node->bucket_count * 2
+		: TOPIC_NODE_INITIAL_BUCKETS;
+
+	topic_node_t **buckets = calloc(bucket_count, sizeof(topic_node_t *));
+	if (!buckets)
+		err(1, "topic node expand calloc buckets");
+
+	topic_node_t *next;
+	for (size_t i = 0; i < node->bucket_count; i++) {
+		for (topic_node_t *child = node->buckets[i]; child; child = next) {
+			next = child->next_sibling;
+			size_t index = child->level_id & (bucket_count - 1);
+			child->next_sibling = buckets[index];
+			buckets[index] = child;
+		}
+	}
+
+	free(node->buckets);
+	node->buckets = buckets;
+	node->bucket_count = bucket_count;
+}
+
+/**
+ * Finds child of node by its topic level, child is created if not present.
+ * Topic level of new child is interned.
+ */
+topic_node_t *
+topic_node_get_child(
+	topic_tree_t *tree, topic_node_t *node, const char *level, size_t level_len
+) {
+	topic_node_t **wildcard = NULL;
+
+	if (level_len == 1 && level[0] == '+')
+		wildcard = &node->plus;
+	else if (level_len == 1 && level[0] == '#')
+		wildcard = &node->hash;
+
+	if (wildcard) {
+		if (!*wildcard)
+			*wildcard = topic_node_create(node, INTERN_NONE);
+		return *wildcard;
+	}
+
+	uint32_t level_id = intern_find(
+		&tree->levels, level, level_len, hash_level(level, level_len)
+	);
+	topic_node_t *child = level_id != INTERN_NONE
+		? topic_node_find_child(node, level_id)
+		: NULL;
+	if (child)
+		return child;
+
+	if (node->child_count >= node->bucket_count)
+		topic_node_expand(node);
+
+	level_id = intern_acquire(&tree->levels, level, level_len);
+	child = topic_node_create(node, level_id);
+	size_t index = level_id & (node->bucket_count - 1);
+	child->next_sibling = node->buckets[index];
+	node->buckets[index] = child;
+	node->child_count++;
+
+	return child;
+}
+
+/**
+ * Removes nodes without subscriptions and children, starting from given node
+ * up to the root.
+ */
+void
+topic_node_prune(topic_tree_t *tree, topic_node_t *node) {
+	topic_node_t *parent;
+
+	while (
+		node && node->parent &&
+		!node->subscribers && node->child_count == 0 &&
+		!node->plus && !node->hash
+	) {
+		parent = node->parent;
+
+		if (parent->plus == node) {
+			parent->plus = NULL;
+		}
+		else if (parent->hash == node) {
+			parent->hash = NULL;
+		}
+		else {
+			topic_node_t **link = &parent->buckets[
+				node->level_id & (parent->bucket_count - 1)
+			];
+			while (*link != node)
+				link = &(*link)->next_sibling;
+			*link = node->next_sibling;
+			parent->child_count--;
+		}
+
+		topic_node_free(tree, node);
+		node = parent;
+	}
+}
+
+void
+topic_tree_init(topic_tree_t *tree) {
+	intern_table_init(&tree->levels);
+	tree->epoch = 0;
+	match_cache_init(&tree->cache, MATCH_CACHE_SIZE);
+	tree->root = topic_node_create(NULL, INTERN_NONE);
+	tree->matches = NULL;
+	tree->matches_capacity = 0;
+	tree->match_levels = NULL;
+	tree->match_levels_capacity = 0;
+	topic_scan_init(&tree->scan);
+	tree->shares = NULL;
+	tree->worker_id = 0;
+	tree->subscription_count = 0;
+}
+
+void
+topic_tree_free(topic_tree_t *tree) {
+	topic_node_free(tree, tree->root);
+	intern_table_free(&tree->levels);
+	match_cache_free(&tree->cache);
+	free(tree->matches);
+	free(tree->match_levels);
+	topic_scan_free(&tree->scan);
+	tree->root = NULL;
+	tree->matches = NULL;
+	tree->matches_capacity = 0;
+	tree->match_levels = NULL;
+	tree->match_levels_capacity = 0;
+}
+
+/**
+ * Appends all subscriptions of node to matches of subscription tree.
+ */
+void
+topic_tree_add_matches(topic_tree_t *tree, topic_node_t *node, size_t *count) {
+	for (topic_t *topic = node->subscribers; topic; topic = topic->node_next) {
+		if (*count == tree->matches_capacity) {
+			tree->matches_capacity = tree->matches_capacity
+				? tree->matches_capacity * 2
+				: 16;
+			tree->matches = realloc(
+				tree->matches, tree->matches_capacity * sizeof(topic_t *)
+			);
+			if (!tree->matches)
+				err(1, "topic tree realloc matches");
+		}
+		tree->matches[(*count)++] = topic;
+	}
+}
+
+/**
+ * Recursively matches remaining levels of published topic against subtree.
+ *
+ * \param levels IDs of remaining topic levels (INTERN_NONE for levels no
+ * 				 subscription uses).
+ * \param level_count Number of remaining topic levels.
+ * \param wildcards Zero if wildcard children must not match (first level of
+ * 					topics starting with `$`).
+ */
+void
+topic_tree_match_level(
+	topic_tree_t *tree, topic_node_t *node, const uint32_t *levels,
+	size_t level_count, int wildcards, size_t *count
+) {
+	// `#` matches parent level as well, so it is checked before end of topic
+	if (wildcards && node->hash)
+		topic_tree_add_matches(tree, node->hash, count);
+
+	if (level_count == 0) {
+		topic_tree_add_matches(tree, node, count);
+		return;
+	}
+
+	if (levels[0] != INTERN_NONE) {
+		topic_node_t *child = topic_node_find_child(node, levels[0]);
+		if (child) {
+			topic_tree_match_level(
+				tree, child, levels + 1, level_count - 1, 1, count
+			);
+		}
+	}
+
+	if (wildcards && node->plus) {
+		topic_tree_match_level(
+			tree, node->plus, levels + 1, level_count - 1, 1, count
+		);
+	}
+}
+
+/**
+ * Translates levels of published topic into their interned IDs, stored in
+ * `tree->match_levels`.
+ *
+ * \param levels Scan of the topic.
+ *
+ * \returns Number of topic levels.
+ */
+size_t
+topic_tree_intern_levels(
+	topic_tree_t *tree, const char *topic, size_t topic_len,
+	const topic_scan_t *levels
+) {
+	size_t level_count = topic_scan_level_count(levels);
+
+	if (level_count > tree->match_levels_capacity) {
+		while (tree->match_levels_capacity < level_count) {
+			tree->match_levels_capacity = tree->match_levels_capacity
+				? tree->match_levels_capacity * 2
+				: 16;
+		}
+		tree->match_levels = realloc(
+			tree->match_levels, tree->match_levels_capacity * sizeof(uint32_t)
+		);
+		if (!tree->match_levels)
+			err(1, "topic tree realloc match levels");
+	}
+
+	for (size_t i = 0; i < level_count; i++) {
+		size_t level_len;
+		const char *level = topic + topic_scan_level(
+			levels, topic_len, i, &level_len
+		);
+		tree->match_levels[i] = intern_find(
+			&tree->levels, level, level_len, hash_level(level, level_len)
+		);
+	}
+
+	return level_count;
+}
+
+/**
+ * Matches published topic against subscription tree. Matches of recently
+ * published topics are taken from the cache, if no subscription was linked
+ * or unlinked since they were cached. Topic is scanned only on cache miss,
+ * unless the caller scanned it already.
+ */
+size_t
+topic_tree_match(
+	topic_tree_t *tree, const char *topic, size_t topic_len,
+	const topic_scan_t *levels, topic_t ***matches
+) {
+	size_t count = 0;
+	uint32_t hash = 0;
+
+	if (tree->cache.capacity > 0) {
+		hash = hash_level(topic, topic_len);
+		match_cache_entry_t *entry = match_cache_lookup(
+			&tree->cache, topic, topic_len, hash, tree->epoch
+		);
+		if (entry) {
+			*matches = entry->matches;
+			return entry->match_count;
+		}
 	}
 
-	char **tokenized_topic = calloc(count, sizeof(char*));
-	if (!tokenized_topic)
-		err(1, "tokenize topic calloc tokenized_topic");
-	temp = strtok(topic, "/");
-	for (int i = 0; i < count; i++) {
-		if (strchr(temp, '+') || strchr(temp, '#') || strchr(temp, '$'))
-			return NULL;
-		tokenized_topic[i] = calloc(strlen(temp) + 1, sizeof(char));
-		strncpy(tokenized_topic[i], temp, strlen(temp));
-		temp = strtok(NULL, "/");
+	if (!levels) {
+		// topics are validated when received, scan can't fail
+		(void) topic_scan(topic, topic_len, &tree->scan);
+		levels = &tree->scan;
 	}
 
-	*count_out = count;
+	size_t level_count = topic_tree_intern_levels(
+		tree, topic, topic_len, levels
+	);
+	topic_tree_match_level(
+		tree, tree->root, tree->match_levels, level_count,
+		topic_len == 0 || topic[0] != '$', &count
+	);
+
+	if (tree->cache.capacity > 0) {
+		match_cache_store(
+			&tree->cache, topic, topic_len, hash, tree->epoch,
+			tree->matches, count
+		);
+	}
+
+	*matches = tree->matches;
+	return count;
+}
+
+/**
+ * Finds subscription tree node of topic filter. Nodes on the path are
+ * created as needed.
+ *
+ * \param levels Scan of the topic filter.
+ */
+topic_node_t *
+topic_tree_get_node(
+	topic_tree_t *tree, const char *filter, size_t filter_len,
+	const topic_scan_t *levels
+) {
+	topic_node_t *node = tree->root;
+	size_t level_count = topic_scan_level_count(levels);
+
+	for (size_t i = 0; i < level_count; i++) {
+		size_t level_len;
+		const char *level = filter + topic_scan_level(
+			levels, filter_len, i, &level_len
+		);
+		node = topic_node_get_child(tree, node, level, level_len);
+	}
+
+	return node;
+}
+
+/**
+ * Links subscription into subscribers of subscription tree node.
+ */
+void
+topic_node_add(topic_tree_t *tree, topic_node_t *node, topic_t *topic) {
+	tree->epoch++;
+	topic->node = node;
+	topic->node_prev = NULL;
+	topic->node_next = node->subscribers;
+	if (node->subscribers)
+		node->subscribers->node_prev = topic;
+	node->subscribers = topic;
+}
+
+/**
+ * Links subscription into subscription tree node of its topic filter. Nodes
+ * on the path are created as needed.
+ *
+ * \param levels Scan of the topic filter.
+ */
+void
+topic_tree_link(topic_tree_t *tree, topic_t *topic, const topic_scan_t *levels) {
+	tree->subscription_count++;
+	topic_node_add(
+		tree,
+		topic_tree_get_node(tree, topic->topic, topic->topic_len, levels),
+		topic
+	);
+}
+
+/**
+ * Creates group of shared subscriptions and links it into subscription tree
+ * node of its topic filter. Group joins the registry, if there is one.
+ *
+ * \param topic First member, `$share/<name>/<filter>`.
+ * \param name Share name, view into topic of the member.
+ * \param filter Topic filter, view into topic of the member.
+ */
+share_group_t *
+share_group_create(
+	topic_tree_t *tree, topic_node_t *node, const topic_t *topic,
+	const char *name, size_t name_len, const char *filter, size_t filter_len
+) {
+	share_group_t *group = calloc(1, sizeof(share_group_t));
+	if (!group)
+		err(1, "share group calloc group");
+
+	group->name = buffer_alloc(name_len + 1);
+	memcpy(group->name, name, name_len);
+	group->name[name_len] = '\0';
+	group->name_len = name_len;
+
+	group->entry.topic = buffer_alloc(filter_len + 1);
+	memcpy(group->entry.topic, filter, filter_len);
+	group->entry.topic[filter_len] = '\0';
+	group->entry.topic_len = filter_len;
+	group->entry.group = group;
+	topic_node_add(tree, node, &group->entry);
 
-	return tokenized_topic;
+	if (tree->shares) {
+		group->shared = share_registry_join(
+			tree->shares, topic->topic, topic->topic_len, tree->worker_id
+		);
+	}
+
+	return group;
 }
 
 /**
- * Inserts new topic into list. Topic is tokenized from its string form, and
- * both forms are saved. QoS code can be inserted as well.
- * 
- * NOTE: Implementation only supports QoS level 0. Other levels are ignored.
- * 
+ * Adds shared subscription to group of its share name and topic filter, the
+ * group is created if it does not exist. Share name must not be empty nor
+ * contain wildcards.
+ *
+ * \param topic Subscription `$share/<name>/<filter>`, not linked yet.
+ *
+ * \returns 1 if subscription joined its group, 0 if it is not valid.
+ */
+int
+share_group_join(topic_tree_t *tree, topic_t *topic) {
+	char *name = topic->topic + SHARE_PREFIX_LEN;
+	char *end = memchr(name, '/', topic->topic_len - SHARE_PREFIX_LEN);
+
+	if (
+		!end || end == name ||
+		memchr(name, '+', end - name) || memchr(name, '#', end - name)
+	)
+		return 0;
+
+	size_t name_len = end - name;
+	char *filter = end + 1;
+	size_t filter_len = topic->topic + topic->topic_len - filter;
+
+	// filter is part of scanned topic filter, scan can't fail
+	(void) topic_scan(filter, filter_len, &tree->scan);
+	if (!is_valid_topic_filter(filter, filter_len, &tree->scan))
+		return 0;
+
+	topic_node_t *node = topic_tree_get_node(
+		tree, filter, filter_len, &tree->scan
+	);
+	share_group_t *group = NULL;
+	for (topic_t *entry = node->subscribers; entry; entry = entry->node_next) {
+		if (
+			!entry->owner && entry->group->name_len == name_len &&
+			memcmp(entry->group->name, name, name_len) == 0
+		) {
+			group = entry->group;
+			break;
+		}
+	}
+	if (!group) {
+		group = share_group_create(
+			tree, node, topic, name, name_len, filter, filter_len
+		);
+	}
+
+	if (group->member_count == group->member_capacity) {
+		group->member_capacity = group->member_capacity
+			? group->member_capacity * 2
+			: 4;
+		group->members = realloc(
+			group->members, group->member_capacity * sizeof(topic_t *)
+		);
+		if (!group->members)
+			err(1, "share group realloc members");
+	}
+	topic->group = group;
+	topic->member_index = group->member_count;
+	group->members[group->member_count++] = topic;
+	tree->subscription_count++;
+
+	return 1;
+}
+
+void
+topic_tree_unlink(topic_tree_t *tree, topic_t *topic);
+
+/**
+ * Removes shared subscription from its group. Group without members is
+ * unlinked from subscription tree and freed.
+ */
+void
+share_group_leave(topic_tree_t *tree, topic_t *topic) {
+	share_group_t *group = topic->group;
+
+	// last member takes place of the removed one
+	topic_t *last = group->members[--group->member_count];
+	group->members[topic->member_index] = last;
+	last->member_index = topic->member_index;
+	topic->group = NULL;
+	tree->subscription_count--;
+
+	if (group->member_count > 0)
+		return;
+
+	topic_tree_unlink(tree, &group->entry);
+	if (group->shared)
+		share_registry_leave(tree->shares, group->shared, tree->worker_id);
+	buffer_free(group->entry.topic);
+	buffer_free(group->name);
+	free(group->members);
+	free(group);
+}
+
+/**
+ * Unlinks subscription from its subscription tree node, empty nodes are
+ * removed. Shared subscription leaves its group.
+ */
+void
+topic_tree_unlink(topic_tree_t *tree, topic_t *topic) {
+	topic_node_t *node = topic->node;
+
+	if (topic->group && topic->owner) {
+		share_group_leave(tree, topic);
+		return;
+	}
+
+	if (!node)
+		return;
+
+	if (topic->node_prev)
+		topic->node_prev->node_next = topic->node_next;
+	else
+		node->subscribers = topic->node_next;
+
+	if (topic->node_next)
+		topic->node_next->node_prev = topic->node_prev;
+
+	tree->epoch++;
+	topic->node = NULL;
+	if (topic->owner)
+		tree->subscription_count--;
+	topic_node_prune(tree, node);
+}
+
+/**
+ * Frees topic, it has to be unlinked from topic linked list and subscription
+ * tree first.
+ */
+void
+free_topic(topic_t *topic) {
+	buffer_free(topic->topic);
+	slab_free(&pools_local()->topics, topic);
+}
+
+/**
+ * Inserts new topic into list and links it into subscription tree. QoS code
+ * can be inserted as well. Topic is allocated from slab pool of the thread.
+ *
+ * Invalid topic filter is inserted only into the list, with QoS code set to
+ * 0x80 (failure), so it can be reported in SUBACK. Shared subscription
+ * (`$share/<name>/<filter>`) joins its group instead of being linked.
+ *
+ * \param tree Subscription tree.
  * \param list Linked list of topics.
- * \param topic_str Topic in string form, to be tokenized.
+ * \param owner Subscribed client.
+ * \param topic_str Topic in string form.
  * \param topic_len Topic length, wihout null terminator.
+ * \param scan Scan of the topic, see `topic_scan`.
  * \param qos_code QoS quarantee for this topic.
  */
 void
-insert_topic(topics_t *list, char *topic_str, size_t topic_len, int qos_code) {
-	topic_t *topic = calloc(1, sizeof(topic_t));
-	if (!topic)
-		err(1, "insert topic calloc topic");
+insert_topic(
+	topic_tree_t *tree, topics_t *list, struct connection *owner,
+	char *topic_str, size_t topic_len, const topic_scan_t *scan, int qos_code
+) {
+	topic_t *topic = slab_alloc(&pools_local()->topics);
+	memset(topic, 0, sizeof(topic_t));
 	topic_t *head = list->head;
 
 	if (head == NULL) {
@@ -64,18 +655,31 @@ insert_topic(topics_t *list, char *topic_str, size_t topic_len, int qos_code) {
 		head->next = topic;
 	}
 	topic->next = NULL;
-	// tokenize_topic is destructive... make copy
-	char* topic_copy = calloc(strnlen(topic_str, topic_len) + 1, sizeof(char));
-	if (!topic_copy)
-		err(1, "insert topic calloc topic_copy");
-	strncpy(topic_copy, topic_str, topic_len);
+
+	char* topic_copy = buffer_alloc(topic_len + 1);
+	memcpy(topic_copy, topic_str, topic_len);
+	topic_copy[topic_len] = '\0';
 	topic->topic_len = topic_len;
 	topic->topic = topic_copy;
-	topic->tokenized_topic = tokenize_topic(
-		topic_str,
-		&topic->topic_token_count
-	);
-	topic->qos_code = qos_code;
+	topic->owner = owner;
+	topic->node = NULL;
+
+	if (
+		topic_len > SHARE_PREFIX_LEN &&
+		memcmp(topic_str, SHARE_PREFIX, SHARE_PREFIX_LEN) == 0
+	) {
+		topic->qos_code = share_group_join(tree, topic) ? qos_code : 0x80;
+		if (topic->qos_code == 0x80)
+			log_warn("Invalid shared subscription %s.", topic_copy);
+	}
+	else if (is_valid_topic_filter(topic_str, topic_len, scan)) {
+		topic->qos_code = qos_code;
+		topic_tree_link(tree, topic, scan);
+	}
+	else {
+		log_warn("Invalid topic filter %s.", topic_copy);
+		topic->qos_code = 0x80;
+	}
 
 	if (list->back == NULL) {
 		list->back = topic;
@@ -85,25 +689,27 @@ insert_topic(topics_t *list, char *topic_str, size_t topic_len, int qos_code) {
 }
 
 /**
- * Removes topic from topic linked list based on its string representation.
- * Allocated memory is freed as needed.
- * 
+ * Removes topic from topic linked list and subscription tree based on its
+ * string representation. Allocated memory is freed as needed.
+ *
+ * \param tree Subscription tree.
  * \param list Linked list of topics.
  * \param topic_str Topic in string form, to be removed.
  * \param topic_len Topic length, wihout null terminator.
- * 
+ *
  * \returns 1, if removal took place, 0 otherwise.
  */
 int
-remove_topic(topics_t *list, char *topic_str, size_t topic_len) {
+remove_topic(
+	topic_tree_t *tree, topics_t *list, char *topic_str, size_t topic_len
+) {
 	topic_t *prev_topic = NULL;
 	for (topic_t *topic = list->back; topic != NULL; topic = topic->next) {
-		if (strncmp(topic->topic, topic_str, topic_len) == 0) {
-			free(topic->topic);
-			for (int i = 0; i < topic->topic_token_count; i++) {
-				free(topic->tokenized_topic[i]);
-			}
-			free(topic->tokenized_topic);
+		if (
+			topic->topic_len == topic_len &&
+			memcmp(topic->topic, topic_str, topic_len) == 0
+		) {
+			topic_tree_unlink(tree, topic);
 			if (prev_topic != NULL) {
 				prev_topic->next = topic->next;
 				if (topic == list->head)
@@ -114,7 +720,7 @@ remove_topic(topics_t *list, char *topic_str, size_t topic_len) {
 				if (topic == list->head)
 					list->head = NULL;
 			}
-			free(topic);
+			free_topic(topic);
 			return 1;
 		}
 
@@ -125,24 +731,29 @@ remove_topic(topics_t *list, char *topic_str, size_t topic_len) {
 
 /**
  * Finds topic in topic linked list.
- * 
+ *
  * \param list Linked list of topics.
  * \param topic_str Topic in string form, to be found.
- * 
- * \returns 1, if present, 0 otherwise.
+ * \param topic_len Topic length, wihout null terminator.
+ *
+ * \returns Topic, NULL if not present.
  */
-int
-find_topic(topics_t *list, char *topic_str) {
+topic_t *
+find_topic(topics_t *list, char *topic_str, size_t topic_len) {
 	for (topic_t *topic = list->back; topic != NULL; topic = topic->next) {
-		if (strncmp(topic->topic, topic_str, topic->topic_len) == 0)
-			return 1;
+		if (
+			topic->topic_len == topic_len &&
+			memcmp(topic->topic, topic_str, topic_len) == 0
+		) {
+			return topic;
+		}
 	}
-	return 0;
+	return NULL;
 }
 
 /**
  * Initializes new topic linked list.
- * 
+ *
  * \returns New topic linked list.
  */
 topics_t *
@@ -156,32 +767,44 @@ create_topics_list(void) {
 }
 
 /**
- * Frees allocated memory by topic linked list.
- * 
+ * Unlinks all topics of the list from subscription tree and frees memory
+ * allocated by topic linked list.
+ *
+ * \param tree Subscription tree.
  * \param list Topic linked list to delete.
  */
 void
-delete_topics_list(topics_t *list) {
-	topic_t *prev_topic = NULL;
+delete_topics_list(topic_tree_t *tree, topics_t *list) {
+	topic_t *next;
 
-	for (topic_t *topic = list->back; topic != NULL; topic = topic->next) {
-		free(topic->topic);
-		for (int i = 0; i < topic->topic_token_count; i++) {
-			free(topic->tokenized_topic[i]);
-		}
-		free(topic->tokenized_topic);
-		if (prev_topic)
-			free(prev_topic);
-		prev_topic = topic;
+	for (topic_t *topic = list->back; topic != NULL; topic = next) {
+		next = topic->next;
+		topic_tree_unlink(tree, topic);
+		free_topic(topic);
 	}
 
-	if (prev_topic)
-		free(prev_topic);
-
 	free(list);
 }
 
+/**
+ * Checks topic name from PUBLISH control packet. It can't be empty and must
+ * not contain wildcard characters (`$` is refused as well, topics starting
+ * with it are reserved for the broker) nor null character, it has to be
+ * valid UTF-8.
+ *
+ * \param topic Topic name, not null-terminated.
+ * \param topic_len Length of topic name.
+ * \param scan Filled with levels of the topic.
+ *
+ * \returns 1 if topic name is valid, 0 otherwise.
+ */
 int
-contains_wildcard_char(char *topic) {
-	return strchr(topic, '+') || strchr(topic, '$') || strchr(topic, '#');
-}
\ No newline at end of file
+is_valid_topic_name(const char *topic, size_t topic_len, topic_scan_t *scan) {
+	if (topic_len == 0)
+		return 0;
+
+	if (topic_scan(topic, topic_len, scan) == -1)
+		return 0;
+
+	return scan->wildcard_count == 0 && scan->dollar_count == 0;
+}
@@ -0,0 +1,377 @@
+#include "topic_scan.h"
+
+#if TOPIC_SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+void
+topic_scan_init(topic_scan_t *scan) {
+	scan->separators = NULL;
+	scan->separator_count = 0;
+	scan->capacity = 0;
+	scan->wildcard_count = 0;
+	scan->dollar_count = 0;
+}
+
+void
+topic_scan_free(topic_scan_t *scan) {
+	free(scan->separators);
+	topic_scan_init(scan);
+}
+
+static void
+topic_scan_reset(topic_scan_t *scan) {
+	scan->separator_count = 0;
+	scan->wildcard_count = 0;
+	scan->dollar_count = 0;
+}
+
+/**
+ * Makes room for given number of separators.
+ */
+static void
+topic_scan_reserve(topic_scan_t *scan, size_t count) {
+	if (count <= scan->capacity)
+		return;
+
+	size_t capacity = scan->capacity ? scan->capacity : 16;
+	while (capacity < count) {
+		capacity *= 2;
+	}
+
+	scan->separators = realloc(scan->separators, capacity * sizeof(uint32_t));
+	if (!scan->separators)
+		err(1, "topic scan realloc separators");
+	scan->capacity = capacity;
+}
+
+/**
+ * ASCII characters `topic_scan` records or refuses.
+ */
+static const uint8_t special_ascii[128] = {
+	['\0'] = 1, ['/'] = 1, ['+'] = 1, ['#'] = 1, ['$'] = 1
+};
+
+/**
+ * Checks UTF-8 sequence as defined by RFC 3629: no overlong encodings, no
+ * UTF-16 surrogates, no code points above U+10FFFF.
+ *
+ * \param index Index of the first (non-ASCII) byte of the sequence.
+ *
+ * \returns Length of the sequence, 0 if it is not valid.
+ */
+static size_t
+utf8_sequence(const uint8_t *topic, size_t topic_len, size_t index) {
+	uint8_t byte = topic[index];
+	size_t length;
+	uint32_t code_point;
+
+	if (byte >= 0xC2 && byte <= 0xDF) {
+		length = 2;
+		code_point = byte & 0x1F;
+	}
+	else if ((byte & 0xF0) == 0xE0) {
+		length = 3;
+		code_point = byte & 0x0F;
+	}
+	else if (byte >= 0xF0 && byte <= 0xF4) {
+		length = 4;
+		code_point = byte & 0x07;
+	}
+	else {
+		return 0;
+	}
+
+	if (length > topic_len - index)
+		return 0;
+	for (size_t k = 1; k < length; k++) {
+		if ((topic[index + k] & 0xC0) != 0x80)
+			return 0;
+		code_point = (code_point << 6) | (topic[index + k] & 0x3F);
+	}
+
+	if (length == 3 && (
+		code_point < 0x800 ||
+		(code_point >= 0xD800 && code_point <= 0xDFFF)
+	)) {
+		return 0;
+	}
+	if (length == 4 && (code_point < 0x10000 || code_point > 0x10FFFF))
+		return 0;
+
+	return length;
+}
+
+/**
+ * Scans characters one by one, from `index` to the end of topic.
+ *
+ * \returns 0 on success, -1 if topic is not valid.
+ */
+static int
+scan_characters(
+	const uint8_t *topic, size_t topic_len, size_t index, topic_scan_t *scan
+) {
+	size_t i = index;
+
+	while (i < topic_len) {
+		uint8_t byte = topic[i];
+
+		if (byte >= 0x80) {
+			size_t length = utf8_sequence(topic, topic_len, i);
+			if (length == 0)
+				return -1;
+			i += length;
+			continue;
+		}
+
+		if (special_ascii[byte]) {
+			switch (byte) {
+			case '\0':
+				return -1;
+			case '/':
+				topic_scan_reserve(scan, scan->separator_count + 1);
+				scan->separators[scan->separator_count++] = i;
+				break;
+			case '+':
+			case '#':
+				scan->wildcard_count++;
+				break;
+			case '$':
+				scan->dollar_count++;
+				break;
+			}
+		}
+		i++;
+	}
+
+	return 0;
+}
+
+int
+topic_scan_scalar(const char *topic, size_t topic_len, topic_scan_t *scan) {
+	topic_scan_reset(scan);
+	return scan_characters((const uint8_t *) topic, topic_len, 0, scan);
+}
+
+#if TOPIC_SCAN_SIMD
+
+/**
+ * Records special characters of ASCII block, given by bit masks of their
+ * positions in the block.
+ */
+static void
+scan_ascii_block(
+	topic_scan_t *scan, size_t offset, uint32_t separators,
+	uint32_t wildcards, uint32_t dollars
+) {
+	scan->wildcard_count += __builtin_popcount(wildcards);
+	scan->dollar_count += __builtin_popcount(dollars);
+
+	if (!separators)
+		return;
+
+	topic_scan_reserve(
+		scan, scan->separator_count + __builtin_popcount(separators)
+	);
+	while (separators) {
+		scan->separators[scan->separator_count++] =
+			offset + __builtin_ctz(separators);
+		separators &= separators - 1;
+	}
+}
+
+/**
+ * Checks UTF-8 sequences starting in a block. Sequences may continue into
+ * the following block, bytes validated already are skipped.
+ *
+ * \param non_ascii Bit mask of positions of non-ASCII bytes in the block.
+ * \param valid_end End of the last validated sequence, updated.
+ *
+ * \returns 0 on success, -1 if a sequence is not valid.
+ */
+static int
+scan_utf8_block(
+	const uint8_t *topic, size_t topic_len, size_t offset, uint32_t non_ascii,
+	size_t *valid_end
+) {
+	while (non_ascii) {
+		size_t i = offset + __builtin_ctz(non_ascii);
+		non_ascii &= non_ascii - 1;
+
+		if (i < *valid_end)
+			continue;
+
+		size_t length = utf8_sequence(topic, topic_len, i);
+		if (length == 0)
+			return -1;
+		*valid_end = i + length;
+	}
+
+	return 0;
+}
+
+/**
+ * Scans topic by 16 byte blocks with SSE2, from `*index` while whole block
+ * is available. Special characters are ASCII, UTF-8 sequences never contain
+ * their bytes, so they are found by comparing whole blocks. Non-ASCII bytes
+ * are validated one sequence at a time.
+ *
+ * \param valid_end End of the last validated UTF-8 sequence, updated.
+ */
+static int
+scan_sse2_blocks(
+	const uint8_t *topic, size_t topic_len, size_t *index, size_t *valid_end,
+	topic_scan_t *scan
+) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i slash = _mm_set1_epi8('/');
+	const __m128i plus = _mm_set1_epi8('+');
+	const __m128i hash = _mm_set1_epi8('#');
+	const __m128i dollar = _mm_set1_epi8('$');
+	size_t i = *index;
+
+	while (topic_len - i >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) (topic + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)) != 0)
+			return -1;
+
+		uint32_t non_ascii = _mm_movemask_epi8(block);
+		if (
+			non_ascii &&
+			scan_utf8_block(topic, topic_len, i, non_ascii, valid_end) == -1
+		) {
+			return -1;
+		}
+
+		scan_ascii_block(
+			scan, i,
+			_mm_movemask_epi8(_mm_cmpeq_epi8(block, slash)),
+			_mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(block, plus), _mm_cmpeq_epi8(block, hash)
+			)),
+			_mm_movemask_epi8(_mm_cmpeq_epi8(block, dollar))
+		);
+		i += 16;
+	}
+
+	*index = i;
+	return 0;
+}
+
+/**
+ * Scans rest of topic after vectorized blocks, from the end of the last
+ * validated UTF-8 sequence which may reach past the blocks.
+ */
+static int
+scan_tail(
+	const uint8_t *topic, size_t topic_len, size_t index, size_t valid_end,
+	topic_scan_t *scan
+) {
+	return scan_characters(
+		topic, topic_len, valid_end > index ? valid_end : index, scan
+	);
+}
+
+int
+topic_scan_sse2(const char *topic, size_t topic_len, topic_scan_t *scan) {
+	const uint8_t *bytes = (const uint8_t *) topic;
+	size_t i = 0;
+	size_t valid_end = 0;
+
+	topic_scan_reset(scan);
+	if (scan_sse2_blocks(bytes, topic_len, &i, &valid_end, scan) == -1)
+		return -1;
+	return scan_tail(bytes, topic_len, i, valid_end, scan);
+}
+
+/**
+ * The same as `scan_sse2_blocks`, with 32 byte blocks.
+ */
+__attribute__((target("avx2")))
+static int
+scan_avx2_blocks(
+	const uint8_t *topic, size_t topic_len, size_t *index, size_t *valid_end,
+	topic_scan_t *scan
+) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i slash = _mm256_set1_epi8('/');
+	const __m256i plus = _mm256_set1_epi8('+');
+	const __m256i hash = _mm256_set1_epi8('#');
+	const __m256i dollar = _mm256_set1_epi8('$');
+	size_t i = *index;
+
+	while (topic_len - i >= 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *) (topic + i));
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero)) != 0)
+			return -1;
+
+		uint32_t non_ascii = _mm256_movemask_epi8(block);
+		if (
+			non_ascii &&
+			scan_utf8_block(topic, topic_len, i, non_ascii, valid_end) == -1
+		) {
+			return -1;
+		}
+
+		scan_ascii_block(
+			scan, i,
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, slash)),
+			_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_cmpeq_epi8(block, plus), _mm256_cmpeq_epi8(block, hash)
+			)),
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, dollar))
+		);
+		i += 32;
+	}
+
+	*index = i;
+	return 0;
+}
+
+int
+topic_scan_avx2(const char *topic, size_t topic_len, topic_scan_t *scan) {
+	const uint8_t *bytes = (const uint8_t *) topic;
+	size_t i = 0;
+	size_t valid_end = 0;
+
+	topic_scan_reset(scan);
+	if (scan_avx2_blocks(bytes, topic_len, &i, &valid_end, scan) == -1)
+		return -1;
+	if (scan_sse2_blocks(bytes, topic_len, &i, &valid_end, scan) == -1)
+		return -1;
+	return scan_tail(bytes, topic_len, i, valid_end, scan);
+}
+
+#endif
+
+int
+topic_scan(const char *topic, size_t topic_len, topic_scan_t *scan) {
+#if TOPIC_SCAN_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return topic_scan_avx2(topic, topic_len, scan);
+	return topic_scan_sse2(topic, topic_len, scan);
+#else
+	return topic_scan_scalar(topic, topic_len, scan);
+#endif
+}
+
+size_t
+topic_scan_level_count(const topic_scan_t *scan) {
+	return scan->separator_count + 1;
+}
+
+size_t
+topic_scan_level(
+	const topic_scan_t *scan, size_t topic_len, size_t index,
+	size_t *level_len
+) {
+	size_t start = index == 0 ? 0 : scan->separators[index - 1] + 1;
+	size_t end = index == scan->separator_count
+		? topic_len
+		: scan->separators[index];
+
+	*level_len = end - start;
+	return start;
+}
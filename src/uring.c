@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#if URING_SUPPORTED
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter(
+	int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+	void *arg, size_t arg_size
+) {
+	return (int) syscall(
+		__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg,
+		arg_size
+	);
+}
+
+static int
+uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/**
+ * Maps submission and completion rings of set up io_uring instance.
+ *
+ * \returns 0 on success, -1 on failure.
+ */
+static int
+uring_map_rings(uring_t *uring, struct io_uring_params *params) {
+	uring->sq_ring_size =
+		params->sq_off.array + params->sq_entries * sizeof(unsigned);
+	uring->sq_ring = mmap(
+		NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING
+	);
+	if (uring->sq_ring == MAP_FAILED)
+		return -1;
+
+	uring->cq_ring_size =
+		params->cq_off.cqes + params->cq_entries * sizeof(cqe_t);
+	uring->cq_ring = mmap(
+		NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING
+	);
+	if (uring->cq_ring == MAP_FAILED)
+		return -1;
+
+	uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(
+		NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES
+	);
+	if (uring->sqes == MAP_FAILED)
+		return -1;
+
+	char *sq = uring->sq_ring;
+	uring->sq_head = (unsigned *) (sq + params->sq_off.head);
+	uring->sq_tail = (unsigned *) (sq + params->sq_off.tail);
+	uring->sq_mask = *(unsigned *) (sq + params->sq_off.ring_mask);
+	uring->sq_entries = params->sq_entries;
+	uring->sq_local_tail = *uring->sq_tail;
+
+	// submission queue entries are used in order, map them one to one
+	unsigned *array = (unsigned *) (sq + params->sq_off.array);
+	for (unsigned i = 0; i < params->sq_entries; i++) {
+		array[i] = i;
+	}
+
+	char *cq = uring->cq_ring;
+	uring->cq_head = (unsigned *) (cq + params->cq_off.head);
+	uring->cq_tail = (unsigned *) (cq + params->cq_off.tail);
+	uring->cq_mask = *(unsigned *) (cq + params->cq_off.ring_mask);
+	uring->cqes = (cqe_t *) (cq + params->cq_off.cqes);
+
+	return 0;
+}
+
+/**
+ * Allocates receive buffers and registers their ring in kernel.
+ *
+ * \returns 0 on success, -1 on failure.
+ */
+static int
+uring_setup_buffers(uring_t *uring) {
+	uring->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+	uring->buf_ring = mmap(
+		NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+	);
+	if (uring->buf_ring == MAP_FAILED) {
+		uring->buf_ring = NULL;
+		return -1;
+	}
+
+	uring->buffers = malloc((size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	if (!uring->buffers)
+		err(1, "uring malloc buffers");
+
+	struct io_uring_buf_reg reg = { 0 };
+	reg.ring_addr = (uint64_t) (uintptr_t) uring->buf_ring;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (uring_register(uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return -1;
+
+	uring->buf_tail = 0;
+	for (unsigned id = 0; id < URING_BUFFER_COUNT; id++) {
+		uring_buffer_return(uring, id);
+	}
+
+	return 0;
+}
+
+int
+uring_init(uring_t *uring) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(uring, 0, sizeof(*uring));
+	uring->sq_ring = MAP_FAILED;
+	uring->cq_ring = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+
+	uring->ring_fd = uring_setup(URING_ENTRIES, &params);
+	if (uring->ring_fd == -1)
+		return -1;
+
+	if (!(params.features & IORING_FEAT_EXT_ARG)) {
+		uring_free(uring);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (uring_map_rings(uring, &params) == -1
+		|| uring_setup_buffers(uring) == -1
+	) {
+		int saved_errno = errno;
+		uring_free(uring);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+uring_free(uring_t *uring) {
+	if (uring->ring_fd != -1)
+		close(uring->ring_fd);
+	uring->ring_fd = -1;
+
+	if (uring->sq_ring != MAP_FAILED)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	if (uring->cq_ring != MAP_FAILED)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sqes != MAP_FAILED)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->buf_ring)
+		munmap(uring->buf_ring, uring->buf_ring_size);
+	free(uring->buffers);
+
+	uring->sq_ring = MAP_FAILED;
+	uring->cq_ring = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+	uring->buf_ring = NULL;
+	uring->buffers = NULL;
+}
+
+/**
+ * Publishes queued submission queue entries to kernel.
+ *
+ * \returns Number of entries not yet consumed by kernel.
+ */
+static unsigned
+uring_flush_sq(uring_t *uring) {
+	__atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+	return uring->sq_local_tail
+		- __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * \returns Cleared submission queue entry, queued at the tail. When
+ * 			submission queue is full, queued entries are submitted first.
+ */
+static struct io_uring_sqe *
+uring_get_sqe(uring_t *uring) {
+	unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+	while (uring->sq_local_tail - head >= uring->sq_entries) {
+		unsigned to_submit = uring_flush_sq(uring);
+		if (uring_enter(uring->ring_fd, to_submit, 0, 0, NULL, 0) == -1
+			&& errno != EINTR && errno != EAGAIN && errno != EBUSY
+		) {
+			err(1, "io_uring_enter submit");
+		}
+		head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	struct io_uring_sqe *sqe =
+		&uring->sqes[uring->sq_local_tail & uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_local_tail++;
+	return sqe;
+}
+
+int
+uring_wait(uring_t *uring, int timeout) {
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+
+	struct io_uring_getevents_arg arg = { 0 };
+	arg.ts = (uint64_t) (uintptr_t) &ts;
+
+	unsigned to_submit = uring_flush_sq(uring);
+	if (uring_enter(
+			uring->ring_fd, to_submit, 1,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)
+		) == -1
+	) {
+		if (errno == EINTR || errno == ETIME || errno == EAGAIN
+			|| errno == EBUSY
+		) {
+			return 0;
+		}
+		err(1, "io_uring_enter");
+	}
+
+	return 0;
+}
+
+cqe_t *
+uring_peek_cqe(uring_t *uring) {
+	unsigned head = *uring->cq_head;
+
+	if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &uring->cqes[head & uring->cq_mask];
+}
+
+void
+uring_cqe_seen(uring_t *uring) {
+	__atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+uring_cqe_more(cqe_t *cqe) {
+	return (cqe->flags & IORING_CQE_F_MORE) != 0;
+}
+
+char *
+uring_cqe_buffer(uring_t *uring, cqe_t *cqe, unsigned *id) {
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return NULL;
+
+	*id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	return uring->buffers + (size_t) *id * URING_BUFFER_SIZE;
+}
+
+void
+uring_buffer_return(uring_t *uring, unsigned id) {
+	struct io_uring_buf *buf =
+		&uring->buf_ring->bufs[uring->buf_tail & (URING_BUFFER_COUNT - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) (
+		uring->buffers + (size_t) id * URING_BUFFER_SIZE
+	);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = id;
+	uring->buf_tail++;
+	__atomic_store_n(
+		&uring->buf_ring->tail, (uint16_t) uring->buf_tail, __ATOMIC_RELEASE
+	);
+}
+
+void
+uring_accept_multishot(uring_t *uring, int fd, uint64_t user_data) {
+	struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = user_data;
+}
+
+void
+uring_recv_multishot(uring_t *uring, int fd, uint64_t user_data) {
+	struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = user_data;
+}
+
+void
+uring_poll_multishot(uring_t *uring, int fd, uint64_t user_data) {
+	struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = user_data;
+}
+
+void
+uring_cancel(uring_t *uring, uint64_t target, uint64_t user_data) {
+	struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = user_data;
+}
+
+void
+uring_writev(
+	uring_t *uring, int fd, struct iovec *iov, int iov_count,
+	uint64_t user_data, int link
+) {
+	struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) iov;
+	sqe->len = iov_count;
+	sqe->user_data = user_data;
+	if (link)
+		sqe->flags = IOSQE_IO_LINK;
+}
+
+#else
+
+/*
+ * io_uring backend is not compiled in, initialization always fails and the
+ * rest is never used.
+ */
+
+int
+uring_init(uring_t *uring) {
+	memset(uring, 0, sizeof(*uring));
+	uring->ring_fd = -1;
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+uring_free(uring_t *uring) {
+	(void) uring;
+}
+
+int
+uring_wait(uring_t *uring, int timeout) {
+	(void) uring;
+	(void) timeout;
+	return 0;
+}
+
+cqe_t *
+uring_peek_cqe(uring_t *uring) {
+	(void) uring;
+	return NULL;
+}
+
+void
+uring_cqe_seen(uring_t *uring) {
+	(void) uring;
+}
+
+int
+uring_cqe_more(cqe_t *cqe) {
+	(void) cqe;
+	return 0;
+}
+
+char *
+uring_cqe_buffer(uring_t *uring, cqe_t *cqe, unsigned *id) {
+	(void) uring;
+	(void) cqe;
+	(void) id;
+	return NULL;
+}
+
+void
+uring_buffer_return(uring_t *uring, unsigned id) {
+	(void) uring;
+	(void) id;
+}
+
+void
+uring_accept_multishot(uring_t *uring, int fd, uint64_t user_data) {
+	(void) uring;
+	(void) fd;
+	(void) user_data;
+}
+
+void
+uring_recv_multishot(uring_t *uring, int fd, uint64_t user_data) {
+	(void) uring;
+	(void) fd;
+	(void) user_data;
+}
+
+void
+uring_poll_multishot(uring_t *uring, int fd, uint64_t user_data) {
+	(void) uring;
+	(void) fd;
+	(void) user_data;
+}
+
+void
+uring_cancel(uring_t *uring, uint64_t target, uint64_t user_data) {
+	(void) uring;
+	(void) target;
+	(void) user_data;
+}
+
+void
+uring_writev(
+	uring_t *uring, int fd, struct iovec *iov, int iov_count,
+	uint64_t user_data, int link
+) {
+	(void) uring;
+	(void) fd;
+	(void) iov;
+	(void) iov_count;
+	(void) user_data;
+	(void) link;
+}
+
+#endif
@@ -0,0 +1,559 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "wal.h"
+#include "log.h"
+
+/**
+ * Size record takes in segment file, records are aligned to 8 bytes.
+ */
+#define record_span(size) \
+	((sizeof(wal_record_t) + (size_t) (size) + 7) & ~(size_t) 7)
+
+/**
+ * Segment file found in log directory.
+ */
+typedef struct {
+	int id;
+	unsigned long long seq;
+} segment_name_t;
+
+static uint64_t
+now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * FNV-1a hash of QoS and frame of record, its checksum.
+ */
+static uint32_t
+record_checksum(uint8_t qos, const char *data, size_t size) {
+	uint32_t hash = 2166136261u;
+
+	hash ^= qos;
+	hash *= 16777619u;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (uint8_t) data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void
+segment_path(char *path, size_t size, const char *dir, int id, uint64_t seq) {
+	snprintf(path, size, "%s/wal-%d-%016llx.log", dir, id, (unsigned long long) seq);
+}
+
+/**
+ * \returns 1 if directory entry is segment file, its worker ID and sequence
+ * 			number are filled in, 0 otherwise.
+ */
+static int
+segment_parse(const char *name, segment_name_t *segment) {
+	int end = 0;
+	if (sscanf(name, "wal-%d-%16llx.log%n", &segment->id, &segment->seq, &end) != 2)
+		return 0;
+	return end > 0 && name[end] == '\0';
+}
+
+/**
+ * Lists segment files in directory.
+ *
+ * \returns Allocated array of segments, NULL on error (errno is set).
+ */
+static segment_name_t *
+segment_list(const char *dir, size_t *count) {
+	DIR *listing = opendir(dir);
+	if (!listing)
+		return NULL;
+
+	size_t capacity = 16;
+	segment_name_t *segments = malloc(capacity * sizeof(segment_name_t));
+	if (!segments)
+		err(1, "wal segment list malloc");
+
+	*count = 0;
+	for (struct dirent *entry; (entry = readdir(listing)) != NULL;) {
+		segment_name_t segment;
+		if (!segment_parse(entry->d_name, &segment))
+			continue;
+
+		if (*count == capacity) {
+			capacity *= 2;
+			segments = realloc(segments, capacity * sizeof(segment_name_t));
+			if (!segments)
+				err(1, "wal segment list realloc");
+		}
+		segments[(*count)++] = segment;
+	}
+	closedir(listing);
+	return segments;
+}
+
+/**
+ * Orders segments by worker, then by sequence number, so messages of every
+ * worker are replayed in order they were received.
+ */
+static int
+segment_compare(const void *a, const void *b) {
+	const segment_name_t *first = a;
+	const segment_name_t *second = b;
+
+	if (first->id != second->id)
+		return first->id < second->id ? -1 : 1;
+	if (first->seq != second->seq)
+		return first->seq < second->seq ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Creates new active segment file. Directory is synced, so the file is found
+ * after crash.
+ *
+ * \returns 0 on success, -1 on error (errno is set).
+ */
+static int
+segment_start(wal_t *wal) {
+	char path[PATH_MAX];
+	wal_segment_t *segment = malloc(sizeof(wal_segment_t));
+	if (!segment)
+		err(1, "wal segment malloc");
+
+	segment->next = NULL;
+	segment->seq = wal->next_seq++;
+	segment->size = 0;
+	segment->live = 0;
+
+	segment_path(path, sizeof(path), wal->dir, wal->id, segment->seq);
+	segment->fd = open(
+		path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600
+	);
+	if (segment->fd == -1 || fsync(wal->dir_fd) == -1) {
+		int saved = errno;
+		if (segment->fd != -1)
+			close(segment->fd);
+		free(segment);
+		errno = saved;
+		return -1;
+	}
+
+	wal->active = segment;
+	return 0;
+}
+
+/**
+ * Marks start of batch when its first record or acknowledgement is added.
+ */
+static void
+batch_add(wal_t *wal) {
+	if (wal->window > 0 && wal->batch_records == 0 && wal->ack_count == 0)
+		wal->batch_started = now_us();
+}
+
+/**
+ * Writes whole buffer to file descriptor.
+ *
+ * \returns 0 on success, -1 on error (errno is set).
+ */
+static int
+write_all(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += written;
+		size -= written;
+	}
+	return 0;
+}
+
+/**
+ * Replays records of one segment file.
+ *
+ * \returns Number of replayed messages, -1 if the file cannot be read.
+ */
+static ssize_t
+segment_replay(wal_t *wal, const char *path, wal_replay_t replay, void *arg) {
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	size_t size = st.st_size;
+	char *data = malloc(size ? size : 1);
+	if (!data)
+		err(1, "wal replay malloc");
+
+	size_t read_size = 0;
+	while (read_size < size) {
+		ssize_t n = read(fd, data + read_size, size - read_size);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+		read_size += n;
+	}
+	close(fd);
+
+	ssize_t count = 0;
+	size_t offset = 0;
+	while (read_size - offset >= sizeof(wal_record_t)) {
+		wal_record_t record;
+		memcpy(&record, data + offset, sizeof(record));
+		const char *frame_data = data + offset + sizeof(record);
+
+		// record written partially before crash ends the segment
+		if (record.size < 4
+			|| record.qos == 0 || record.qos > 2
+			|| record_span(record.size) > read_size - offset
+			|| record.checksum
+				!= record_checksum(record.qos, frame_data, record.size)
+		)
+			break;
+
+		frame_t *frame = frame_create(record.size);
+		memcpy(frame->data, frame_data, record.size);
+		frame->qos = record.qos;
+		wal_append(wal, frame);
+		replay(arg, frame);
+		frame_release(frame);
+
+		offset += record_span(record.size);
+		count++;
+	}
+
+	if (offset < read_size) {
+		log_warn(
+			"Ignoring last %zu bytes of write-ahead log segment %s.",
+			read_size - offset, path
+		);
+	}
+	free(data);
+	return count;
+}
+
+void
+wal_init(wal_t *wal) {
+	memset(wal, 0, sizeof(wal_t));
+	wal->dir = NULL;
+	wal->dir_fd = -1;
+}
+
+int
+wal_open(wal_t *wal, const char *dir, int id, uint32_t window) {
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return -1;
+
+	size_t count;
+	segment_name_t *segments = segment_list(dir, &count);
+	if (!segments)
+		return -1;
+
+	// sequence numbers continue after segments left by previous run
+	wal->next_seq = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (segments[i].seq >= wal->next_seq)
+			wal->next_seq = segments[i].seq + 1;
+	}
+	free(segments);
+
+	wal->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (wal->dir_fd == -1)
+		return -1;
+
+	wal->dir = strdup(dir);
+	wal->buffer = malloc(WAL_INITIAL_BUFFER);
+	if (!wal->dir || !wal->buffer)
+		err(1, "wal_open malloc");
+	wal->buffer_capacity = WAL_INITIAL_BUFFER;
+	wal->id = id;
+	wal->window = window;
+
+	if (segment_start(wal) == -1) {
+		int saved = errno;
+		close(wal->dir_fd);
+		free(wal->dir);
+		free(wal->buffer);
+		wal_init(wal);
+		errno = saved;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t
+wal_recover(wal_t *wal, wal_replay_t replay, void *arg) {
+	char path[PATH_MAX];
+	size_t count;
+	segment_name_t *segments = segment_list(wal->dir, &count);
+	if (!segments)
+		return -1;
+
+	qsort(segments, count, sizeof(segment_name_t), segment_compare);
+
+	// commit may seal the segment, it is still ours
+	uint64_t own = wal->active->seq;
+	ssize_t replayed = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (segments[i].id == wal->id && segments[i].seq == own)
+			continue;
+
+		segment_path(
+			path, sizeof(path), wal->dir, segments[i].id, segments[i].seq
+		);
+		ssize_t messages = segment_replay(wal, path, replay, arg);
+		if (messages == -1) {
+			free(segments);
+			return -1;
+		}
+		replayed += messages;
+	}
+
+	// old segments are deleted only once their messages are logged again
+	if (wal_commit(wal) == -1) {
+		free(segments);
+		return -1;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (segments[i].id == wal->id && segments[i].seq == own)
+			continue;
+
+		segment_path(
+			path, sizeof(path), wal->dir, segments[i].id, segments[i].seq
+		);
+		if (unlink(path) == -1)
+			log_warn("Cannot delete %s: %s.", path, strerror(errno));
+	}
+	free(segments);
+	return replayed;
+}
+
+void
+wal_append(wal_t *wal, frame_t *frame) {
+	size_t span = record_span(frame->size);
+
+	if (wal->buffer_size + span > wal->buffer_capacity) {
+		while (wal->buffer_size + span > wal->buffer_capacity)
+			wal->buffer_capacity *= 2;
+		wal->buffer = realloc(wal->buffer, wal->buffer_capacity);
+		if (!wal->buffer)
+			err(1, "wal_append realloc");
+	}
+
+	wal_record_t record;
+	memset(&record, 0, sizeof(record));
+	record.size = frame->size;
+	record.qos = frame->qos;
+	record.checksum = record_checksum(frame->qos, frame->data, frame->size);
+
+	char *index = wal->buffer + wal->buffer_size;
+	memcpy(index, &record, sizeof(record));
+	memcpy(index + sizeof(record), frame->data, frame->size);
+	memset(
+		index + sizeof(record) + frame->size, 0,
+		span - sizeof(record) - frame->size
+	);
+
+	batch_add(wal);
+	wal->buffer_size += span;
+	wal->batch_records++;
+	wal->stats.records++;
+
+	frame->segment = wal->active;
+	__atomic_add_fetch(&wal->active->live, 1, __ATOMIC_RELAXED);
+}
+
+void
+wal_defer_ack(wal_t *wal, struct connection *conn, frame_t *frame) {
+	if (wal->ack_count == wal->ack_capacity) {
+		wal->ack_capacity = wal->ack_capacity ? wal->ack_capacity * 2 : 64;
+		wal->acks = realloc(wal->acks, wal->ack_capacity * sizeof(wal_ack_t));
+		if (!wal->acks)
+			err(1, "wal_defer_ack realloc");
+	}
+
+	batch_add(wal);
+	wal->acks[wal->ack_count].conn = conn;
+	wal->acks[wal->ack_count].frame = frame;
+	wal->ack_count++;
+	wal->stats.acks++;
+}
+
+int
+wal_commit_due(wal_t *wal) {
+	if (wal->batch_records == 0 && wal->ack_count == 0)
+		return 0;
+	return wal->window == 0 || now_us() - wal->batch_started >= wal->window;
+}
+
+int
+wal_wait_time(wal_t *wal, int max_wait) {
+	if (wal->window == 0 || (wal->batch_records == 0 && wal->ack_count == 0))
+		return max_wait;
+
+	uint64_t now = now_us();
+	uint64_t deadline = wal->batch_started + wal->window;
+	if (now >= deadline)
+		return 0;
+
+	uint64_t wait = (deadline - now + 999) / 1000;
+	return wait < (uint64_t) max_wait ? (int) wait : max_wait;
+}
+
+int
+wal_commit(wal_t *wal) {
+	if (wal->buffer_size > 0) {
+		uint64_t started = now_us();
+		if (write_all(wal->active->fd, wal->buffer, wal->buffer_size) == -1
+			|| fdatasync(wal->active->fd) == -1
+		)
+			return -1;
+		uint64_t latency = now_us() - started;
+
+		wal->active->size += wal->buffer_size;
+		wal->stats.bytes += wal->buffer_size;
+		wal->stats.commits++;
+		wal->stats.latency_sum += latency;
+		if (latency > wal->stats.latency_max)
+			wal->stats.latency_max = latency;
+		int bucket = latency ? 64 - __builtin_clzll(latency) : 0;
+		wal->stats.latency[
+			bucket < WAL_LATENCY_BUCKETS ? bucket : WAL_LATENCY_BUCKETS - 1
+		]++;
+		if (wal->batch_records > wal->stats.max_batch)
+			wal->stats.max_batch = wal->batch_records;
+		wal->buffer_size = 0;
+	}
+	wal->batch_records = 0;
+
+	if (wal->active->size >= WAL_SEGMENT_SIZE) {
+		wal_segment_t *full = wal->active;
+		if (segment_start(wal) == -1)
+			return -1;
+		close(full->fd);
+		full->fd = -1;
+		full->next = wal->sealed;
+		wal->sealed = full;
+	}
+	return 0;
+}
+
+void
+wal_truncate(wal_t *wal, uint64_t now) {
+	char path[PATH_MAX];
+
+	if (now - wal->last_truncate < WAL_TRUNCATE_INTERVAL)
+		return;
+	wal->last_truncate = now;
+
+	for (wal_segment_t **link = &wal->sealed; *link != NULL;) {
+		wal_segment_t *segment = *link;
+		if (__atomic_load_n(&segment->live, __ATOMIC_ACQUIRE) > 0) {
+			link = &segment->next;
+			continue;
+		}
+
+		segment_path(path, sizeof(path), wal->dir, wal->id, segment->seq);
+		if (unlink(path) == -1)
+			log_warn("Cannot delete %s: %s.", path, strerror(errno));
+		*link = segment->next;
+		free(segment);
+		wal->stats.segments_removed++;
+	}
+
+	// all records of active segment are synced, none is needed anymore
+	wal_segment_t *active = wal->active;
+	if (active->size > 0 && wal->buffer_size == 0
+		&& __atomic_load_n(&active->live, __ATOMIC_ACQUIRE) == 0
+	) {
+		if (ftruncate(active->fd, 0) == -1) {
+			log_warn("Cannot truncate write-ahead log: %s.", strerror(errno));
+		} else {
+			active->size = 0;
+			wal->stats.segments_removed++;
+		}
+	}
+}
+
+void
+wal_segment_release(wal_segment_t *segment) {
+	__atomic_sub_fetch(&segment->live, 1, __ATOMIC_RELEASE);
+}
+
+void
+wal_log_stats(wal_t *wal) {
+	if (!wal->dir)
+		return;
+
+	wal_stats_t *stats = &wal->stats;
+	uint64_t p99 = 0;
+	uint64_t seen = 0;
+	for (int i = 0; i < WAL_LATENCY_BUCKETS && stats->commits > 0; i++) {
+		seen += stats->latency[i];
+		if (seen * 100 >= stats->commits * 99) {
+			p99 = i ? (uint64_t) 1 << i : 1;
+			break;
+		}
+	}
+
+	log_info(
+		"Write-ahead log %d: %llu messages in %llu commits (%.1f per commit, "
+		"at most %llu), commit latency %.0f us average, under %llu us for "
+		"99 %%, %llu us max, %llu segments removed.",
+		wal->id, (unsigned long long) stats->records,
+		(unsigned long long) stats->commits,
+		stats->commits ? (double) stats->records / stats->commits : 0.0,
+		(unsigned long long) stats->max_batch,
+		stats->commits ? (double) stats->latency_sum / stats->commits : 0.0,
+		(unsigned long long) p99, (unsigned long long) stats->latency_max,
+		(unsigned long long) stats->segments_removed
+	);
+}
+
+void
+wal_free(wal_t *wal) {
+	char path[PATH_MAX];
+
+	if (!wal->dir)
+		return;
+
+	for (size_t i = 0; i < wal->ack_count; i++) {
+		frame_release(wal->acks[i].frame);
+	}
+
+	wal->active->next = wal->sealed;
+	wal_segment_t *next;
+	for (wal_segment_t *segment = wal->active; segment != NULL; segment = next) {
+		next = segment->next;
+		if (segment->fd != -1)
+			close(segment->fd);
+		// messages still referenced are replayed by next run
+		if (__atomic_load_n(&segment->live, __ATOMIC_ACQUIRE) == 0) {
+			segment_path(path, sizeof(path), wal->dir, wal->id, segment->seq);
+			unlink(path);
+		}
+		free(segment);
+	}
+
+	close(wal->dir_fd);
+	free(wal->dir);
+	free(wal->buffer);
+	free(wal->acks);
+	wal_init(wal);
+}
@@ -0,0 +1,292 @@
+#include "worker.h"
+#include "mqtt_publish.h"
+
+void
+worker_init(
+	worker_t *worker, int id, worker_t *workers, int worker_count,
+	int listening_fd, int use_uring
+) {
+	worker->id = id;
+	worker->workers = workers;
+	worker->worker_count = worker_count;
+	worker->listening_fd = listening_fd;
+	worker->accept_pending = 0;
+	worker->mailbox.head = NULL;
+
+	worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->wake_fd == -1)
+		err(1, "eventfd");
+
+	conns_init(&worker->conns);
+	worker->conns.worker = worker;
+	wal_init(&worker->wal);
+
+	worker->use_uring = 0;
+	if (use_uring) {
+		if (uring_init(&worker->uring) == 0) {
+			// listener and eventfd requests are queued by the event loop
+			worker->use_uring = 1;
+			return;
+		}
+		log_warn(
+			"io_uring not available (%s), falling back to epoll.",
+			strerror(errno)
+		);
+	}
+
+	reactor_init(&worker->reactor);
+	if (reactor_add(&worker->reactor, listening_fd, NULL, EPOLLIN) == -1)
+		err(1, "epoll_ctl add listening socket");
+	if (reactor_add(
+		&worker->reactor, worker->wake_fd, &worker->mailbox, EPOLLIN
+	) == -1)
+		err(1, "epoll_ctl add eventfd");
+}
+
+/**
+ * Takes all mails from mailbox.
+ *
+ * \returns Mails in order they were posted.
+ */
+mail_t *
+mailbox_take(mailbox_t *mailbox) {
+	mail_t *mail = __atomic_exchange_n(&mailbox->head, NULL, __ATOMIC_ACQUIRE);
+	mail_t *reversed = NULL;
+	mail_t *next;
+
+	// mails were pushed onto stack, reverse them to get posting order
+	for (; mail != NULL; mail = next) {
+		next = mail->next;
+		mail->next = reversed;
+		reversed = mail;
+	}
+
+	return reversed;
+}
+
+/**
+ * Pushes mail into mailbox of target worker. Worker is woken up, if its
+ * mailbox was empty.
+ */
+void
+mailbox_push(worker_t *target, mail_t *mail) {
+	mail_t *head = __atomic_load_n(&target->mailbox.head, __ATOMIC_RELAXED);
+
+	do {
+		mail->next = head;
+	} while (!__atomic_compare_exchange_n(
+		&target->mailbox.head, &head, mail, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED
+	));
+
+	if (head == NULL)
+		worker_wake(target);
+}
+
+void
+worker_free(worker_t *worker) {
+	mail_t *next;
+	for (
+		mail_t *mail = mailbox_take(&worker->mailbox);
+		mail != NULL;
+		mail = next
+	) {
+		next = mail->next;
+		if (mail->fd != -1)
+			close(mail->fd);
+		frame_release(mail->frame);
+		if (mail->retained)
+			frame_release(mail->retained);
+		buffer_free(mail);
+	}
+
+	match_cache_log_stats(&worker->conns.topic_tree.cache);
+	wal_log_stats(&worker->wal);
+	if (worker->conns.congestions > 0) {
+		log_info(
+			"Clients got congested %llu times, %llu messages dropped.",
+			(unsigned long long) worker->conns.congestions,
+			(unsigned long long) worker->conns.dropped
+		);
+	}
+	retain_store_log_stats(&worker->conns.retained);
+	retain_store_free(&worker->conns.retained);
+	topic_tree_free(&worker->conns.topic_tree);
+	free(worker->conns.subscribed);
+	client_table_free(&worker->conns.clients);
+	timer_wheel_free(&worker->conns.timers);
+	timer_wheel_free(&worker->conns.retries);
+	/* io_uring releases the socket asynchronously after exit, meanwhile it
+	 * must not take connections meant for restarted server */
+	shutdown(worker->listening_fd, SHUT_RDWR);
+	if (worker->use_uring)
+		uring_free(&worker->uring);
+	else
+		reactor_free(&worker->reactor);
+	close(worker->wake_fd);
+	close(worker->listening_fd);
+}
+
+void
+worker_wake(worker_t *worker) {
+	uint64_t value = 1;
+	if (write(worker->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+		err(1, "write wake eventfd");
+}
+
+void
+forward_published_frame(
+	worker_t *worker, frame_t *frame, char *topic, uint16_t topic_size,
+	int retain, frame_t *retained
+) {
+	frame->shared = 1;
+	if (retained)
+		retained->shared = 1;
+
+	for (int i = 0; i < worker->worker_count; i++) {
+		worker_t *target = &worker->workers[i];
+		if (target == worker)
+			continue;
+
+		mail_t *mail = buffer_alloc(sizeof(mail_t));
+		mail->fd = -1;
+		mail->frame = frame_ref(frame);
+		mail->topic = topic;
+		mail->topic_size = topic_size;
+		mail->retain = retain;
+		mail->retained = retained ? frame_ref(retained) : NULL;
+		mailbox_push(target, mail);
+	}
+}
+
+void
+hand_over_connection(worker_t *worker, conn_t *conn) {
+	mail_t *mail = buffer_alloc(sizeof(mail_t));
+	memset(mail, 0, sizeof(mail_t));
+
+	mail->fd = conn->fd;
+	mail->frame = frame_create(conn->in_end - conn->in_start);
+	memcpy(
+		mail->frame->data, conn->in_buffer + conn->in_start,
+		conn->in_end - conn->in_start
+	);
+
+	conn->fd = -1;
+	clear_one_connection(conn, &worker->conns);
+	mailbox_push(conn->handoff, mail);
+}
+
+void
+process_mailbox(worker_t *worker) {
+	uint64_t value;
+	publish_t publish;
+	mail_t *next;
+
+	// reset eventfd before taking mails, so no wake up can be lost
+	if (read(worker->wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+		err(1, "read wake eventfd");
+
+	for (
+		mail_t *mail = mailbox_take(&worker->mailbox);
+		mail != NULL;
+		mail = next
+	) {
+		next = mail->next;
+
+		if (mail->fd != -1) {
+			adopt_connection(worker, mail->fd, mail->frame);
+			frame_release(mail->frame);
+			buffer_free(mail);
+			continue;
+		}
+
+		memset(&publish, 0, sizeof(publish));
+		publish.topic = mail->topic;
+		publish.topic_size = mail->topic_size;
+		publish.qos = mail->frame->qos;
+
+		if (mail->retain) {
+			// topic was validated by the worker that received it
+			topic_scan_t *levels = &worker->conns.topic_tree.scan;
+			(void) topic_scan(publish.topic, publish.topic_size, levels);
+			publish.levels = levels;
+			retain_store_set(
+				&worker->conns.retained, publish.topic, publish.topic_size,
+				levels, mail->retained
+			);
+			if (mail->retained)
+				frame_release(mail->retained);
+		}
+
+		deliver_publish(&worker->conns, &publish, &mail->frame);
+
+		frame_release(mail->frame);
+		buffer_free(mail);
+	}
+}
+
+void
+replay_logged_message(void *arg, frame_t *frame) {
+	worker_t *workers = arg;
+
+	// subscribers of other workers release the frame from their threads
+	if (workers[0].worker_count > 1)
+		frame->shared = 1;
+
+	for (int i = 0; i < workers[0].worker_count; i++) {
+		(void) deliver_published_frame(&workers[i].conns, frame);
+	}
+}
+
+/**
+ * Publishes value of statistics counter as retained QoS 0 message.
+ */
+static void
+publish_counter(conns_t *conns, enum stats_counter counter, uint64_t value) {
+	char payload[24];
+	publish_t publish;
+
+	memset(&publish, 0, sizeof(publish));
+	publish.topic = (char *) stats_topic(counter);
+	publish.topic_size = strlen(publish.topic);
+	publish.message = payload;
+	publish.message_size = snprintf(
+		payload, sizeof(payload), "%llu", (unsigned long long) value
+	);
+	publish.retain = 1;
+
+	// $SYS topics are valid, scan can't fail
+	(void) topic_scan(
+		publish.topic, publish.topic_size, &conns->topic_tree.scan
+	);
+	publish.levels = &conns->topic_tree.scan;
+	(void) send_published_message(NULL, conns, &publish);
+}
+
+void
+publish_broker_stats(worker_t *worker) {
+	conns_t *conns = &worker->conns;
+	uint64_t *counters = conns->stats.counters;
+
+	if (!stats_due(&conns->stats, conns->now))
+		return;
+
+	counters[STATS_CLIENTS_CONNECTED] = conns->count;
+	counters[STATS_SUBSCRIPTIONS] = conns->topic_tree.subscription_count;
+	match_cache_stats_t *cache = &conns->topic_tree.cache.stats;
+	counters[STATS_MATCH_CACHE_HITS] = cache->hits;
+	counters[STATS_MATCH_CACHE_MISSES] = cache->misses;
+	counters[STATS_MATCH_CACHE_EVICTIONS] = cache->evictions;
+	stats_take_snapshot(&conns->stats);
+
+	if (worker->id != 0)
+		return;
+
+	uint64_t sums[STATS_COUNTERS] = { 0 };
+	for (int i = 0; i < worker->worker_count; i++) {
+		stats_read(&worker->workers[i].conns.stats, sums);
+	}
+	for (int i = 0; i < STATS_COUNTERS; i++) {
+		publish_counter(conns, i, sums[i]);
+	}
+}
@@ -0,0 +1,134 @@
+import socket
+
+from ..common import mqtt_server, PROGRAM_PATH
+from ..server import Server
+from .test_client_id import connect_packet
+from .test_pipelining import recv_exactly
+from .test_publish_binary import publish_packet, receive_publish, subscribe
+
+PAYLOAD_SIZE = 32 * 1024
+
+
+def connect_stalled(port, client_id):
+    """
+    Connect client with tiny receive buffer, which does not read until the
+    test drains it.
+    """
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sock.settimeout(5)
+    sock.connect(("localhost", port))
+    sock.send(connect_packet(client_id))
+    assert recv_exactly(sock, 4) == bytes([0x20, 0x02, 0x00, 0x00])
+    return sock
+
+
+def resident_memory(pid):
+    with open(f"/proc/{pid}/status") as status:
+        for line in status:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1]) * 1024
+    raise AssertionError("VmRSS not found")
+
+
+def flood(port, client_id, count):
+    """
+    Publish numbered QoS 0 messages and wait until the broker processed them
+    all (PINGRESP follows them).
+    """
+    pub = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+    pub.settimeout(30)
+    pub.connect(("localhost", port))
+    pub.send(connect_packet(client_id))
+    assert recv_exactly(pub, 4) == bytes([0x20, 0x02, 0x00, 0x00])
+    for i in range(count):
+        payload = i.to_bytes(4, "big") + bytes(PAYLOAD_SIZE - 4)
+        pub.sendall(publish_packet(b"bp/flood", payload))
+    pub.send(bytes([0xC0, 0x00]))
+    assert recv_exactly(pub, 2) == bytes([0xD0, 0x00])
+    pub.close()
+
+
+def drain(sock):
+    """
+    Receive messages until the broker has nothing more to send and return
+    their numbers.
+    """
+    numbers = []
+    sock.settimeout(1)
+    try:
+        while True:
+            topic, payload = receive_publish(sock)
+            assert topic == b"bp/flood" and len(payload) == PAYLOAD_SIZE
+            numbers.append(int.from_bytes(payload[:4], "big"))
+    except socket.timeout:
+        pass
+    return numbers
+
+
+def test_stalled_subscriber_bounded(mqtt_server):
+    """
+    Messages for subscriber which does not read are dropped once its outgoing
+    queue reaches high watermark, broker memory stays bounded and the
+    subscriber gets the messages queued before.
+    """
+    stalled = connect_stalled(mqtt_server.port, "bp_stalled")
+    subscribe(stalled, b"bp/#")
+    before = resident_memory(mqtt_server.popen.pid)
+
+    flood(mqtt_server.port, "bp_pub", 2000)
+
+    grown = resident_memory(mqtt_server.popen.pid) - before
+    assert grown < 16 * 1024 * 1024
+    numbers = drain(stalled)
+    assert 0 < len(numbers) < 2000
+    assert numbers == sorted(numbers) and numbers[0] == 0
+    stalled.close()
+
+
+def test_drop_oldest():
+    """
+    With drop oldest policy, subscriber which caught up gets the latest
+    messages.
+    """
+    server = Server(PROGRAM_PATH, args=["-o", "drop-oldest", "-Q", "16:4"])
+    server.start()
+    try:
+        stalled = connect_stalled(server.port, "bp_oldest")
+        subscribe(stalled, b"bp/#")
+        flood(server.port, "bp_pub", 500)
+        numbers = drain(stalled)
+        assert 0 < len(numbers) < 500
+        assert numbers == sorted(numbers) and numbers[-1] == 499
+        stalled.close()
+    finally:
+        server.stop()
+
+
+def test_disconnect_slow_client():
+    """
+    With disconnect policy, subscriber which does not read is disconnected,
+    others are not affected.
+    """
+    server = Server(PROGRAM_PATH, args=["-o", "disconnect"])
+    server.start()
+    try:
+        stalled = connect_stalled(server.port, "bp_slow")
+        subscribe(stalled, b"bp/#")
+        flood(server.port, "bp_pub", 500)
+        stalled.settimeout(5)
+        closed = False
+        received = 0
+        try:
+            while True:
+                data = stalled.recv(65536)
+                if not data:
+                    closed = True
+                    break
+                received += len(data)
+        except ConnectionResetError:
+            closed = True
+        assert closed and received < 500 * PAYLOAD_SIZE
+        stalled.close()
+    finally:
+        server.stop()
@@ -0,0 +1,109 @@
+import socket
+
+from ..common import mqtt_server, PROGRAM_PATH
+from ..server import Server
+
+
+def connect_packet(client_id):
+    """
+    Build CONNECT packet with clean session flag and 60 s keep alive.
+    """
+    client_id = client_id.encode()
+    body = (
+        bytes([0x00, 0x04]) + b"MQTT" + bytes([0x04, 0x02, 0x00, 0x3C])
+        + len(client_id).to_bytes(2, "big") + client_id
+    )
+    return bytes([0x10, len(body)]) + body
+
+
+def connect(port, client_id):
+    """
+    Connect client and return the socket once CONNACK is received.
+    """
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+    sock.settimeout(5)
+    sock.connect(("localhost", port))
+    sock.send(connect_packet(client_id))
+    assert sock.recv(4) == bytes([0x20, 0x02, 0x00, 0x00])
+    return sock
+
+
+def test_client_id_prefix(mqtt_server):
+    """
+    Client ID that is a prefix of another connected client's ID is not a duplicate.
+    """
+    first = connect(mqtt_server.port, "abcd")
+    second = connect(mqtt_server.port, "abc")
+    first.close()
+    second.close()
+
+
+def test_connect_truncated(mqtt_server):
+    """
+    CONNECT shorter than its fixed fields or client ID is malformed, the
+    connection is closed without CONNACK.
+    """
+    header = bytes([0x00, 0x04]) + b"MQTT" + bytes([0x04, 0x02, 0x00, 0x3C])
+    bodies = [
+        header[:6],
+        header,
+        header + bytes([0x00]),
+        header + bytes([0x00, 0x20]) + b"short",
+    ]
+    for body in bodies:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+        sock.settimeout(5)
+        sock.connect(("localhost", mqtt_server.port))
+        sock.send(bytes([0x10, len(body)]) + body)
+        try:
+            assert sock.recv(1) == b""
+        except ConnectionResetError:
+            pass
+        sock.close()
+
+    # broker keeps serving other clients
+    connect(mqtt_server.port, "after_truncated").close()
+
+
+def test_client_id_takeover(mqtt_server):
+    """
+    Client connecting with ID of connected client takes over the session,
+    the old connection is closed (MQTT-3.1.4-2).
+    """
+    old = connect(mqtt_server.port, "takeover")
+    new = connect(mqtt_server.port, "takeover")
+    try:
+        assert old.recv(1) == b""
+    except ConnectionResetError:
+        pass
+
+    # new connection stays usable
+    new.send(bytes([0xC0, 0x00]))
+    assert new.recv(2) == bytes([0xD0, 0x00])
+    old.close()
+    new.close()
+
+
+def test_client_id_takeover_workers():
+    """
+    Takeover works when connections are accepted by different workers, every
+    CONNECT is processed by the worker owning the client ID.
+    """
+    server = Server(PROGRAM_PATH, args=["-t", "4"])
+    server.start()
+    try:
+        socks = []
+        for _ in range(8):
+            socks.append(connect(server.port, "takeover_mt"))
+            for old in socks[:-1]:
+                try:
+                    assert old.recv(1) == b""
+                except ConnectionResetError:
+                    pass
+
+        socks[-1].send(bytes([0xC0, 0x00]))
+        assert socks[-1].recv(2) == bytes([0xD0, 0x00])
+        for sock in socks:
+            sock.close()
+    finally:
+        server.stop()
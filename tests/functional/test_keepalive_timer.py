@@ -0,0 +1,65 @@
+import socket
+import time
+
+from ..common import mqtt_server
+from .test_pipelining import recv_exactly
+
+KEEP_ALIVE = 2
+
+
+def connect_keep_alive(port, client_id, keep_alive):
+    """
+    Connect client with given keep alive (seconds).
+    """
+    client_id = client_id.encode()
+    body = (
+        bytes([0x00, 0x04]) + b"MQTT" + bytes([0x04, 0x02])
+        + keep_alive.to_bytes(2, "big")
+        + len(client_id).to_bytes(2, "big") + client_id
+    )
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+    sock.settimeout(5)
+    sock.connect(("localhost", port))
+    sock.send(bytes([0x10, len(body)]) + body)
+    assert recv_exactly(sock, 4) == bytes([0x20, 0x02, 0x00, 0x00])
+    return sock
+
+
+def is_closed(sock):
+    """
+    Return True if the broker closed the connection, False if it is open and
+    there is nothing to read.
+    """
+    sock.setblocking(False)
+    try:
+        return sock.recv(1) == b""
+    except BlockingIOError:
+        return False
+    except ConnectionResetError:
+        return True
+    finally:
+        sock.settimeout(5)
+
+
+def test_keep_alive_expired(mqtt_server):
+    """
+    Client silent for one and a half of its keep alive is disconnected
+    (MQTT-3.1.2-24), client sending PINGREQ in time stays connected.
+    """
+    silent = connect_keep_alive(mqtt_server.port, "ka_silent", KEEP_ALIVE)
+    active = connect_keep_alive(mqtt_server.port, "ka_active", KEEP_ALIVE)
+
+    start = time.monotonic()
+    silent_closed = None
+    while time.monotonic() - start < 3 * KEEP_ALIVE:
+        active.send(bytes([0xC0, 0x00]))
+        assert recv_exactly(active, 2) == bytes([0xD0, 0x00])
+        if silent_closed is None and is_closed(silent):
+            silent_closed = time.monotonic() - start
+        time.sleep(0.25)
+
+    assert silent_closed is not None
+    assert 1.5 * KEEP_ALIVE <= silent_closed + 0.25
+    assert not is_closed(active)
+    silent.close()
+    active.close()
@@ -0,0 +1,32 @@
+from ..common import mqtt_server
+from .test_backpressure import connect_stalled
+from .test_client_id import connect
+from .test_publish_binary import publish_packet, receive_publish, subscribe
+
+
+def test_stalled_clients_do_not_block(mqtt_server):
+    """
+    Subscriber which does not read and client which stopped in the middle of
+    a packet do not hold up delivery to other clients.
+    """
+    stalled = connect_stalled(mqtt_server.port, "nb_stalled")
+    subscribe(stalled, b"nb/#")
+    partial = connect(mqtt_server.port, "nb_partial")
+    packet = publish_packet(b"nb/partial", b"completed later")
+    partial.send(packet[:5])
+    live = connect(mqtt_server.port, "nb_live")
+    subscribe(live, b"nb/#")
+
+    # far more than socket buffers of stalled subscriber can take
+    pub = connect(mqtt_server.port, "nb_pub")
+    for i in range(300):
+        payload = i.to_bytes(4, "big") + bytes(16 * 1024)
+        pub.sendall(publish_packet(b"nb/data", payload))
+        assert receive_publish(live) == (b"nb/data", payload)
+
+    # rest of the packet is decoded together with what was received before
+    partial.send(packet[5:])
+    assert receive_publish(live) == (b"nb/partial", b"completed later")
+
+    for sock in (stalled, partial, live, pub):
+        sock.close()
@@ -0,0 +1,56 @@
+import time
+
+import pytest
+
+from ..common import PROGRAM_PATH
+from ..server import Server
+from .test_backpressure import connect_stalled
+from .test_client_id import connect
+from .test_publish_binary import publish_packet, receive_publish, subscribe
+
+PAYLOAD_SIZE = 1024 * 1024
+
+
+class SlowReader:
+    """
+    Socket wrapper which reads in small chunks with pauses, so that writes of
+    the broker keep stopping in the middle of a message.
+    """
+    def __init__(self, sock):
+        self.sock = sock
+
+    def recv(self, size):
+        time.sleep(0.0001)
+        return self.sock.recv(min(size, 4096))
+
+
+@pytest.mark.parametrize("backend", ["epoll", "uring"])
+def test_partial_write_resumed(backend):
+    """
+    Large messages sent to client which reads slowly arrive whole and in order,
+    every write resumes at the offset where the previous one stopped. Queue
+    limit is raised, so that the messages do not fit in socket buffers and
+    none is dropped.
+    """
+    server = Server(PROGRAM_PATH, args=["-b", backend, "-q", "67108864:1024"])
+    server.start()
+    try:
+        sub = connect_stalled(server.port, "partial_sub")
+        subscribe(sub, b"partial/#")
+        pub = connect(server.port, "partial_pub")
+
+        payloads = [
+            bytes((i + j) % 251 for j in range(PAYLOAD_SIZE)) for i in range(8)
+        ]
+        for payload in payloads:
+            pub.sendall(publish_packet(b"partial/large", payload))
+        pub.send(publish_packet(b"partial/small", b"last"))
+
+        reader = SlowReader(sub)
+        for payload in payloads:
+            assert receive_publish(reader) == (b"partial/large", payload)
+        assert receive_publish(reader) == (b"partial/small", b"last")
+        pub.close()
+        sub.close()
+    finally:
+        server.stop()
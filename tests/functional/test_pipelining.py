@@ -0,0 +1,42 @@
+import socket
+import time
+
+from ..common import mqtt_server
+from .test_client_id import connect, connect_packet
+
+
+def recv_exactly(sock, size):
+    """
+    Receive given number of bytes from the socket.
+    """
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        assert chunk, "connection closed"
+        data += chunk
+    return data
+
+
+def test_pipelined_packets(mqtt_server):
+    """
+    All control packets sent together in one write are processed, in order.
+    """
+    sock = connect(mqtt_server.port, "pipelined")
+    sock.send(bytes([0xC0, 0x00]) * 100)
+    assert recv_exactly(sock, 200) == bytes([0xD0, 0x00]) * 100
+    sock.close()
+
+
+def test_fragmented_packets(mqtt_server):
+    """
+    Control packet split into many writes is processed once it is complete.
+    """
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sock.settimeout(5)
+    sock.connect(("localhost", mqtt_server.port))
+    for byte in connect_packet("fragmented") + bytes([0xC0, 0x00]):
+        sock.send(bytes([byte]))
+        time.sleep(0.001)
+    assert recv_exactly(sock, 6) == bytes([0x20, 0x02, 0x00, 0x00, 0xD0, 0x00])
+    sock.close()
@@ -0,0 +1,102 @@
+import os
+
+from ..common import mqtt_server
+from .test_client_id import connect
+from .test_pipelining import recv_exactly
+
+
+def encode_length(length):
+    """
+    Encode remaining length as MQTT variable length integer.
+    """
+    encoded = b""
+    while True:
+        byte = length % 128
+        length //= 128
+        if length:
+            byte |= 0x80
+        encoded += bytes([byte])
+        if not length:
+            return encoded
+
+
+def string(value):
+    return len(value).to_bytes(2, "big") + value
+
+
+def subscribe(sock, topic):
+    body = bytes([0x00, 0x01]) + string(topic) + bytes([0x00])
+    sock.send(bytes([0x82]) + encode_length(len(body)) + body)
+    assert recv_exactly(sock, 5) == bytes([0x90, 0x03, 0x00, 0x01, 0x00])
+
+
+def publish_packet(topic, payload):
+    body = string(topic) + payload
+    return bytes([0x30]) + encode_length(len(body)) + body
+
+
+def receive_publish(sock):
+    """
+    Receive PUBLISH packet and return its topic and payload.
+    """
+    assert recv_exactly(sock, 1) == bytes([0x30])
+    length, multiplier = 0, 1
+    while True:
+        byte = recv_exactly(sock, 1)[0]
+        length += (byte & 0x7F) * multiplier
+        multiplier *= 128
+        if not byte & 0x80:
+            break
+    body = recv_exactly(sock, length)
+    topic_length = int.from_bytes(body[:2], "big")
+    return body[2:2 + topic_length], body[2 + topic_length:]
+
+
+def test_publish_payload_with_nul(mqtt_server):
+    """
+    Payload is binary, it is delivered whole, including NUL bytes.
+    """
+    sub = connect(mqtt_server.port, "binary_sub")
+    subscribe(sub, b"binary/nul")
+    pub = connect(mqtt_server.port, "binary_pub")
+
+    payloads = [b"\x00", b"\x00abc\x00def\x00", b"\x08\x96\x01\x12\x00\x1a\x00"]
+    for payload in payloads:
+        pub.send(publish_packet(b"binary/nul", payload))
+    for payload in payloads:
+        assert receive_publish(sub) == (b"binary/nul", payload)
+
+    pub.close()
+    sub.close()
+
+
+def test_publish_large_payload(mqtt_server):
+    """
+    Payload larger than 1 MiB is delivered unchanged.
+    """
+    sub = connect(mqtt_server.port, "large_sub")
+    sub.settimeout(30)
+    subscribe(sub, b"binary/large")
+    pub = connect(mqtt_server.port, "large_pub")
+
+    payload = os.urandom(3 * 1024 * 1024 // 2) + b"\x00" * 1024
+    pub.sendall(publish_packet(b"binary/large", payload))
+    pub.send(publish_packet(b"binary/large", b"after"))
+    assert receive_publish(sub) == (b"binary/large", payload)
+    assert receive_publish(sub) == (b"binary/large", b"after")
+
+    pub.close()
+    sub.close()
+
+
+def test_publish_topic_with_nul(mqtt_server):
+    """
+    Topic name must not contain NUL character, publisher is disconnected.
+    """
+    pub = connect(mqtt_server.port, "nul_topic_pub")
+    pub.send(publish_packet(b"binary\x00topic", b"payload"))
+    try:
+        assert pub.recv(1) == b""
+    except ConnectionResetError:
+        pass
+    pub.close()
@@ -0,0 +1,121 @@
+from ..common import mqtt_server
+from .test_client_id import connect
+from .test_pipelining import recv_exactly
+from .test_publish_binary import encode_length, receive_publish, string
+from .test_retain import assert_nothing_received
+
+
+def subscribe_qos(sock, topic, qos):
+    """
+    Subscribe to topic with requested QoS and return granted QoS.
+    """
+    body = bytes([0x00, 0x01]) + string(topic) + bytes([qos])
+    sock.send(bytes([0x82]) + encode_length(len(body)) + body)
+    suback = recv_exactly(sock, 5)
+    assert suback[:4] == bytes([0x90, 0x03, 0x00, 0x01])
+    return suback[4]
+
+
+def publish_qos1(sock, topic, payload, packet_id):
+    body = string(topic) + packet_id.to_bytes(2, "big") + payload
+    sock.send(bytes([0x32]) + encode_length(len(body)) + body)
+
+
+def receive_qos1(sock):
+    """
+    Receive PUBLISH packet with QoS 1 and return its topic, packet ID and
+    payload.
+    """
+    assert recv_exactly(sock, 1) == bytes([0x32])
+    length, multiplier = 0, 1
+    while True:
+        byte = recv_exactly(sock, 1)[0]
+        length += (byte & 0x7F) * multiplier
+        multiplier *= 128
+        if not byte & 0x80:
+            break
+    body = recv_exactly(sock, length)
+    topic_length = int.from_bytes(body[:2], "big")
+    packet_id = int.from_bytes(body[2 + topic_length:4 + topic_length], "big")
+    return body[2:2 + topic_length], packet_id, body[4 + topic_length:]
+
+
+def puback(packet_id):
+    return bytes([0x40, 0x02]) + packet_id.to_bytes(2, "big")
+
+
+def test_qos1_delivery(mqtt_server):
+    """
+    QoS 1 PUBLISH is acknowledged and delivered with the lower of published
+    and granted QoS.
+    """
+    sub1 = connect(mqtt_server.port, "qos1_sub1")
+    assert subscribe_qos(sub1, b"qos1/+", 2) == 2
+    sub0 = connect(mqtt_server.port, "qos1_sub0")
+    assert subscribe_qos(sub0, b"qos1/+", 0) == 0
+    pub = connect(mqtt_server.port, "qos1_pub")
+
+    publish_qos1(pub, b"qos1/a", b"first", 0x1234)
+    assert recv_exactly(pub, 4) == puback(0x1234)
+    topic, packet_id, payload = receive_qos1(sub1)
+    assert (topic, payload) == (b"qos1/a", b"first")
+    assert packet_id != 0
+    assert receive_publish(sub0) == (b"qos1/a", b"first")
+    sub1.send(puback(packet_id))
+
+    pub.close()
+    sub0.close()
+    sub1.close()
+
+
+def test_qos1_inflight_window(mqtt_server):
+    """
+    Only limited number of QoS 1 messages is sent before they are
+    acknowledged, the rest waits and is sent in order as slots are freed.
+    """
+    sub = connect(mqtt_server.port, "window_sub")
+    assert subscribe_qos(sub, b"window/#", 1) == 1
+    pub = connect(mqtt_server.port, "window_pub")
+
+    for i in range(40):
+        publish_qos1(pub, b"window/t", b"%d" % i, i + 1)
+    for i in range(40):
+        assert recv_exactly(pub, 4) == puback(i + 1)
+
+    received = [receive_qos1(sub) for _ in range(16)]
+    assert_nothing_received(sub)
+    assert len({packet_id for _, packet_id, _ in received}) == 16
+
+    while len(received) < 40:
+        sub.settimeout(None)
+        _, packet_id, _ = received[len(received) - 16]
+        sub.send(puback(packet_id))
+        received.append(receive_qos1(sub))
+    assert [payload for _, _, payload in received] == [
+        b"%d" % i for i in range(40)
+    ]
+
+    pub.close()
+    sub.close()
+
+
+def test_qos1_empty_payload(mqtt_server):
+    """
+    QoS 1 message with empty payload is delivered, messages after it too.
+    """
+    sub = connect(mqtt_server.port, "qos1_empty_sub")
+    assert subscribe_qos(sub, b"qos1/empty", 1) == 1
+    pub = connect(mqtt_server.port, "qos1_empty_pub")
+
+    publish_qos1(pub, b"qos1/empty", b"", 1)
+    assert recv_exactly(pub, 4) == puback(1)
+    publish_qos1(pub, b"qos1/empty", b"next", 2)
+    assert recv_exactly(pub, 4) == puback(2)
+
+    for expected in [b"", b"next"]:
+        topic, packet_id, payload = receive_qos1(sub)
+        assert (topic, payload) == (b"qos1/empty", expected)
+        sub.send(puback(packet_id))
+
+    pub.close()
+    sub.close()
@@ -0,0 +1,97 @@
+from ..common import mqtt_server
+from .test_client_id import connect
+from .test_pipelining import recv_exactly
+from .test_publish_binary import encode_length, string
+from .test_qos1 import subscribe_qos
+from .test_retain import assert_nothing_received
+
+
+def publish_qos2(sock, topic, payload, packet_id, dup=False):
+    body = string(topic) + packet_id.to_bytes(2, "big") + payload
+    header = 0x3C if dup else 0x34
+    sock.send(bytes([header]) + encode_length(len(body)) + body)
+
+
+def receive_qos2(sock):
+    """
+    Receive PUBLISH packet with QoS 2 and return its topic, packet ID and
+    payload.
+    """
+    assert recv_exactly(sock, 1) == bytes([0x34])
+    length, multiplier = 0, 1
+    while True:
+        byte = recv_exactly(sock, 1)[0]
+        length += (byte & 0x7F) * multiplier
+        multiplier *= 128
+        if not byte & 0x80:
+            break
+    body = recv_exactly(sock, length)
+    topic_length = int.from_bytes(body[:2], "big")
+    packet_id = int.from_bytes(body[2 + topic_length:4 + topic_length], "big")
+    return body[2:2 + topic_length], packet_id, body[4 + topic_length:]
+
+
+def ack(header, packet_id):
+    return bytes([header, 0x02]) + packet_id.to_bytes(2, "big")
+
+
+PUBREC, PUBREL, PUBCOMP = 0x50, 0x62, 0x70
+
+
+def test_qos2_exactly_once(mqtt_server):
+    """
+    QoS 2 PUBLISH sent again before PUBREL is not delivered twice, packet ID
+    released by PUBREL may be used for a new message.
+    """
+    sub = connect(mqtt_server.port, "qos2_sub")
+    assert subscribe_qos(sub, b"qos2/#", 2) == 2
+    pub = connect(mqtt_server.port, "qos2_pub")
+
+    publish_qos2(pub, b"qos2/bill", b"first", 7)
+    assert recv_exactly(pub, 4) == ack(PUBREC, 7)
+    publish_qos2(pub, b"qos2/bill", b"first", 7, dup=True)
+    assert recv_exactly(pub, 4) == ack(PUBREC, 7)
+    pub.send(ack(PUBREL, 7))
+    assert recv_exactly(pub, 4) == ack(PUBCOMP, 7)
+
+    topic, packet_id, payload = receive_qos2(sub)
+    assert (topic, payload) == (b"qos2/bill", b"first")
+    sub.send(ack(PUBREC, packet_id))
+    assert recv_exactly(sub, 4) == ack(PUBREL, packet_id)
+    sub.send(ack(PUBCOMP, packet_id))
+    assert_nothing_received(sub)
+
+    sub.settimeout(None)
+    publish_qos2(pub, b"qos2/bill", b"second", 7)
+    assert recv_exactly(pub, 4) == ack(PUBREC, 7)
+    assert receive_qos2(sub)[2] == b"second"
+
+    pub.close()
+    sub.close()
+
+
+def test_qos2_empty_payload(mqtt_server):
+    """
+    QoS 2 message with empty payload is delivered, messages after it too.
+    """
+    sub = connect(mqtt_server.port, "qos2_empty_sub")
+    assert subscribe_qos(sub, b"qos2/empty", 2) == 2
+    pub = connect(mqtt_server.port, "qos2_empty_pub")
+
+    for packet_id, payload in [(1, b""), (2, b"next")]:
+        publish_qos2(pub, b"qos2/empty", payload, packet_id)
+        assert recv_exactly(pub, 4) == ack(PUBREC, packet_id)
+        pub.send(ack(PUBREL, packet_id))
+        assert recv_exactly(pub, 4) == ack(PUBCOMP, packet_id)
+
+    received = [receive_qos2(sub) for _ in range(2)]
+    assert [(t, p) for t, _, p in received] == [
+        (b"qos2/empty", b""), (b"qos2/empty", b"next")
+    ]
+    for _, packet_id, _ in received:
+        sub.send(ack(PUBREC, packet_id))
+        assert recv_exactly(sub, 4) == ack(PUBREL, packet_id)
+        sub.send(ack(PUBCOMP, packet_id))
+
+    pub.close()
+    sub.close()
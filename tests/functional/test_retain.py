@@ -0,0 +1,70 @@
+import socket
+
+from ..common import mqtt_server
+from .test_client_id import connect
+from .test_pipelining import recv_exactly
+from .test_publish_binary import (
+    encode_length, receive_publish, string, subscribe,
+)
+
+
+def retained_packet(topic, payload):
+    body = string(topic) + payload
+    return bytes([0x31]) + encode_length(len(body)) + body
+
+
+def receive_retained(sock):
+    """
+    Receive PUBLISH packet with RETAIN flag and return its topic and payload.
+    """
+    assert recv_exactly(sock, 1) == bytes([0x31])
+    length, multiplier = 0, 1
+    while True:
+        byte = recv_exactly(sock, 1)[0]
+        length += (byte & 0x7F) * multiplier
+        multiplier *= 128
+        if not byte & 0x80:
+            break
+    body = recv_exactly(sock, length)
+    topic_length = int.from_bytes(body[:2], "big")
+    return body[2:2 + topic_length], body[2 + topic_length:]
+
+
+def assert_nothing_received(sock):
+    sock.settimeout(0.5)
+    try:
+        assert sock.recv(1) == b""
+    except socket.timeout:
+        pass
+
+
+def test_retained_on_subscribe(mqtt_server):
+    """
+    Retained message is delivered to existing subscribers without RETAIN flag
+    and to new subscribers of matching filters with it.
+    """
+    live = connect(mqtt_server.port, "retain_live")
+    subscribe(live, b"retain/+/temp")
+    pub = connect(mqtt_server.port, "retain_pub")
+
+    pub.send(retained_packet(b"retain/1/temp", b"21"))
+    pub.send(retained_packet(b"retain/2/temp", b"22"))
+    pub.send(retained_packet(b"retain/2/hum", b"40"))
+    assert receive_publish(live) == (b"retain/1/temp", b"21")
+    assert receive_publish(live) == (b"retain/2/temp", b"22")
+
+    # later messages replace retained one, empty payload removes it
+    pub.send(retained_packet(b"retain/1/temp", b"23"))
+    pub.send(retained_packet(b"retain/2/temp", b""))
+    assert receive_publish(live) == (b"retain/1/temp", b"23")
+    assert receive_publish(live) == (b"retain/2/temp", b"")
+
+    late = connect(mqtt_server.port, "retain_late")
+    subscribe(late, b"retain/#")
+    received = sorted([receive_retained(late), receive_retained(late)])
+    assert received == [(b"retain/1/temp", b"23"), (b"retain/2/hum", b"40")]
+    assert_nothing_received(late)
+
+    pub.close()
+    live.close()
+    late.close()
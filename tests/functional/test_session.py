@@ -0,0 +1,151 @@
+import socket
+
+from ..common import mqtt_server, PROGRAM_PATH
+from ..server import Server
+from .test_pipelining import recv_exactly
+from .test_publish_binary import encode_length, string
+from .test_qos1 import subscribe_qos, publish_qos1, receive_qos1, puback
+from .test_retain import assert_nothing_received
+
+
+def connect_session(port, client_id, clean):
+    """
+    Connect client with given clean session flag and return the socket and
+    session present flag of CONNACK.
+    """
+    body = (
+        string(b"MQTT") + bytes([0x04, 0x02 if clean else 0x00, 0x00, 0x3C])
+        + string(client_id)
+    )
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+    sock.settimeout(5)
+    sock.connect(("localhost", port))
+    sock.send(bytes([0x10]) + encode_length(len(body)) + body)
+    connack = recv_exactly(sock, 4)
+    assert connack[:2] == bytes([0x20, 0x02]) and connack[3] == 0x00
+    return sock, connack[2]
+
+
+def disconnect(sock):
+    sock.send(bytes([0xE0, 0x00]))
+    sock.close()
+
+
+def test_session_resumed(mqtt_server):
+    """
+    Client without clean session gets QoS 1 messages published while it was
+    disconnected, QoS 0 messages are not kept. Clean session discards the
+    session.
+    """
+    sub, present = connect_session(mqtt_server.port, b"session_sub", False)
+    assert present == 0
+    assert subscribe_qos(sub, b"session/#", 1) == 1
+    disconnect(sub)
+
+    pub, _ = connect_session(mqtt_server.port, b"session_pub", True)
+    publish_qos1(pub, b"session/a", b"first", 1)
+    assert recv_exactly(pub, 4) == puback(1)
+    body = string(b"session/a") + b"qos0"
+    pub.send(bytes([0x30]) + encode_length(len(body)) + body)
+    publish_qos1(pub, b"session/b", b"second", 2)
+    assert recv_exactly(pub, 4) == puback(2)
+
+    sub, present = connect_session(mqtt_server.port, b"session_sub", False)
+    assert present == 1
+    for expected in ((b"session/a", b"first"), (b"session/b", b"second")):
+        topic, packet_id, payload = receive_qos1(sub)
+        assert (topic, payload) == expected
+        sub.send(puback(packet_id))
+    assert_nothing_received(sub)
+    disconnect(sub)
+
+    sub, present = connect_session(mqtt_server.port, b"session_sub", True)
+    assert present == 0
+    disconnect(sub)
+    publish_qos1(pub, b"session/a", b"lost", 3)
+    assert recv_exactly(pub, 4) == puback(3)
+
+    sub, present = connect_session(mqtt_server.port, b"session_sub", False)
+    assert present == 0
+    assert_nothing_received(sub)
+
+    sub.close()
+    pub.close()
+
+
+def test_session_restored(tmp_path):
+    """
+    Sessions and their messages are restored from session file after the
+    broker restarts.
+    """
+    args = ["-s", str(tmp_path / "sessions.db")]
+    server = Server(PROGRAM_PATH, args=args)
+    server.start()
+    try:
+        sub, _ = connect_session(server.port, b"restored_sub", False)
+        assert subscribe_qos(sub, b"restored/+", 1) == 1
+        disconnect(sub)
+        pub, _ = connect_session(server.port, b"restored_pub", True)
+        publish_qos1(pub, b"restored/a", b"kept", 1)
+        assert recv_exactly(pub, 4) == puback(1)
+        pub.close()
+    finally:
+        server.stop()
+
+    server = Server(PROGRAM_PATH, args=args)
+    server.start()
+    try:
+        sub, present = connect_session(server.port, b"restored_sub", False)
+        assert present == 1
+        topic, packet_id, payload = receive_qos1(sub)
+        assert (topic, payload) == (b"restored/a", b"kept")
+        sub.send(puback(packet_id))
+
+        pub, _ = connect_session(server.port, b"restored_pub", True)
+        publish_qos1(pub, b"restored/b", b"subscribed", 1)
+        assert recv_exactly(pub, 4) == puback(1)
+        topic, packet_id, payload = receive_qos1(sub)
+        assert (topic, payload) == (b"restored/b", b"subscribed")
+        sub.send(puback(packet_id))
+
+        disconnect(sub)
+        pub.close()
+    finally:
+        server.stop()
+
+
+def test_resubscribe_replaces(mqtt_server):
+    """
+    Subscription to topic filter the client has already replaces it, also
+    when the client subscribes again after every reconnect. The message is
+    delivered once, with QoS of the last subscription.
+    """
+    for _ in range(3):
+        sub, _ = connect_session(mqtt_server.port, b"resub_sub", False)
+        assert subscribe_qos(sub, b"resub/#", 1) == 1
+        disconnect(sub)
+
+    sub, present = connect_session(mqtt_server.port, b"resub_sub", False)
+    assert present == 1
+    # the same filter twice in one packet gets an answer for both
+    body = (
+        bytes([0x00, 0x02]) + string(b"resub/#") + bytes([0x00])
+        + string(b"resub/#") + bytes([0x00])
+    )
+    sub.send(bytes([0x82]) + encode_length(len(body)) + body)
+    assert recv_exactly(sub, 6) == bytes([0x90, 0x04, 0x00, 0x02, 0x00, 0x00])
+
+    pub, _ = connect_session(mqtt_server.port, b"resub_pub", True)
+    publish_qos1(pub, b"resub/a", b"once", 1)
+    assert recv_exactly(pub, 4) == puback(1)
+
+    body = string(b"resub/a") + b"once"
+    assert recv_exactly(sub, 2 + len(body)) == (
+        bytes([0x30]) + encode_length(len(body)) + body
+    )
+    assert_nothing_received(sub)
+
+    disconnect(sub)
+    sub, _ = connect_session(mqtt_server.port, b"resub_sub", True)
+    disconnect(sub)
+    pub.close()
@@ -0,0 +1,118 @@
+import socket
+
+from ..common import mqtt_server, PROGRAM_PATH
+from ..server import Server
+from .test_client_id import connect
+from .test_pipelining import recv_exactly
+from .test_publish_binary import publish_packet, receive_publish, subscribe
+from .test_qos1 import subscribe_qos
+
+
+def publish_all(port, client_id, topics, count):
+    """
+    Publish numbered QoS 0 messages to topics in turn and wait until the
+    broker processed them all (PINGRESP follows them).
+    """
+    pub = connect(port, client_id)
+    for i in range(count):
+        pub.send(publish_packet(topics[i % len(topics)], str(i).encode()))
+    pub.send(bytes([0xC0, 0x00]))
+    assert recv_exactly(pub, 2) == bytes([0xD0, 0x00])
+    pub.close()
+
+
+def receive_all(sock):
+    """
+    Receive messages until the broker has nothing more to send and return
+    their topics and numbers.
+    """
+    messages = []
+    sock.settimeout(0.5)
+    try:
+        while True:
+            topic, payload = receive_publish(sock)
+            messages.append((topic, int(payload)))
+    except socket.timeout:
+        pass
+    return messages
+
+
+def test_shared_round_robin(mqtt_server):
+    """
+    Members of shared group get messages in turn, plain subscription of the
+    same filter gets all of them.
+    """
+    members = [connect(mqtt_server.port, f"shared_rr_{i}") for i in range(2)]
+    for member in members:
+        subscribe(member, b"$share/workers/jobs/+")
+    plain = connect(mqtt_server.port, "shared_rr_plain")
+    subscribe(plain, b"jobs/+")
+
+    publish_all(mqtt_server.port, "shared_rr_pub", [b"jobs/a"], 10)
+
+    received = [receive_all(member) for member in members]
+    assert [len(messages) for messages in received] == [5, 5]
+    numbers = sorted(n for messages in received for _, n in messages)
+    assert numbers == list(range(10))
+    assert [n for _, n in receive_all(plain)] == list(range(10))
+    for sock in members + [plain]:
+        sock.close()
+
+
+def test_shared_invalid_name(mqtt_server):
+    """
+    Shared subscription with empty share name, wildcard in it or without
+    topic filter is refused.
+    """
+    sock = connect(mqtt_server.port, "shared_invalid")
+    for topic in [b"$share//a", b"$share/a+b/a", b"$share/a#/a", b"$share/a"]:
+        assert subscribe_qos(sock, topic, 0) == 0x80
+    sock.close()
+
+
+def test_shared_sticky():
+    """
+    With sticky strategy, messages of one topic go to the same member.
+    """
+    server = Server(PROGRAM_PATH, args=["-S", "sticky"])
+    server.start()
+    try:
+        members = [connect(server.port, f"shared_sticky_{i}") for i in range(3)]
+        for member in members:
+            subscribe(member, b"$share/g/sticky/#")
+        topics = [b"sticky/%d" % i for i in range(8)]
+        publish_all(server.port, "shared_sticky_pub", topics, 40)
+
+        owners = {}
+        total = 0
+        for index, member in enumerate(members):
+            for topic, _ in receive_all(member):
+                assert owners.setdefault(topic, index) == index
+                total += 1
+        assert total == 40
+        for member in members:
+            member.close()
+    finally:
+        server.stop()
+
+
+def test_shared_across_workers():
+    """
+    Members connected to different workers get every message once in total.
+    """
+    server = Server(PROGRAM_PATH, args=["-t", "3", "-S", "least-queue"])
+    server.start()
+    try:
+        members = [connect(server.port, f"shared_mt_{i}") for i in range(6)]
+        for member in members:
+            subscribe(member, b"$share/g/mt/#")
+        publish_all(server.port, "shared_mt_pub", [b"mt/x", b"mt/y"], 100)
+
+        numbers = sorted(
+            n for member in members for _, n in receive_all(member)
+        )
+        assert numbers == list(range(100))
+        for member in members:
+            member.close()
+    finally:
+        server.stop()
@@ -0,0 +1,93 @@
+import socket
+import time
+
+from ..common import PROGRAM_PATH
+from ..server import Server
+from .test_client_id import connect
+from .test_pipelining import recv_exactly
+from .test_publish_binary import publish_packet, receive_publish, subscribe
+
+
+def receive_retained(sock):
+    """
+    Receive retained messages sent after SUBSCRIBE and return them as dict of
+    topic and value.
+    """
+    values = {}
+    sock.settimeout(0.5)
+    try:
+        while True:
+            assert recv_exactly(sock, 1) == bytes([0x31])
+            length = recv_exactly(sock, 1)[0]
+            body = recv_exactly(sock, length)
+            topic_length = int.from_bytes(body[:2], "big")
+            topic = body[2:2 + topic_length].decode()
+            values[topic] = int(body[2 + topic_length:])
+    except socket.timeout:
+        pass
+    return values
+
+
+def test_sys_statistics():
+    """
+    Broker statistics are published periodically as retained $SYS messages.
+    """
+    server = Server(PROGRAM_PATH, args=["-i", "1"])
+    server.start()
+    try:
+        sub = connect(server.port, "sys_sub")
+        subscribe(sub, b"sys/test")
+        pub = connect(server.port, "sys_pub")
+        for i in range(10):
+            pub.send(publish_packet(b"sys/test", b"%d" % i))
+        for i in range(10):
+            assert receive_publish(sub) == (b"sys/test", b"%d" % i)
+
+        # statistics of the traffic above are published within an interval
+        time.sleep(2.5)
+        watcher = connect(server.port, "sys_watcher")
+        subscribe(watcher, b"$SYS/broker/#")
+        values = receive_retained(watcher)
+
+        assert values["$SYS/broker/publish/messages/received"] >= 10
+        assert values["$SYS/broker/publish/messages/sent"] >= 10
+        assert values["$SYS/broker/publish/messages/dropped"] == 0
+        assert values["$SYS/broker/messages/received"] >= 13
+        assert values["$SYS/broker/bytes/received"] > 0
+        assert values["$SYS/broker/bytes/sent"] > 0
+        assert values["$SYS/broker/clients/connected"] == 2
+        assert values["$SYS/broker/subscriptions/count"] == 1
+        assert values["$SYS/broker/loop/iterations"] > 0
+        # totals of outgoing queues are back to zero once they were written
+        assert values["$SYS/broker/queue/messages"] == 0
+        assert values["$SYS/broker/queue/bytes"] == 0
+        # first message of the topic is matched in the tree, then cached
+        assert values["$SYS/broker/match_cache/hits"] >= 9
+        assert values["$SYS/broker/match_cache/misses"] >= 1
+        assert values["$SYS/broker/match_cache/evictions"] == 0
+
+        # wildcard at first level does not match $SYS topics
+        subscribe(sub, b"#")
+        time.sleep(1.5)
+        assert receive_retained(sub) == {}
+        pub.close()
+        sub.close()
+        watcher.close()
+    finally:
+        server.stop()
+
+
+def test_sys_disabled():
+    """
+    With interval 0, no statistics are published.
+    """
+    server = Server(PROGRAM_PATH, args=["-i", "0", "-t", "2"])
+    server.start()
+    try:
+        watcher = connect(server.port, "sys_off")
+        subscribe(watcher, b"$SYS/#")
+        time.sleep(1.5)
+        assert receive_retained(watcher) == {}
+        watcher.close()
+    finally:
+        server.stop()
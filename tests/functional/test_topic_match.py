@@ -0,0 +1,82 @@
+import socket
+
+from ..common import mqtt_server
+from .test_client_id import connect
+from .test_publish_binary import publish_packet, receive_publish, subscribe
+
+
+def test_level_prefix_does_not_match(mqtt_server):
+    """
+    Topic level is matched whole, `a/bc` does not match filter `a/b` and vice
+    versa.
+    """
+    sub = connect(mqtt_server.port, "prefix_sub")
+    subscribe(sub, b"a/b")
+    pub = connect(mqtt_server.port, "prefix_pub")
+
+    for topic in [b"a/bc", b"a/b/c", b"a", b"a/b"]:
+        pub.send(publish_packet(topic, topic))
+    assert receive_publish(sub) == (b"a/b", b"a/b")
+
+    sub.settimeout(0.5)
+    try:
+        assert sub.recv(1) == b""
+    except socket.timeout:
+        pass
+
+    pub.close()
+    sub.close()
+
+
+def test_wildcard_levels(mqtt_server):
+    """
+    `+` matches exactly one level, `#` matches the parent level and any
+    number of levels below it.
+    """
+    sub = connect(mqtt_server.port, "wildcard_sub")
+    subscribe(sub, b"a/+/c")
+    pub = connect(mqtt_server.port, "wildcard_pub")
+
+    for topic in [b"a/c", b"a/b/c/d", b"a/bb/c"]:
+        pub.send(publish_packet(topic, topic))
+    assert receive_publish(sub) == (b"a/bb/c", b"a/bb/c")
+
+    other = connect(mqtt_server.port, "wildcard_other")
+    subscribe(other, b"x/#")
+    for topic in [b"xx", b"x", b"x/y/z"]:
+        pub.send(publish_packet(topic, topic))
+    assert receive_publish(other) == (b"x", b"x")
+    assert receive_publish(other) == (b"x/y/z", b"x/y/z")
+
+    pub.close()
+    sub.close()
+    other.close()
+
+
+def test_utf8_topics(mqtt_server):
+    """
+    Topics are UTF-8, multi-byte levels longer than a vector block are
+    matched. Malformed UTF-8 in topic name closes the connection.
+    """
+    level = "teplota-žárovka-温度-\U0001f321".encode() * 3
+    sub = connect(mqtt_server.port, "utf8_sub")
+    subscribe(sub, b"utf8/+/" + level)
+    pub = connect(mqtt_server.port, "utf8_pub")
+
+    topic = b"utf8/" + level + b"/" + level
+    pub.send(publish_packet(topic, b"payload"))
+    assert receive_publish(sub) == (topic, b"payload")
+
+    # overlong encoding of `/`, surrogate and truncated sequence
+    for invalid in [b"utf8/\xc0\xaf", b"utf8/\xed\xa0\x80",
+                    b"utf8/" + level[:-1]]:
+        bad = connect(mqtt_server.port, "utf8_bad")
+        bad.send(publish_packet(invalid, b"payload"))
+        try:
+            assert bad.recv(1) == b""
+        except ConnectionResetError:
+            pass
+        bad.close()
+
+    pub.close()
+    sub.close()
@@ -0,0 +1,37 @@
+import pytest
+
+from ..common import PROGRAM_PATH
+from ..server import Server
+from . import test_pipelining, test_qos1, test_retain
+
+
+@pytest.fixture
+def uring_server():
+    server = Server(PROGRAM_PATH, args=["-b", "uring"])
+    server.start()
+    yield server
+    server.stop()
+
+
+def test_uring_pipelining(uring_server):
+    """
+    Pipelined and fragmented packets with io_uring backend.
+    """
+    test_pipelining.test_pipelined_packets(uring_server)
+    test_pipelining.test_fragmented_packets(uring_server)
+
+
+def test_uring_qos1(uring_server):
+    """
+    QoS 1 delivery and inflight window with io_uring backend.
+    """
+    test_qos1.test_qos1_delivery(uring_server)
+    test_qos1.test_qos1_inflight_window(uring_server)
+    test_qos1.test_qos1_empty_payload(uring_server)
+
+
+def test_uring_retain(uring_server):
+    """
+    Retained messages with io_uring backend.
+    """
+    test_retain.test_retained_on_subscribe(uring_server)
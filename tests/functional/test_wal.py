@@ -0,0 +1,57 @@
+import os
+
+from ..common import PROGRAM_PATH
+from ..server import Server
+from .test_pipelining import recv_exactly
+from .test_qos1 import subscribe_qos, publish_qos1, receive_qos1, puback
+from .test_retain import assert_nothing_received
+from .test_session import connect_session, disconnect
+
+
+def test_wal_replayed(tmp_path):
+    """
+    Acknowledged QoS 1 messages are replayed from write-ahead log into restored
+    sessions after the broker is killed, acknowledged segments are deleted.
+    """
+    wal_dir = tmp_path / "wal"
+    args = [
+        "-t", "2", "-s", str(tmp_path / "sessions.db"), "-w", str(wal_dir),
+        "-g", "500",
+    ]
+    server = Server(PROGRAM_PATH, args=args)
+    server.start()
+    try:
+        sub, _ = connect_session(server.port, b"wal_sub", False)
+        assert subscribe_qos(sub, b"wal/+", 1) == 1
+        disconnect(sub)
+        # messages of connected client are not in session store
+        online, _ = connect_session(server.port, b"wal_online", False)
+        assert subscribe_qos(online, b"wal/#", 1) == 1
+        pub, _ = connect_session(server.port, b"wal_pub", True)
+        for packet_id in range(1, 4):
+            publish_qos1(pub, b"wal/a", b"logged %d" % packet_id, packet_id)
+        for packet_id in range(1, 4):
+            assert recv_exactly(pub, 4) == puback(packet_id)
+        for packet_id in range(1, 4):
+            assert receive_qos1(online)[2] == b"logged %d" % packet_id
+        pub.close()
+    finally:
+        server.kill()
+    online.close()
+
+    server = Server(PROGRAM_PATH, args=args)
+    server.start()
+    try:
+        for client_id in (b"wal_sub", b"wal_online"):
+            sub, present = connect_session(server.port, client_id, False)
+            assert present == 1
+            for packet_id in range(1, 4):
+                topic, received_id, payload = receive_qos1(sub)
+                assert (topic, payload) == (b"wal/a", b"logged %d" % packet_id)
+                sub.send(puback(received_id))
+            assert_nothing_received(sub)
+            disconnect(sub)
+    finally:
+        server.stop()
+
+    assert os.listdir(wal_dir) == []
@@ -10,7 +10,7 @@ class Server:
 
     It is specifically meant to be used to start and stop a MQTT server program.
     """
-    def __init__(self, program_path, port=1883, timeout=5, nofiles=None):
+    def __init__(self, program_path, port=1883, timeout=5, nofiles=None, args=()):
         """
         Initialize the instance.
         """
@@ -19,6 +19,7 @@ class Server:
         self.port = port
         self.timeout = timeout
         self.nofiles = nofiles
+        self.args = list(args)
 
         self.outs = None
         self.errs = None
@@ -47,7 +48,7 @@ class Server:
 
         # TODO: is this going to hang the program once the pipe is filled ?
         #       i.e. should there be a thread that does read the stdout/stderr ala communicate() ?
-        self.popen = subprocess.Popen([self.program_path, "-p", f"{self.port}"])
+        self.popen = subprocess.Popen([self.program_path, "-p", f"{self.port}", *self.args])
 
         #
         # Wait for the port to accept connections (optional - can be turned off by setting timeout=0).
@@ -79,6 +80,27 @@ class Server:
                     if socket_v4:
                         socket_v4.close()
 
+    def kill(self):
+        """
+        Kill the program without letting it shut down and wait until the port
+        is free again. Listening socket of killed program can stay open for a
+        while, e.g. until the kernel tears down its io_uring instance.
+        """
+        self.popen.kill()
+        self.popen.wait()
+
+        start_time = time.monotonic()
+        while time.monotonic() - start_time < self.timeout:
+            socket_v4 = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+            try:
+                socket_v4.connect(('localhost', self.port))
+            except ConnectionRefusedError:
+                return
+            finally:
+                socket_v4.close()
+            time.sleep(0.05)
+        raise Exception(f"port {self.port} still open after the program was killed")
+
     def stop(self):
         """
         Check if the test program is still running. If yes, terminate it.